@@ -0,0 +1,146 @@
+# Master load test: simulated workers on one asyncio loop. Each registers,
+# opens its channel, takes the pushed leases and posts a zero result per item
+# RENDER_MS after getting it, over one keep-alive connection. Prints the time
+# to finish and the latency of the result posts.
+#
+# Usage: python3 bench/load_sim.py PORT WORKERS RENDER_MS
+#        python3 bench/load_sim.py --scene FILE   (the scene of load_test.sh)
+import asyncio
+import json
+import random
+import struct
+import sys
+import time
+
+HOST = "127.0.0.1"
+
+
+def write_scene(path):
+    # 8192 tiles of one sample, so every item is a round trip
+    rng = random.Random(1)
+    spheres = [{"center": [rng.uniform(-20, 20), rng.uniform(-10, 10),
+                           rng.uniform(-40, 0)],
+                "radius": rng.uniform(0.05, 0.3),
+                "material": rng.randrange(3)} for _ in range(20000)]
+    scene = {
+        "config": {"width": 8192, "height": 4096, "samples_per_pixel": 1,
+                   "max_depth": 1},
+        "camera": {"position": [0, 0, 10], "look_at": [0, 0, 0],
+                   "up": [0, 1, 0], "fov": 60, "aspect_ratio": "4/3",
+                   "defocus_angle": 0, "focus_dist": 10},
+        "materials": [
+            {"type": "lambertian", "albedo": [0.7, 0.7, 0.7]},
+            {"type": "metal", "albedo": [0.8, 0.8, 0.8], "fuzz": 0.1},
+            {"type": "emissive", "emission": [3, 3, 3]}],
+        "objects": {"sphere": spheres},
+    }
+    with open(path, "w") as f:
+        json.dump(scene, f)
+
+
+def checksum(count):
+    # result_checksum of count zero floats
+    return (2166136261 * pow(16777619, count, 1 << 32)) % (1 << 32)
+
+
+async def headers(r):
+    status = int((await r.readline()).split()[1])
+    h = {}
+    while True:
+        line = (await r.readline()).decode().strip()
+        if not line:
+            return status, h
+        k, v = line.split(":", 1)
+        h[k.strip().lower()] = v.strip()
+
+
+async def request(r, w, method, path, body=b"", ctype="application/json"):
+    w.write(f"{method} {path} HTTP/1.1\r\nHost: x\r\nContent-Type: {ctype}\r\n"
+            f"Content-Length: {len(body)}\r\n\r\n".encode() + body)
+    await w.drain()
+    status, h = await headers(r)
+    return status, await r.readexactly(int(h.get("content-length", 0)))
+
+
+async def channel(port, name, crc):
+    r, w = await asyncio.open_connection(HOST, port)
+    w.write(f"GET /api/channel?worker_id={name}&scene_crc={crc} HTTP/1.1\r\n"
+            "Host: x\r\n\r\n".encode())
+    await w.drain()
+    await headers(r)
+    buf = b""
+    while True:
+        size = int((await r.readline()).strip(), 16)
+        if size == 0:
+            break
+        buf += await r.readexactly(size)
+        await r.readline()
+        while b"\n" in buf:
+            line, buf = buf.split(b"\n", 1)
+            yield json.loads(line)
+    w.close()
+
+
+async def worker(port, i, count, render_ms, gate, stats):
+    name = f"sim{i:04d}"
+    try:
+        r, w = await asyncio.open_connection(HOST, port)
+        await request(r, w, "POST", "/api/register", json.dumps(
+            {"name": name, "perf": 5, "thread_count": 2, "simd": 0,
+             "codecs": ["none"]}).encode())
+        # everyone registered before the first lease
+        gate[0] += 1
+        while gate[0] < count:
+            await asyncio.sleep(0.05)
+        crc = 0
+        async for ev in channel(port, name, 0):
+            crc = ev["scene_crc"]
+        async for ev in channel(port, name, crc):
+            if ev["type"] == "done":
+                break
+            if ev["type"] != "lease":
+                continue
+            for it in ev["items"]:
+                await asyncio.sleep(render_ms / 1000)
+                t = it["tile"]
+                n = t["tw"] * t["th"] * 3
+                s = it["sample_end"] - it["sample_begin"]
+                body = struct.pack("<IiiiHHHHII", 0x32525252, ev["job_id"],
+                                   it["tile_id"], s, t["tw"], t["th"], 1, 0,
+                                   n * 4, checksum(n)) + bytes(n * 4)
+                t0 = time.perf_counter()
+                status, _ = await request(
+                    r, w, "POST", f"/api/result/bin?worker_id={name}", body,
+                    "application/octet-stream")
+                stats["lat"].append((time.perf_counter() - t0) * 1000)
+                if status != 200:
+                    stats["refused"] += 1
+        stats["done"] += 1
+    except Exception as e:
+        stats["errors"] += 1
+        print(name, repr(e), file=sys.stderr)
+
+
+async def main(port, count, render_ms):
+    gate = [0]
+    stats = {"lat": [], "done": 0, "errors": 0, "refused": 0}
+    t0 = time.time()
+    await asyncio.gather(*(worker(port, i, count, render_ms, gate, stats)
+                           for i in range(count)))
+    lat = sorted(stats["lat"]) or [0.0]
+    q = lambda p: lat[min(len(lat) - 1, int(p * len(lat)))]
+    print(f"{count} workers ({stats['done']} got done), {len(stats['lat'])} "
+          f"results in {time.time() - t0:.1f}s, {stats['refused']} refused, "
+          f"{stats['errors']} errors; post ms p50 {q(.5):.2f} p90 {q(.9):.2f} "
+          f"p99 {q(.99):.2f} max {lat[-1]:.2f}")
+
+
+if __name__ == "__main__":
+    if len(sys.argv) == 3 and sys.argv[1] == "--scene":
+        write_scene(sys.argv[2])
+    elif len(sys.argv) == 4:
+        asyncio.run(main(int(sys.argv[1]), int(sys.argv[2]),
+                         float(sys.argv[3])))
+    else:
+        sys.exit("usage: load_sim.py PORT WORKERS RENDER_MS | "
+                 "load_sim.py --scene FILE")
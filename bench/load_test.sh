@@ -0,0 +1,34 @@
+#!/bin/bash
+# Master load test: a master serving WORKERS simulated workers
+# (bench/load_sim.py) that post a zero result RENDER_MS after taking each
+# item, on a scene of 8192 one-sample items. Options after PORT go to
+# raybun, e.g. --http-threads 2.
+#
+# Usage: bench/load_test.sh [WORKERS] [RENDER_MS] [PORT] [raybun options..]
+cd "$(dirname "$0")/.." || exit 1
+WORKERS=${1:-300}
+RENDER_MS=${2:-200}
+PORT=${3:-3100}
+shift $(($# < 3 ? $# : 3))
+
+DIR=$(mktemp -d)
+trap 'kill $MASTER 2>/dev/null; rm -rf "$DIR"' EXIT
+python3 bench/load_sim.py --scene "$DIR/scene.json" || exit 1
+# a socket per worker connection, two per worker
+ulimit -n $((WORKERS * 2 + 256)) 2>/dev/null
+
+./build/raybun "$@" master "$PORT" "$DIR/scene.json" "$DIR/out.pfm" \
+    > "$DIR/master.log" 2>&1 &
+MASTER=$!
+# the master runs its benchmark first
+for _ in $(seq 600); do
+    grep -q "Starting server" "$DIR/master.log" && break
+    kill -0 $MASTER 2>/dev/null || break
+    sleep 0.2
+done
+sleep 0.5
+
+python3 bench/load_sim.py "$PORT" "$WORKERS" "$RENDER_MS"
+wait $MASTER
+grep -E "HTTP threads|render_scene_distributed: Completed|result uploads" \
+    "$DIR/master.log"
@@ -0,0 +1,84 @@
+// Thread scaling benchmark for the render RNG.
+// Compares the old xorshift on one shared global state (what every render
+// thread used to hit) against the per-thread counter seeded PCG stream.
+//
+// Usage: ./build/bench/rng_bench [MAX_THREADS] [DRAWS_PER_THREAD]
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#define UTILS_IMPLEMENTATION
+#include "utils.h"
+
+typedef struct {
+    long draws;
+    int use_shared;
+    float sink;
+} BenchArg;
+
+// Old behaviour: one 4-byte state shared between every thread
+static uint32_t shared_state = 0x12345678u;
+
+static inline float shared_f32(void) {
+    uint32_t x = shared_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    shared_state = x;
+    return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+static void *bench_thread(void *arg) {
+    BenchArg *b = arg;
+    float acc = 0;
+    if (b->use_shared) {
+        for (long i = 0; i < b->draws; i++) acc += shared_f32();
+    } else {
+        // Same access pattern as the renderer: reseed per sample, then draw
+        // a handful of dimensions
+        for (long i = 0; i < b->draws; i += 16) {
+            rng_seed_sample_tls((uint32_t)i, (uint32_t)(i >> 4), 1);
+            for (int d = 0; d < 16; d++) acc += rng_f32_tls();
+        }
+    }
+    b->sink = acc;
+    return NULL;
+}
+
+static double run(int threads, long draws, int use_shared) {
+    pthread_t tids[threads];
+    BenchArg args[threads];
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    for (int i = 0; i < threads; i++) {
+        args[i] = (BenchArg){.draws = draws, .use_shared = use_shared};
+        pthread_create(&tids[i], NULL, bench_thread, &args[i]);
+    }
+    for (int i = 0; i < threads; i++) pthread_join(tids[i], NULL);
+    gettimeofday(&end, NULL);
+    return timersub_ms(&end, &start);
+}
+
+int main(int argc, char **argv) {
+    int max_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    long draws = 50 * 1000 * 1000;
+    if (argc > 1) max_threads = atoi(argv[1]);
+    if (argc > 2) draws = atol(argv[2]);
+    if (max_threads <= 0) max_threads = 1;
+
+    printf("%8s %14s %14s %14s %14s\n", "threads", "shared ms", "shared Mops",
+           "tls ms", "tls Mops");
+    for (int t = 1;; t = MIN(t * 2, max_threads)) {
+        double shared_ms = run(t, draws, 1);
+        double tls_ms = run(t, draws, 0);
+        double total = (double)draws * t;
+        printf("%8d %14.1f %14.1f %14.1f %14.1f\n", t, shared_ms,
+               total / shared_ms / 1000.0, tls_ms, total / tls_ms / 1000.0);
+        if (t == max_threads) break;
+    }
+    return 0;
+}
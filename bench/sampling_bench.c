@@ -0,0 +1,153 @@
+// Samples/sec of the direction and lens warps: the old rejection loops
+// against the closed form scalar and batch (SoA) routines in sampling.h.
+//
+// Usage: ./build/bench/sampling_bench [SAMPLES]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#define UTILS_IMPLEMENTATION
+#include "utils.h"
+#undef UTILS_IMPLEMENTATION
+#include "sampling.h"
+#include "vec.h"
+
+#define BATCH 256
+
+// Rejection versions the renderer used before sampling.h
+static V3f legacy_random_unit(void) {
+    while (true) {
+        V3f a = {rngf_range_tls(-1, 1), rngf_range_tls(-1, 1),
+                 rngf_range_tls(-1, 1)};
+        float len = v3f_slength(a);
+        if (len <= 1 && len >= 1e-30f) return v3f_divf(a, sqrtf(len));
+    }
+}
+
+static V3f legacy_random_in_unit_disk(void) {
+    while (true) {
+        V3f p = (V3f){rngf_range_tls(-1, 1), rngf_range_tls(-1, 1), 0};
+        if (v3f_slength(p) < 1) return p;
+    }
+}
+
+static V3f legacy_lambertian(V3f n) {
+    V3f d = v3f_add(n, legacy_random_unit());
+    if (v3f_near_zero(d)) d = n;
+    return v3f_normalize(d);
+}
+
+static float u1[BATCH], u2[BATCH], x[BATCH], y[BATCH], z[BATCH];
+static const V3f normal = {0.3f, 0.8f, -0.5f};
+
+static void fill_uniforms(void) {
+    for (int k = 0; k < BATCH; k++) {
+        u1[k] = rng_f32_tls();
+        u2[k] = rng_f32_tls();
+    }
+}
+
+static float sum_x(void) {
+    float acc = 0;
+    for (int k = 0; k < BATCH; k++) acc += x[k];
+    return acc;
+}
+
+static float bench_rng_only(void) {
+    fill_uniforms();
+    return u1[0] + u2[BATCH - 1];
+}
+
+static float bench_legacy_sphere(void) {
+    float acc = 0;
+    for (int k = 0; k < BATCH; k++) acc += legacy_random_unit().x;
+    return acc;
+}
+
+static float bench_sphere(void) {
+    float acc = 0;
+    for (int k = 0; k < BATCH; k++) acc += v3f_random_unit().x;
+    return acc;
+}
+
+static float bench_sphere_batch(void) {
+    fill_uniforms();
+    sample_uniform_sphere_n(u1, u2, x, y, z, BATCH);
+    return sum_x();
+}
+
+static float bench_legacy_disk(void) {
+    float acc = 0;
+    for (int k = 0; k < BATCH; k++) acc += legacy_random_in_unit_disk().x;
+    return acc;
+}
+
+static float bench_disk(void) {
+    float acc = 0;
+    for (int k = 0; k < BATCH; k++) acc += v3f_random_in_unit_disk().x;
+    return acc;
+}
+
+static float bench_disk_batch(void) {
+    fill_uniforms();
+    sample_concentric_disk_n(u1, u2, x, y, BATCH);
+    return sum_x();
+}
+
+static float bench_legacy_lambertian(void) {
+    const V3f n = v3f_normalize(normal);
+    float acc = 0;
+    for (int k = 0; k < BATCH; k++) acc += legacy_lambertian(n).x;
+    return acc;
+}
+
+static float bench_cosine(void) {
+    const V3f n = v3f_normalize(normal);
+    float acc = 0;
+    for (int k = 0; k < BATCH; k++) acc += v3f_random_cosine_direction(n).x;
+    return acc;
+}
+
+static float bench_cosine_batch(void) {
+    fill_uniforms();
+    sample_cosine_hemisphere_n(u1, u2, x, y, z, BATCH);
+    return sum_x();
+}
+
+typedef struct {
+    const char *name;
+    float (*fn)(void);  // one BATCH of samples
+} Bench;
+
+static const Bench benches[] = {
+    {"rng only (2 draws)", bench_rng_only},
+    {"sphere (rejection)", bench_legacy_sphere},
+    {"sphere", bench_sphere},
+    {"sphere batch", bench_sphere_batch},
+    {"disk (rejection)", bench_legacy_disk},
+    {"disk concentric", bench_disk},
+    {"disk batch", bench_disk_batch},
+    {"lambertian (n+unit)", bench_legacy_lambertian},
+    {"cosine hemisphere", bench_cosine},
+    {"cosine batch", bench_cosine_batch},
+};
+
+int main(int argc, char **argv) {
+    long samples = 20 * 1000 * 1000;
+    if (argc > 1) samples = atol(argv[1]);
+    rng_seed_tls(42);
+
+    printf("%-22s %12s %14s\n", "routine", "ms", "Msamples/s");
+    float sink = 0;
+    for (size_t k = 0; k < ARRAY_LENGTH(benches); k++) {
+        struct timeval start, end;
+        gettimeofday(&start, NULL);
+        for (long i = 0; i < samples; i += BATCH) sink += benches[k].fn();
+        gettimeofday(&end, NULL);
+        double ms = timersub_ms(&end, &start);
+        printf("%-22s %12.1f %14.1f\n", benches[k].name, ms,
+               samples / ms / 1000.0);
+    }
+    return sink == 12345.0f;  // keep the work alive
+}
@@ -3,6 +3,7 @@
 #include <stddef.h>
 
 #include "common.h"
+#include "pool.h"
 #include "rinternal.h"
 #include "vec.h"
 
@@ -41,40 +42,52 @@ static inline AABB aabb_join(const AABB a, const AABB b) {
     return aabb;
 }
 
-static int g_sort_axis;
-static int comparator(const void *a, const void *b) {
+static int compare_xmin(const void *a, const void *b) {
     const Hittable *ah = a;
     const Hittable *bh = b;
-    switch (g_sort_axis) {
-        case 0:
-            return (ah->box.xmin > bh->box.xmin) -
-                   (ah->box.xmin < bh->box.xmin);
-            break;
-        case 1:
-            return (ah->box.ymin > bh->box.ymin) -
-                   (ah->box.ymin < bh->box.ymin);
-            break;
-        case 2:
-            return (ah->box.zmin > bh->box.zmin) -
-                   (ah->box.zmin < bh->box.zmin);
-            break;
-        default:
-            return 0;
-    }
+    return (ah->box.xmin > bh->box.xmin) - (ah->box.xmin < bh->box.xmin);
 }
 
-// construct bvh and put scene.bvh_root
-static inline Hittable construct_bvh(Arena *a, Hittable *hittable, size_t start,
-                                     size_t end) {
-    if (hittable == NULL) return (Hittable){0};
-    if (start == end) return (Hittable){0};
+static int compare_ymin(const void *a, const void *b) {
+    const Hittable *ah = a;
+    const Hittable *bh = b;
+    return (ah->box.ymin > bh->box.ymin) - (ah->box.ymin < bh->box.ymin);
+}
+
+static int compare_zmin(const void *a, const void *b) {
+    const Hittable *ah = a;
+    const Hittable *bh = b;
+    return (ah->box.zmin > bh->box.zmin) - (ah->box.zmin < bh->box.zmin);
+}
+
+// Ranges with at least this many primitives build one half as a pool task
+#define BVH_PARALLEL_MIN 4096
 
+typedef struct {
+    Hittable *hittable;
+    BVH_Node *nodes;
+    size_t start, end;
+    Hittable result;
+} BvhBuild;
+
+static inline Hittable construct_bvh_range(Hittable *hittable, BVH_Node *nodes,
+                                           size_t start, size_t end);
+
+static inline void construct_bvh_task(void *arg) {
+    BvhBuild *b = arg;
+    b->result = construct_bvh_range(b->hittable, b->nodes, b->start, b->end);
+}
+
+// Every interior node splits the range at a distinct mid, so nodes[mid - 1]
+// is its own slot whatever thread builds it
+static inline Hittable construct_bvh_range(Hittable *hittable, BVH_Node *nodes,
+                                           size_t start, size_t end) {
     size_t count = end - start;
     if (count == 1) {
         return hittable[start];
     }
     if (count == 2) {
-        BVH_Node *node = ARENA_PUSH_STRUCT(a, BVH_Node);
+        BVH_Node *node = &nodes[start];
         node->left = hittable[start];
         node->right = hittable[end - 1];
         return make_hittable_bvh(node,
@@ -86,26 +99,49 @@ static inline Hittable construct_bvh(Arena *a, Hittable *hittable, size_t start,
         box = aabb_join(box, hittable[i].box);
     }
 
-    BVH_Node *node = ARENA_PUSH_STRUCT(a, BVH_Node);
+    int (*comparator)(const void *, const void *);
     if ((box.xmax - box.xmin) > (box.ymax - box.ymin)) {
         if ((box.xmax - box.xmin) > (box.zmax - box.zmin)) {
-            g_sort_axis = 0;
+            comparator = compare_xmin;
         } else {
-            g_sort_axis = 2;
+            comparator = compare_zmin;
         }
     } else {
         if ((box.ymax - box.ymin) > (box.zmax - box.zmin)) {
-            g_sort_axis = 1;
+            comparator = compare_ymin;
         } else {
-            g_sort_axis = 2;
+            comparator = compare_zmin;
         }
     }
 
     qsort(hittable + start, end - start, sizeof(Hittable), comparator);
 
     size_t mid = count / 2 + start;
-    node->left = construct_bvh(a, hittable, start, mid);
-    node->right = construct_bvh(a, hittable, mid, end);
+    BVH_Node *node = &nodes[mid - 1];
+    if (count >= BVH_PARALLEL_MIN) {
+        BvhBuild left = {.hittable = hittable,
+                         .nodes = nodes,
+                         .start = start,
+                         .end = mid};
+        TaskGroup group = {0};
+        pool_spawn(&group, construct_bvh_task, &left);
+        node->right = construct_bvh_range(hittable, nodes, mid, end);
+        pool_wait(&group);
+        node->left = left.result;
+    } else {
+        node->left = construct_bvh_range(hittable, nodes, start, mid);
+        node->right = construct_bvh_range(hittable, nodes, mid, end);
+    }
 
     return make_hittable_bvh(node, box);
 }
+
+// construct bvh and put scene.bvh_root
+static inline Hittable construct_bvh(Arena *a, Hittable *hittable, size_t start,
+                                     size_t end) {
+    if (hittable == NULL) return (Hittable){0};
+    if (start == end) return (Hittable){0};
+
+    BVH_Node *nodes = ARENA_PUSH_ARRAY(a, BVH_Node, end);
+    return construct_bvh_range(hittable, nodes, start, end);
+}
@@ -1,12 +1,58 @@
 #pragma once
 
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "assets.h"
+#include "codec.h"
+#include "pool.h"
 #include "renderer.h"
 #include "scene.h"
 #include "state.h"
+#include "workqueue.h"
 
 #define SMALL_THRESHOLD (1024 * 1024)     // 1 MB
 #define MAX_PAYLOAD (64UL * 1024 * 1024)  // 64 MB absolute cap
 
+// POST /api/result/bin?worker_id=<id>: a ResultHeader then the pixels, tile
+// rows of rgb float sums, all little endian. The master copies the rows
+// straight into place as the upload arrives, no text encoding or parsing.
+// With a codec (negotiated at /api/register) the rows are sent encoded,
+// RESULT_STRIDE bytes per element, and decoded once complete. Up to
+// RESULT_BATCH_MAX results may follow one another in a body, each merged as
+// soon as it is in.
+#define RESULT_MAGIC 0x32525252u  // "RRR2"
+#define RESULT_FORMAT_F32 1       // rgb float32 sums
+#define RESULT_STRIDE (3 * sizeof(float))
+#define RESULT_BATCH_MAX 64
+
+typedef struct {
+    uint32_t magic;
+    int32_t job_id;
+    int32_t tile_id;
+    int32_t samples;
+    uint16_t tw, th;
+    uint16_t format;
+    uint16_t codec;
+    uint32_t payload_bytes;  // pixel bytes as sent
+    uint32_t checksum;       // result_checksum of the decoded pixels
+} ResultHeader;
+
+_Static_assert(sizeof(ResultHeader) == 32, "ResultHeader is a wire format");
+
+// FNV-1a over the 32 bit words of the pixels, catching truncated or mangled
+// uploads
+static inline uint32_t result_checksum(const float *pixels, size_t count) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < count; i++) {
+        uint32_t bits;
+        memcpy(&bits, &pixels[i], sizeof(bits));
+        h = (h ^ bits) * 16777619u;
+    }
+    return h;
+}
+
 typedef struct {
     size_t received;
     size_t content_length;
@@ -18,81 +64,245 @@ typedef struct {
     FILE *tmpfile;
 
     int processed;
+
+    // Binary results: header first, then pixel bytes copied into pixels,
+    // or into payload to be decoded when the result is encoded
+    bool binary;
+    ResultHeader header;
+    float *pixels;
+    size_t pixel_bytes;
+    uint8_t *payload;
+    const char *error;  // set when the upload is refused, drained unread
+    // Results of the body so far, and the first one refused
+    int results;
+    unsigned int refused_status;
+    const char *refused;
 } ConnectionInfo;
 
 Vector(MachineInfo, Machines);
 
+// /api/work leases a worker a batch of items meant to keep it busy for
+// LEASE_TARGET_MS, by the time per item between its previous two requests
+// (render, upload and round trips included)
+#define LEASE_TARGET_MS 500.0
+#define LEASE_MAX_ITEMS 64
+
+// GET /api/channel?worker_id=<id>&scene_crc=<crc>: a stream of JSON lines
+// from the master to a registered worker, replacing GET /api/work polling.
+//     {"type":"lease","job_id":id,"items":[WorkerWork, ..]}
+//     {"type":"scene","scene_crc":crc}   fetch it and reconnect
+//     {"type":"cancel","job_id":id}      drop the job's items, it was
+//                                        cancelled or replaced
+//     {"type":"done"}                    every item is rendered
+//     {"type":"ping"}                    every CHANNEL_PING_MS without others
+// A lease is pushed whenever fewer than CHANNEL_PREFETCH items per thread
+// of the worker are out, so it asks for nothing. Results and heartbeats go
+// up on the worker's upload connection.
+#define CHANNEL_PING_MS 1000
+#define CHANNEL_PREFETCH 2
+// Longest wait between checks of a channel with nothing to push
+#define CHANNEL_POLL_MS 100
+
+// The server handles every connection on a pool of HTTP_THREADS event
+// driven threads (--http-threads), which the master renders without
+#define HTTP_THREADS 1
+// Keep-alive connections idle this long are closed
+#define HTTP_IDLE_TIMEOUT_S 60
+// Connections waiting to be accepted, a few hundred workers may come at once
+#define HTTP_BACKLOG 1024
+
+// Workers with items POST /api/heartbeat?worker_id=<id> when they have not
+// talked to the master for HEARTBEAT_MS. Items of a worker not heard from in
+// WORKER_TIMEOUT_MS, or past their lease deadline, are handed out again.
+#define HEARTBEAT_MS 1000
+#define WORKER_TIMEOUT_MS 5000.0
+
+typedef struct {
+    struct timeval last_request;
+    int last_batch;  // items leased at last_request, 0 for none
+    double item_ms;    // smoothed, 0 until measured
+    double last_cost;  // of the items leased at last_request
+    double rate;       // item cost per ms, smoothed, 0 until measured
+    double seen_ms;    // last request of any kind, since master_state_create
+    int outstanding;   // leased and neither returned nor requeued
+} WorkerLease;
+
+Vector(WorkerLease, WorkerLeases);
+
+struct JobQueue;
+
 typedef struct {
     Scene *scene;
     State *state;
     Machines workers;
     Work *work;
     struct MasterState *master_state;
+
+    // Serve mode swaps the running job in and out (NULL fields between
+    // jobs), requests pin it while they use the fields above
+    struct JobQueue *jobs;  // NULL outside serve mode
+    int job_id;             // echoed by workers with their results
+    int job_users;
+    pthread_mutex_t job_lock;
+
+    // Codec offered to workers that support it, and what it saved
+    Codec codec;
+    CodecStats result_stats;
+    CodecStats scene_stats;
+
+    // Broadcast (with job_lock) when every channel may have something to
+    // push: the job changed or ended. A result only wakes its worker's.
+    pthread_cond_t channel_wake;
+
+    int http_threads;  // HTTP_THREADS unless set
+
+    // Relay mode swaps jobs like serve mode, as the upstream master leases
+    // them (see relay_connect)
+    bool relay;
 } MasterAPIContext;
 
+// One frame of an animated job (the only one of a still): its camera and
+// the accumulation its items are merged into
+typedef struct {
+    struct MasterState *ms;
+    int index;
+    Camera camera;
+    V3f pixel00_loc;
+    V3f pixel_delta_u;
+    V3f pixel_delta_v;
+    V3f defocus_disk_u;
+    V3f defocus_disk_v;
+    // the Work's for a still, allocated at the first result of an animation
+    // frame and freed once the frame is written out
+    float *accum;
+    int *tile_samples;
+    _Atomic int items_left;
+} MasterFrame;
+
 typedef struct MasterState {
     Scene *scene;
     State *state;
+    const Work *work;
 
-    // Tile tracking
+    // Work items, one per (frame, tile, sample range), frame by frame
     TileAssignment *tiles;
     int tile_count;
 
-    // Registered workers (empty in standalone)
+    // Registered workers (empty in standalone) and their lease sizing, by
+    // worker index
     Machines workers;
+    WorkerLeases leases;
+    pthread_mutex_t lease_lock;
 
     // Render params
     int samples_per_pixel;
     int max_depth;
-    float colour_contribution;
-
-    // Camera data for workers
-    V3f pixel00_loc;
-    V3f pixel_delta_u;
-    V3f pixel_delta_v;
-    V3f defocus_disk_u;
-    V3f defocus_disk_v;
 
-    // Shared image buffer (master writes directly)
-    uint32_t *image;
+    // Partial sums of every item are merged into its frame's accumulation,
+    // resolved at the end for a still, as soon as it completes for an
+    // animation frame (written to frame_file_name(frame_output, frame))
+    MasterFrame *frames;
+    int frame_count;
+    const char *frame_output;
+    TaskGroup exports;
+    _Atomic bool export_failed;  // a frame that could not be written
+    pthread_mutex_t accum_lock;
     size_t image_width;
 
-    // Atomic lock for tile assignment updates
-    _Atomic int tile_assign_lock;
+    // Unclaimed items, status and completion are tracked per item
+    WorkQueue queue;
+    _Atomic int items_completed;
+
+    // Items by first claim, the backup candidates (see find_backup): an
+    // entry is -1 until written, flight_skip[k] is an entry at or past k
+    // with every one before it no candidate for good
+    _Atomic int *flight;
+    _Atomic int *flight_skip;
+    _Atomic int flight_count;
+
+    // Throughput model, in item cost per ms: the measured rate of the master
+    // and of each worker (WorkerLease.rate), or their machine_speed times
+    // rate_scale until measured (under lease_lock). total_rate sums the
+    // machines taking part, cost_left is the cost of the unclaimed items.
+    double self_speed;
+    double self_rate;
+    double rate_scale;
+    _Atomic double total_rate;
+    _Atomic double cost_left;
+
+    // Set to stop handing out items, master_render returns early
+    _Atomic bool cancelled;
+
+    // Relay mode (master_set_relay): results go to forward rather than into
+    // the accumulation
+    void (*forward)(struct MasterState *ms, int item, const float *sums);
+    void *forward_arg;
+
+    // Time base of leases and heartbeats, and the last scan for expired
+    // leases
+    struct timeval start;
+    _Atomic double expiry_checked_ms;
 } MasterState;
 
-typedef struct WorkerState {
-    // Worker connection info
-    char *master_url;
-    char *worker_name;
+// Result of a worker's item: a ResultHeader then the (encoded) pixels
+typedef struct {
+    char *data;
+    size_t size;
+} WorkerUpload;
+
+Vector(WorkerUpload, WorkerUploads);
 
-    // Local scene copy
+// A worker's rendering side: leased items run as pool tasks, each hands its
+// result to the upload thread
+typedef struct WorkerState {
+    // Local scene copy, swapped only while no item renders
     Scene *scene;
     State *state;
+    Codec codec;
 
-    // Current assignment
-    int assigned_tile_id;
-    Tile assigned_tile;
+    // Items spawned into renders and not started yet. The next lease is
+    // fetched while fewer than prefetch_items wait, so the render threads
+    // keep going during the request.
+    TaskGroup renders;
+    _Atomic int items_waiting;
+    int prefetch_items;
 
-    // Render params received from master
-    int samples_per_pixel;
-    int max_depth;
-    float colour_contribution;
-    V3f pixel00_loc;
-    V3f pixel_delta_u;
-    V3f pixel_delta_v;
-    V3f defocus_disk_u;
-    V3f defocus_disk_v;
+    // The upload thread keeps the leases alive with heartbeats while
+    // neither thread has talked to the master
+    char heartbeat_url[512];
+    _Atomic double contact_ms;  // last request of either thread
 
-    // Local tile buffer (reuse per assignment)
-    uint32_t *tile_buffer;
+    // Items of the job a channel cancelled are dropped unrendered
+    _Atomic int cancelled_job;
 
-    // Networking client (curl)
-    void *curl_handle;
+    // Set when leased items go to a relay's local job instead of the pool
+    struct Relay *relay;
 
-    // Failure tracking
-    int consecutive_failures;
-    int is_online;
+    // Finished results, posted to result_url by the upload thread. Render
+    // threads wait while max_uploads are queued or being posted.
+    char result_url[512];
+    WorkerUploads uploads;
+    int uploads_in_flight;
+    int max_uploads;
+    pthread_mutex_t upload_lock;
+    pthread_cond_t upload_ready;
+    pthread_cond_t upload_space;
+    bool closing;
+
+    // Time lost to the network, in microseconds: fetching leases, of which
+    // with no item left waiting (since emptied_ms, from start), posting
+    // results and render threads stalled on a full upload queue
+    struct timeval start;
+    _Atomic double emptied_ms;
+    int lease_requests;
+    int pushed_leases;
+    _Atomic uint64_t lease_us;
+    _Atomic uint64_t starved_us;
+    _Atomic uint64_t upload_us;
+    _Atomic uint64_t stalled_us;
+
+    CodecStats scene_stats;
+    CodecStats upload_stats;
 } WorkerState;
 
 // POST /api/register WorkerHello <-> MasterRegister
@@ -107,23 +317,97 @@ typedef struct {
     char *scene_json;
 } GetScene;
 
-// GET /api/work?worker_id=<id>&scene_crc=<crc> WorkerWork
+// GET /api/work?worker_id=<id>&scene_crc=<crc>
+//     {"job_id": id, "items": [WorkerWork, ..]}
 typedef struct {
+    int job_id;
     int tile_id;
+    int frame;  // into Scene.frames, 0 for a still
     Tile tile;
+    int sample_begin, sample_end;
 } WorkerWork;
 
-// POST /api/result
+// POST /api/result, pixels are the rgb float sums of the item's samples
+// (as hex bit patterns in JSON)
 typedef struct {
     char *name;  // worker name
+    int job_id;  // from WorkerWork, stale results are refused
     int tile_id;
-    uint32_t *pixels;
+    int samples;
+    float *pixels;
 } WorkerResult;
 
 // Master
 static struct MHD_Daemon *master_daemon;
 bool master_start_server(int port, MasterAPIContext *context);
+void master_stop_server(void);
+// State for rendering work on the master and handing it to workers, items
+// are added by master_init_work_items
+MasterState *master_state_create(Scene *scene, State *state, Work *work,
+                                 const MachineInfo *self);
+void master_state_free(MasterState *ms);
+void master_init_work_items(MasterState *ms, const Work *work);
+// Render items on the pool alongside the workers, until all are merged or
+// the render is cancelled
+void master_render(MasterState *ms);
+// Swap the job the HTTP handlers serve (NULLs for none), after the requests
+// still using the old one are done. The registered workers carry over.
+void master_set_job(MasterAPIContext *context, int job_id, Scene *scene,
+                    State *state, Work *work, MasterState *ms);
+// Merge the result of an in flight or requeued item, false otherwise (a
+// duplicate, the slower of two copies or an item nobody claimed)
+bool master_merge_result(MasterState *ms, int item, const float *sums);
+// Mark the item a machine rendering rate item cost per ms should render next
+// as in flight for worker_idx (-1 = master), -1 when no item is left
+int master_claim_item(MasterState *ms, int worker_idx, double rate);
+// Claim a lease of items for a registered worker (one for others), sized by
+// its measured time per item, up to max. Returns the count claimed.
+int master_lease_items(MasterState *ms, int worker_idx, long thread_count,
+                       int *items, int max);
+// Items leased to a worker and not returned yet, and one of them returned
+int master_worker_outstanding(MasterState *ms, int worker_idx);
+void master_item_returned(MasterState *ms, int worker_idx);
+// Modelled throughput of the master (-1) or a worker, item cost per ms
+double master_node_rate(MasterState *ms, int worker_idx);
+// Feed the time one master thread took for an item into the model
+void master_item_rendered(MasterState *ms, int item, double elapsed_ms);
+// Hand an in flight item back to be claimed again
+void master_release_item(MasterState *ms, int item);
+// Once no item is left to claim, a backup copy of the item in flight the
+// longest (not with worker_idx, not copied yet). Whichever result comes in
+// first is merged. -1 when there is none.
+int master_claim_backup(MasterState *ms, int worker_idx);
+// Note a request from a registered worker, keeping its leases alive
+void master_worker_seen(MasterState *ms, int worker_idx);
+// Hand back the items of workers not heard from in WORKER_TIMEOUT_MS or
+// past their lease deadline, at most every few ms. Returns the count.
+int master_expire_leases(MasterState *ms);
+// Relay mode: the items master_init_work_items laid out are held only once
+// master_relay_item adds them as the upstream master leases them, results
+// are handed to forward and no backup copies are made (the upstream master
+// makes them). master_render runs until cancelled.
+void master_set_relay(MasterState *ms,
+                      void (*forward)(MasterState *ms, int item,
+                                      const float *sums),
+                      void *arg);
+// Add an item leased by the upstream master, false when it is held already
+bool master_relay_item(MasterState *ms, const WorkerWork *work);
+// Relative rendering throughput of a machine
+double machine_speed(const MachineInfo *info);
 
 // Worker
 static struct MHD_Daemon *worker_daemon;
-bool worker_connect(const char *master_ip, int port, MachineInfo stats);
+// Scenes and the files of their models are cached under cache_dir, NULL to
+// open model files from the local disk instead
+bool worker_connect(const char *master_ip, int port, MachineInfo stats,
+                    const char *cache_dir);
+
+// Relay
+// A relay registers with the master at master_url as one worker, with the
+// threads of its own pool and of the workers registered with it, and
+// serves those workers on port like a serve mode master: each job the
+// master leases it items of becomes a local job of those items only, and
+// the results go back up in batches. Farms become trees of relays, the
+// master only talks to the relays. False when the server cannot start.
+bool relay_connect(const char *master_url, int port, MachineInfo stats,
+                   const char *cache_dir, Codec codec, int http_threads);
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "codec.h"
+#include "utils.h"
+
+// Scene distribution. The master serializes the /api/scene answer of a
+// scene once per codec and serves the files its models reference (OBJ, the
+// MTL files they name and the textures those name) by content hash. Workers
+// keep both in an on-disk cache: objects/<hash> holds a file's content,
+// scenes/<tag>.scene a scene answer (tag being the ETag, its payload hash)
+// and scenes/<tag>/<path> links every path of that scene to its object, so
+// relative references between the files still resolve.
+
+// GET /api/scene?codec=<name>: a SceneHeader then the payload through the
+// codec (CODEC_NONE when it does not shrink), instead of the JSON answer.
+// The payload is the scene JSON (json_bytes) then the asset manifest
+// {"<path>":"<hash>",..}. The ETag is the payload's hash, a request whose
+// If-None-Match lists it gets 304 and no body.
+#define SCENE_MAGIC 0x32535252u  // "RRS2"
+
+typedef struct {
+    uint32_t magic;
+    uint32_t scene_crc;
+    uint32_t codec;
+    uint32_t raw_bytes;
+    uint32_t json_bytes;
+} SceneHeader;
+
+// GET /api/asset?hash=<hash>&codec=<name>: an AssetHeader then the file
+// through the codec
+#define ASSET_MAGIC 0x31415252u  // "RRA1"
+
+typedef struct {
+    uint32_t magic;
+    uint32_t codec;
+    uint32_t raw_bytes;
+} AssetHeader;
+
+// Largest asset served and fetched, raw_bytes comes off the wire
+#define ASSET_MAX_BYTES (1u << 30)
+
+// Hex digits of an asset_hash
+#define ASSET_HASH_LEN 16
+// Default cache directory of workers
+#define ASSET_CACHE_DIR ".raybun-cache"
+// Cached scene ETags a worker offers in If-None-Match at most
+#define ASSET_CACHE_TAGS 16
+
+// 64 bit FNV-1a of size bytes as ASSET_HASH_LEN hex digits
+void asset_hash(const void *data, size_t size, char out[ASSET_HASH_LEN + 1]);
+// Relative and without ".." components, so it stays below a directory
+bool asset_local_path(const char *path);
+// Exactly ASSET_HASH_LEN lowercase hex digits, like asset_hash writes
+bool asset_hash_valid(const char *hash);
+
+// An encoded answer, header included
+typedef struct {
+    uint8_t *data;
+    size_t size;
+} AssetBody;
+
+typedef struct {
+    char *path;  // as the scene references it, relative to the master's cwd
+    char hash[ASSET_HASH_LEN + 1];
+    uint8_t *data;
+    size_t size;
+    AssetBody body[CODEC_COUNT];  // AssetHeader answers, encoded on demand
+} Asset;
+
+Vector(Asset, Assets);
+
+typedef struct SceneBundle {
+    Assets assets;
+    // Scene JSON followed by the asset manifest {"<path>":"<hash>",..}
+    char *payload;
+    size_t payload_size;
+    size_t json_size;
+    unsigned int scene_crc;
+    char tag[ASSET_HASH_LEN + 1];  // hash of the payload, quoted as ETag
+    // SceneHeader answers and the JSON answer of workers without codecs,
+    // built on first use under lock
+    AssetBody body[CODEC_COUNT];
+    char *json_answer;
+    pthread_mutex_t lock;
+} SceneBundle;
+
+// Hash the files scene_json references, NULL when out of memory. Files that
+// cannot be read or that lie outside the master's cwd are left out, workers
+// then open them from their own disk.
+SceneBundle *scene_bundle_create(const char *scene_json,
+                                 unsigned int scene_crc);
+void scene_bundle_free(SceneBundle *b);
+
+// The answer through codec, NULL when out of memory. codec_ms is the time
+// spent encoding, 0 once cached.
+const AssetBody *scene_bundle_body(SceneBundle *b, Codec codec,
+                                   double *codec_ms);
+const char *scene_bundle_json(SceneBundle *b);
+// The asset with hash and its answer through codec, NULL when unknown
+const AssetBody *scene_bundle_asset(SceneBundle *b, const char *hash,
+                                    Codec codec, size_t *raw_size,
+                                    double *codec_ms);
+
+// Worker side, under dir. False on I/O errors, and for a hash or tag that
+// is not ASSET_HASH_LEN lowercase hex digits (asset_hash_valid), as those
+// come from the master and name files in the cache.
+bool asset_cache_init(const char *dir);
+bool asset_cache_has(const char *dir, const char *hash);
+bool asset_cache_put(const char *dir, const char *hash, const void *data,
+                     size_t size);
+// A cached scene answer by payload hash, NULL when missing
+uint8_t *asset_cache_scene(const char *dir, const char *tag, size_t *size);
+bool asset_cache_put_scene(const char *dir, const char *tag, const void *data,
+                           size_t size);
+// Link scenes/<tag>/<path> to the object of hash, returning the linked path
+// (malloc'd) or NULL
+char *asset_cache_link(const char *dir, const char *tag, const char *path,
+                       const char *hash);
+// If-None-Match value quoting up to ASSET_CACHE_TAGS cached scene hashes,
+// empty when none
+void asset_cache_tags(const char *dir, char *out, size_t cap);
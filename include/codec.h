@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Payload compression between master and workers, no external library.
+// Data made of fixed size elements (stride bytes, e.g. 12 for an rgb float
+// pixel) is first split into byte planes and delta coded along each plane,
+// so the slowly changing sign/exponent bytes turn into long zero runs. The
+// planes then go through a run length or an LZ77 coder. Stride 1 (text)
+// skips the filter.
+
+typedef enum {
+    CODEC_NONE = 0,
+    CODEC_RLE = 1,  // planes + delta + run length
+    CODEC_LZ = 2,   // planes + delta + LZ77 (64KB window)
+    CODEC_COUNT,
+} Codec;
+
+const char *codec_name(Codec codec);
+// CODEC_COUNT for an unknown name
+Codec codec_from_name(const char *name);
+
+// Largest encoding of size bytes
+size_t codec_bound(Codec codec, size_t size);
+
+// Encode size bytes of src into dst (codec_bound bytes). Returns the encoded
+// size, 0 when the encoding is no smaller than src (send it as is).
+size_t codec_encode(Codec codec, const void *src, size_t size, size_t stride,
+                    uint8_t *dst);
+
+// Decode exactly raw_size bytes into dst, false on malformed input
+bool codec_decode(Codec codec, const uint8_t *src, size_t size, size_t stride,
+                  void *dst, size_t raw_size);
+
+// Bytes before and after coding and the time spent in the codec, summed
+// over transfers
+typedef struct {
+    _Atomic uint64_t transfers;
+    _Atomic uint64_t raw_bytes;
+    _Atomic uint64_t wire_bytes;
+    _Atomic uint64_t codec_us;
+} CodecStats;
+
+static inline void codec_stats_add(CodecStats *s, size_t raw, size_t wire,
+                                   double codec_ms) {
+    atomic_fetch_add(&s->transfers, 1);
+    atomic_fetch_add(&s->raw_bytes, raw);
+    atomic_fetch_add(&s->wire_bytes, wire);
+    atomic_fetch_add(&s->codec_us, (uint64_t)(codec_ms * 1000.0));
+}
+
+// Logs "<what>: N transfers, X MB as Y MB (Z% saved), codec T ms"
+void codec_stats_log(const CodecStats *s, const char *what);
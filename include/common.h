@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdatomic.h>
+
 #include "vec.h"
 
 typedef V3f Colour;
@@ -14,6 +16,7 @@ typedef struct {
     V3f center;
     float radius;
     int mat_index;
+    int light_idx;  // into Scene.lights, -1 when not emissive
 } Sphere;
 
 // FIX: no bounding box run separately
@@ -34,6 +37,7 @@ typedef struct {
     Vertex v1, v2, v3;
     V3f e1, e2;  // calculate internally edges
     int mat_index;
+    int light_idx;
 } Triangle;
 
 typedef struct {
@@ -44,6 +48,7 @@ typedef struct {
     float d;     // calculate internally (Ax+By=Cz=D)
     V3f w;       // calculate internally n/(n.n) for normalized n its just n
     int mat_index;
+    int light_idx;
 } Quad;
 
 // Tile description used for tiling the image for distributed rendering
@@ -116,6 +121,7 @@ typedef struct {
     V2f uv;
     bool front_face;
     int mat_index;
+    int light_idx;  // emitter in the light tree, -1 for everything else
 } HitRecord;
 
 typedef struct Hittable Hittable;
@@ -143,11 +149,28 @@ typedef struct BVH_Node {
 typedef enum {
     TILE_UNASSIGNED = 0,
     TILE_IN_FLIGHT = 1,
-    TILE_COMPLETED = 2,
+    TILE_MERGING = 2,  // result being added to the accumulation
+    TILE_COMPLETED = 3,
 } TileStatus;
 
+// One distributed work item: samples [sample_begin, sample_end) of a tile
+// of a frame
 typedef struct {
     Tile tile;
-    TileStatus status;
-    int assigned_worker_idx;  // -1 = master, >=0 = index into workers vector
+    int frame;     // into MasterState.frames
+    int tile_idx;  // into Work.tiles / tile_samples
+    int sample_begin, sample_end;
+    float cost;  // predicted by the cost prepass, 0 without one
+    _Atomic TileStatus status;
+    // Has an entry on the requeue stack, which takes an item once at most
+    _Atomic bool queued;
+    _Atomic int assigned_worker_idx;  // -1 = master, >=0 = into workers
+    // The holder before the latest claim or backup copy, whose result is
+    // still taken. -3 for none.
+    _Atomic int prev_worker_idx;
+    // Times the item was handed out (backup copies included), and when its
+    // latest lease expires, in ms since master_state_create. A worker's late
+    // result still counts once the item was requeued.
+    _Atomic int claims;
+    _Atomic double deadline_ms;  // 0 for the master's own items
 } TileAssignment;
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "renderer.h"
+#include "state.h"
+
+// Resolve work->accum into work->image through an edge aware a-trous wavelet
+// filter (Dammertz et al. 2010) guided by the first hit AOVs in work->aov,
+// with the variance driven luminance stop from SVGF. Lighting is filtered
+// with the albedo divided out so texture and colour edges stay sharp. Runs
+// over the work tiles on the thread pool.
+void denoise_image(const Work *work, const DenoiseConfig *cfg);
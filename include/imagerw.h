@@ -1,13 +1,36 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
-void export_image(const char *output_file_name, const uint32_t *image,
-                  const size_t width, const size_t height);
+#include "state.h"
 
-void export_ppm(const char *output_file_name, const uint32_t *image,
+// Output stage: images are linear rgb floats (3 per pixel) until written.
+// 8 bit formats go through tonemap_rgb8, float formats are written as is.
+
+// Exposure, tone curve, gamma 2 and quantization of count pixels to rgb8
+void tonemap_rgb8(const float *rgb, size_t pixel_count, const Tonemap *tm,
+                  uint8_t *out);
+
+// Output name of an animation frame: pattern with one printf integer
+// conversion ("out_%04d.png"), else pattern with _NNNN before its extension.
+// Heap allocated.
+char *frame_file_name(const char *pattern, int frame);
+
+// Writes the image in the format of the file name's extension (ppm when
+// unknown), false (logged) when it cannot be written
+bool export_image(const char *output_file_name, const float *image,
+                  const size_t width, const size_t height, const Tonemap *tm);
+
+bool export_ppm(const char *output_file_name, const float *image,
+                const size_t width, const size_t height, const Tonemap *tm);
+
+bool export_png(const char *output_file_name, const float *image,
+                const size_t width, const size_t height, const Tonemap *tm);
+
+bool export_pfm(const char *output_file_name, const float *image,
                 const size_t width, const size_t height);
 
-void export_png(const char *output_file_name, const uint32_t *image,
+bool export_exr(const char *output_file_name, const float *image,
                 const size_t width, const size_t height);
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "utils.h"
+#include "vec.h"
+
+// Emissive spheres, quads and triangles, sampled for direct lighting through
+// a light BVH (Conty & Kulla 2018, the pbrt-v4 variant). Emitters shine from
+// both faces like the path tracer treats them, planes are not included.
+
+typedef enum { LIGHT_SPHERE, LIGHT_QUAD, LIGHT_TRIANGLE } LightShape;
+
+typedef struct {
+    LightShape shape;
+    const void *data;  // Sphere, Quad or Triangle in the scene arena
+    Colour emission;
+    V3f normal;  // unit geometric normal, quads and triangles
+    float area;
+} Light;
+
+Vector(Light, Lights);
+
+// What a light tree node knows about the lights below it
+typedef struct {
+    AABB box;
+    V3f axis;     // every surface normal is within acos(cos_o) of axis
+    float cos_o;  // -1 = any direction
+    float cos_e;  // emission spread around a normal, 0 for diffuse emitters
+    float power;  // emitted flux, luminance * area * PI
+} LightBounds;
+
+typedef struct {
+    LightBounds bounds;
+    int child_or_light;  // second child for interiors, light index for leaves
+    bool leaf;
+} LightNode;
+
+typedef struct {
+    Lights lights;
+    LightNode *nodes;  // depth first, the first child follows its parent
+    int node_count;
+    uint64_t *trails;  // per light, branches from the root (bit set = second)
+} LightTree;
+
+void light_tree_build(LightTree *tree);
+void light_tree_free(LightTree *tree);
+
+// Pick a light for shading point p with normal n, walking down the tree with
+// probability proportional to each child's importance. False when no light
+// can reach p's hemisphere.
+bool light_tree_sample(const LightTree *tree, V3f p, V3f n, float u,
+                       int *light_idx, float *pmf);
+
+// Probability of light_tree_sample picking light_idx at p, n
+float light_tree_pmf(const LightTree *tree, V3f p, V3f n, int light_idx);
+
+// Sample a unit direction wi from p towards the light, pdf is per solid angle
+bool light_sample(const Light *light, V3f p, float u1, float u2, V3f *wi,
+                  float *pdf);
+
+// Solid angle pdf of light_sample returning the direction from p that hits
+// the light at q
+float light_pdf(const Light *light, V3f p, V3f q);
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+// Process wide work stealing thread pool, started once in main. Every pool
+// thread owns a deque: it pushes and pops its own tasks at the back while
+// idle threads steal the oldest tasks from the front of the others. Threads
+// outside the pool share one extra deque. A thread waiting on a group runs
+// queued tasks instead of blocking, so tasks can spawn and wait on nested
+// groups.
+//
+// Before pool_init (or with 0 threads) every task runs inline on the
+// caller, e.g. the single threaded startup benchmark.
+//
+// Given a topology the threads are pinned one per cpu, filling NUMA nodes in
+// order, and tasks can be tied to a node to place memory by first touch.
+
+#include "topology.h"
+
+typedef void (*TaskFn)(void *arg);
+
+// Body of a parallel for, runs indices [begin, end)
+typedef void (*RangeFn)(void *ctx, int begin, int end);
+
+// Tasks spawned into a group, pool_wait returns once all of them finished
+typedef struct {
+    _Atomic int pending;
+} TaskGroup;
+
+// Start thread_count pool threads, callers waiting on groups add one more.
+// topo pins the threads and the caller, NULL leaves them to the scheduler.
+void pool_init(long thread_count, const Topology *topo);
+void pool_shutdown(void);
+
+// Threads that run tasks while a caller waits: the pool plus the caller
+long pool_concurrency(void);
+
+// NUMA nodes the pool is pinned over (1 when unpinned) and the node of the
+// calling thread (0 when unpinned or outside the pool)
+int pool_node_count(void);
+int pool_thread_node(void);
+
+// True while nothing is queued, i.e. threads that finish their task go idle.
+// Always false without pool threads. Lets long tasks split off work late.
+bool pool_wants_work(void);
+
+void pool_spawn(TaskGroup *group, TaskFn fn, void *arg);
+// Like pool_spawn, but only threads pinned to node will run the task
+void pool_spawn_on_node(TaskGroup *group, int node, TaskFn fn, void *arg);
+void pool_wait(TaskGroup *group);
+
+// Run fn over [0, count) in chunks of grain indices and wait for all of them.
+// Chunks are queued in order, the stealing threads take the first ones.
+void pool_parallel_for(int count, int grain, RangeFn fn, void *ctx);
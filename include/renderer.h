@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "scene.h"
@@ -12,11 +14,27 @@ typedef V3f Colour;
 #define TILE_WIDTH 64
 #define TILE_HEIGHT 64
 
+// Base seed for the per (pixel, sample) RNG streams, fixed so every node and
+// thread count produces the same image
+#define RENDER_SEED 0x9e3779b9u
+
+// Depth recorded for camera rays that miss everything
+#define AOV_MISS_DEPTH 1e6f
+
+// First hit features, summed over a pixel's samples like accum. lum_sq is
+// the squared sample luminance, for the per pixel variance.
+typedef struct {
+    Colour albedo;
+    V3f normal;
+    float depth;
+    float lum_sq;
+} PixelAov;
+
 typedef struct {
     _Atomic long ray_count;
     _Atomic int tile_finished;
 
-    size_t width;
+    size_t width, height;
     int samples_per_pixel;
     int max_depth;
 
@@ -24,29 +42,60 @@ typedef struct {
     int tile_count;
     Tile *tiles;
 
-    uint32_t *image;
+    Camera camera;  // the scene camera, or the animation frame's
+
+    float *image;  // linear rgb
 
     V3f pixel00_loc;
     V3f pixel_delta_u, pixel_delta_v;
     V3f defocus_disk_u, defocus_disk_v;
     float colour_contribution;
-} Work;  // sent to individual thread
+
+    // Progressive passes render [sample_begin, sample_end) into accum, NULL
+    // accum means one pass straight into image
+    int sample_begin, sample_end;
+    float *accum;
+    int *tile_samples;  // samples summed in accum, per tile
+    PixelAov *aov;      // denoiser guides, NULL when not denoising
+
+    // From estimate_tile_costs, NULL without a cost prepass
+    float *tile_cost;  // relative cost of rendering one sample of the tile
+    int *tile_order;   // tile indices, most expensive first
+
+    bool first_touched;  // framebuffer pages placed on their NUMA nodes
+} Work;  // shared by the render tasks
+
+// Set (e.g. from a SIGINT handler) to stop progressive renders after the
+// tiles in flight, the image keeps every finished tile
+extern _Atomic bool render_stop_requested;
 
 void calculate_camera_fields(Camera *cam);
 void init_work(Scene *scene, State *state, Work *work);
-void render_scene(Work *work, long thread_count);
+void work_set_camera(Work *work, const Camera *cam);
+// Trace a sparse, shallow prepass to fill work->tile_cost and tile_order
+void estimate_tile_costs(Work *work);
+// Render and resolve on the thread pool (pool.h)
+void render_scene(Work *work);
+void render_scene_progressive(Work *work, const State *state,
+                              const char *snapshot_name);
+void render_animation(Work *work, const State *state, const char *output);
+void resolve_accum(const Work *work);
+// resolve_accum for another frame's accumulation (sized like work's)
+void resolve_accum_into(const Work *work, const float *accum,
+                        const int *tile_samples, float *image);
+void resolve_image(const Work *work, const State *state);
 
+// rgb sums of samples [sample_begin, sample_end) for each tile pixel
 void render_single_tile(const Scene *scene, const Tile *tile, const Camera *cam,
-                        int samples_per_pixel, int max_depth,
+                        int sample_begin, int sample_end, int max_depth,
                         const V3f *pixel00_loc, const V3f *pixel_delta_u,
                         const V3f *pixel_delta_v, const V3f *defocus_disk_u,
-                        const V3f *defocus_disk_v, float colour_contribution,
-                        int image_width, uint32_t *output_buffer);
+                        const V3f *defocus_disk_v, int image_width,
+                        float *output_buffer);
 
 void compute_render_camera_fields(const Camera *cam, size_t image_width,
                                   size_t image_height, V3f *pixel00_loc,
                                   V3f *pixel_delta_u, V3f *pixel_delta_v,
                                   V3f *defocus_disk_u, V3f *defocus_disk_v);
 
-void render_scene_distributed(struct MasterState *master_state,
-                              long thread_count);
+void render_scene_distributed(struct MasterState *master_state);
@@ -12,5 +12,11 @@ Hittable make_hittable_bvh(BVH_Node *node, AABB box);
 bool scene_hit(const Ray *r, const Scene *scene, float tmin, float tmax,
                HitRecord *record);
 
+// When set, scene_hit adds the BVH nodes this thread's rays enter here.
+// Only the cost prepass sets it; normal traversal counts nothing.
+extern _Thread_local long *bvh_visit_counter;
+
 bool scatter(const Material *mat, const HitRecord *rec, const Ray *ray_in,
              Colour *attenuation, Ray *ray_out);
+Colour material_albedo(const Material *mat);
+Colour material_emission(const Material *mat);
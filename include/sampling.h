@@ -0,0 +1,167 @@
+#ifndef SAMPLING_H_
+#define SAMPLING_H_
+
+// Closed form warps from [0,1)^2 to the domains the renderer samples. Every
+// function consumes exactly two uniforms, no rejection loops.
+//
+// The *_n batch variants work on SoA arrays and are written branch free so
+// -O3 -march=native vectorizes them.
+
+#include <math.h>
+
+#include "utils.h"
+#include "vec.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifndef SAMPLINGDEF
+#define SAMPLINGDEF static inline
+#endif
+
+#define PI_4 (PI / 4)
+
+// sin/cos for |x| <= PI/4, Taylor to x^7 / x^8 (< 3e-7 abs error). Plain
+// polynomials so the batch loops vectorize without libm calls.
+SAMPLINGDEF void sincos_quarter(float x, float *s, float *c) {
+    const float x2 = x * x;
+    *s = x * (1 + x2 * (-1.0f / 6 + x2 * (1.0f / 120 + x2 * (-1.0f / 5040))));
+    *c = 1 + x2 * (-0.5f + x2 * (1.0f / 24 +
+                                 x2 * (-1.0f / 720 + x2 * (1.0f / 40320))));
+}
+
+// Shirley-Chiu concentric mapping, keeps stratification and area ratios
+SAMPLINGDEF V2f sample_concentric_disk(float u1, float u2) {
+    const float a = 2 * u1 - 1;
+    const float b = 2 * u2 - 1;
+
+    // theta = PI/4 * t in the a-major wedge, PI/2 - PI/4 * t otherwise; the
+    // wedge test is a coin flip so keep it as selects, not branches
+    const bool major_a = fabsf(a) > fabsf(b);
+    const float r = major_a ? a : b;
+    const float num = major_a ? b : a;
+    const float t = num / (r != 0 ? r : 1.0f);  // r == 0 only at the centre
+    float sn, cs;
+    sincos_quarter(PI_4 * t, &sn, &cs);
+    return (V2f){r * (major_a ? cs : sn), r * (major_a ? sn : cs)};
+}
+
+// Equal area lift of the concentric disk (Clarberg 2008)
+SAMPLINGDEF V3f sample_uniform_sphere(float u1, float u2) {
+    const V2f d = sample_concentric_disk(u1, u2);
+    const float r2 = d.x * d.x + d.y * d.y;
+    const float scale = 2 * sqrtf(MAX(0.0f, 1 - r2));
+    // fold the disk onto both hemispheres: r2 in [0,1] -> z in [1,-1]
+    return (V3f){d.x * scale, d.y * scale, 1 - 2 * r2};
+}
+
+// Malley's method, pdf = cos(theta) / PI around +z
+SAMPLINGDEF V3f sample_cosine_hemisphere(float u1, float u2) {
+    const V2f d = sample_concentric_disk(u1, u2);
+    const float z = sqrtf(MAX(0.0f, 1 - d.x * d.x - d.y * d.y));
+    return (V3f){d.x, d.y, z};
+}
+
+// Orthonormal basis around unit n (Duff et al. 2017), no normalize/branches
+SAMPLINGDEF void onb_from_normal(V3f n, V3f *t, V3f *b) {
+    const float sign = copysignf(1.0f, n.z);
+    const float a = -1.0f / (sign + n.z);
+    const float c = n.x * n.y * a;
+    *t = (V3f){1.0f + sign * n.x * n.x * a, sign * c, -sign * n.x};
+    *b = (V3f){c, sign + n.y * n.y * a, -n.y};
+}
+
+SAMPLINGDEF V3f onb_to_world(V3f local, V3f t, V3f b, V3f n) {
+    return v3f_add(v3f_add(v3f_mulf(t, local.x), v3f_mulf(b, local.y)),
+                   v3f_mulf(n, local.z));
+}
+
+// Cosine weighted direction around unit normal n
+SAMPLINGDEF V3f sample_cosine_direction(V3f n, float u1, float u2) {
+    V3f t, b;
+    onb_from_normal(n, &t, &b);
+    return onb_to_world(sample_cosine_hemisphere(u1, u2), t, b, n);
+}
+
+// ----------------------------------------------------------------------------
+//  Batch (SoA) variants
+// ----------------------------------------------------------------------------
+SAMPLINGDEF void sample_concentric_disk_n(const float *restrict u1,
+                                          const float *restrict u2,
+                                          float *restrict x,
+                                          float *restrict y, int n) {
+    for (int i = 0; i < n; i++) {
+        const float a = 2 * u1[i] - 1;
+        const float b = 2 * u2[i] - 1;
+        const bool major_a = fabsf(a) > fabsf(b);
+        const float r = major_a ? a : b;
+        const float num = major_a ? b : a;
+        const float t = num / (r != 0 ? r : 1.0f);
+        float sn, cs;
+        sincos_quarter(PI_4 * t, &sn, &cs);
+        x[i] = r * (major_a ? cs : sn);
+        y[i] = r * (major_a ? sn : cs);
+    }
+}
+
+SAMPLINGDEF void sample_uniform_sphere_n(const float *restrict u1,
+                                         const float *restrict u2,
+                                         float *restrict x, float *restrict y,
+                                         float *restrict z, int n) {
+    sample_concentric_disk_n(u1, u2, x, y, n);
+    for (int i = 0; i < n; i++) {
+        const float r2 = x[i] * x[i] + y[i] * y[i];
+        const float scale = 2 * sqrtf(fmaxf(0.0f, 1 - r2));
+        x[i] *= scale;
+        y[i] *= scale;
+        z[i] = 1 - 2 * r2;
+    }
+}
+
+SAMPLINGDEF void sample_cosine_hemisphere_n(const float *restrict u1,
+                                            const float *restrict u2,
+                                            float *restrict x,
+                                            float *restrict y,
+                                            float *restrict z, int n) {
+    sample_concentric_disk_n(u1, u2, x, y, n);
+    for (int i = 0; i < n; i++) {
+        z[i] = sqrtf(fmaxf(0.0f, 1 - x[i] * x[i] - y[i] * y[i]));
+    }
+}
+
+// ----------------------------------------------------------------------------
+//  Thread local RNG helpers
+// ----------------------------------------------------------------------------
+SAMPLINGDEF V3f v3f_random_unit() {
+    const float u1 = rng_f32_tls();
+    const float u2 = rng_f32_tls();
+    return sample_uniform_sphere(u1, u2);
+}
+
+SAMPLINGDEF V3f v3f_random_in_unit_disk() {
+    const float u1 = rng_f32_tls();
+    const float u2 = rng_f32_tls();
+    const V2f d = sample_concentric_disk(u1, u2);
+    return (V3f){d.x, d.y, 0};
+}
+
+SAMPLINGDEF V3f v3f_random_on_hemisphere(const V3f normal) {
+    V3f on_unit_sphere = v3f_random_unit();
+    if (v3f_dot(on_unit_sphere, normal) >
+        0.0)  // In the same hemisphere as the normal
+        return on_unit_sphere;
+    else
+        return v3f_neg(on_unit_sphere);
+}
+
+SAMPLINGDEF V3f v3f_random_cosine_direction(const V3f normal) {
+    const float u1 = rng_f32_tls();
+    const float u2 = rng_f32_tls();
+    return sample_cosine_direction(normal, u1, u2);
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif  // SAMPLING_H_
@@ -1,6 +1,7 @@
 #pragma once
 #include "arena.h"
 #include "common.h"
+#include "light.h"
 #include "state.h"
 #include "vec.h"
 
@@ -22,10 +23,13 @@ typedef struct {
 
 Vector(Hittable, Hittables);
 Vector(Material, Materials);
+Vector(Camera, Cameras);
 typedef struct {
     Arena arena;
     unsigned int scene_crc;
     char *scene_json;
+    // What /api/scene serves of it, masters only (see assets.h)
+    struct SceneBundle *bundle;
 
     int plane_count;
     int sphere_count;
@@ -34,13 +38,22 @@ typedef struct {
 
     Hittables objects;
     Hittable bvh_root;
+    LightTree lights;
 
     Materials materials;
 
     Camera camera;
+    // One camera per frame of the "animation" section, empty for stills
+    Cameras frames;
 } Scene;
 
+// The minified scene JSON of scene_file, NULL when it cannot be read
 char *read_compress_scene(const char *scene_file);
-void load_scene(const char *scene_file_content, Scene *scene, State *state);
+// CRC-32 of the (minified) scene JSON, identifies a scene to workers
+unsigned int scene_crc32(const char *scene_json);
+// False for a scene that cannot be rendered (malformed JSON, no config, bad
+// image size, unknown material) or out of memory, logged. free_scene
+// releases what was loaded either way.
+bool load_scene(const char *scene_file_content, Scene *scene, State *state);
 void print_summary(const Scene *scene, const State *state);
 void free_scene(Scene *scene);
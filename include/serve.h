@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cJSON.h>
+#include <stdbool.h>
+
+#include "codec.h"
+#include "state.h"
+
+// Render server: jobs are submitted, polled and cancelled over the master's
+// HTTP server and rendered one at a time, highest priority first, by the
+// pool and the registered workers. Recently used scenes stay loaded (BVH,
+// lights, prepass costs) so jobs on the same scene start right away.
+
+// Scenes kept loaded by default
+#define SERVE_RESIDENT_SCENES 4
+
+// Answer to workers between jobs, they poll again later
+#define SERVE_IDLE "{\"status\":\"idle\"}"
+
+struct JobQueue;
+
+// Serve on port until SIGINT (render_stop_requested), offering codec to
+// workers and handling them on http_threads. False when the server cannot
+// start.
+bool serve_run(int port, const MachineInfo *self, int resident_scenes,
+               Codec codec, int http_threads);
+
+// Queue a render of scene_file into output_file, the job id or -1 when the
+// scene cannot be read or either path is absolute or has ".." in it
+int job_queue_submit(struct JobQueue *q, const char *scene_file,
+                     const char *output_file, int priority);
+// Cancel a queued or running job, false when there is no such job
+bool job_queue_cancel(struct JobQueue *q, int id);
+// Status of every job, or of one (NULL when unknown)
+cJSON *job_queue_json(struct JobQueue *q);
+cJSON *job_queue_job_json(struct JobQueue *q, int id);
@@ -1,15 +1,44 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
+// Edge aware a-trous filter guided by first hit albedo/normal/depth
+typedef struct {
+    bool enabled;
+    int iterations;         // filter passes, the footprint doubles each pass
+    float sigma_luminance;  // luminance stop, in noise standard deviations
+    float sigma_normal;     // exponent on the normal dot product
+    float sigma_depth;      // relative depth change allowed per pixel
+} DenoiseConfig;
+
+typedef enum { TONEMAP_CLAMP, TONEMAP_REINHARD, TONEMAP_ACES } TonemapOperator;
+
+// Display transform for 8 bit outputs, float outputs stay linear
+typedef struct {
+    TonemapOperator op;
+    float exposure;  // stops
+} Tonemap;
+
 typedef struct {
     size_t width;
     size_t height;
     int samples_per_pixel;
     int max_depth;
 
-    uint32_t *image;
+    // Progressive mode: render in passes of pass_samples spp (0 = one pass)
+    int pass_samples;
+    float snapshot_interval;  // seconds between snapshots, 0 = none
+    float *accum;             // rgb sample sums, progressive or denoised
+
+    DenoiseConfig denoise;
+    Tonemap tonemap;
+
+    // Estimate tile costs with a cheap prepass and schedule expensive first
+    bool cost_prepass;
+
+    float *image;  // linear rgb framebuffer, 3 floats per pixel
 } State;
 
 typedef struct {
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdbool.h>
+
+// NUMA layout of the cpus this process may run on, read from sysfs
+// (/sys/devices/system/node). Machines without it count as one node.
+
+#define TOPOLOGY_MAX_CPUS 1024
+
+typedef struct {
+    int node_count;
+    int cpu_count;
+    int *cpus;      // usable cpus, grouped by node
+    int *cpu_node;  // node of cpus[i], nodes numbered from 0 densely
+} Topology;
+
+bool topology_detect(Topology *topo);
+void topology_free(Topology *topo);
+
+// Restrict the calling thread to the given cpus
+bool topology_pin(const int *cpus, int count);
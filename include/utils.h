@@ -13,6 +13,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <time.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -131,6 +132,19 @@ static inline double timersub_ms(const struct timeval *end,
     return res;
 }
 
+// TIME_UTC deadline ms from now, as pthread_cond_timedwait takes it
+static inline struct timespec deadline_ms(long ms) {
+    struct timespec t;
+    timespec_get(&t, TIME_UTC);
+    t.tv_sec += ms / 1000;
+    t.tv_nsec += (ms % 1000) * 1000000L;
+    if (t.tv_nsec >= 1000000000L) {
+        t.tv_sec++;
+        t.tv_nsec -= 1000000000L;
+    }
+    return t;
+}
+
 // ----------------------------------------------------------------------------
 //  Math Utils
 // ----------------------------------------------------------------------------
@@ -192,26 +206,53 @@ WRAP_TYPE(int)
 WRAP_TYPE(float)
 WRAP_TYPE(double)
 
+// PCG32 (XSH-RR), https://www.pcg-random.org. Every thread owns its own
+// stream; renders reseed it per (pixel, sample) with rng_seed_sample so each
+// draw only depends on the pixel, the sample index and how many numbers were
+// drawn before it (the dimension), never on which thread did the work.
 typedef struct RNG {
-    uint32_t state;
+    uint64_t state;
 } RNG;
 
-static RNG rng_state = (RNG){0x12345678u};
+#define RNG_DEFAULT_STATE 0x853c49e6748fea9bULL
+#define RNG_MULTIPLIER 6364136223846793005ULL
+#define RNG_INCREMENT 1442695040888963407ULL
+
+// Defined once with UTILS_IMPLEMENTATION so every translation unit draws from
+// the same per-thread stream
+extern UTILS_TLS RNG rng_state;
+
+// PCG-RXS-M-XS 32 bit hash, good avalanche for keying streams by counters
+static inline uint32_t rng_hash_u32(uint32_t v) {
+    uint32_t state = v * 747796405u + 2891336453u;
+    uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+    return (word >> 22u) ^ word;
+}
 
 static inline void rng_seed(RNG *rng, uint32_t seed) {
-    rng->state = seed ? seed : 0x12345678u;
+    rng->state = seed ? ((uint64_t)rng_hash_u32(seed) << 32 | seed)
+                      : RNG_DEFAULT_STATE;
 }
-static inline void rng_seed_tls(uint32_t seed) {
-    rng_state = (RNG){seed ? seed : 0x12345678u};
+static inline void rng_seed_tls(uint32_t seed) { rng_seed(&rng_state, seed); }
+
+// Counter based seeding: same (pixel, sample, seed) -> same stream
+static inline void rng_seed_sample(RNG *rng, uint32_t pixel, uint32_t sample,
+                                   uint32_t seed) {
+    uint32_t hi = rng_hash_u32(pixel ^ rng_hash_u32(seed));
+    uint32_t lo = rng_hash_u32(sample ^ rng_hash_u32(hi));
+    rng->state = ((uint64_t)hi << 32 | lo) + RNG_INCREMENT;
+}
+static inline void rng_seed_sample_tls(uint32_t pixel, uint32_t sample,
+                                       uint32_t seed) {
+    rng_seed_sample(&rng_state, pixel, sample, seed);
 }
 
 static inline uint32_t rng_u32(RNG *rng) {
-    uint32_t x = rng->state;
-    x ^= x << 13;
-    x ^= x >> 17;
-    x ^= x << 5;
-    rng->state = x;
-    return x;
+    uint64_t old = rng->state;
+    rng->state = old * RNG_MULTIPLIER + RNG_INCREMENT;
+    uint32_t xorshifted = (uint32_t)(((old >> 18u) ^ old) >> 27u);
+    uint32_t rot = (uint32_t)(old >> 59u);
+    return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
 }
 
 static inline uint32_t rng_u32_tls() { return rng_u32(&rng_state); }
@@ -326,7 +367,15 @@ UTILS_DEF bool triangle_is_inside(float x1, float y1, float x2, float y2,
 // ----------------------------------------------------------------------------
 //  String Utils
 // ----------------------------------------------------------------------------
+// libc declares strdup itself from POSIX 2008 (implied by _GNU_SOURCE) and C23
+#if (defined(_POSIX_C_SOURCE) && _POSIX_C_SOURCE >= 200809L) || \
+    (defined(__STDC_VERSION__) && __STDC_VERSION__ >= 202311L)
+#define UTILS_LIBC_STRDUP
+#endif
+
+#ifndef UTILS_LIBC_STRDUP
 UTILS_DEF char *strdup(const char *src);
+#endif
 
 #define UTILS_MAX_TEMP_SIZE 1024 * 100
 UTILS_DEF char *combine_charp(const char *str1, const char *str2);
@@ -351,6 +400,8 @@ UTILS_DEF char *read_entire_file(const char *filename);
 
 #ifdef UTILS_IMPLEMENTATION
 
+UTILS_TLS RNG rng_state = {RNG_DEFAULT_STATE};
+
 static FILE *_log_output_file = NULL;
 
 UTILS_DEF int Log_set_out_file(const char *out_file) {
@@ -537,6 +588,7 @@ UTILS_DEF bool triangle_is_inside(float x1, float y1, float x2, float y2,
     return (A == A1 + A2 + A3);
 }
 
+#ifndef UTILS_LIBC_STRDUP
 UTILS_DEF char *strdup(const char *src) {
     if (src == NULL) return NULL;
 
@@ -552,6 +604,7 @@ UTILS_DEF char *strdup(const char *src) {
 
     return dst;
 }
+#endif
 
 static char utils_static_temp_buffer[UTILS_MAX_TEMP_SIZE];
 static uint32_t utils_static_temp_buffer_pos = 0;
@@ -102,6 +102,11 @@ VECDEF V3f v3f_comp_mul(V3f a, V3f b) {
     return (V3f){a.x * b.x, a.y * b.y, a.z * b.z};
 }
 
+// Rec. 709 luma weights on linear rgb
+VECDEF float v3f_luminance(V3f a) {
+    return 0.2126f * a.x + 0.7152f * a.y + 0.0722f * a.z;
+}
+
 VECDEF V3f v3f_neg(V3f a) { return (V3f){-a.x, -a.y, -a.z}; }
 
 VECDEF V3f v3f_inv(V3f a) { return (V3f){1 / a.x, 1 / a.y, 1 / a.z}; }
@@ -122,33 +127,6 @@ VECDEF V3f v3f_random_range(float min, float max) {
                  rngf_range_tls(min, max)};
 }
 
-// TODO: find better way for random vector on sphere
-VECDEF V3f v3f_random_unit() {
-    while (true) {
-        V3f a = v3f_random();
-        float len = v3f_slength(a);
-        if (len <= 1 && len >= 1e-50) {
-            return v3f_divf(a, sqrtf(len));
-        }
-    }
-}
-
-VECDEF V3f v3f_random_in_unit_disk() {
-    while (true) {
-        V3f p = (V3f){rngf_range_tls(-1, 1), rngf_range_tls(-1, 1), 0};
-        if (v3f_slength(p) < 1) return p;
-    }
-}
-
-VECDEF V3f v3f_random_on_hemisphere(const V3f normal) {
-    V3f on_unit_sphere = v3f_random_unit();
-    if (v3f_dot(on_unit_sphere, normal) >
-        0.0)  // In the same hemisphere as the normal
-        return on_unit_sphere;
-    else
-        return v3f_neg(on_unit_sphere);
-}
-
 VECDEF V3f v3f_reflect(const V3f a, const V3f n) {
     return v3f_sub(a, v3f_mulf(n, 2 * v3f_dot(a, n)));
 }
@@ -0,0 +1,109 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+// Lock-free multi producer / multi consumer queue of item indices
+// [0, count). Fresh items are claimed in O(1) from either end of one packed
+// (front, back) cursor, so fast claimers can take the head of a sorted list
+// while slow ones take its tail. Items handed back go on a tagged Treiber
+// stack that claims drain first, the only source of items for a queue whose
+// fresh range was cleared.
+
+typedef struct {
+    _Atomic uint64_t ends;      // front in the low 32 bits, back (exclusive)
+                                // in the high 32 bits
+    _Atomic uint64_t requeued;  // top item + 1 in the low 32 bits (0 = empty),
+                                // ABA tag in the high 32 bits
+    _Atomic int requeued_count;
+    _Atomic int *next;          // requeue stack links, per item
+    int count;
+} WorkQueue;
+
+static inline uint64_t wq_pack(uint32_t lo, uint32_t hi) {
+    return (uint64_t)hi << 32 | lo;
+}
+
+static inline bool work_queue_init(WorkQueue *q, int count) {
+    q->next = malloc((count > 0 ? count : 1) * sizeof(*q->next));
+    if (!q->next) return false;
+    for (int i = 0; i < count; i++) atomic_init(&q->next[i], -1);
+    atomic_init(&q->ends, wq_pack(0, (uint32_t)count));
+    atomic_init(&q->requeued, 0);
+    atomic_init(&q->requeued_count, 0);
+    q->count = count;
+    return true;
+}
+
+static inline void work_queue_free(WorkQueue *q) {
+    free((void *)q->next);
+    q->next = NULL;
+    q->count = 0;
+}
+
+// Hand an item back, it is claimed again before any fresh one. The caller
+// must own it (claimed and not pushed since).
+static inline void work_queue_push(WorkQueue *q, int item) {
+    uint64_t head = atomic_load(&q->requeued);
+    do {
+        atomic_store(&q->next[item], (int)(uint32_t)head - 1);
+    } while (!atomic_compare_exchange_weak(
+        &q->requeued, &head,
+        wq_pack((uint32_t)item + 1, (uint32_t)(head >> 32) + 1)));
+    atomic_fetch_add(&q->requeued_count, 1);
+}
+
+// Claim every fresh item at once, items then come from work_queue_push only
+static inline void work_queue_clear(WorkQueue *q) {
+    atomic_store(&q->ends, wq_pack(0, 0));
+}
+
+// Claim an item: a handed back one, else the fresh one at the front (or the
+// back). -1 when nothing is left.
+static inline int work_queue_pop(WorkQueue *q, bool back) {
+    uint64_t head = atomic_load(&q->requeued);
+    while ((uint32_t)head != 0) {
+        const int item = (int)(uint32_t)head - 1;
+        const int next = atomic_load(&q->next[item]);
+        if (atomic_compare_exchange_weak(
+                &q->requeued, &head,
+                wq_pack((uint32_t)(next + 1), (uint32_t)(head >> 32) + 1))) {
+            atomic_fetch_sub(&q->requeued_count, 1);
+            return item;
+        }
+    }
+
+    uint64_t ends = atomic_load(&q->ends);
+    while (true) {
+        const uint32_t front = (uint32_t)ends;
+        const uint32_t end = (uint32_t)(ends >> 32);
+        if (front >= end) return -1;
+        const uint64_t claimed =
+            back ? wq_pack(front, end - 1) : wq_pack(front + 1, end);
+        if (atomic_compare_exchange_weak(&q->ends, &ends, claimed))
+            return back ? (int)end - 1 : (int)front;
+    }
+}
+
+// Nothing to claim, neither handed back nor fresh items
+static inline bool work_queue_empty(WorkQueue *q) {
+    const uint64_t ends = atomic_load(&q->ends);
+    return (uint32_t)atomic_load(&q->requeued) == 0 &&
+           (uint32_t)ends >= (uint32_t)(ends >> 32);
+}
+
+// Fresh items not claimed yet, handed back items not included
+static inline int work_queue_fresh(WorkQueue *q) {
+    const uint64_t ends = atomic_load(&q->ends);
+    const uint32_t front = (uint32_t)ends, end = (uint32_t)(ends >> 32);
+    return front < end ? (int)(end - front) : 0;
+}
+
+// Items left to claim, fresh and handed back. The count of handed back
+// items trails their stack, so it is a hint only.
+static inline int work_queue_size(WorkQueue *q) {
+    const int requeued = atomic_load(&q->requeued_count);
+    return work_queue_fresh(q) + (requeued > 0 ? requeued : 0);
+}
@@ -0,0 +1,425 @@
+#include "assets.h"
+
+#include <cJSON.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "utils.h"
+
+// Longest path under a worker's cache directory
+#define CACHE_PATH_MAX 1024
+// Longest line of an OBJ or MTL file scanned for references
+#define ASSET_LINE_MAX 512
+
+void asset_hash(const void *data, size_t size, char out[ASSET_HASH_LEN + 1]) {
+    const uint8_t *bytes = data;
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < size; i++) h = (h ^ bytes[i]) * 1099511628211ull;
+    snprintf(out, ASSET_HASH_LEN + 1, "%016llx", (unsigned long long)h);
+}
+
+bool asset_hash_valid(const char *hash) {
+    for (int i = 0; i < ASSET_HASH_LEN; i++) {
+        if (!(hash[i] >= '0' && hash[i] <= '9') &&
+            !(hash[i] >= 'a' && hash[i] <= 'f'))
+            return false;
+    }
+    return hash[ASSET_HASH_LEN] == '\0';
+}
+
+// The whole file, NUL terminated, NULL when it cannot be read
+static uint8_t *read_file(const char *path, size_t *size) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return NULL;
+    uint8_t *data = NULL;
+    long len = -1;
+    if (fseek(f, 0, SEEK_END) == 0) len = ftell(f);
+    if (len >= 0 && fseek(f, 0, SEEK_SET) == 0) data = malloc((size_t)len + 1);
+    if (data && fread(data, 1, (size_t)len, f) != (size_t)len) {
+        free(data);
+        data = NULL;
+    }
+    fclose(f);
+    if (!data) return NULL;
+    data[len] = '\0';
+    *size = (size_t)len;
+    return data;
+}
+
+bool asset_local_path(const char *path) {
+    if (!path[0] || path[0] == '/') return false;
+    for (const char *p = path; *p;) {
+        const size_t n = strcspn(p, "/");
+        if (n == 2 && p[0] == '.' && p[1] == '.') return false;
+        p += n;
+        if (*p == '/') p++;
+    }
+    return true;
+}
+
+// name relative to the directory of file, malloc'd
+static char *sibling_path(const char *file, const char *name) {
+    const char *slash = strrchr(file, '/');
+    const size_t dir = slash ? (size_t)(slash - file) + 1 : 0;
+    char *path = malloc(dir + strlen(name) + 1);
+    if (!path) return NULL;
+    memcpy(path, file, dir);
+    strcpy(path + dir, name);
+    return path;
+}
+
+// Index of the asset of path, reading it unless listed already, -1 when it
+// cannot be served
+static int add_asset(SceneBundle *b, const char *path) {
+    for (size_t i = 0; i < b->assets.size; i++)
+        if (strcmp(b->assets.items[i].path, path) == 0) return (int)i;
+    if (!asset_local_path(path)) {
+        Log(Log_Warn,
+            "scene_bundle_create: %s is outside the working directory, "
+            "workers open it from their own disk",
+            path);
+        return -1;
+    }
+    Asset a = {0};
+    a.data = read_file(path, &a.size);
+    a.path = strdup(path);
+    if (!a.data || !a.path) {
+        Log(Log_Warn, "scene_bundle_create: Cannot read %s: %s", path,
+            strerror(errno));
+        free(a.data);
+        free(a.path);
+        return -1;
+    }
+    if (a.size > ASSET_MAX_BYTES) {
+        Log(Log_Warn,
+            "scene_bundle_create: %s is over %u bytes, workers open it from "
+            "their own disk",
+            path, ASSET_MAX_BYTES);
+        free(a.data);
+        free(a.path);
+        return -1;
+    }
+    asset_hash(a.data, a.size, a.hash);
+    vec_push(&b->assets, a);
+    return (int)b->assets.size - 1;
+}
+
+// Adds the files an OBJ (mtllib) or MTL (map_*, bump, disp, decal, refl,
+// norm) names, relative to its own directory. Texture options precede the
+// file name, the last word of the line.
+static void add_references(SceneBundle *b, int idx, bool obj) {
+    // copied, adding assets moves the vector
+    char *file = strdup(b->assets.items[idx].path);
+    const char *text = (const char *)b->assets.items[idx].data;
+    if (!file) return;
+    static const char *const maps[] = {"map_", "bump", "disp",
+                                       "decal", "refl", "norm"};
+    while (*text) {
+        char line[ASSET_LINE_MAX];
+        const size_t n = strcspn(text, "\r\n");
+        snprintf(line, sizeof(line), "%.*s", (int)MIN(n, sizeof(line) - 1),
+                 text);
+        text += n;
+        text += strspn(text, "\r\n");
+
+        const char *p = line + strspn(line, " \t");
+        bool refers = obj && strncmp(p, "mtllib", 6) == 0;
+        for (size_t m = 0; !obj && m < sizeof(maps) / sizeof(maps[0]); m++)
+            refers |= strncmp(p, maps[m], strlen(maps[m])) == 0;
+        if (!refers) continue;
+        p += strcspn(p, " \t");
+
+        // every word of mtllib is a file, the last one of texture maps
+        while (*(p += strspn(p, " \t"))) {
+            const size_t w = strcspn(p, " \t");
+            if (obj || p[w] == '\0' || p[w + strspn(p + w, " \t")] == '\0') {
+                char name[ASSET_LINE_MAX];
+                snprintf(name, sizeof(name), "%.*s", (int)w, p);
+                char *path = sibling_path(file, name);
+                const int ref = path ? add_asset(b, path) : -1;
+                if (ref >= 0 && obj) add_references(b, ref, false);
+                free(path);
+            }
+            p += w;
+        }
+    }
+    free(file);
+}
+
+SceneBundle *scene_bundle_create(const char *scene_json,
+                                 unsigned int scene_crc) {
+    SceneBundle *b = calloc(1, sizeof(*b));
+    if (!b) return NULL;
+    vec_init(&b->assets);
+    pthread_mutex_init(&b->lock, NULL);
+    b->scene_crc = scene_crc;
+
+    cJSON *root = cJSON_Parse(scene_json);
+    const cJSON *objects = cJSON_GetObjectItemCaseSensitive(root, "objects");
+    const cJSON *models = cJSON_GetObjectItemCaseSensitive(objects, "models");
+    const cJSON *model;
+    cJSON_ArrayForEach(model, models) {
+        const cJSON *file = cJSON_GetObjectItemCaseSensitive(model, "file");
+        if (!cJSON_IsString(file)) continue;
+        const int idx = add_asset(b, file->valuestring);
+        if (idx >= 0) add_references(b, idx, true);
+    }
+    cJSON_Delete(root);
+
+    cJSON *manifest = cJSON_CreateObject();
+    size_t asset_bytes = 0;
+    for (size_t i = 0; i < b->assets.size; i++) {
+        cJSON_AddStringToObject(manifest, b->assets.items[i].path,
+                                b->assets.items[i].hash);
+        asset_bytes += b->assets.items[i].size;
+    }
+    char *listed = cJSON_PrintUnformatted(manifest);
+    cJSON_Delete(manifest);
+
+    b->json_size = strlen(scene_json);
+    b->payload_size = b->json_size + (listed ? strlen(listed) : 0);
+    b->payload = malloc(b->payload_size + 1);
+    if (!listed || !b->payload) {
+        free(listed);
+        scene_bundle_free(b);
+        return NULL;
+    }
+    memcpy(b->payload, scene_json, b->json_size);
+    strcpy(b->payload + b->json_size, listed);
+    free(listed);
+    asset_hash(b->payload, b->payload_size, b->tag);
+
+    Log(Log_Info,
+        "scene_bundle_create: Scene %u with %zu assets (%.2f MB), ETag %s",
+        scene_crc, b->assets.size, (double)asset_bytes / (1024.0 * 1024.0),
+        b->tag);
+    return b;
+}
+
+void scene_bundle_free(SceneBundle *b) {
+    if (!b) return;
+    for (size_t i = 0; i < b->assets.size; i++) {
+        Asset *a = &b->assets.items[i];
+        for (int c = 0; c < CODEC_COUNT; c++) free(a->body[c].data);
+        free(a->data);
+        free(a->path);
+    }
+    vec_free(&b->assets);
+    for (int c = 0; c < CODEC_COUNT; c++) free(b->body[c].data);
+    free(b->json_answer);
+    free(b->payload);
+    pthread_mutex_destroy(&b->lock);
+    free(b);
+}
+
+// header_size bytes left for the caller, then raw through codec. Returns the
+// codec used, CODEC_NONE when encoding doesn't shrink raw.
+static Codec encode_body(AssetBody *body, size_t header_size, Codec codec,
+                         const void *raw, size_t raw_size, double *codec_ms) {
+    body->data = malloc(header_size + codec_bound(codec, raw_size));
+    if (!body->data) return CODEC_NONE;
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    size_t size =
+        codec_encode(codec, raw, raw_size, 1, body->data + header_size);
+    gettimeofday(&end, NULL);
+    *codec_ms = timersub_ms(&end, &start);
+    if (size == 0) {
+        codec = CODEC_NONE;
+        size = raw_size;
+        memcpy(body->data + header_size, raw, raw_size);
+    }
+    body->size = header_size + size;
+    return codec;
+}
+
+const AssetBody *scene_bundle_body(SceneBundle *b, Codec codec,
+                                   double *codec_ms) {
+    *codec_ms = 0;
+    pthread_mutex_lock(&b->lock);
+    AssetBody *body = &b->body[codec];
+    if (!body->data) {
+        const SceneHeader h = {
+            .magic = SCENE_MAGIC,
+            .scene_crc = b->scene_crc,
+            .codec = encode_body(body, sizeof(SceneHeader), codec, b->payload,
+                                 b->payload_size, codec_ms),
+            .raw_bytes = (uint32_t)b->payload_size,
+            .json_bytes = (uint32_t)b->json_size};
+        if (body->data) memcpy(body->data, &h, sizeof(h));
+    }
+    pthread_mutex_unlock(&b->lock);
+    return body->data ? body : NULL;
+}
+
+const char *scene_bundle_json(SceneBundle *b) {
+    pthread_mutex_lock(&b->lock);
+    if (!b->json_answer) {
+        cJSON *root = cJSON_CreateObject();
+        cJSON_AddNumberToObject(root, "scene_crc", b->scene_crc);
+        char *json = malloc(b->json_size + 1);
+        if (json) {
+            memcpy(json, b->payload, b->json_size);
+            json[b->json_size] = '\0';
+            cJSON_AddStringToObject(root, "scene_json", json);
+            free(json);
+        }
+        cJSON_AddItemToObject(root, "assets",
+                              cJSON_Parse(b->payload + b->json_size));
+        b->json_answer = cJSON_PrintUnformatted(root);
+        cJSON_Delete(root);
+    }
+    pthread_mutex_unlock(&b->lock);
+    return b->json_answer;
+}
+
+const AssetBody *scene_bundle_asset(SceneBundle *b, const char *hash,
+                                    Codec codec, size_t *raw_size,
+                                    double *codec_ms) {
+    *codec_ms = 0;
+    Asset *a = NULL;
+    for (size_t i = 0; i < b->assets.size && !a; i++)
+        if (strcmp(b->assets.items[i].hash, hash) == 0) a = &b->assets.items[i];
+    if (!a) return NULL;
+
+    pthread_mutex_lock(&b->lock);
+    AssetBody *body = &a->body[codec];
+    if (!body->data) {
+        const AssetHeader h = {
+            .magic = ASSET_MAGIC,
+            .codec = encode_body(body, sizeof(AssetHeader), codec, a->data,
+                                 a->size, codec_ms),
+            .raw_bytes = (uint32_t)a->size};
+        if (body->data) memcpy(body->data, &h, sizeof(h));
+    }
+    pthread_mutex_unlock(&b->lock);
+    *raw_size = a->size;
+    return body->data ? body : NULL;
+}
+
+// mkdir -p of the first len bytes of path
+static bool make_dirs(const char *path, size_t len) {
+    char dir[CACHE_PATH_MAX];
+    if (len >= sizeof(dir)) return false;
+    memcpy(dir, path, len);
+    dir[len] = '\0';
+    for (char *p = dir + 1;; p++) {
+        if (*p != '/' && *p != '\0') continue;
+        const char end = *p;
+        *p = '\0';
+        if (mkdir(dir, 0755) != 0 && errno != EEXIST) return false;
+        *p = end;
+        if (end == '\0') return true;
+    }
+}
+
+// Written next to path and renamed into place, so readers (other workers
+// sharing the cache) never see a partial file
+static bool write_file(const char *path, const void *data, size_t size) {
+    char tmp[CACHE_PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path, (long)getpid());
+    FILE *f = fopen(tmp, "wb");
+    if (!f) return false;
+    bool ok = fwrite(data, 1, size, f) == size;
+    ok &= fclose(f) == 0;
+    if (ok) ok = rename(tmp, path) == 0;
+    if (!ok) remove(tmp);
+    return ok;
+}
+
+static bool exists(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) return false;
+    fclose(f);
+    return true;
+}
+
+bool asset_cache_init(const char *dir) {
+    char path[CACHE_PATH_MAX];
+    snprintf(path, sizeof(path), "%s/objects", dir);
+    if (!make_dirs(path, strlen(path))) return false;
+    snprintf(path, sizeof(path), "%s/scenes", dir);
+    return make_dirs(path, strlen(path));
+}
+
+bool asset_cache_has(const char *dir, const char *hash) {
+    if (!asset_hash_valid(hash)) return false;
+    char path[CACHE_PATH_MAX];
+    snprintf(path, sizeof(path), "%s/objects/%s", dir, hash);
+    return exists(path);
+}
+
+bool asset_cache_put(const char *dir, const char *hash, const void *data,
+                     size_t size) {
+    if (!asset_hash_valid(hash)) return false;
+    char path[CACHE_PATH_MAX];
+    snprintf(path, sizeof(path), "%s/objects/%s", dir, hash);
+    return write_file(path, data, size);
+}
+
+uint8_t *asset_cache_scene(const char *dir, const char *tag, size_t *size) {
+    if (!asset_hash_valid(tag)) return NULL;
+    char path[CACHE_PATH_MAX];
+    snprintf(path, sizeof(path), "%s/scenes/%s.scene", dir, tag);
+    return read_file(path, size);
+}
+
+bool asset_cache_put_scene(const char *dir, const char *tag, const void *data,
+                           size_t size) {
+    if (!asset_hash_valid(tag)) return false;
+    char path[CACHE_PATH_MAX];
+    snprintf(path, sizeof(path), "%s/scenes/%s.scene", dir, tag);
+    return write_file(path, data, size);
+}
+
+char *asset_cache_link(const char *dir, const char *tag, const char *path,
+                       const char *hash) {
+    if (!asset_hash_valid(tag) || !asset_hash_valid(hash)) return NULL;
+    char object[CACHE_PATH_MAX], linked[CACHE_PATH_MAX];
+    snprintf(object, sizeof(object), "%s/objects/%s", dir, hash);
+    const int n =
+        snprintf(linked, sizeof(linked), "%s/scenes/%s/%s", dir, tag, path);
+    if (!asset_local_path(path) || n < 0 || n >= (int)sizeof(linked))
+        return NULL;
+    if (!exists(linked)) {
+        if (!make_dirs(linked, strrchr(linked, '/') - linked)) return NULL;
+        // a copy where hard links are not supported
+        if (link(object, linked) != 0 && errno != EEXIST) {
+            size_t size = 0;
+            uint8_t *data = read_file(object, &size);
+            const bool ok = data && write_file(linked, data, size);
+            free(data);
+            if (!ok) return NULL;
+        }
+    }
+    return strdup(linked);
+}
+
+void asset_cache_tags(const char *dir, char *out, size_t cap) {
+    char path[CACHE_PATH_MAX];
+    snprintf(path, sizeof(path), "%s/scenes", dir);
+    out[0] = '\0';
+    DIR *d = opendir(path);
+    if (!d) return;
+    size_t len = 0;
+    int tags = 0;
+    const struct dirent *e;
+    while (tags < ASSET_CACHE_TAGS && (e = readdir(d)) != NULL) {
+        if (strlen(e->d_name) != ASSET_HASH_LEN + 6 ||
+            strcmp(e->d_name + ASSET_HASH_LEN, ".scene") != 0)
+            continue;
+        const int n = snprintf(out + len, cap - len, "%s\"%.*s\"",
+                               tags ? ", " : "", ASSET_HASH_LEN, e->d_name);
+        if (n < 0 || (size_t)n >= cap - len) break;
+        len += (size_t)n;
+        tags++;
+    }
+    out[len] = '\0';
+    closedir(d);
+}
@@ -0,0 +1,270 @@
+#include "codec.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+// Shortest match worth an LZ sequence, and the hash table size for finding
+// them
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 14
+#define LZ_WINDOW 65535
+
+// Run length: a control byte c < 128 is followed by c + 1 literal bytes,
+// c >= 128 by one byte repeated c - 128 + RLE_MIN_RUN times
+#define RLE_MIN_RUN 3
+#define RLE_MAX_RUN (127 + RLE_MIN_RUN)
+#define RLE_MAX_LITERALS 128
+
+static const char *const codec_names[CODEC_COUNT] = {"none", "rle", "lz"};
+
+const char *codec_name(Codec codec) {
+    return codec < CODEC_COUNT ? codec_names[codec] : "unknown";
+}
+
+Codec codec_from_name(const char *name) {
+    for (int c = 0; c < CODEC_COUNT; c++)
+        if (strcmp(codec_names[c], name) == 0) return (Codec)c;
+    return CODEC_COUNT;
+}
+
+size_t codec_bound(Codec codec, size_t size) {
+    switch (codec) {
+        case CODEC_RLE:
+            return size + size / RLE_MAX_LITERALS + 1;
+        case CODEC_LZ:
+            return size + size / 255 + 16;
+        default:
+            return size;
+    }
+}
+
+// Element bytes regrouped by position (all first bytes, all second bytes..),
+// each plane delta coded. A tail shorter than stride is copied as is.
+static void plane_filter(const uint8_t *src, size_t size, size_t stride,
+                         uint8_t *dst) {
+    const size_t count = size / stride;
+    for (size_t b = 0; b < stride; b++) {
+        uint8_t prev = 0;
+        uint8_t *plane = &dst[b * count];
+        for (size_t i = 0; i < count; i++) {
+            const uint8_t v = src[i * stride + b];
+            plane[i] = (uint8_t)(v - prev);
+            prev = v;
+        }
+    }
+    memcpy(&dst[count * stride], &src[count * stride], size - count * stride);
+}
+
+static void plane_unfilter(const uint8_t *src, size_t size, size_t stride,
+                           uint8_t *dst) {
+    const size_t count = size / stride;
+    for (size_t b = 0; b < stride; b++) {
+        uint8_t prev = 0;
+        const uint8_t *plane = &src[b * count];
+        for (size_t i = 0; i < count; i++) {
+            prev = (uint8_t)(prev + plane[i]);
+            dst[i * stride + b] = prev;
+        }
+    }
+    memcpy(&dst[count * stride], &src[count * stride], size - count * stride);
+}
+
+static size_t rle_encode(const uint8_t *src, size_t size, uint8_t *dst) {
+    size_t out = 0, i = 0, literal_start = 0;
+    while (i <= size) {
+        size_t run = 1;
+        while (i + run < size && src[i + run] == src[i] && run < RLE_MAX_RUN)
+            run++;
+        const bool flush = i == size || run >= RLE_MIN_RUN ||
+                           i - literal_start == RLE_MAX_LITERALS;
+        if (flush && i > literal_start) {
+            const size_t n = i - literal_start;
+            dst[out++] = (uint8_t)(n - 1);
+            memcpy(&dst[out], &src[literal_start], n);
+            out += n;
+            literal_start = i;
+        }
+        if (i == size) break;
+        if (run >= RLE_MIN_RUN) {
+            dst[out++] = (uint8_t)(128 + run - RLE_MIN_RUN);
+            dst[out++] = src[i];
+            i += run;
+            literal_start = i;
+        } else {
+            i++;
+        }
+    }
+    return out;
+}
+
+static bool rle_decode(const uint8_t *src, size_t size, uint8_t *dst,
+                       size_t raw_size) {
+    size_t in = 0, out = 0;
+    while (in < size) {
+        const uint8_t c = src[in++];
+        if (c < 128) {
+            const size_t n = (size_t)c + 1;
+            if (in + n > size || out + n > raw_size) return false;
+            memcpy(&dst[out], &src[in], n);
+            in += n;
+            out += n;
+        } else {
+            const size_t n = (size_t)c - 128 + RLE_MIN_RUN;
+            if (in >= size || out + n > raw_size) return false;
+            memset(&dst[out], src[in++], n);
+            out += n;
+        }
+    }
+    return out == raw_size;
+}
+
+static inline uint32_t lz_hash(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Length nibble of a token, the rest as 255.. bytes
+static inline size_t lz_put_length(uint8_t *dst, size_t out, size_t n) {
+    for (n -= 15; n >= 255; n -= 255) dst[out++] = 255;
+    dst[out++] = (uint8_t)n;
+    return out;
+}
+
+static inline bool lz_get_length(const uint8_t *src, size_t size, size_t *in,
+                                 size_t *n) {
+    uint8_t b;
+    do {
+        if (*in >= size) return false;
+        b = src[(*in)++];
+        *n += b;
+    } while (b == 255);
+    return true;
+}
+
+// LZ4 style sequences: token (literal count << 4 | match length - 4),
+// literals, 2 byte offset, the last sequence has literals only
+static size_t lz_encode(const uint8_t *src, size_t size, uint8_t *dst) {
+    uint32_t *table = calloc(1u << LZ_HASH_BITS, sizeof(*table));
+    if (!table) return 0;
+    size_t out = 0, i = 0, anchor = 0;
+    while (i + LZ_MIN_MATCH <= size) {
+        const uint32_t h = lz_hash(&src[i]);
+        const size_t cand = table[h];
+        table[h] = (uint32_t)i;
+        if (cand >= i || i - cand > LZ_WINDOW ||
+            memcmp(&src[cand], &src[i], LZ_MIN_MATCH) != 0) {
+            i++;
+            continue;
+        }
+        size_t match = LZ_MIN_MATCH;
+        while (i + match < size && src[cand + match] == src[i + match])
+            match++;
+
+        const size_t literals = i - anchor;
+        const size_t ml = match - LZ_MIN_MATCH;
+        uint8_t *token = &dst[out++];
+        *token =
+            (uint8_t)((MIN(literals, (size_t)15) << 4) | MIN(ml, (size_t)15));
+        if (literals >= 15) out = lz_put_length(dst, out, literals);
+        memcpy(&dst[out], &src[anchor], literals);
+        out += literals;
+        const size_t offset = i - cand;
+        dst[out++] = (uint8_t)offset;
+        dst[out++] = (uint8_t)(offset >> 8);
+        if (ml >= 15) out = lz_put_length(dst, out, ml);
+
+        i += match;
+        anchor = i;
+    }
+    const size_t literals = size - anchor;
+    dst[out++] = (uint8_t)(MIN(literals, (size_t)15) << 4);
+    if (literals >= 15) out = lz_put_length(dst, out, literals);
+    memcpy(&dst[out], &src[anchor], literals);
+    out += literals;
+    free(table);
+    return out;
+}
+
+static bool lz_decode(const uint8_t *src, size_t size, uint8_t *dst,
+                      size_t raw_size) {
+    size_t in = 0, out = 0;
+    while (in < size) {
+        const uint8_t token = src[in++];
+        size_t literals = token >> 4;
+        if (literals == 15 && !lz_get_length(src, size, &in, &literals))
+            return false;
+        if (in + literals > size || out + literals > raw_size) return false;
+        memcpy(&dst[out], &src[in], literals);
+        in += literals;
+        out += literals;
+        if (in == size) break;  // last sequence
+
+        if (in + 2 > size) return false;
+        const size_t offset = src[in] | (size_t)src[in + 1] << 8;
+        in += 2;
+        size_t match = token & 15;
+        if (match == 15 && !lz_get_length(src, size, &in, &match))
+            return false;
+        match += LZ_MIN_MATCH;
+        if (offset == 0 || offset > out || out + match > raw_size)
+            return false;
+        // byte by byte, matches may overlap their own output
+        for (size_t k = 0; k < match; k++, out++) dst[out] = dst[out - offset];
+    }
+    return out == raw_size;
+}
+
+size_t codec_encode(Codec codec, const void *src, size_t size, size_t stride,
+                    uint8_t *dst) {
+    if (codec == CODEC_NONE || codec >= CODEC_COUNT || size == 0) return 0;
+    const uint8_t *bytes = src;
+    uint8_t *filtered = NULL;
+    if (stride > 1) {
+        filtered = malloc(size);
+        if (!filtered) return 0;
+        plane_filter(bytes, size, stride, filtered);
+        bytes = filtered;
+    }
+    const size_t n = codec == CODEC_RLE ? rle_encode(bytes, size, dst)
+                                        : lz_encode(bytes, size, dst);
+    free(filtered);
+    return n < size ? n : 0;
+}
+
+bool codec_decode(Codec codec, const uint8_t *src, size_t size, size_t stride,
+                  void *dst, size_t raw_size) {
+    if (codec == CODEC_NONE) {
+        if (size != raw_size) return false;
+        memcpy(dst, src, size);
+        return true;
+    }
+    if (codec >= CODEC_COUNT) return false;
+
+    uint8_t *bytes = dst;
+    uint8_t *filtered = NULL;
+    if (stride > 1) {
+        filtered = malloc(raw_size);
+        if (!filtered) return false;
+        bytes = filtered;
+    }
+    bool ok = codec == CODEC_RLE ? rle_decode(src, size, bytes, raw_size)
+                                 : lz_decode(src, size, bytes, raw_size);
+    if (ok && filtered) plane_unfilter(filtered, raw_size, stride, dst);
+    free(filtered);
+    return ok;
+}
+
+void codec_stats_log(const CodecStats *s, const char *what) {
+    const uint64_t transfers = atomic_load(&s->transfers);
+    if (transfers == 0) return;
+    const double raw = (double)atomic_load(&s->raw_bytes);
+    const double wire = (double)atomic_load(&s->wire_bytes);
+    Log(Log_Info,
+        "%s: %llu transfers, %.2f MB as %.2f MB (%.0f%% saved), codec %.1f ms",
+        what, (unsigned long long)transfers, raw / (1024.0 * 1024.0),
+        wire / (1024.0 * 1024.0), raw > 0 ? 100.0 * (1.0 - wire / raw) : 0.0,
+        (double)atomic_load(&s->codec_us) / 1000.0);
+}
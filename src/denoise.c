@@ -0,0 +1,291 @@
+#include "denoise.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "pool.h"
+#include "utils.h"
+#include "vec.h"
+
+// Smallest albedo/luminance divided by when demodulating
+#define DENOISE_MIN_ALBEDO 1e-3f
+
+typedef struct Denoiser Denoiser;
+typedef void (*TileStage)(Denoiser *dn, int tile_idx);
+
+struct Denoiser {
+    const Work *work;
+    const DenoiseConfig *cfg;
+
+    // guides, resolved from work->aov
+    Colour *albedo;
+    V3f *normal;
+    float *depth;
+
+    // ping-pong buffers, iteration i reads [src] and writes [src ^ 1]
+    Colour *illum[2];  // colour with the albedo divided out
+    float *variance[2];
+    int src;
+    int step;  // tap spacing in pixels, doubles every iteration
+
+    TileStage stage;
+};
+
+// B3 spline taps, the a-trous scaling function
+static const float kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4,
+                                1.0f / 16};
+
+// Euclidean length of each 5x5 tap offset, 1 at the centre (its depth
+// difference is 0 anyway)
+static const float tap_dist[5][5] = {
+    {2.828427f, 2.236068f, 2.0f, 2.236068f, 2.828427f},
+    {2.236068f, 1.414214f, 1.0f, 1.414214f, 2.236068f},
+    {2.0f, 1.0f, 1.0f, 1.0f, 2.0f},
+    {2.236068f, 1.414214f, 1.0f, 1.414214f, 2.236068f},
+    {2.828427f, 2.236068f, 2.0f, 2.236068f, 2.828427f},
+};
+
+// log of the edge stopping weight between centre p and tap q, dist is the
+// tap offset in pixels. Summing logs keeps it to one expf per tap.
+static inline float edge_log_weight(const Denoiser *dn, int p, int q,
+                                    float depth_scale, float dist) {
+    const float cos_n = v3f_dot(dn->normal[p], dn->normal[q]);
+    const float ln = dn->cfg->sigma_normal * logf(MAX(cos_n, 1e-8f));
+    const float ez = fabsf(dn->depth[p] - dn->depth[q]) * depth_scale / dist;
+    return ln - ez;
+}
+
+// Normalize the sums in accum/aov and demodulate. The per pixel luminance
+// variance of the mean comes from the summed squares.
+static void prepare_tile(Denoiser *dn, int tile_idx) {
+    const Work *work = dn->work;
+    const Tile tile = work->tiles[tile_idx];
+    const int samples = work->tile_samples[tile_idx];
+    const float inv = samples > 0 ? 1.0f / samples : 0.0f;
+
+    for (int j = tile.y; j < tile.y + tile.th; j++) {
+        for (int i = tile.x; i < tile.x + tile.tw; i++) {
+            const size_t idx = j * work->width + i;
+            const float *c = &work->accum[idx * 3];
+            const PixelAov *aov = &work->aov[idx];
+
+            const Colour colour = v3f_mulf((Colour){c[0], c[1], c[2]}, inv);
+            const Colour albedo = v3f_mulf(aov->albedo, inv);
+            dn->albedo[idx] = albedo;
+            dn->normal[idx] = v3f_normalize(aov->normal);
+            dn->depth[idx] = aov->depth * inv;
+
+            const float lum = v3f_luminance(colour);
+            const float var = MAX(0.0f, aov->lum_sq * inv - lum * lum) * inv;
+            const float albedo_lum =
+                MAX(v3f_luminance(albedo), DENOISE_MIN_ALBEDO);
+
+            dn->illum[0][idx] = (Colour){
+                colour.x / MAX(albedo.x, DENOISE_MIN_ALBEDO),
+                colour.y / MAX(albedo.y, DENOISE_MIN_ALBEDO),
+                colour.z / MAX(albedo.z, DENOISE_MIN_ALBEDO)};
+            dn->variance[0][idx] = var / (albedo_lum * albedo_lum);
+        }
+    }
+}
+
+// Few samples per pixel give a poor (often zero) variance, so also take the
+// luminance variance over the surrounding 5x5 pixels of the same surface
+static void estimate_variance_tile(Denoiser *dn, int tile_idx) {
+    const Work *work = dn->work;
+    const Tile tile = work->tiles[tile_idx];
+    const int width = work->width;
+    const int height = work->height;
+    const Colour *illum = dn->illum[0];
+
+    for (int y = tile.y; y < tile.y + tile.th; y++) {
+        for (int x = tile.x; x < tile.x + tile.tw; x++) {
+            const int p = y * width + x;
+            const float depth_scale =
+                1.0f / (dn->cfg->sigma_depth * dn->depth[p] + 1e-4f);
+
+            float m1 = 0, m2 = 0, wsum = 0;
+            for (int dy = -2; dy <= 2; dy++) {
+                const int qy = y + dy;
+                if (qy < 0 || qy >= height) continue;
+                for (int dx = -2; dx <= 2; dx++) {
+                    const int qx = x + dx;
+                    if (qx < 0 || qx >= width) continue;
+                    const int q = qy * width + qx;
+                    const float w = expf(edge_log_weight(
+                        dn, p, q, depth_scale, tap_dist[dy + 2][dx + 2]));
+                    const float l = v3f_luminance(illum[q]);
+                    m1 += w * l;
+                    m2 += w * l * l;
+                    wsum += w;
+                }
+            }
+            float spatial = 0;
+            if (wsum > 0) {
+                m1 /= wsum;
+                spatial = m2 / wsum - m1 * m1;
+            }
+            dn->variance[1][p] = MAX(dn->variance[0][p], spatial);
+        }
+    }
+}
+
+// 3x3 gaussian of the variance around (x, y), one sample count is too noisy
+// to steer the luminance stop on its own
+static float blurred_variance(const Denoiser *dn, int x, int y) {
+    const float *var = dn->variance[dn->src];
+    const int width = dn->work->width;
+    const int height = dn->work->height;
+    static const float g[2] = {0.25f, 0.125f};  // centre, edge
+
+    float sum = 0, wsum = 0;
+    for (int dy = -1; dy <= 1; dy++) {
+        for (int dx = -1; dx <= 1; dx++) {
+            const int qx = x + dx, qy = y + dy;
+            if (qx < 0 || qy < 0 || qx >= width || qy >= height) continue;
+            const float w = g[abs(dx)] * g[abs(dy)];
+            sum += w * var[qy * width + qx];
+            wsum += w;
+        }
+    }
+    return sum / wsum;
+}
+
+// One a-trous iteration: 5x5 B3 taps spaced dn->step apart, each weighted by
+// how alike its normal, depth and luminance are to the centre pixel
+static void atrous_tile(Denoiser *dn, int tile_idx) {
+    const Work *work = dn->work;
+    const DenoiseConfig *cfg = dn->cfg;
+    const Tile tile = work->tiles[tile_idx];
+    const int width = work->width;
+    const int height = work->height;
+    const int step = dn->step;
+
+    const Colour *illum = dn->illum[dn->src];
+    const float *variance = dn->variance[dn->src];
+    Colour *illum_out = dn->illum[dn->src ^ 1];
+    float *variance_out = dn->variance[dn->src ^ 1];
+
+    for (int y = tile.y; y < tile.y + tile.th; y++) {
+        for (int x = tile.x; x < tile.x + tile.tw; x++) {
+            const int p = y * width + x;
+            const Colour ip = illum[p];
+            const float lp = v3f_luminance(ip);
+            const float lum_scale =
+                1.0f / (cfg->sigma_luminance *
+                            sqrtf(blurred_variance(dn, x, y)) +
+                        1e-4f);
+            const float depth_scale =
+                1.0f / (cfg->sigma_depth * dn->depth[p] * step + 1e-4f);
+
+            // the centre always counts fully, pixels without guides (no
+            // samples yet) then pass through unchanged
+            const float h0 = kernel[2] * kernel[2];
+            Colour sum = v3f_mulf(ip, h0);
+            float wsum = h0;
+            float vsum = h0 * h0 * variance[p];
+
+            for (int dy = -2; dy <= 2; dy++) {
+                const int qy = y + dy * step;
+                if (qy < 0 || qy >= height) continue;
+                for (int dx = -2; dx <= 2; dx++) {
+                    const int qx = x + dx * step;
+                    if ((dx == 0 && dy == 0) || qx < 0 || qx >= width)
+                        continue;
+                    const int q = qy * width + qx;
+
+                    const float el =
+                        fabsf(lp - v3f_luminance(illum[q])) * lum_scale;
+                    const float w =
+                        kernel[dx + 2] * kernel[dy + 2] *
+                        expf(edge_log_weight(dn, p, q, depth_scale,
+                                             tap_dist[dy + 2][dx + 2]) -
+                             el);
+
+                    sum = v3f_add(sum, v3f_mulf(illum[q], w));
+                    wsum += w;
+                    vsum += w * w * variance[q];
+                }
+            }
+
+            illum_out[p] = v3f_divf(sum, wsum);
+            variance_out[p] = vsum / (wsum * wsum);
+        }
+    }
+}
+
+// Put the albedo back into the output image
+static void finish_tile(Denoiser *dn, int tile_idx) {
+    const Work *work = dn->work;
+    const Tile tile = work->tiles[tile_idx];
+    const Colour *illum = dn->illum[dn->src];
+
+    for (int j = tile.y; j < tile.y + tile.th; j++) {
+        for (int i = tile.x; i < tile.x + tile.tw; i++) {
+            const size_t idx = j * work->width + i;
+            const Colour albedo = dn->albedo[idx];
+            float *dst = &work->image[idx * 3];
+            dst[0] = illum[idx].x * MAX(albedo.x, DENOISE_MIN_ALBEDO);
+            dst[1] = illum[idx].y * MAX(albedo.y, DENOISE_MIN_ALBEDO);
+            dst[2] = illum[idx].z * MAX(albedo.z, DENOISE_MIN_ALBEDO);
+        }
+    }
+}
+
+static void stage_tiles(void *ctx, int begin, int end) {
+    Denoiser *dn = ctx;
+    for (int t = begin; t < end; t++) dn->stage(dn, t);
+}
+
+// Run stage over every tile on the pool, returns once all are done
+static void run_stage(Denoiser *dn, TileStage stage) {
+    dn->stage = stage;
+    pool_parallel_for(dn->work->tile_count, 1, stage_tiles, dn);
+}
+
+void denoise_image(const Work *work, const DenoiseConfig *cfg) {
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    const size_t pixels = work->width * work->height;
+    Denoiser dn = {.work = work, .cfg = cfg};
+    dn.albedo = malloc(pixels * sizeof(*dn.albedo));
+    dn.normal = malloc(pixels * sizeof(*dn.normal));
+    dn.depth = malloc(pixels * sizeof(*dn.depth));
+    for (int k = 0; k < 2; k++) {
+        dn.illum[k] = malloc(pixels * sizeof(*dn.illum[k]));
+        dn.variance[k] = malloc(pixels * sizeof(*dn.variance[k]));
+    }
+    if (!dn.albedo || !dn.normal || !dn.depth || !dn.illum[0] ||
+        !dn.illum[1] || !dn.variance[0] || !dn.variance[1]) {
+        Log(Log_Error, "denoise_image: malloc failed, writing noisy image");
+        resolve_accum(work);
+        goto cleanup;
+    }
+
+    run_stage(&dn, prepare_tile);
+    run_stage(&dn, estimate_variance_tile);
+    float *estimate = dn.variance[1];
+    dn.variance[1] = dn.variance[0];
+    dn.variance[0] = estimate;
+    for (int i = 0; i < cfg->iterations; i++) {
+        dn.step = 1 << i;
+        run_stage(&dn, atrous_tile);
+        dn.src ^= 1;
+    }
+    run_stage(&dn, finish_tile);
+
+    gettimeofday(&end, NULL);
+    Log(Log_Info, "denoise_image: %d iterations in %.0fms", cfg->iterations,
+        timersub_ms(&end, &start));
+
+cleanup:
+    free(dn.albedo);
+    free(dn.normal);
+    free(dn.depth);
+    for (int k = 0; k < 2; k++) {
+        free(dn.illum[k]);
+        free(dn.variance[k]);
+    }
+}
@@ -1,77 +1,289 @@
 #include "imagerw.h"
 
+#include <errno.h>
+#include <math.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "pool.h"
 #include "stb_image_write.h"
 #include "utils.h"
 
-void export_ppm(const char *output_file_name, const uint32_t *image,
-                const size_t width, const size_t height) {
+// Tile edge of the EXR output
+#define EXR_TILE_SIZE ((size_t)64)
+
+// Pixels per tonemap task
+#define TONEMAP_CHUNK ((size_t)16384)
+
+static inline uint8_t encode_8bit(float v) {
+    return (uint8_t)(sqrtf(clamp_float(v, 0, 1)) * 255);  // gamma 2
+}
+
+// One loop per operator, each vectorizes on its own
+void tonemap_rgb8(const float *restrict rgb, size_t pixel_count,
+                  const Tonemap *tm, uint8_t *restrict out) {
+    const size_t n = pixel_count * 3;
+    const float scale = exp2f(tm->exposure);
+
+    switch (tm->op) {
+        case TONEMAP_CLAMP:
+            for (size_t i = 0; i < n; i++) out[i] = encode_8bit(rgb[i] * scale);
+            break;
+        case TONEMAP_REINHARD:
+            for (size_t i = 0; i < n; i++) {
+                const float v = rgb[i] * scale;
+                out[i] = encode_8bit(v / (1 + v));
+            }
+            break;
+        case TONEMAP_ACES:  // Narkowicz's fit of the ACES filmic curve
+            for (size_t i = 0; i < n; i++) {
+                const float v = rgb[i] * scale;
+                out[i] = encode_8bit((v * (2.51f * v + 0.03f)) /
+                                     (v * (2.43f * v + 0.59f) + 0.14f));
+            }
+            break;
+    }
+}
+
+typedef struct {
+    const float *image;
+    const Tonemap *tm;
+    uint8_t *out;
+} TonemapJob;
+
+static void tonemap_chunks(void *ctx, int begin, int end) {
+    const TonemapJob *job = ctx;
+    const size_t first = (size_t)begin * TONEMAP_CHUNK;
+    tonemap_rgb8(&job->image[first * 3],
+                 (size_t)(end - begin) * TONEMAP_CHUNK, job->tm,
+                 &job->out[first * 3]);
+}
+
+// Tonemap on the pool, whole chunks of TONEMAP_CHUNK pixels then the rest
+static uint8_t *tonemap_image(const char *ctx, const float *image,
+                              size_t pixel_count, const Tonemap *tm) {
+    uint8_t *rgb8 = malloc(pixel_count * 3);
+    if (rgb8 == NULL) {
+        Log(Log_Error, "%s: Memory allocation failed", ctx);
+        return NULL;
+    }
+    TonemapJob job = {.image = image, .tm = tm, .out = rgb8};
+    const size_t chunks = pixel_count / TONEMAP_CHUNK;
+    pool_parallel_for((int)chunks, 1, tonemap_chunks, &job);
+    const size_t done = chunks * TONEMAP_CHUNK;
+    tonemap_rgb8(&image[done * 3], pixel_count - done, tm, &rgb8[done * 3]);
+    return rgb8;
+}
+
+static FILE *open_output(const char *ctx, const char *output_file_name) {
     FILE *f = fopen(output_file_name, "wb");
-    if (f == NULL) {
-        Log(Log_Error, temp_sprintf("export_ppm: %s", strerror(errno)));
-        exit(1);
+    if (f == NULL)
+        Log(Log_Error, "%s: %s: %s", ctx, output_file_name, strerror(errno));
+    return f;
+}
+
+// Closes f, false (logged) if any write to it failed
+static bool close_output(const char *ctx, FILE *f) {
+    const bool failed = ferror(f) != 0;
+    if (fclose(f) != 0 || failed) {
+        Log(Log_Error, "%s: Write failed: %s", ctx, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool export_ppm(const char *output_file_name, const float *image,
+                const size_t width, const size_t height, const Tonemap *tm) {
+    uint8_t *rgb8 = tonemap_image("export_ppm", image, width * height, tm);
+    if (!rgb8) return false;
+    FILE *f = open_output("export_ppm", output_file_name);
+    if (!f) {
+        free(rgb8);
+        return false;
     }
 
     fprintf(f, "P6\n");
     fprintf(f, "%zu %zu\n", width, height);
     fprintf(f, "255\n");
+    fwrite(rgb8, 3, width * height, f);
+
+    free(rgb8);
+    return close_output("export_ppm", f);
+}
 
-    for (size_t i = 0; i < height; i++) {
-        for (size_t j = 0; j < width; j++) {
-            uint32_t pixel = image[i * width + j];
+bool export_png(const char *output_file_name, const float *image,
+                const size_t width, const size_t height, const Tonemap *tm) {
+    uint8_t *rgb8 = tonemap_image("export_png", image, width * height, tm);
+    if (!rgb8) return false;
+    const int written =
+        stbi_write_png(output_file_name, width, height, 3, rgb8, width * 3);
+    free(rgb8);
+    if (!written)
+        Log(Log_Error, "export_png: Cannot write %s", output_file_name);
+    return written != 0;
+}
 
-            uint8_t r = (pixel >> 16) & 0xFF;
-            uint8_t g = (pixel >> 8) & 0xFF;
-            uint8_t b = pixel & 0xFF;
+// Portable float map, little endian (negative scale) rgb, bottom row first
+bool export_pfm(const char *output_file_name, const float *image,
+                const size_t width, const size_t height) {
+    FILE *f = open_output("export_pfm", output_file_name);
+    if (!f) return false;
 
-            fwrite(&r, sizeof(uint8_t), 1, f);
-            fwrite(&g, sizeof(uint8_t), 1, f);
-            fwrite(&b, sizeof(uint8_t), 1, f);
-        }
+    fprintf(f, "PF\n");
+    fprintf(f, "%zu %zu\n", width, height);
+    fprintf(f, "-1.0\n");
+    for (size_t j = height; j-- > 0;) {
+        fwrite(&image[j * width * 3], sizeof(float), width * 3, f);
     }
-    fclose(f);
+
+    return close_output("export_pfm", f);
+}
+
+// NOTE: the EXR writer assumes a little endian host, like the file format
+static void exr_attribute(FILE *f, const char *name, const char *type,
+                          uint32_t size, const void *value) {
+    fwrite(name, strlen(name) + 1, 1, f);
+    fwrite(type, strlen(type) + 1, 1, f);
+    fwrite(&size, sizeof(size), 1, f);
+    fwrite(value, size, 1, f);
 }
 
-void export_png(const char *output_file_name, const uint32_t *image,
+// Single part, one level tiled OpenEXR with uncompressed FLOAT B, G, R
+// channels (stored in alphabetical order)
+bool export_exr(const char *output_file_name, const float *image,
                 const size_t width, const size_t height) {
-    uint32_t *converted_image =
-        (uint32_t *)malloc(width * height * sizeof(uint32_t));
-    if (converted_image == NULL) {
-        Log(Log_Error, temp_sprintf("export_png: Memory allocation failed"));
-        exit(1);
+    FILE *f = open_output("export_exr", output_file_name);
+    if (!f) return false;
+
+    const uint32_t magic = 20000630;
+    const uint32_t version = 2 | 0x200;  // format 2, single part tiled
+    fwrite(&magic, sizeof(magic), 1, f);
+    fwrite(&version, sizeof(version), 1, f);
+
+    // name, pixel type (2 = FLOAT), pLinear + reserved, x/y sampling
+    uint8_t chlist[3 * 18 + 1] = {0};
+    const char *channel_names = "BGR";
+    for (int c = 0; c < 3; c++) {
+        uint8_t *ch = &chlist[c * 18];
+        const int32_t desc[4] = {2, 0, 1, 1};
+        ch[0] = channel_names[c];
+        memcpy(&ch[2], desc, sizeof(desc));
     }
 
-    for (size_t i = 0; i < width * height; i++) {
-        uint32_t pixel = image[i];
-        uint8_t a = (pixel >> 24) & 0xFF;
-        uint8_t r = (pixel >> 16) & 0xFF;
-        uint8_t g = (pixel >> 8) & 0xFF;
-        uint8_t b = (pixel >> 0) & 0xFF;
+    const int32_t window[4] = {0, 0, (int32_t)width - 1, (int32_t)height - 1};
+    const uint8_t no_compression = 0;
+    const uint8_t increasing_y = 0;
+    const float one = 1.0f;
+    const float centre[2] = {0, 0};
+    uint8_t tiledesc[9] = {0};  // x size, y size, ONE_LEVEL | ROUND_DOWN
+    const uint32_t tile_size[2] = {EXR_TILE_SIZE, EXR_TILE_SIZE};
+    memcpy(tiledesc, tile_size, sizeof(tile_size));
+
+    exr_attribute(f, "channels", "chlist", sizeof(chlist), chlist);
+    exr_attribute(f, "compression", "compression", 1, &no_compression);
+    exr_attribute(f, "dataWindow", "box2i", sizeof(window), window);
+    exr_attribute(f, "displayWindow", "box2i", sizeof(window), window);
+    exr_attribute(f, "lineOrder", "lineOrder", 1, &increasing_y);
+    exr_attribute(f, "pixelAspectRatio", "float", sizeof(one), &one);
+    exr_attribute(f, "screenWindowCenter", "v2f", sizeof(centre), centre);
+    exr_attribute(f, "screenWindowWidth", "float", sizeof(one), &one);
+    exr_attribute(f, "tiles", "tiledesc", sizeof(tiledesc), tiledesc);
+    fputc(0, f);
 
-        converted_image[i] = (a << 24) | (b << 16) | (g << 8) | r;
+    // offset table, tiles follow it in row major order
+    const size_t tiles_x = (width + EXR_TILE_SIZE - 1) / EXR_TILE_SIZE;
+    const size_t tiles_y = (height + EXR_TILE_SIZE - 1) / EXR_TILE_SIZE;
+    uint64_t offset = (uint64_t)ftell(f) + tiles_x * tiles_y * sizeof(offset);
+    for (size_t ty = 0; ty < tiles_y; ty++) {
+        for (size_t tx = 0; tx < tiles_x; tx++) {
+            const size_t tw = MIN(EXR_TILE_SIZE, width - tx * EXR_TILE_SIZE);
+            const size_t th = MIN(EXR_TILE_SIZE, height - ty * EXR_TILE_SIZE);
+            fwrite(&offset, sizeof(offset), 1, f);
+            offset += 5 * sizeof(int32_t) + tw * th * 3 * sizeof(float);
+        }
     }
 
-    stbi_write_png(output_file_name, width, height, 4, (void *)converted_image,
-                   width * 4);
+    float line[EXR_TILE_SIZE * 3];
+    for (size_t ty = 0; ty < tiles_y; ty++) {
+        for (size_t tx = 0; tx < tiles_x; tx++) {
+            const size_t x0 = tx * EXR_TILE_SIZE;
+            const size_t y0 = ty * EXR_TILE_SIZE;
+            const size_t tw = MIN(EXR_TILE_SIZE, width - x0);
+            const size_t th = MIN(EXR_TILE_SIZE, height - y0);
+            const int32_t header[5] = {(int32_t)tx, (int32_t)ty, 0, 0,
+                                       (int32_t)(tw * th * 3 * sizeof(float))};
+            fwrite(header, sizeof(header), 1, f);
 
-    free(converted_image);
+            // each scanline holds all of B, then G, then R
+            for (size_t y = y0; y < y0 + th; y++) {
+                const float *src = &image[(y * width + x0) * 3];
+                for (size_t i = 0; i < tw; i++) {
+                    line[i] = src[i * 3 + 2];
+                    line[tw + i] = src[i * 3 + 1];
+                    line[2 * tw + i] = src[i * 3 + 0];
+                }
+                fwrite(line, sizeof(float), tw * 3, f);
+            }
+        }
+    }
+
+    return close_output("export_exr", f);
+}
+
+// The one %d (with optional zero padding / width) of a frame name pattern, or
+// NULL. Patterns can arrive over the network, so anything else is rejected.
+static const char *frame_conversion(const char *pattern) {
+    const char *conversion = NULL;
+    for (const char *p = pattern; (p = strchr(p, '%')); p++) {
+        const char *q = p + 1;
+        while (*q >= '0' && *q <= '9') q++;
+        if (*q != 'd' || conversion) return NULL;
+        conversion = p;
+        p = q;
+    }
+    return conversion;
+}
+
+char *frame_file_name(const char *pattern, int frame) {
+    const size_t len = strlen(pattern) + 32;
+    char *name = malloc(len);
+    if (!name) {
+        Log(Log_Error, "frame_file_name: Memory allocation failed");
+        exit(1);
+    }
+    if (frame_conversion(pattern)) {
+        snprintf(name, len, pattern, frame);
+        return name;
+    }
+    const char *dot = strrchr(pattern, '.');
+    const char *slash = strrchr(pattern, '/');
+    if (!dot || (slash && slash > dot)) dot = pattern + strlen(pattern);
+    snprintf(name, len, "%.*s_%04d%s", (int)(dot - pattern), pattern, frame,
+             dot);
+    return name;
 }
 
-void export_image(const char *output_file_name, const uint32_t *image,
-                  const size_t width, const size_t height) {
+bool export_image(const char *output_file_name, const float *image,
+                  const size_t width, const size_t height, const Tonemap *tm) {
+    bool written;
     if (strstr(output_file_name, ".png") != NULL) {
-        export_png(output_file_name, image, width, height);
+        written = export_png(output_file_name, image, width, height, tm);
     } else if (strstr(output_file_name, ".ppm") != NULL) {
-        export_ppm(output_file_name, image, width, height);
+        written = export_ppm(output_file_name, image, width, height, tm);
+    } else if (strstr(output_file_name, ".pfm") != NULL) {
+        written = export_pfm(output_file_name, image, width, height);
+    } else if (strstr(output_file_name, ".exr") != NULL) {
+        written = export_exr(output_file_name, image, width, height);
     } else {
         Log(Log_Warn,
             "Output format not supported, outputting ppm instead with the same "
             "name");
-        export_ppm(output_file_name, image, width, height);
+        written = export_ppm(output_file_name, image, width, height, tm);
     }
+    if (!written) return false;
 
     Log(Log_Info, temp_sprintf("export_image: Successfully written %s",
                                output_file_name));
+    return true;
 }
@@ -0,0 +1,458 @@
+#include "light.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "aabb.h"
+#include "sampling.h"
+
+// Split candidates per axis when building
+#define LIGHT_BUCKETS 12
+
+// Past this depth split by count, keeps every trail within 64 bits
+#define LIGHT_MAX_SAH_DEPTH 32
+
+#define ONE_MINUS_EPS 0x1.fffffep-1f
+
+typedef struct {
+    LightBounds bounds;
+    V3f centroid;
+    int light;
+} BuildItem;
+
+static inline float safe_sqrt(float x) { return sqrtf(MAX(0.0f, x)); }
+
+static inline float v3f_axis(V3f v, int dim) {
+    return dim == 0 ? v.x : dim == 1 ? v.y : v.z;
+}
+
+static inline V3f box_lo(AABB b) { return (V3f){b.xmin, b.ymin, b.zmin}; }
+static inline V3f box_hi(AABB b) { return (V3f){b.xmax, b.ymax, b.zmax}; }
+
+static float box_area(AABB b) {
+    const V3f d = v3f_sub(box_hi(b), box_lo(b));
+    return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+// Angle between unit vectors, stable near 0 and PI
+static float angle_between(V3f a, V3f b) {
+    if (v3f_dot(a, b) < 0)
+        return PI - 2 * asinf(MIN(1.0f, v3f_length(v3f_add(a, b)) / 2));
+    return 2 * asinf(MIN(1.0f, v3f_length(v3f_sub(b, a)) / 2));
+}
+
+// Rotate v around unit axis k by theta (Rodrigues)
+static V3f rotate(V3f v, V3f k, float theta) {
+    const float c = cosf(theta), s = sinf(theta);
+    return v3f_add(v3f_add(v3f_mulf(v, c), v3f_mulf(v3f_cross(k, v), s)),
+                   v3f_mulf(k, v3f_dot(k, v) * (1 - c)));
+}
+
+// Smallest cone holding both normal cones
+static void cone_union(V3f wa, float cos_a, V3f wb, float cos_b, V3f *w,
+                       float *cos_o) {
+    *w = (V3f){0, 0, 1};
+    *cos_o = -1;
+    if (cos_a <= -1 || cos_b <= -1) return;
+
+    const float theta_a = acosf(clamp_float(cos_a, -1, 1));
+    const float theta_b = acosf(clamp_float(cos_b, -1, 1));
+    const float theta_d = angle_between(wa, wb);
+    if (MIN(theta_d + theta_b, PI) <= theta_a) {
+        *w = wa;
+        *cos_o = cos_a;
+        return;
+    }
+    if (MIN(theta_d + theta_a, PI) <= theta_b) {
+        *w = wb;
+        *cos_o = cos_b;
+        return;
+    }
+
+    const float theta_o = (theta_a + theta_d + theta_b) / 2;
+    const V3f wr = v3f_cross(wa, wb);
+    if (theta_o >= PI || v3f_slength(wr) == 0) return;
+    *w = rotate(wa, v3f_normalize(wr), theta_o - theta_a);
+    *cos_o = cosf(theta_o);
+}
+
+static LightBounds bounds_union(const LightBounds *a, const LightBounds *b) {
+    LightBounds u = {.box = aabb_join(a->box, b->box),
+                     .cos_e = MIN(a->cos_e, b->cos_e),
+                     .power = a->power + b->power};
+    cone_union(a->axis, a->cos_o, b->axis, b->cos_o, &u.axis, &u.cos_o);
+    return u;
+}
+
+// Surface area orientation heuristic of a candidate child, dim is the split
+// axis of the parent box
+static float bounds_cost(const LightBounds *b, AABB parent, int dim) {
+    const float theta_o = acosf(clamp_float(b->cos_o, -1, 1));
+    const float theta_e = acosf(clamp_float(b->cos_e, -1, 1));
+    const float theta_w = MIN(theta_o + theta_e, PI);
+    const float sin_o = safe_sqrt(1 - b->cos_o * b->cos_o);
+    const float m_omega =
+        2 * PI * (1 - b->cos_o) +
+        PI / 2 *
+            (2 * theta_w * sin_o - cosf(theta_o - 2 * theta_w) -
+             2 * theta_o * sin_o + b->cos_o);
+
+    const V3f d = v3f_sub(box_hi(parent), box_lo(parent));
+    const float max_extent = MAX(d.x, MAX(d.y, d.z));
+    const float kr = max_extent / MAX(v3f_axis(d, dim), 1e-6f);
+    return b->power * m_omega * kr * box_area(b->box);
+}
+
+// cos(max(0, a - b)) and sin(max(0, a - b)) from the sines and cosines
+static inline float cos_sub_clamped(float sin_a, float cos_a, float sin_b,
+                                    float cos_b) {
+    if (cos_a > cos_b) return 1;
+    return cos_a * cos_b + sin_a * sin_b;
+}
+
+static inline float sin_sub_clamped(float sin_a, float cos_a, float sin_b,
+                                    float cos_b) {
+    if (cos_a > cos_b) return 0;
+    return sin_a * cos_b - cos_a * sin_b;
+}
+
+// Upper bound on what the lights in b can send to p, on the side of n
+static float importance(const LightBounds *b, V3f p, V3f n) {
+    const V3f lo = box_lo(b->box), hi = box_hi(b->box);
+    const V3f pc = v3f_mulf(v3f_add(lo, hi), 0.5f);
+    const float dist2 = v3f_slength(v3f_sub(p, pc));
+    const float d2 = MAX(dist2, v3f_length(v3f_sub(hi, lo)) / 2);
+    const V3f wi = v3f_normalize(v3f_sub(p, pc));
+
+    // emitters are two sided, either face may point at p
+    const float cos_w = fabsf(v3f_dot(b->axis, wi));
+    const float sin_w = safe_sqrt(1 - cos_w * cos_w);
+
+    // half angle of the box's bounding sphere seen from p
+    const float r2 = v3f_slength(v3f_sub(hi, pc));
+    const float cos_b = dist2 < r2 ? -1 : safe_sqrt(1 - r2 / dist2);
+    const float sin_b = safe_sqrt(1 - cos_b * cos_b);
+
+    const float sin_o = safe_sqrt(1 - b->cos_o * b->cos_o);
+    const float cos_x = cos_sub_clamped(sin_w, cos_w, sin_o, b->cos_o);
+    const float sin_x = sin_sub_clamped(sin_w, cos_w, sin_o, b->cos_o);
+    const float cos_p = cos_sub_clamped(sin_x, cos_x, sin_b, cos_b);
+    if (cos_p <= b->cos_e) return 0;
+
+    // receivers are one sided
+    const float cos_i = -v3f_dot(n, wi);
+    const float sin_i = safe_sqrt(1 - cos_i * cos_i);
+    const float cos_pi = cos_sub_clamped(sin_i, cos_i, sin_b, cos_b);
+    return MAX(0.0f, b->power * cos_p * cos_pi / d2);
+}
+
+static LightBounds light_bounds(const Light *light) {
+    const float power = v3f_luminance(light->emission) * light->area * PI;
+    LightBounds b = {
+        .axis = light->normal, .cos_o = 1, .cos_e = 0, .power = power};
+    switch (light->shape) {
+        case LIGHT_SPHERE: {
+            const Sphere *s = light->data;
+            const V3f r = {s->radius, s->radius, s->radius};
+            b.box = aabb(v3f_sub(s->center, r), v3f_add(s->center, r));
+            b.axis = (V3f){0, 0, 1};
+            b.cos_o = -1;
+        } break;
+        case LIGHT_QUAD: {
+            const Quad *q = light->data;
+            b.box = aabb_join(
+                aabb(q->corner, v3f_add(q->corner, v3f_add(q->u, q->v))),
+                aabb(v3f_add(q->corner, q->u), v3f_add(q->corner, q->v)));
+        } break;
+        case LIGHT_TRIANGLE: {
+            const Triangle *t = light->data;
+            b.box = aabb_join(aabb(t->v1.v, t->v2.v), aabb(t->v3.v, t->v3.v));
+        } break;
+    }
+    return b;
+}
+
+// Bucket of a centroid along dim, centroid bounds [lo, lo + extent]
+static inline int bucket_of(float c, float lo, float extent) {
+    const int b = (int)(LIGHT_BUCKETS * (c - lo) / extent);
+    return clamp_int(b, 0, LIGHT_BUCKETS - 1);
+}
+
+// Pick the cheapest bucket boundary over all axes, false if every centroid
+// is in the same place
+static bool find_split(const BuildItem *items, int count, AABB box,
+                       AABB centroids, int *split_dim, int *split_bucket) {
+    float best = INFINITY;
+    for (int dim = 0; dim < 3; dim++) {
+        const float lo = v3f_axis(box_lo(centroids), dim);
+        const float extent = v3f_axis(box_hi(centroids), dim) - lo;
+        if (extent <= 0) continue;
+
+        LightBounds bucket[LIGHT_BUCKETS];
+        int bucket_count[LIGHT_BUCKETS] = {0};
+        for (int i = 0; i < count; i++) {
+            const int b = bucket_of(v3f_axis(items[i].centroid, dim), lo,
+                                    extent);
+            bucket[b] = bucket_count[b] == 0
+                            ? items[i].bounds
+                            : bounds_union(&bucket[b], &items[i].bounds);
+            bucket_count[b]++;
+        }
+
+        // cost of splitting after bucket i
+        for (int i = 0; i < LIGHT_BUCKETS - 1; i++) {
+            LightBounds below = {0}, above = {0};
+            int below_count = 0, above_count = 0;
+            for (int j = 0; j < LIGHT_BUCKETS; j++) {
+                if (bucket_count[j] == 0) continue;
+                LightBounds *side = j <= i ? &below : &above;
+                int *side_count = j <= i ? &below_count : &above_count;
+                *side = *side_count == 0 ? bucket[j]
+                                         : bounds_union(side, &bucket[j]);
+                *side_count += bucket_count[j];
+            }
+            if (below_count == 0 || above_count == 0) continue;
+
+            const float cost = bounds_cost(&below, box, dim) +
+                               bounds_cost(&above, box, dim);
+            if (cost < best) {
+                best = cost;
+                *split_dim = dim;
+                *split_bucket = i;
+            }
+        }
+    }
+    return best < INFINITY;
+}
+
+static int build_node(LightTree *tree, BuildItem *items, int count,
+                      uint64_t trail, int depth) {
+    const int node_idx = tree->node_count++;
+    LightNode *node = &tree->nodes[node_idx];
+
+    if (count == 1) {
+        *node = (LightNode){.bounds = items[0].bounds,
+                            .child_or_light = items[0].light,
+                            .leaf = true};
+        tree->trails[items[0].light] = trail;
+        return node_idx;
+    }
+
+    AABB box = items[0].bounds.box;
+    AABB centroids = aabb(items[0].centroid, items[0].centroid);
+    for (int i = 1; i < count; i++) {
+        box = aabb_join(box, items[i].bounds.box);
+        centroids =
+            aabb_join(centroids, aabb(items[i].centroid, items[i].centroid));
+    }
+
+    int mid = count / 2;
+    int dim, split;
+    if (depth < LIGHT_MAX_SAH_DEPTH &&
+        find_split(items, count, box, centroids, &dim, &split)) {
+        const float lo = v3f_axis(box_lo(centroids), dim);
+        const float extent = v3f_axis(box_hi(centroids), dim) - lo;
+        int i = 0, j = count - 1;
+        while (i <= j) {
+            if (bucket_of(v3f_axis(items[i].centroid, dim), lo, extent) <=
+                split) {
+                i++;
+            } else {
+                const BuildItem tmp = items[i];
+                items[i] = items[j];
+                items[j--] = tmp;
+            }
+        }
+        if (i > 0 && i < count) mid = i;
+    }
+
+    build_node(tree, items, mid, trail, depth + 1);
+    const int second = build_node(tree, items + mid, count - mid,
+                                  trail | (1ull << depth), depth + 1);
+
+    node = &tree->nodes[node_idx];
+    node->bounds = bounds_union(&tree->nodes[node_idx + 1].bounds,
+                                &tree->nodes[second].bounds);
+    node->child_or_light = second;
+    node->leaf = false;
+    return node_idx;
+}
+
+void light_tree_build(LightTree *tree) {
+    tree->nodes = NULL;
+    tree->trails = NULL;
+    tree->node_count = 0;
+    const int count = (int)tree->lights.size;
+    if (count == 0) return;
+
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    BuildItem *items = malloc(count * sizeof(*items));
+    tree->nodes = malloc((2 * count - 1) * sizeof(*tree->nodes));
+    tree->trails = malloc(count * sizeof(*tree->trails));
+    if (!items || !tree->nodes || !tree->trails) {
+        Log(Log_Error, "light_tree_build: Memory allocation failed");
+        exit(1);
+    }
+
+    for (int i = 0; i < count; i++) {
+        const LightBounds b = light_bounds(&tree->lights.items[i]);
+        items[i] = (BuildItem){
+            .bounds = b,
+            .centroid = v3f_mulf(v3f_add(box_lo(b.box), box_hi(b.box)), 0.5f),
+            .light = i};
+    }
+    build_node(tree, items, count, 0, 0);
+    free(items);
+
+    gettimeofday(&end, NULL);
+    Log(Log_Info, "light_tree_build: %d lights, %d nodes in %.2fms", count,
+        tree->node_count, timersub_ms(&end, &start));
+}
+
+void light_tree_free(LightTree *tree) {
+    vec_free(&tree->lights);
+    free(tree->nodes);
+    free(tree->trails);
+    tree->nodes = NULL;
+    tree->trails = NULL;
+    tree->node_count = 0;
+}
+
+bool light_tree_sample(const LightTree *tree, V3f p, V3f n, float u,
+                       int *light_idx, float *pmf) {
+    if (tree->node_count == 0) return false;
+    const LightNode *nodes = tree->nodes;
+    if (nodes[0].leaf && importance(&nodes[0].bounds, p, n) <= 0)
+        return false;
+
+    int node = 0;
+    float prob = 1;
+    while (!nodes[node].leaf) {
+        const int second = nodes[node].child_or_light;
+        const float c0 = importance(&nodes[node + 1].bounds, p, n);
+        const float c1 = importance(&nodes[second].bounds, p, n);
+        if (c0 <= 0 && c1 <= 0) return false;
+
+        const float p0 = c0 / (c0 + c1);
+        if (u < p0) {
+            node = node + 1;
+            u = MIN(u / p0, ONE_MINUS_EPS);
+            prob *= p0;
+        } else {
+            node = second;
+            u = MIN((u - p0) / (1 - p0), ONE_MINUS_EPS);
+            prob *= 1 - p0;
+        }
+    }
+    *light_idx = nodes[node].child_or_light;
+    *pmf = prob;
+    return true;
+}
+
+float light_tree_pmf(const LightTree *tree, V3f p, V3f n, int light_idx) {
+    const LightNode *nodes = tree->nodes;
+    if (nodes[0].leaf) return importance(&nodes[0].bounds, p, n) > 0 ? 1 : 0;
+
+    uint64_t trail = tree->trails[light_idx];
+    int node = 0;
+    float prob = 1;
+    while (!nodes[node].leaf) {
+        const int second = nodes[node].child_or_light;
+        const float c0 = importance(&nodes[node + 1].bounds, p, n);
+        const float c1 = importance(&nodes[second].bounds, p, n);
+        if (c0 <= 0 && c1 <= 0) return 0;
+
+        if (trail & 1) {
+            prob *= c1 / (c0 + c1);
+            node = second;
+        } else {
+            prob *= c0 / (c0 + c1);
+            node = node + 1;
+        }
+        trail >>= 1;
+    }
+    return prob;
+}
+
+// Cone of directions from p covering sphere s, false when p is inside it.
+// 1 - cos is kept separately, it cancels badly for small distant spheres.
+static bool sphere_cone(const Sphere *s, V3f p, V3f *axis,
+                        float *one_minus_cos) {
+    const V3f d = v3f_sub(s->center, p);
+    const float dist2 = v3f_slength(d);
+    const float r2 = s->radius * s->radius;
+    if (dist2 <= r2) return false;
+
+    const float sin2_max = r2 / dist2;
+    const float cos_max = safe_sqrt(1 - sin2_max);
+    *axis = v3f_divf(d, sqrtf(dist2));
+    *one_minus_cos = sin2_max / (1 + cos_max);
+    return true;
+}
+
+// Area sampled point q seen from p, pdf converted to solid angle
+static bool area_direction(const Light *light, V3f p, V3f q, V3f *wi,
+                           float *pdf) {
+    const V3f d = v3f_sub(q, p);
+    const float dist2 = v3f_slength(d);
+    if (dist2 < 1e-12f) return false;
+
+    *wi = v3f_divf(d, sqrtf(dist2));
+    const float cos_l = fabsf(v3f_dot(light->normal, *wi));
+    if (cos_l < 1e-6f) return false;
+    *pdf = dist2 / (cos_l * light->area);
+    return true;
+}
+
+bool light_sample(const Light *light, V3f p, float u1, float u2, V3f *wi,
+                  float *pdf) {
+    switch (light->shape) {
+        case LIGHT_SPHERE: {
+            V3f axis;
+            float one_minus_cos;
+            if (!sphere_cone(light->data, p, &axis, &one_minus_cos))
+                return false;
+
+            // uniform over the cone's solid angle
+            const float cos_t = 1 - u1 * one_minus_cos;
+            const float sin_t = safe_sqrt(1 - cos_t * cos_t);
+            const float phi = 2 * PI * u2;
+            V3f t, b;
+            onb_from_normal(axis, &t, &b);
+            *wi = onb_to_world(
+                (V3f){cosf(phi) * sin_t, sinf(phi) * sin_t, cos_t}, t, b, axis);
+            *pdf = 1 / (2 * PI * one_minus_cos);
+            return true;
+        }
+        case LIGHT_QUAD: {
+            const Quad *q = light->data;
+            const V3f point = v3f_add(
+                q->corner, v3f_add(v3f_mulf(q->u, u1), v3f_mulf(q->v, u2)));
+            return area_direction(light, p, point, wi, pdf);
+        }
+        case LIGHT_TRIANGLE: {
+            const Triangle *t = light->data;
+            const float su = sqrtf(u1);
+            const V3f point =
+                v3f_add(t->v1.v, v3f_add(v3f_mulf(t->e1, su * (1 - u2)),
+                                         v3f_mulf(t->e2, su * u2)));
+            return area_direction(light, p, point, wi, pdf);
+        }
+    }
+    return false;
+}
+
+float light_pdf(const Light *light, V3f p, V3f q) {
+    if (light->shape == LIGHT_SPHERE) {
+        V3f axis;
+        float one_minus_cos;
+        if (!sphere_cone(light->data, p, &axis, &one_minus_cos)) return 0;
+        return 1 / (2 * PI * one_minus_cos);
+    }
+    V3f wi;
+    float pdf;
+    return area_direction(light, p, q, &wi, &pdf) ? pdf : 0;
+}
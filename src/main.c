@@ -1,3 +1,4 @@
+#include <signal.h>
 #include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,38 +8,65 @@
 #include "api.h"
 #include "imagerw.h"
 #include "libmicrohttpd-1.0.1/src/include/microhttpd.h"
+#include "pool.h"
 #include "renderer.h"
 #define ARENA_IMPLEMENTATION
 #include "arena.h"
 #include "scene.h"
+#include "serve.h"
 #include "state.h"
+#include "topology.h"
 #define UTILS_IMPLEMENTATION
 #include "utils.h"
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "stb_image_write.h"
 
-const enum Log_Level level = Log_Trace;
+static enum Log_Level level = Log_Info;
 
 static void usage(const char *prog_name) {
     printf("%s — Distributed and standalone renderer\n\n", prog_name);
     printf("Usage:\n");
-    printf("  %s <COMMAND> [ARGS]\n\n", prog_name);
+    printf("  %s [OPTIONS] <COMMAND> [ARGS]\n\n", prog_name);
     printf("Commands:\n");
     printf("  master <PORT> <SCENE> [OUTPUT]\n");
     printf("      Coordinate workers and manage the render queue\n\n");
+    printf("  serve <PORT>\n");
+    printf("      Render server: queue jobs over HTTP, keep scenes loaded\n\n");
     printf("  worker <MASTER_URL> [DEVICE_ID]\n");
     printf("      Connect to master and render assigned tiles\n\n");
+    printf("  relay <PORT> <MASTER_URL> [DEVICE_ID]\n");
+    printf("      Join master as one worker, fanning its items out to the\n");
+    printf("      workers connecting on PORT\n\n");
     printf("  standalone <SCENE> [OUTPUT]\n");
     printf("      Render locally (single process)\n\n");
     printf("  benchmark <SCENE>\n");
     printf("      Run performance benchmark on this machine\n\n");
+    printf("  scaling <SCENE>\n");
+    printf("      Render at 1, 2, 4.. threads, unpinned and NUMA pinned\n\n");
     printf("Arguments:\n");
-    printf("  PORT           Port to listen on (master mode)\n");
+    printf("  PORT           Port to listen on (master, serve and relay\n");
+    printf("                 modes)\n");
     printf("  SCENE          Scene description file (JSON)\n");
     printf("  OUTPUT         Output image file name\n");
     printf("  MASTER_URL     Master address (e.g. http://127.0.0.1:8080)\n");
     printf("  DEVICE_ID      ID for the worker device\n\n");
     printf("Options:\n");
+    printf("  --numa         Pin threads over the NUMA nodes, each node\n");
+    printf("                 renders and first touches its image band\n");
+    printf("  --resident N   Scenes serve mode keeps loaded (default %d)\n",
+           SERVE_RESIDENT_SCENES);
+    printf("  --codec NAME   Compression offered to workers in master,\n");
+    printf("                 serve and relay modes: none, rle or lz\n");
+    printf("                 (default lz)\n");
+    printf("  --cache DIR    Worker and relay cache of scenes and model\n");
+    printf("                 files (default %s), relative for a relay\n",
+           ASSET_CACHE_DIR);
+    printf("                 to serve the files on\n");
+    printf("  --http-threads N\n");
+    printf("                 Threads serving workers in master, serve\n");
+    printf("                 and relay modes, taken off rendering\n");
+    printf("                 (default %d)\n", HTTP_THREADS);
+    printf("  -v, --verbose  Log every item handed out and received\n");
     printf("  -h, --help     Print this help message and exit\n");
 }
 
@@ -48,6 +76,12 @@ static void print_args_error(const char *prog_name, const char *error) {
     exit(1);
 }
 
+static void handle_sigint(int sig) {
+    UNUSED(sig);
+    atomic_store(&render_stop_requested, true);
+    signal(SIGINT, SIG_DFL);  // a second Ctrl-C kills the process
+}
+
 static MachineInfo get_device_stats(const char *perf_json_file, char *name) {
     Log_set_level(Log_Warn);
 
@@ -57,7 +91,7 @@ static MachineInfo get_device_stats(const char *perf_json_file, char *name) {
     State *state = malloc(sizeof(State));
 
     char *file_content = read_compress_scene(perf_json_file);
-    load_scene(file_content, scene, state);
+    if (!file_content || !load_scene(file_content, scene, state)) exit(1);
     free(file_content);
 
     Work *work = malloc(sizeof(Work));
@@ -67,7 +101,7 @@ static MachineInfo get_device_stats(const char *perf_json_file, char *name) {
 
     calculate_camera_fields(&scene->camera);
     init_work(scene, state, work);
-    render_scene(work, 1);  // get single threaded performance
+    render_scene(work);  // pool not started yet: single threaded performance
 
     gettimeofday(&end, NULL);
 
@@ -102,6 +136,66 @@ static MachineInfo get_device_stats(const char *perf_json_file, char *name) {
     return stats;
 }
 
+// Render time of scene at thread_count threads, pinned over topo when given
+static double time_render(Scene *scene, State *state, long thread_count,
+                          const Topology *topo) {
+    pool_init(thread_count - 1, topo);
+    Work work;
+    init_work(scene, state, &work);
+
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    render_scene(&work);
+    gettimeofday(&end, NULL);
+
+    pool_shutdown();
+    free(work.tiles);
+    return timersub_ms(&end, &start);
+}
+
+// Thread scaling of a single pass render, unpinned next to NUMA pinned
+static void scaling_report(const char *scene_json_file) {
+    Scene *scene = calloc(1, sizeof(Scene));
+    State *state = malloc(sizeof(State));
+    scene->arena = arena_create(1024 * 1024 * 256);  // 256MB
+    char *scene_json = read_compress_scene(scene_json_file);
+    if (!scene_json || !load_scene(scene_json, scene, state)) exit(1);
+    calculate_camera_fields(&scene->camera);
+    float *accum = state->accum;
+    state->accum = NULL;  // plain single pass renders
+
+    Topology topo;
+    const bool pinnable = topology_detect(&topo);
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    Log(Log_Info, "scaling: threads   unpinned ms (speedup)   pinned ms "
+                  "(speedup)");
+    double base_unpinned = 0, base_pinned = 0;
+    for (long threads = 1;; threads = MIN(threads * 2, cpus)) {
+        Log_set_level(Log_Warn);
+        const double unpinned = time_render(scene, state, threads, NULL);
+        const double pinned =
+            pinnable ? time_render(scene, state, threads, &topo) : 0;
+        Log_set_level(level);
+        if (threads == 1) {
+            base_unpinned = unpinned;
+            base_pinned = pinned;
+        }
+        Log(Log_Info, "scaling: %7ld %14.0f (%5.2fx) %11.0f (%5.2fx)",
+            threads, unpinned, base_unpinned / unpinned, pinned,
+            pinned > 0 ? base_pinned / pinned : 0.0);
+        if (threads >= cpus) break;
+    }
+
+    topology_free(&topo);
+    free(scene_json);
+    free_scene(scene);
+    free(scene);
+    free(state->image);
+    free(accum);
+    free(state);
+}
+
 int main(int argc, char **argv) {
     char *prog_name = shift(&argc, &argv);
 
@@ -118,6 +212,11 @@ int main(int argc, char **argv) {
     int port;
     char *master_url = "";
     char *device_name = NULL;
+    bool numa = false;
+    int resident_scenes = SERVE_RESIDENT_SCENES;
+    Codec codec = CODEC_LZ;
+    const char *cache_dir = ASSET_CACHE_DIR;
+    int http_threads = HTTP_THREADS;
 
     while (argc > 0) {
         char *flag = shift(&argc, &argv);
@@ -167,6 +266,89 @@ int main(int argc, char **argv) {
                 perf_json_file = shift(&argc, &argv);
             }
             mode = 3;
+        } else if (strncmp(flag, "scaling", 7) == 0) {
+            if (argc <= 0) {
+                print_args_error(prog_name,
+                                 "missing required argument <SCENE>");
+            }
+            scene_json_file = shift(&argc, &argv);
+            mode = 4;
+        } else if (strncmp(flag, "serve", 5) == 0) {
+            if (argc <= 0) {
+                print_args_error(prog_name, "missing required argument <PORT>");
+            }
+            const char *port1 = shift(&argc, &argv);
+            port = atoi(port1);
+            if (port == 0) {
+                print_args_error(
+                    prog_name,
+                    temp_sprintf("invalid value '%s' for <PORT>", port1));
+            }
+            mode = 5;
+        } else if (strncmp(flag, "relay", 5) == 0) {
+            if (argc <= 0) {
+                print_args_error(
+                    prog_name,
+                    "missing required arguments <PORT> and <MASTER_URL>");
+            }
+            const char *port1 = shift(&argc, &argv);
+            port = atoi(port1);
+            if (port == 0) {
+                print_args_error(
+                    prog_name,
+                    temp_sprintf("invalid value '%s' for <PORT>", port1));
+            }
+            if (argc <= 0) {
+                print_args_error(prog_name,
+                                 "missing required argument <MASTER_URL>");
+            }
+            master_url = shift(&argc, &argv);
+            if (argc > 0) device_name = shift(&argc, &argv);
+            mode = 6;
+        } else if (strcmp(flag, "--numa") == 0) {
+            numa = true;
+        } else if (strcmp(flag, "--resident") == 0) {
+            if (argc <= 0) {
+                print_args_error(prog_name, "missing value for --resident");
+            }
+            const char *count = shift(&argc, &argv);
+            resident_scenes = atoi(count);
+            if (resident_scenes <= 0) {
+                print_args_error(
+                    prog_name,
+                    temp_sprintf("invalid value '%s' for --resident", count));
+            }
+        } else if (strcmp(flag, "--codec") == 0) {
+            if (argc <= 0) {
+                print_args_error(prog_name, "missing value for --codec");
+            }
+            const char *name = shift(&argc, &argv);
+            codec = codec_from_name(name);
+            if (codec == CODEC_COUNT) {
+                print_args_error(
+                    prog_name,
+                    temp_sprintf("invalid value '%s' for --codec", name));
+            }
+        } else if (strcmp(flag, "--cache") == 0) {
+            if (argc <= 0) {
+                print_args_error(prog_name, "missing value for --cache");
+            }
+            cache_dir = shift(&argc, &argv);
+        } else if (strcmp(flag, "--http-threads") == 0) {
+            if (argc <= 0) {
+                print_args_error(prog_name, "missing value for --http-threads");
+            }
+            const char *count = shift(&argc, &argv);
+            http_threads = atoi(count);
+            if (http_threads <= 0) {
+                print_args_error(
+                    prog_name,
+                    temp_sprintf("invalid value '%s' for --http-threads",
+                                 count));
+            }
+        } else if (strcmp(flag, "-v") == 0 ||
+                   strcmp(flag, "--verbose") == 0) {
+            level = Log_Trace;
         } else if (strncmp(flag, "-h", 2) == 0 ||
                    strncmp(flag, "--help", 6) == 0) {
             usage(prog_name);
@@ -177,6 +359,12 @@ int main(int argc, char **argv) {
         }
     }
     UNUSED(master_url);
+    Log_set_level(level);
+
+    if (mode == 4) {
+        scaling_report(scene_json_file);
+        return 0;
+    }
 
     MachineInfo stats = get_device_stats(perf_json_file, device_name);
 
@@ -184,69 +372,100 @@ int main(int argc, char **argv) {
         exit(0);
     }
 
+    Topology topo = {0};
+    if (numa) topology_detect(&topo);
+    // the caller thread joins in whenever it waits, so one less pool thread,
+    // except for a worker whose caller thread fetches leases. Servers leave
+    // the cores of their HTTP threads alone.
+    long render_threads =
+        mode == 1 ? stats.thread_count : stats.thread_count - 1;
+    if (mode == 0 || mode == 5 || mode == 6)
+        render_threads = MAX(render_threads - http_threads, 0L);
+    pool_init(render_threads, numa ? &topo : NULL);
+
     Scene *scene = NULL;
     State *state = NULL;
     char *scene_json = NULL;
     if (mode == 0 || mode == 2) {
+        if (output_name == NULL) {
+            output_name = strdup(scene_json_file);
+            char *mark = NULL;
+            char *mark_next = strstr(output_name, ".json");
+            while (mark_next != NULL) {
+                mark = mark_next;
+                mark_next = strstr(mark_next + 1, ".json");
+            }
+            mark[1] = 'p';
+            mark[2] = 'n';
+            mark[3] = 'g';
+            mark[4] = '\0';
+        }
+
         scene = malloc(sizeof(Scene));
         memset(scene, 0, sizeof(Scene));
         scene->arena = arena_create(1024 * 1024 * 256);  // 256MB
         state = malloc(sizeof(State));
 
         scene_json = read_compress_scene(scene_json_file);
-        unsigned int scene_crc =
-            stbiw__crc32((unsigned char *)scene_json, strlen(scene_json));
+        if (!scene_json || !load_scene(scene_json, scene, state)) return 1;
+        unsigned int scene_crc = scene_crc32(scene_json);
 
-        load_scene(scene_json, scene, state);
         scene->scene_crc = scene_crc;
         scene->scene_json = scene_json;
+        if (mode == 0)
+            scene->bundle = scene_bundle_create(scene_json, scene_crc);
         print_summary(scene, state);
         calculate_camera_fields(&scene->camera);
 
         MasterAPIContext *context = malloc(sizeof(MasterAPIContext));
         if (!context) return false;
-        context->scene = scene;
-        context->state = state;
+        *context =
+            (MasterAPIContext){.scene = scene,
+                               .state = state,
+                               .codec = codec,
+                               .http_threads = http_threads};
         vec_init(&context->workers);
+        pthread_mutex_init(&context->job_lock, NULL);
+        pthread_cond_init(&context->channel_wake, NULL);
 
         context->work = malloc(sizeof(Work));
 
+        // the master merges partial sums from workers into accum
+        if (mode == 0 && !state->accum) {
+            state->accum =
+                calloc(state->width * state->height * 3, sizeof(float));
+            if (!state->accum) {
+                Log(Log_Error, "main: Failed to allocate accum");
+                return 1;
+            }
+        }
         init_work(context->scene, context->state, context->work);
+        const bool animated = scene->frames.size > 0;
+        // the first frame stands in for the others in the prepass
+        if (animated) work_set_camera(context->work, &scene->frames.items[0]);
+        if (state->cost_prepass) estimate_tile_costs(context->work);
 
         // Create MasterState and wire it into API context so the server and
         // master threads coordinate over the same tile assignments.
-        struct MasterState *ms = malloc(sizeof(struct MasterState));
-        if (!ms) {
-            Log(Log_Error, "main: Failed to allocate MasterState");
-            return 1;
-        }
-        ms->scene = context->scene;
-        ms->state = context->state;
-        ms->tile_count = context->work->tile_count;
-        ms->tiles = malloc(sizeof(TileAssignment) * ms->tile_count);
-        for (int i = 0; i < ms->tile_count; i++) {
-            ms->tiles[i].tile = context->work->tiles[i];
-            ms->tiles[i].status = TILE_UNASSIGNED;
-            ms->tiles[i].assigned_worker_idx = -3; /* unassigned */
-        }
-        vec_init(&ms->workers);
-        ms->samples_per_pixel = state->samples_per_pixel;
-        ms->max_depth = state->max_depth;
-        ms->colour_contribution = 1.0f / (float)state->samples_per_pixel;
-
-        // compute camera-derived vectors for tile rendering
-        compute_render_camera_fields(&scene->camera, state->width,
-                                     state->height, &ms->pixel00_loc,
-                                     &ms->pixel_delta_u, &ms->pixel_delta_v,
-                                     &ms->defocus_disk_u, &ms->defocus_disk_v);
-        ms->image = state->image;
-        ms->image_width = state->width;
-        atomic_init(&ms->tile_assign_lock, 0);
-
+        MasterState *ms =
+            master_state_create(scene, state, context->work, &stats);
+        ms->frame_output = output_name;
+        if (mode == 0) master_init_work_items(ms, context->work);
         context->master_state = ms;
 
         // Start server before rendering so workers can connect.
         if (mode == 0) {
+            if (state->pass_samples > 0) {
+                Log(Log_Warn,
+                    "Master: progressive mode is standalone only, rendering "
+                    "in one pass");
+            }
+            // results carry colour sums only, not the albedo, normal, depth
+            // and luminance moments the filter is guided by
+            if (state->denoise.enabled) {
+                Log(Log_Warn, "Master: distributed renders are not denoised, "
+                              "skipping denoise");
+            }
             bool success = master_start_server(port, context);
             if (success) {
                 Log(Log_Info, "master_start_server: Started master server");
@@ -255,51 +474,46 @@ int main(int argc, char **argv) {
                     "master_start_server: Cannot start master server");
             }
 
-            // Start master-side renderer threads to process tiles locally while
-            // accepting remote workers. The HTTP server is already running in
-            // background threads, so calling `render_scene_distributed` will
-            // let master threads claim tiles concurrently with workers.
-            long thread_count = stats.thread_count - 1;
-            render_scene_distributed(ms, thread_count);
-
-            // After master-side rendering completes, wait for any remaining
-            // tiles to be uploaded by workers.
-            int total = ms->tile_count;
-            Log(Log_Info,
-                "Master: master-side rendering done; waiting for %d tiles "
-                "total",
-                total);
-            int last_logged = -1;
-            // TODO: infinite wait for dead workers? switch to amster rendering
-            while (true) {  // Spin until workers complete
-                int completed = 0;
-                for (int i = 0; i < ms->tile_count; i++) {
-                    if (ms->tiles[i].status == TILE_COMPLETED) completed++;
-                }
-                if (completed >= total) break;
-                if (completed != last_logged && completed % 4 == 0) {
-                    Log(Log_Info, "Master: progress %d/%d tiles completed",
-                        completed, total);
-                    last_logged = completed;
-                }
-                sleep(1);
-            }
+            master_render(ms);
 
             Log(Log_Info, "Master: all tiles completed (master+workers)");
-            free(ms->tiles);
-            vec_free(&ms->workers);
-            free(ms);
+            if (!animated) resolve_accum(context->work);
+            codec_stats_log(&context->scene_stats, "Master: scene downloads");
+            codec_stats_log(&context->result_stats, "Master: result uploads");
+            master_state_free(ms);
             vec_free(&context->workers);
         } else {
             // standalone mode: render locally using existing work struct
-            long thread_count = stats.thread_count - 1;
-            render_scene(context->work, thread_count);
+            if (animated) {
+                if (state->pass_samples > 0) {
+                    Log(Log_Warn, "Standalone: progressive mode renders stills "
+                                  "only, rendering frames in one pass");
+                }
+                signal(SIGINT, handle_sigint);
+                render_animation(context->work, state, output_name);
+            } else if (state->pass_samples > 0) {
+                signal(SIGINT, handle_sigint);
+                render_scene_progressive(context->work, state, output_name);
+            } else {
+                render_scene(context->work);
+                if (state->accum) resolve_image(context->work, state);
+            }
             vec_free(&context->workers);
         }
     }
 
+    if (mode == 5) {
+        signal(SIGINT, handle_sigint);
+        if (!serve_run(port, &stats, resident_scenes, codec, http_threads))
+            Log(Log_Error, "serve: Cannot start the server");
+    }
+
+    if (mode == 6 && !relay_connect(master_url, port, stats, cache_dir, codec,
+                                    http_threads))
+        Log(Log_Error, "Relay: Cannot relay for the master");
+
     if (mode == 1) {
-        bool success = worker_connect(master_url, 0, stats);
+        bool success = worker_connect(master_url, 0, stats, cache_dir);
         if (success) {
             Log(Log_Info, "worker_connect: Connected to master");
         } else {
@@ -307,33 +521,23 @@ int main(int argc, char **argv) {
         }
     }
 
-    if (mode == 0 || mode == 2) {
-        if (output_name == NULL) {
-            output_name = strdup(scene_json_file);
-            char *mark = NULL;
-            char *mark_next = strstr(output_name, ".json");
-            while (mark_next != NULL) {
-                mark = mark_next;
-                mark_next = strstr(mark_next + 1, ".json");
-            }
-            mark[1] = 'p';
-            mark[2] = 'n';
-            mark[3] = 'g';
-            mark[4] = '\0';
-        }
-        export_image(output_name, state->image, state->width, state->height);
+    bool written = true;
+    if ((mode == 0 || mode == 2) && scene->frames.size == 0) {
+        written = export_image(output_name, state->image, state->width,
+                               state->height, &state->tonemap);
     }
 
     Log(Log_Info, "Press Enter to exit...");
-    if (master_daemon) {
-        MHD_stop_daemon(master_daemon);
-    }
+    master_stop_server();
     if (worker_daemon) {
         MHD_stop_daemon(worker_daemon);
     }
 
     free(scene_json);
+    if (scene) scene_bundle_free(scene->bundle);
     free_scene(scene);
+    pool_shutdown();
+    topology_free(&topo);
 
-    return 0;
+    return written ? 0 : 1;
 }
@@ -5,12 +5,746 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <threads.h>
 
 #include "api.h"
 #include "cJSON.h"
+#include "imagerw.h"
 #include "libmicrohttpd-1.0.1/src/include/microhttpd.h"
+#include "serve.h"
 #include "utils.h"
 
+// Items the master aims to hand out, so a small image at high spp still
+// feeds every core of the farm
+#define TARGET_WORK_ITEMS 256
+// Fewest samples worth a work item round trip
+#define MIN_ITEM_SAMPLES 16
+// How often master_render checks for results still out with workers
+#define RESULT_POLL_MS 10
+// Weight of the latest measurement in a worker's smoothed time per item
+#define LEASE_SMOOTHING 0.3
+// A lease expires after LEASE_DEADLINE_FACTOR times its expected duration,
+// and no sooner than LEASE_DEADLINE_MIN_MS
+#define LEASE_DEADLINE_FACTOR 4.0
+#define LEASE_DEADLINE_MIN_MS 30000.0
+// Least time between two scans for expired leases
+#define LEASE_CHECK_MS 100.0
+// Weight of the latest measurement in the throughput model
+#define RATE_SMOOTHING 0.3
+// Floor of the benchmark seeds, which may round down to 0
+#define MIN_MACHINE_SPEED 1e-3
+
+static double master_ms(const MasterState *ms) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return timersub_ms(&now, &ms->start);
+}
+
+MasterState *master_state_create(Scene *scene, State *state, Work *work,
+                                 const MachineInfo *self) {
+    MasterState *ms = calloc(1, sizeof(*ms));
+    if (!ms) {
+        Log(Log_Error, "master_state_create: Memory allocation failed");
+        exit(1);
+    }
+    ms->scene = scene;
+    ms->state = state;
+    vec_init(&ms->workers);
+    vec_init(&ms->leases);
+    pthread_mutex_init(&ms->lease_lock, NULL);
+    ms->samples_per_pixel = state->samples_per_pixel;
+    ms->max_depth = state->max_depth;
+
+    ms->work = work;
+
+    // one frame per animation camera, camera-derived vectors for each
+    const Cameras *cams = &scene->frames;
+    ms->frame_count = cams->size > 0 ? (int)cams->size : 1;
+    ms->frames = calloc(ms->frame_count, sizeof(*ms->frames));
+    if (!ms->frames) {
+        Log(Log_Error, "master_state_create: Memory allocation failed");
+        exit(1);
+    }
+    for (int f = 0; f < ms->frame_count; f++) {
+        MasterFrame *frame = &ms->frames[f];
+        frame->ms = ms;
+        frame->index = f;
+        frame->camera = cams->size > 0 ? cams->items[f] : scene->camera;
+        compute_render_camera_fields(
+            &frame->camera, state->width, state->height, &frame->pixel00_loc,
+            &frame->pixel_delta_u, &frame->pixel_delta_v,
+            &frame->defocus_disk_u, &frame->defocus_disk_v);
+    }
+    if (cams->size == 0) {
+        ms->frames[0].accum = work->accum;
+        ms->frames[0].tile_samples = work->tile_samples;
+    }
+    pthread_mutex_init(&ms->accum_lock, NULL);
+    ms->image_width = state->width;
+    ms->self_speed = MAX(machine_speed(self), MIN_MACHINE_SPEED);
+    ms->self_rate = 0;
+    ms->rate_scale = 1;
+    atomic_init(&ms->total_rate, ms->self_speed);
+    atomic_init(&ms->cost_left, 0.0);
+    atomic_init(&ms->items_completed, 0);
+    atomic_init(&ms->cancelled, false);
+    atomic_init(&ms->export_failed, false);
+    gettimeofday(&ms->start, NULL);
+    atomic_init(&ms->expiry_checked_ms, 0.0);
+    return ms;
+}
+
+void master_state_free(MasterState *ms) {
+    pool_wait(&ms->exports);
+    // frames of a cancelled animation still holding their accumulation
+    for (int f = 0; f < ms->frame_count && ms->scene->frames.size > 0; f++) {
+        free(ms->frames[f].accum);
+        free(ms->frames[f].tile_samples);
+    }
+    free(ms->frames);
+    free(ms->tiles);
+    free(ms->flight);
+    free(ms->flight_skip);
+    work_queue_free(&ms->queue);
+    vec_free(&ms->workers);
+    vec_free(&ms->leases);
+    pthread_mutex_destroy(&ms->lease_lock);
+    pthread_mutex_destroy(&ms->accum_lock);
+    free(ms);
+}
+
+// Cost of an item in the throughput model: its predicted cost, or its pixel
+// samples without a cost prepass
+static double item_cost(const TileAssignment *a) {
+    return a->cost > 0 ? a->cost
+                       : (double)a->tile.tw * a->tile.th *
+                             (a->sample_end - a->sample_begin);
+}
+
+static void add_cost_left(MasterState *ms, double cost) {
+    double left = atomic_load(&ms->cost_left);
+    while (!atomic_compare_exchange_weak(&ms->cost_left, &left, left + cost)) {
+    }
+}
+
+// The lease record of a registered worker, under lease_lock
+static WorkerLease *worker_lease(MasterState *ms, int worker_idx) {
+    while ((int)ms->leases.size <= worker_idx)
+        vec_push(&ms->leases, (WorkerLease){0});
+    return &ms->leases.items[worker_idx];
+}
+
+// Under lease_lock. Unregistered workers count as the master.
+static double node_rate(MasterState *ms, int worker_idx) {
+    if (worker_idx >= 0 && worker_idx < (int)ms->workers.size) {
+        const WorkerLease *lease = worker_lease(ms, worker_idx);
+        if (lease->rate > 0) return lease->rate;
+        const double speed = machine_speed(&ms->workers.items[worker_idx]);
+        return MAX(speed, MIN_MACHINE_SPEED) * ms->rate_scale;
+    }
+    return ms->self_rate > 0 ? ms->self_rate : ms->self_speed * ms->rate_scale;
+}
+
+// Under lease_lock, after a measurement or a worker showing up: the seeds
+// are scaled like the measured machines, and total_rate sums the master and
+// the workers heard from lately
+static void update_rates(MasterState *ms) {
+    double rates = 0, speeds = 0;
+    if (ms->self_rate > 0) {
+        rates += ms->self_rate;
+        speeds += ms->self_speed;
+    }
+    for (size_t wi = 0; wi < ms->workers.size; wi++) {
+        const WorkerLease *lease = worker_lease(ms, (int)wi);
+        if (lease->rate <= 0) continue;
+        rates += lease->rate;
+        speeds += MAX(machine_speed(&ms->workers.items[wi]), MIN_MACHINE_SPEED);
+    }
+    if (speeds > 0) ms->rate_scale = rates / speeds;
+
+    const double now = master_ms(ms);
+    double total = node_rate(ms, -1);
+    for (size_t wi = 0; wi < ms->workers.size; wi++) {
+        const WorkerLease *lease = worker_lease(ms, (int)wi);
+        if (lease->seen_ms > 0 && now - lease->seen_ms <= WORKER_TIMEOUT_MS)
+            total += node_rate(ms, (int)wi);
+    }
+    atomic_store(&ms->total_rate, total);
+}
+
+static double smoothed(double old, double sample) {
+    return old > 0 ? old * (1.0 - RATE_SMOOTHING) + sample * RATE_SMOOTHING
+                   : sample;
+}
+
+double master_node_rate(MasterState *ms, int worker_idx) {
+    pthread_mutex_lock(&ms->lease_lock);
+    const double rate = node_rate(ms, worker_idx);
+    pthread_mutex_unlock(&ms->lease_lock);
+    return rate;
+}
+
+void master_item_rendered(MasterState *ms, int item, double elapsed_ms) {
+    // one thread's rate, the master renders with all of them
+    const double rate = item_cost(&ms->tiles[item]) / MAX(elapsed_ms, 1e-3) *
+                        (double)pool_concurrency();
+    pthread_mutex_lock(&ms->lease_lock);
+    ms->self_rate = smoothed(ms->self_rate, rate);
+    update_rates(ms);
+    pthread_mutex_unlock(&ms->lease_lock);
+}
+
+static int compare_item_cost_desc(const void *a, const void *b) {
+    const TileAssignment *ia = a, *ib = b;
+    if (ia->cost != ib->cost) return ia->cost < ib->cost ? 1 : -1;
+    return ia->sample_begin != ib->sample_begin
+               ? ia->sample_begin - ib->sample_begin
+               : ia->tile_idx - ib->tile_idx;
+}
+
+// Split every tile's spp into equal sample ranges when there are fewer tiles
+// than TARGET_WORK_ITEMS. Items are ordered range first so the whole frame
+// gets its first samples before any tile gets its second range, or most
+// expensive first when the work has tile costs from a prepass. Animation
+// frames follow one another, so each completes (and is written out) early.
+void master_init_work_items(MasterState *ms, const Work *work) {
+    const int spp = ms->samples_per_pixel;
+    int slices = (TARGET_WORK_ITEMS + work->tile_count - 1) / work->tile_count;
+    slices = MAX(MIN(slices, spp / MIN_ITEM_SAMPLES), 1);
+
+    const int frame_items = work->tile_count * slices;
+    ms->tile_count = frame_items * ms->frame_count;
+    ms->tiles = malloc(sizeof(TileAssignment) * ms->tile_count);
+    if (!ms->tiles) {
+        Log(Log_Error, "master_init_work_items: malloc failed");
+        exit(1);
+    }
+    for (int f = 0; f < ms->frame_count; f++) {
+        TileAssignment *items = &ms->tiles[f * frame_items];
+        for (int s = 0; s < slices; s++) {
+            for (int t = 0; t < work->tile_count; t++) {
+                items[s * work->tile_count + t] = (TileAssignment){
+                    .tile = work->tiles[t],
+                    .frame = f,
+                    .tile_idx = t,
+                    .sample_begin = (int)((long)spp * s / slices),
+                    .sample_end = (int)((long)spp * (s + 1) / slices),
+                    .cost = 0,
+                    .status = TILE_UNASSIGNED,
+                    .assigned_worker_idx = -3,  // unassigned
+                    .prev_worker_idx = -3,
+                };
+            }
+        }
+        if (work->tile_cost) {
+            for (int i = 0; i < frame_items; i++) {
+                TileAssignment *a = &items[i];
+                a->cost = work->tile_cost[a->tile_idx] *
+                          (float)(a->sample_end - a->sample_begin);
+            }
+            qsort(items, frame_items, sizeof(*items), compare_item_cost_desc);
+        }
+        atomic_init(&ms->frames[f].items_left, frame_items);
+    }
+    double cost = 0;
+    for (int i = 0; i < ms->tile_count; i++) cost += item_cost(&ms->tiles[i]);
+    atomic_store(&ms->cost_left, cost);
+    Log(Log_Info,
+        "master_init_work_items: %d tiles x %d sample ranges x %d frames = "
+        "%d work items",
+        work->tile_count, slices, ms->frame_count, ms->tile_count);
+
+    if (!work_queue_init(&ms->queue, ms->tile_count)) {
+        Log(Log_Error, "master_init_work_items: malloc failed");
+        exit(1);
+    }
+    ms->flight = malloc(sizeof(*ms->flight) * ms->tile_count);
+    ms->flight_skip = malloc(sizeof(*ms->flight_skip) * ms->tile_count);
+    if (!ms->flight || !ms->flight_skip) {
+        Log(Log_Error, "master_init_work_items: malloc failed");
+        exit(1);
+    }
+    for (int k = 0; k < ms->tile_count; k++) {
+        atomic_init(&ms->flight[k], -1);
+        atomic_init(&ms->flight_skip[k], k);
+    }
+    atomic_init(&ms->flight_count, 0);
+}
+
+// Marks flight entries [from, to) as no backup candidates
+static void skip_flight(MasterState *ms, int from, int to) {
+    int skip = atomic_load(&ms->flight_skip[from]);
+    while (skip < to &&
+           !atomic_compare_exchange_weak(&ms->flight_skip[from], &skip, to)) {
+    }
+}
+
+// The item in flight the longest that has not been copied yet, and is not
+// with worker_idx. Its first claim is its only one, so it is the first such
+// entry of the flight log. An entry that is not (done, requeued or copied)
+// never is again, runs of them are skipped over.
+static int find_backup(MasterState *ms, int worker_idx) {
+    const int count = atomic_load(&ms->flight_count);
+    int run = -1;  // start of the run of dead entries being walked
+    for (int k = 0; k < count;) {
+        const int skip = atomic_load(&ms->flight_skip[k]);
+        if (skip > k) {
+            if (run < 0) run = k;
+            k = skip;
+            continue;
+        }
+        const int i = atomic_load(&ms->flight[k]);
+        if (i >= 0 && (atomic_load(&ms->tiles[i].status) != TILE_IN_FLIGHT ||
+                       atomic_load(&ms->tiles[i].claims) != 1)) {
+            if (run < 0) run = k;
+            k++;
+            continue;
+        }
+        if (run >= 0) skip_flight(ms, run, k);
+        run = -1;
+        // claimed but not logged yet, or with worker_idx
+        if (i >= 0 &&
+            atomic_load(&ms->tiles[i].assigned_worker_idx) != worker_idx)
+            return i;
+        k++;
+    }
+    if (run >= 0) skip_flight(ms, run, count);
+    return -1;
+}
+
+// Puts an item back for claiming, unless its old entry is still queued: a
+// second push of it would link the requeue stack into a cycle. The old
+// entry serves again once the status is back to unassigned.
+static void requeue_item(MasterState *ms, int item) {
+    if (!atomic_exchange(&ms->tiles[item].queued, true))
+        work_queue_push(&ms->queue, item);
+}
+
+// The throughput model at the end of a render, '*' marks machines that were
+// never measured and kept their benchmark seed
+static void log_rates(MasterState *ms) {
+    pthread_mutex_lock(&ms->lease_lock);
+    Log(Log_Info, "Master: throughput master %.3f%s cost/ms",
+        node_rate(ms, -1), ms->self_rate > 0 ? "" : "*");
+    for (size_t wi = 0; wi < ms->workers.size; wi++) {
+        const WorkerLease *lease = worker_lease(ms, (int)wi);
+        Log(Log_Info, "Master: throughput worker '%s' %.3f%s cost/ms",
+            ms->workers.items[wi].name, node_rate(ms, (int)wi),
+            lease->rate > 0 ? "" : "*");
+    }
+    pthread_mutex_unlock(&ms->lease_lock);
+}
+
+void master_render(MasterState *ms) {
+    // master threads claim items concurrently with the workers, the HTTP
+    // server is already running in its own threads
+    render_scene_distributed(ms);
+
+    // then wait for the items still being rendered by workers, a relay for
+    // the items still to come as well
+    const bool relay = ms->forward != NULL;
+    const int total = ms->tile_count;
+    if (!relay) {
+        Log(Log_Info,
+            "Master: master-side rendering done; waiting for %d work items "
+            "total",
+            total);
+    }
+    const struct timespec poll = {.tv_nsec = RESULT_POLL_MS * 1000000L};
+    int last_logged = -1;
+    while (!atomic_load(&ms->cancelled)) {
+        const int completed = atomic_load(&ms->items_completed);
+        if (!relay && completed >= total) break;
+        if (!relay && completed != last_logged && completed % 4 == 0) {
+            Log(Log_Info, "Master: progress %d/%d items completed", completed,
+                total);
+            last_logged = completed;
+        }
+        // items of dead or stalled workers come back to the master, and its
+        // idle threads take backup copies of the ones out the longest
+        master_expire_leases(ms);
+        if (!work_queue_empty(&ms->queue) ||
+            (!relay && find_backup(ms, -1) >= 0))
+            render_scene_distributed(ms);
+        else
+            thrd_sleep(&poll, NULL);
+    }
+    pool_wait(&ms->exports);
+    log_rates(ms);
+}
+
+void master_set_job(MasterAPIContext *context, int job_id, Scene *scene,
+                    State *state, Work *work, MasterState *ms) {
+    const struct timespec poll = {.tv_nsec = 1000000L};
+    pthread_mutex_lock(&context->job_lock);
+    // no new request pins the old job from here on
+    context->scene = NULL;
+    context->state = NULL;
+    context->work = NULL;
+    context->master_state = NULL;
+    while (context->job_users > 0) {
+        pthread_mutex_unlock(&context->job_lock);
+        thrd_sleep(&poll, NULL);
+        pthread_mutex_lock(&context->job_lock);
+    }
+    if (ms) {
+        for (size_t i = 0; i < context->workers.size; i++)
+            vec_push(&ms->workers, context->workers.items[i]);
+    }
+    context->job_id = job_id;
+    context->scene = scene;
+    context->state = state;
+    context->work = work;
+    context->master_state = ms;
+    pthread_cond_broadcast(&context->channel_wake);
+    pthread_mutex_unlock(&context->job_lock);
+}
+
+double machine_speed(const MachineInfo *info) {
+    return (double)info->perf * (double)info->thread_count;
+}
+
+// Items are sorted by cost when they have one, most expensive first, and
+// claimed from the front so the cheap ones are left to fill the end. A
+// machine that would still be on the front item when the others run out of
+// work (at the modelled rates) takes the cheapest one instead.
+int master_claim_item(MasterState *ms, int worker_idx, double rate) {
+    if (atomic_load(&ms->cancelled)) return -1;
+    bool cheap = false;
+    const uint64_t ends = atomic_load(&ms->queue.ends);
+    const uint32_t front = (uint32_t)ends;
+    if (ms->tile_count > 0 && ms->tiles[0].cost > 0 &&
+        front < (uint32_t)(ends >> 32)) {
+        const double finish = item_cost(&ms->tiles[front]) / rate;
+        cheap = finish > atomic_load(&ms->cost_left) /
+                             atomic_load(&ms->total_rate);
+    }
+    while (true) {
+        const int found = work_queue_pop(&ms->queue, cheap);
+        if (found < 0) return -1;
+        TileAssignment *a = &ms->tiles[found];
+        // off the stack, cleared before the status CAS so that a requeue
+        // racing with this claim pushes it again rather than getting lost
+        atomic_store(&a->queued, false);
+        TileStatus expected = TILE_UNASSIGNED;
+        if (!atomic_compare_exchange_strong(&a->status, &expected,
+                                            TILE_IN_FLIGHT))
+            continue;  // stale entry, already done
+        atomic_store(&a->prev_worker_idx,
+                     atomic_exchange(&a->assigned_worker_idx, worker_idx));
+        // relays never copy items, and reset claims when one comes back
+        if (atomic_fetch_add(&a->claims, 1) == 0 && !ms->forward) {
+            const int k = atomic_fetch_add(&ms->flight_count, 1);
+            atomic_store(&ms->flight[k], found);
+        }
+        atomic_store(&a->deadline_ms, 0.0);
+        add_cost_left(ms, -item_cost(a));
+        return found;
+    }
+}
+
+int master_claim_backup(MasterState *ms, int worker_idx) {
+    if (atomic_load(&ms->cancelled) || ms->forward ||
+        !work_queue_empty(&ms->queue))
+        return -1;
+    while (true) {
+        const int found = find_backup(ms, worker_idx);
+        if (found < 0) return -1;
+        TileAssignment *a = &ms->tiles[found];
+        int single = 1;
+        if (!atomic_compare_exchange_strong(&a->claims, &single, 2)) continue;
+        // the backup holds the lease now, the first result still counts
+        atomic_store(&a->prev_worker_idx,
+                     atomic_exchange(&a->assigned_worker_idx, worker_idx));
+        atomic_store(&a->deadline_ms, 0.0);
+        Log(Log_Debug, "Master: Backup copy of item %d for idx %d", found,
+            worker_idx);
+        return found;
+    }
+}
+
+int master_worker_outstanding(MasterState *ms, int worker_idx) {
+    if (worker_idx < 0) return 0;
+    pthread_mutex_lock(&ms->lease_lock);
+    const int outstanding = worker_lease(ms, worker_idx)->outstanding;
+    pthread_mutex_unlock(&ms->lease_lock);
+    return outstanding;
+}
+
+void master_item_returned(MasterState *ms, int worker_idx) {
+    if (worker_idx < 0) return;
+    pthread_mutex_lock(&ms->lease_lock);
+    WorkerLease *lease = worker_lease(ms, worker_idx);
+    lease->outstanding = MAX(lease->outstanding - 1, 0);
+    pthread_mutex_unlock(&ms->lease_lock);
+}
+
+// Index of the registered worker named name, -1 for none, and its thread
+// count. ms->workers grows (and moves) under lease_lock as workers register,
+// so it is only read under it.
+static int find_worker(MasterState *ms, const char *name, long *thread_count) {
+    int found = -1;
+    pthread_mutex_lock(&ms->lease_lock);
+    for (size_t wi = 0; name && wi < ms->workers.size; wi++) {
+        if (strcmp(ms->workers.items[wi].name, name) == 0) {
+            found = (int)wi;
+            if (thread_count)
+                *thread_count = ms->workers.items[wi].thread_count;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ms->lease_lock);
+    return found;
+}
+
+void master_worker_seen(MasterState *ms, int worker_idx) {
+    if (worker_idx < 0) return;
+    const double now = master_ms(ms);
+    pthread_mutex_lock(&ms->lease_lock);
+    worker_lease(ms, worker_idx)->seen_ms = now;
+    pthread_mutex_unlock(&ms->lease_lock);
+}
+
+int master_expire_leases(MasterState *ms) {
+    const double now = master_ms(ms);
+    double checked = atomic_load(&ms->expiry_checked_ms);
+    if (now - checked < LEASE_CHECK_MS ||
+        !atomic_compare_exchange_strong(&ms->expiry_checked_ms, &checked, now))
+        return 0;
+
+    int expired = 0;
+    pthread_mutex_lock(&ms->lease_lock);
+    for (int i = 0; i < ms->tile_count; i++) {
+        TileAssignment *a = &ms->tiles[i];
+        const int idx = atomic_load(&a->assigned_worker_idx);
+        if (idx == -1 || atomic_load(&a->status) != TILE_IN_FLIGHT) continue;
+        const double deadline = atomic_load(&a->deadline_ms);
+        const bool late = deadline > 0 && now > deadline;
+        const bool dead = idx >= 0 && now - worker_lease(ms, idx)->seen_ms >
+                                          WORKER_TIMEOUT_MS;
+        if (!late && !dead) continue;
+        TileStatus expected = TILE_IN_FLIGHT;
+        if (atomic_compare_exchange_strong(&a->status, &expected,
+                                           TILE_UNASSIGNED)) {
+            add_cost_left(ms, item_cost(a));
+            requeue_item(ms, i);
+            if (idx >= 0) {
+                WorkerLease *lease = worker_lease(ms, idx);
+                lease->outstanding = MAX(lease->outstanding - 1, 0);
+            }
+            expired++;
+        }
+    }
+    pthread_mutex_unlock(&ms->lease_lock);
+    if (expired > 0) {
+        Log(Log_Warn,
+            "Master: Requeued %d items of workers past their lease or not "
+            "heard from",
+            expired);
+    }
+    return expired;
+}
+
+// The batch starts at the worker's thread count and then follows its
+// measured time per item, growing at most 2x per lease. It never exceeds a
+// fair share of the fresh items left, so the tail still spreads over every
+// machine. The cost of the items over the time until the next lease
+// measures the worker's rate.
+int master_lease_items(MasterState *ms, int worker_idx, long thread_count,
+                       int *items, int max) {
+    master_expire_leases(ms);
+    if (worker_idx < 0) {
+        items[0] = master_claim_item(ms, worker_idx,
+                                     master_node_rate(ms, worker_idx));
+        if (items[0] < 0) items[0] = master_claim_backup(ms, worker_idx);
+        if (items[0] < 0) return 0;
+        atomic_store(&ms->tiles[items[0]].deadline_ms,
+                     master_ms(ms) + LEASE_DEADLINE_MIN_MS);
+        return 1;
+    }
+
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    pthread_mutex_lock(&ms->lease_lock);
+    WorkerLease *lease = worker_lease(ms, worker_idx);
+    lease->seen_ms = timersub_ms(&now, &ms->start);
+    if (lease->last_batch > 0) {
+        const double interval_ms =
+            MAX(timersub_ms(&now, &lease->last_request), 1e-3);
+        const double item_ms = interval_ms / lease->last_batch;
+        lease->item_ms = lease->item_ms > 0
+                             ? lease->item_ms * (1.0 - LEASE_SMOOTHING) +
+                                   item_ms * LEASE_SMOOTHING
+                             : item_ms;
+        lease->rate = smoothed(lease->rate, lease->last_cost / interval_ms);
+    }
+    update_rates(ms);
+    const double rate = node_rate(ms, worker_idx);
+
+    double batch = lease->item_ms > 0 ? LEASE_TARGET_MS / lease->item_ms
+                                      : (double)thread_count;
+    if (lease->last_batch > 0) batch = MIN(batch, 2.0 * lease->last_batch);
+    const int machines = (int)ms->workers.size + 1;
+    const int fair = work_queue_size(&ms->queue) / (2 * machines);
+    const int size = (int)MAX(MIN(MIN(batch, (double)fair), (double)max), 1.0);
+
+    int count = 0;
+    double cost = 0;
+    while (count < size) {
+        const int item = master_claim_item(ms, worker_idx, rate);
+        if (item < 0) break;
+        items[count++] = item;
+        cost += item_cost(&ms->tiles[item]);
+    }
+    if (count == 0) {
+        items[0] = master_claim_backup(ms, worker_idx);
+        count = items[0] >= 0 ? 1 : 0;
+        if (count) cost = item_cost(&ms->tiles[items[0]]);
+    }
+    const double expected_ms = lease->item_ms > 0 ? lease->item_ms * count : 0;
+    const double deadline =
+        lease->seen_ms +
+        MAX(LEASE_DEADLINE_FACTOR * expected_ms, LEASE_DEADLINE_MIN_MS);
+    for (int i = 0; i < count; i++)
+        atomic_store(&ms->tiles[items[i]].deadline_ms, deadline);
+    lease->last_request = now;
+    lease->last_batch = count;
+    lease->outstanding += count;
+    lease->last_cost = cost;
+    pthread_mutex_unlock(&ms->lease_lock);
+    return count;
+}
+
+void master_release_item(MasterState *ms, int item) {
+    TileStatus expected = TILE_IN_FLIGHT;
+    if (atomic_compare_exchange_strong(&ms->tiles[item].status, &expected,
+                                       TILE_UNASSIGNED)) {
+        add_cost_left(ms, item_cost(&ms->tiles[item]));
+        requeue_item(ms, item);
+    }
+}
+
+void master_set_relay(MasterState *ms,
+                      void (*forward)(MasterState *ms, int item,
+                                      const float *sums),
+                      void *arg) {
+    ms->forward = forward;
+    ms->forward_arg = arg;
+    // completed stands for not held, until leased from upstream
+    for (int i = 0; i < ms->tile_count; i++)
+        atomic_store(&ms->tiles[i].status, TILE_COMPLETED);
+    work_queue_clear(&ms->queue);
+    atomic_store(&ms->cost_left, 0.0);
+}
+
+bool master_relay_item(MasterState *ms, const WorkerWork *work) {
+    if (work->tile_id < 0 || work->tile_id >= ms->tile_count ||
+        work->frame < 0 || work->frame >= ms->frame_count)
+        return false;
+    TileAssignment *a = &ms->tiles[work->tile_id];
+    if (atomic_load(&a->status) != TILE_COMPLETED) return false;
+    // not held, so nobody else looks at the item until it is queued. An
+    // entry left queued from an earlier lease only reads the status.
+    a->tile = work->tile;
+    a->frame = work->frame;
+    a->sample_begin = work->sample_begin;
+    a->sample_end = work->sample_end;
+    a->cost = 0;
+    atomic_store(&a->claims, 0);
+    atomic_store(&a->assigned_worker_idx, -3);
+    atomic_store(&a->prev_worker_idx, -3);
+    atomic_store(&a->status, TILE_UNASSIGNED);
+    add_cost_left(ms, item_cost(a));
+    requeue_item(ms, work->tile_id);
+    return true;
+}
+
+// Pool task writing out a completed animation frame
+static void export_master_frame(void *arg) {
+    MasterFrame *frame = arg;
+    MasterState *ms = frame->ms;
+    const State *state = ms->state;
+    float *image = malloc(state->width * state->height * 3 * sizeof(float));
+    if (image && ms->frame_output) {
+        resolve_accum_into(ms->work, frame->accum, frame->tile_samples, image);
+        char *name = frame_file_name(ms->frame_output, frame->index);
+        if (!export_image(name, image, state->width, state->height,
+                          &state->tonemap))
+            atomic_store(&ms->export_failed, true);
+        free(name);
+    } else if (!image) {
+        Log(Log_Error, "export_master_frame: Memory allocation failed");
+        atomic_store(&ms->export_failed, true);
+    }
+    free(image);
+    free(frame->accum);
+    free(frame->tile_samples);
+    frame->accum = NULL;
+    frame->tile_samples = NULL;
+}
+
+// Add an item's rgb sums (tile sized, row major) into the accumulation
+bool master_merge_result(MasterState *ms, int item, const float *sums) {
+    TileAssignment *a = &ms->tiles[item];
+    MasterFrame *frame = &ms->frames[a->frame];
+    const Tile tile = a->tile;
+    // in flight, or requeued after its lease expired. Expiry counted a
+    // requeued item as left again, and its queue entry is dropped by the
+    // claim that finds it no longer unassigned.
+    TileStatus expected = TILE_IN_FLIGHT;
+    if (!atomic_compare_exchange_strong(&a->status, &expected, TILE_MERGING)) {
+        expected = TILE_UNASSIGNED;
+        if (atomic_load(&a->claims) == 0 ||
+            !atomic_compare_exchange_strong(&a->status, &expected,
+                                            TILE_MERGING))
+            return false;
+        add_cost_left(ms, -item_cost(a));
+    }
+    if (ms->forward) {
+        ms->forward(ms, item, sums);
+        atomic_store(&a->status, TILE_COMPLETED);
+        atomic_fetch_add(&ms->items_completed, 1);
+        return true;
+    }
+
+    pthread_mutex_lock(&ms->accum_lock);
+    if (!frame->accum) {
+        frame->accum = calloc(ms->state->width * ms->state->height * 3,
+                              sizeof(*frame->accum));
+        frame->tile_samples =
+            calloc(ms->work->tile_count, sizeof(*frame->tile_samples));
+        if (!frame->accum || !frame->tile_samples) {
+            Log(Log_Error, "master_merge_result: Memory allocation failed");
+            exit(1);
+        }
+    }
+    for (int y = 0; y < tile.th; y++) {
+        float *dst =
+            &frame->accum[((tile.y + y) * ms->image_width + tile.x) * 3];
+        const float *src = &sums[y * tile.tw * 3];
+        for (int i = 0; i < tile.tw * 3; i++) dst[i] += src[i];
+    }
+    frame->tile_samples[a->tile_idx] += a->sample_end - a->sample_begin;
+    pthread_mutex_unlock(&ms->accum_lock);
+
+    atomic_store(&a->status, TILE_COMPLETED);
+    atomic_fetch_add(&ms->items_completed, 1);
+    // a still is resolved by the caller of master_render
+    if (atomic_fetch_sub(&frame->items_left, 1) == 1 &&
+        ms->scene->frames.size > 0)
+        pool_spawn(&ms->exports, export_master_frame, frame);
+    return true;
+}
+
+static inline uint32_t parse_hex_u32(const char *hex) {
+    uint32_t v = 0;
+    for (int i = 0; i < 8; i++) {
+        const char c = hex[i];
+        v = (v << 4) | (uint32_t)(c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);
+    }
+    return v;
+}
+
 static enum MHD_Result send_response(struct MHD_Connection *connection,
                                      unsigned int status, const char *msg) {
     struct MHD_Response *resp = MHD_create_response_from_buffer(
@@ -36,35 +770,642 @@ static void free_conn_info(void *cls, struct MHD_Connection *connection,
 
     if (ci->tmpfile) fclose(ci->tmpfile);
 
+    free(ci->pixels);
+    free(ci->payload);
     free(ci);
     *con_cls = NULL;
 }
 
-static enum MHD_Result answer_get_request(
-    void *cls, struct MHD_Connection *connection, const char *url,
-    const char *method, const char *version, const char *upload_data,
-    unsigned long *upload_data_size, void **con_cls) {
+// A pre-serialized answer, copied since the scene may be evicted before it
+// is sent
+static enum MHD_Result send_body(struct MHD_Connection *connection,
+                                 const AssetBody *body, const char *etag) {
+    struct MHD_Response *resp = MHD_create_response_from_buffer(
+        body->size, body->data, MHD_RESPMEM_MUST_COPY);
+    MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE,
+                            "application/octet-stream");
+    if (etag) MHD_add_response_header(resp, MHD_HTTP_HEADER_ETAG, etag);
+    enum MHD_Result ret = MHD_queue_response(connection, MHD_HTTP_OK, resp);
+    MHD_destroy_response(resp);
+    return ret;
+}
+
+// GET /api/scene: 304 when If-None-Match lists the payload's hash, else the
+// SceneHeader answer through the codec asked for, or the JSON answer
+static enum MHD_Result send_scene(struct MHD_Connection *connection,
+                                  MasterAPIContext *context) {
+    SceneBundle *bundle = context->scene->bundle;
+    if (!bundle) {
+        return send_response(connection, MHD_HTTP_INTERNAL_SERVER_ERROR,
+                             "{\"error\":\"Out of memory\"}");
+    }
+    char etag[ASSET_HASH_LEN + 3];
+    snprintf(etag, sizeof(etag), "\"%s\"", bundle->tag);
+    const char *cached = MHD_lookup_connection_value(
+        connection, MHD_HEADER_KIND, MHD_HTTP_HEADER_IF_NONE_MATCH);
+    if (cached && strstr(cached, etag)) {
+        Log(Log_Info, "Master: Scene %u not modified for worker",
+            context->scene->scene_crc);
+        struct MHD_Response *resp =
+            MHD_create_response_from_buffer(0, NULL, MHD_RESPMEM_PERSISTENT);
+        MHD_add_response_header(resp, MHD_HTTP_HEADER_ETAG, etag);
+        enum MHD_Result ret =
+            MHD_queue_response(connection, MHD_HTTP_NOT_MODIFIED, resp);
+        MHD_destroy_response(resp);
+        return ret;
+    }
+
+    Log(Log_Info, "Master: Serving scene %u to worker",
+        context->scene->scene_crc);
+    const char *codec_c = MHD_lookup_connection_value(
+        connection, MHD_GET_ARGUMENT_KIND, "codec");
+    const Codec codec = codec_c ? codec_from_name(codec_c) : CODEC_COUNT;
+    const char *json = codec == CODEC_COUNT ? scene_bundle_json(bundle) : NULL;
+    if (json) return send_response(connection, MHD_HTTP_OK, json);
+
+    double codec_ms = 0;
+    const AssetBody *body = NULL;
+    if (codec < CODEC_COUNT) body = scene_bundle_body(bundle, codec, &codec_ms);
+    if (!body) {
+        return send_response(connection, MHD_HTTP_INTERNAL_SERVER_ERROR,
+                             "{\"error\":\"Out of memory\"}");
+    }
+    codec_stats_add(&context->scene_stats, bundle->payload_size,
+                    body->size - sizeof(SceneHeader), codec_ms);
+    return send_body(connection, body, etag);
+}
+
+// GET /api/asset?hash=<hash>&codec=<name>: a file of the current scene
+static enum MHD_Result send_asset(struct MHD_Connection *connection,
+                                  MasterAPIContext *context) {
+    const char *hash = MHD_lookup_connection_value(
+        connection, MHD_GET_ARGUMENT_KIND, "hash");
+    const char *codec_c = MHD_lookup_connection_value(
+        connection, MHD_GET_ARGUMENT_KIND, "codec");
+    const Codec codec = codec_c ? codec_from_name(codec_c) : CODEC_NONE;
+    SceneBundle *bundle = context->scene->bundle;
+    if (!hash || codec == CODEC_COUNT || !bundle) {
+        return send_response(connection, MHD_HTTP_BAD_REQUEST,
+                             "{\"error\":\"/api/asset bad parameters\"}");
+    }
+    size_t raw = 0;
+    double codec_ms = 0;
+    const AssetBody *body =
+        scene_bundle_asset(bundle, hash, codec, &raw, &codec_ms);
+    if (!body) {
+        Log(Log_Warn, "Master: No asset %s in scene %u", hash,
+            context->scene->scene_crc);
+        return send_response(connection, MHD_HTTP_NOT_FOUND,
+                             "{\"error\":\"no such asset\"}");
+    }
+    codec_stats_add(&context->scene_stats, raw,
+                    body->size - sizeof(AssetHeader), codec_ms);
+    char etag[ASSET_HASH_LEN + 3];
+    snprintf(etag, sizeof(etag), "\"%s\"", hash);
+    return send_body(connection, body, etag);
+}
+
+// Serve and relay modes swap the running job in and out
+static bool swaps_jobs(const MasterAPIContext *context) {
+    return context->jobs || context->relay;
+}
+
+// {"job_id": id, "items": [WorkerWork, ..]} of leased items
+static cJSON *lease_json(const MasterState *ms, int job_id, const int *leased,
+                         int count) {
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddNumberToObject(root, "job_id", job_id);
+    cJSON *items = cJSON_AddArrayToObject(root, "items");
+    for (int i = 0; i < count; i++) {
+        const TileAssignment *item = &ms->tiles[leased[i]];
+        const Tile tile = item->tile;
+        cJSON *itemj = cJSON_CreateObject();
+        cJSON_AddNumberToObject(itemj, "tile_id", leased[i]);
+        cJSON_AddNumberToObject(itemj, "frame", item->frame);
+        cJSON *tilej = cJSON_CreateObject();
+        cJSON_AddNumberToObject(tilej, "x", tile.x);
+        cJSON_AddNumberToObject(tilej, "y", tile.y);
+        cJSON_AddNumberToObject(tilej, "tw", tile.tw);
+        cJSON_AddNumberToObject(tilej, "th", tile.th);
+        cJSON_AddItemToObject(itemj, "tile", tilej);
+        cJSON_AddNumberToObject(itemj, "sample_begin", item->sample_begin);
+        cJSON_AddNumberToObject(itemj, "sample_end", item->sample_end);
+        cJSON_AddItemToArray(items, itemj);
+    }
+    return root;
+}
+
+// The master's side of a worker's /api/channel, read by the server whenever
+// the connection can send more
+typedef struct {
+    MasterAPIContext *context;
+    struct MHD_Connection *connection;
+    char *worker_id;
+    long thread_count;
+    int worker_idx;  // in the MasterState of idx_job, -1 until found
+    int idx_job;
+    unsigned int scene_crc;  // the worker has loaded
+    bool leased;             // items of job_id, until cancelled
+    int job_id;
+    bool done;  // the stream ends after the line being sent
+    struct timeval last_sent;
+    char *line;  // being sent, from sent on
+    size_t size, sent;
+} Channel;
+
+Vector(Channel *, Channels);
+
+// Channels with nothing to push are suspended rather than waited on, so idle
+// workers cost no server thread. A result resumes its worker's channel, the
+// waker thread all of them on job changes and every CHANNEL_POLL_MS (pings,
+// expired leases).
+static struct {
+    pthread_mutex_t lock;
+    Channels parked;
+    bool stopping;  // the server is going down, channels end
+    bool waking;    // the waker thread runs
+    pthread_t waker;
+} channel_park = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+// Resume the parked channels of worker_id, or all of them when NULL. False
+// once the server stops.
+static bool channels_resume(const char *worker_id) {
+    Channels woken;
+    vec_init(&woken);
+    pthread_mutex_lock(&channel_park.lock);
+    size_t kept = 0;
+    for (size_t i = 0; i < channel_park.parked.size; i++) {
+        Channel *ch = channel_park.parked.items[i];
+        if (!worker_id || strcmp(ch->worker_id, worker_id) == 0)
+            vec_push(&woken, ch);
+        else
+            channel_park.parked.items[kept++] = ch;
+    }
+    channel_park.parked.size = kept;
+    const bool stopping = channel_park.stopping;
+    pthread_mutex_unlock(&channel_park.lock);
+
+    // suspended until here, so still alive
+    for (size_t i = 0; i < woken.size; i++)
+        MHD_resume_connection(woken.items[i]->connection);
+    vec_free(&woken);
+    return !stopping;
+}
+
+static void *channel_waker(void *arg) {
+    MasterAPIContext *context = arg;
+    do {
+        const struct timespec until = deadline_ms(CHANNEL_POLL_MS);
+        pthread_mutex_lock(&context->job_lock);
+        pthread_cond_timedwait(&context->channel_wake, &context->job_lock,
+                               &until);
+        pthread_mutex_unlock(&context->job_lock);
+    } while (channels_resume(NULL));
+    return NULL;
+}
+
+// Suspend the channel from its content reader until resumed, false when the
+// server stops
+static bool channel_suspend(Channel *ch) {
+    // suspended before it is listed, resumes only follow suspends
+    MHD_suspend_connection(ch->connection);
+    pthread_mutex_lock(&channel_park.lock);
+    const bool stopping = channel_park.stopping;
+    if (!stopping) vec_push(&channel_park.parked, ch);
+    pthread_mutex_unlock(&channel_park.lock);
+    if (stopping) MHD_resume_connection(ch->connection);
+    return !stopping;
+}
+
+// The next line for the worker, NULL when there is nothing to push.
+// Leases come from the job pinned like for a request.
+static char *channel_event(Channel *ch) {
+    MasterAPIContext *context = ch->context;
+    pthread_mutex_lock(&context->job_lock);
+    MasterState *ms = context->master_state;
+    if (ms) context->job_users++;
+    const int job_id = context->job_id;
+    const unsigned int scene_crc = ms ? context->scene->scene_crc : 0;
+    pthread_mutex_unlock(&context->job_lock);
+
+    cJSON *root = NULL;
+    const bool cancelled = ms && atomic_load(&ms->cancelled);
+    if (ch->leased && (job_id != ch->job_id || cancelled)) {
+        root = cJSON_CreateObject();
+        cJSON_AddStringToObject(root, "type", "cancel");
+        cJSON_AddNumberToObject(root, "job_id", ch->job_id);
+        ch->leased = false;
+    } else if (!ms || cancelled) {
+        // serve mode between jobs, nothing to push
+    } else if (scene_crc != ch->scene_crc) {
+        root = cJSON_CreateObject();
+        cJSON_AddStringToObject(root, "type", "scene");
+        cJSON_AddNumberToObject(root, "scene_crc", scene_crc);
+        ch->done = true;  // the worker reconnects once it has the scene
+    } else if (!swaps_jobs(context) &&
+               atomic_load(&ms->items_completed) >= ms->tile_count) {
+        root = cJSON_CreateObject();
+        cJSON_AddStringToObject(root, "type", "done");
+        ch->done = true;
+    } else {
+        if (ch->idx_job != job_id || ch->worker_idx < 0) {
+            ch->idx_job = job_id;
+            ch->worker_idx = find_worker(ms, ch->worker_id, NULL);
+        }
+        const int worker_idx = ch->worker_idx;
+        if (worker_idx >= 0) {
+            // a relay registers again as its own workers come and go
+            pthread_mutex_lock(&ms->lease_lock);
+            ch->thread_count = ms->workers.items[worker_idx].thread_count;
+            pthread_mutex_unlock(&ms->lease_lock);
+        }
+        int leased[LEASE_MAX_ITEMS];
+        const int count =
+            worker_idx >= 0 && master_worker_outstanding(ms, worker_idx) <
+                                   CHANNEL_PREFETCH * ch->thread_count
+                ? master_lease_items(ms, worker_idx, ch->thread_count, leased,
+                                     LEASE_MAX_ITEMS)
+                : 0;
+        if (count > 0) {
+            Log(Log_Debug, "Master: Pushed %d items (first %d) to '%s'", count,
+                leased[0], ch->worker_id);
+            root = lease_json(ms, job_id, leased, count);
+            cJSON_AddStringToObject(root, "type", "lease");
+            ch->leased = true;
+            ch->job_id = job_id;
+        }
+    }
+
+    if (ms) {
+        pthread_mutex_lock(&context->job_lock);
+        context->job_users--;
+        pthread_mutex_unlock(&context->job_lock);
+    }
+    if (!root) return NULL;
+    char *json = cJSON_PrintUnformatted(root);
+    cJSON_Delete(root);
+    return json;
+}
+
+static ssize_t channel_read(void *cls, uint64_t pos, char *buf, size_t max) {
+    UNUSED(pos);
+    Channel *ch = cls;
+    if (!ch->line) {
+        if (ch->done) return MHD_CONTENT_READER_END_OF_STREAM;
+        char *json = channel_event(ch);
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        if (!json && timersub_ms(&now, &ch->last_sent) >= CHANNEL_PING_MS)
+            json = strdup("{\"type\":\"ping\"}");
+        if (json) {
+            ch->size = strlen(json) + 1;
+            ch->line = realloc(json, ch->size);
+            if (!ch->line) {
+                free(json);
+                return MHD_CONTENT_READER_END_WITH_ERROR;
+            }
+            ch->line[ch->size - 1] = '\n';
+            ch->sent = 0;
+            ch->last_sent = now;
+        } else {
+            // called again once resumed
+            return channel_suspend(ch) ? 0
+                                       : MHD_CONTENT_READER_END_OF_STREAM;
+        }
+    }
+    const size_t n = MIN(max, ch->size - ch->sent);
+    memcpy(buf, ch->line + ch->sent, n);
+    ch->sent += n;
+    if (ch->sent == ch->size) {
+        free(ch->line);
+        ch->line = NULL;
+    }
+    return (ssize_t)n;
+}
+
+static void channel_free(void *cls) {
+    Channel *ch = cls;
+    Log(Log_Info, "Master: Channel of '%s' closed", ch->worker_id);
+    free(ch->line);
+    free(ch->worker_id);
+    free(ch);
+}
+
+// Whether a worker named name registered with the server, and its thread
+// count
+static bool registered_worker(MasterAPIContext *context, const char *name,
+                              long *thread_count) {
+    bool found = false;
+    pthread_mutex_lock(&context->job_lock);
+    for (size_t wi = 0; name && wi < context->workers.size; wi++) {
+        if (strcmp(context->workers.items[wi].name, name) == 0) {
+            found = true;
+            if (thread_count)
+                *thread_count = context->workers.items[wi].thread_count;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&context->job_lock);
+    return found;
+}
+
+// GET /api/channel, for registered workers only
+static enum MHD_Result open_channel(struct MHD_Connection *connection,
+                                    MasterAPIContext *context) {
+    const char *worker_id = MHD_lookup_connection_value(
+        connection, MHD_GET_ARGUMENT_KIND, "worker_id");
+    const char *scene_crc_c = MHD_lookup_connection_value(
+        connection, MHD_GET_ARGUMENT_KIND, "scene_crc");
+    Channel *ch = calloc(1, sizeof(*ch));
+    if (!ch) {
+        return send_response(connection, MHD_HTTP_INTERNAL_SERVER_ERROR,
+                             "{\"error\":\"Out of memory\"}");
+    }
+    ch->context = context;
+    ch->connection = connection;
+    ch->worker_idx = -1;
+    ch->scene_crc = scene_crc_c ? strtoul(scene_crc_c, NULL, 10) : 0;
+    gettimeofday(&ch->last_sent, NULL);
+    if (registered_worker(context, worker_id, &ch->thread_count))
+        ch->worker_id = strdup(worker_id);
+    if (!ch->worker_id) {
+        free(ch);
+        return send_response(connection, MHD_HTTP_NOT_FOUND,
+                             "{\"error\":\"worker not registered\"}");
+    }
+
+    Log(Log_Info, "Master: Channel of '%s' open", ch->worker_id);
+    struct MHD_Response *resp = MHD_create_response_from_callback(
+        MHD_SIZE_UNKNOWN, 4096, channel_read, ch, channel_free);
+    MHD_add_response_header(resp, MHD_HTTP_HEADER_CONTENT_TYPE,
+                            "application/x-ndjson");
+    enum MHD_Result ret = MHD_queue_response(connection, MHD_HTTP_OK, resp);
+    MHD_destroy_response(resp);
+    return ret;
+}
+
+// Checks a worker's result against its item and merges it. h carries the
+// ids and sample count (tw and th are checked when non zero), sums holds
+// value_count floats. Returns the HTTP status, with the reason in *refused
+// unless OK.
+static unsigned int accept_result(MasterAPIContext *context,
+                                  const char *worker_name,
+                                  const ResultHeader *h, const float *sums,
+                                  size_t value_count, const char **refused) {
+    if (h->job_id != context->job_id) {
+        Log(Log_Warn, "Master: Dropping result from '%s' for finished job %d",
+            worker_name, h->job_id);
+        *refused = "Job is not running";
+        return MHD_HTTP_CONFLICT;
+    }
+
+    const int tid = h->tile_id;
+    struct MasterState *ms = context->master_state;
+    if (tid < 0 || tid >= ms->tile_count) {
+        Log(Log_Warn, "Master: Worker sent invalid tile_id %d", tid);
+        *refused = "Invalid tile_id";
+        return MHD_HTTP_BAD_REQUEST;
+    }
+
+    const int worker_idx = find_worker(ms, worker_name, NULL);
+    const Tile tile = ms->tiles[tid].tile;
+    const int expected_samples =
+        ms->tiles[tid].sample_end - ms->tiles[tid].sample_begin;
+    if (worker_idx < 0) {
+        Log(Log_Warn, "Master: Dropping result from unregistered worker '%s'",
+            worker_name);
+        *refused = "Worker not registered";
+        return MHD_HTTP_NOT_FOUND;
+    }
+    if (atomic_load(&ms->tiles[tid].assigned_worker_idx) != worker_idx &&
+        atomic_load(&ms->tiles[tid].prev_worker_idx) != worker_idx) {
+        Log(Log_Warn,
+            "Master: Dropping result for item %d from '%s', it was never "
+            "leased to it",
+            tid, worker_name);
+        *refused = "Item not leased to worker";
+        return MHD_HTTP_CONFLICT;
+    }
+
+    const size_t expected_values = (size_t)tile.tw * tile.th * 3;
+    if (value_count != expected_values || h->samples != expected_samples ||
+        (h->tw && (h->tw != tile.tw || h->th != tile.th))) {
+        Log(Log_Warn,
+            "Master: Result mismatch. Expected %zu values / %d samples, got "
+            "%zu / %d",
+            expected_values, expected_samples, value_count, h->samples);
+        *refused = "Pixel data length mismatch";
+        return MHD_HTTP_BAD_REQUEST;
+    }
+
+    master_worker_seen(ms, worker_idx);
+    master_item_returned(ms, worker_idx);
+    const bool merged = master_merge_result(ms, tid, sums);
+    // the worker's channel may push another lease, every channel announces
+    // the end
+    channels_resume(worker_name);
+    if (atomic_load(&ms->items_completed) >= ms->tile_count)
+        pthread_cond_broadcast(&context->channel_wake);
+    if (!merged) {
+        // usually the slower of an item and its backup copy
+        Log(Log_Debug,
+            "Master: Dropping result for item %d from '%s', it is not in "
+            "flight",
+            tid, worker_name);
+        *refused = "Item not in flight";
+        return MHD_HTTP_CONFLICT;
+    }
+
+    const int assigned = atomic_load(&ms->tiles[tid].assigned_worker_idx);
+    Log(Log_Debug,
+        "Master: Received result for item %d from '%s' (idx %d), assigned "
+        "idx was %d",
+        tid, worker_name, worker_idx, assigned);
+    return MHD_HTTP_OK;
+}
+
+static enum MHD_Result send_result_answer(struct MHD_Connection *connection,
+                                          unsigned int status,
+                                          const char *refused) {
+    if (status == MHD_HTTP_OK)
+        return send_response(connection, status, "{\"success\":true}");
+    return send_response(connection, status,
+                         temp_sprintf("{\"error\":\"%s\"}", refused));
+}
+
+// Decodes and checks the binary result just received and merges it, then
+// readies the connection for the next result of the body
+static void finish_result(ConnectionInfo *ci, MasterAPIContext *context,
+                          const char *worker_name) {
+    const ResultHeader *h = &ci->header;
+    const char *refused = NULL;
+    unsigned int status = MHD_HTTP_BAD_REQUEST;
+    if (ci->payload) {
+        struct timeval start, end;
+        gettimeofday(&start, NULL);
+        if (!codec_decode(h->codec, ci->payload, h->payload_bytes,
+                          RESULT_STRIDE, ci->pixels, ci->pixel_bytes))
+            refused = "Malformed encoded pixels";
+        gettimeofday(&end, NULL);
+        codec_stats_add(&context->result_stats, ci->pixel_bytes,
+                        h->payload_bytes, timersub_ms(&end, &start));
+    } else {
+        codec_stats_add(&context->result_stats, ci->pixel_bytes,
+                        ci->pixel_bytes, 0.0);
+    }
+    const size_t value_count = ci->pixel_bytes / sizeof(float);
+    if (!refused && result_checksum(ci->pixels, value_count) != h->checksum)
+        refused = "Checksum mismatch";
+    if (refused) {
+        Log(Log_Warn, "Master: /api/result/bin refused: %s", refused);
+    } else {
+        status = accept_result(context, worker_name, h, ci->pixels,
+                               value_count, &refused);
+    }
+    if (status != MHD_HTTP_OK && !ci->refused) {
+        ci->refused = refused;
+        ci->refused_status = status;
+    }
+    ci->results++;
+    free(ci->pixels);
+    free(ci->payload);
+    ci->pixels = NULL;
+    ci->payload = NULL;
+    ci->received = 0;
+}
+
+// Takes an upload chunk of binary results: each header, then its pixel rows
+// copied straight into their buffer, or the encoded rows into payload, the
+// result being merged once complete. Refused uploads are drained unread.
+static void receive_result_chunk(ConnectionInfo *ci, MasterAPIContext *context,
+                                 const char *worker_name, const char *data,
+                                 size_t size) {
+    while (size > 0 && !ci->error) {
+        if (ci->received < sizeof(ci->header)) {
+            const size_t n = MIN(size, sizeof(ci->header) - ci->received);
+            memcpy((char *)&ci->header + ci->received, data, n);
+            ci->received += n;
+            data += n;
+            size -= n;
+            if (ci->received < sizeof(ci->header)) return;
+
+            const ResultHeader *h = &ci->header;
+            if (h->magic != RESULT_MAGIC || h->format != RESULT_FORMAT_F32) {
+                ci->error = "Unknown result format";
+                return;
+            }
+            if (h->tw == 0 || h->th == 0 || h->tw > TILE_WIDTH ||
+                h->th > TILE_HEIGHT) {
+                ci->error = "Invalid tile size";
+                return;
+            }
+            ci->pixel_bytes = (size_t)h->tw * h->th * RESULT_STRIDE;
+            if (h->codec >= CODEC_COUNT || h->payload_bytes == 0 ||
+                (h->codec == CODEC_NONE &&
+                 h->payload_bytes != ci->pixel_bytes) ||
+                h->payload_bytes > codec_bound(h->codec, ci->pixel_bytes)) {
+                ci->error = "Invalid payload encoding";
+                return;
+            }
+            if (ci->results == RESULT_BATCH_MAX) {
+                ci->error = "Too many results";
+                return;
+            }
+            ci->pixels = malloc(ci->pixel_bytes);
+            if (h->codec != CODEC_NONE) ci->payload = malloc(h->payload_bytes);
+            if (!ci->pixels || (h->codec != CODEC_NONE && !ci->payload)) {
+                ci->error = "Out of memory";
+                return;
+            }
+        }
+
+        const size_t offset = ci->received - sizeof(ci->header);
+        const size_t n = MIN(size, ci->header.payload_bytes - offset);
+        uint8_t *dst = ci->payload ? ci->payload : (uint8_t *)ci->pixels;
+        memcpy(dst + offset, data, n);
+        ci->received += n;
+        data += n;
+        size -= n;
+        if (offset + n == ci->header.payload_bytes)
+            finish_result(ci, context, worker_name);
+    }
+}
+
+// worker_id of a result upload
+static const char *result_worker(struct MHD_Connection *connection) {
+    const char *name = MHD_lookup_connection_value(
+        connection, MHD_GET_ARGUMENT_KIND, "worker_id");
+    return name ? name : "worker";
+}
+
+// Answers a binary upload once all of it is in: the first result refused,
+// if any
+static enum MHD_Result answer_binary_result(struct MHD_Connection *connection,
+                                            ConnectionInfo *ci) {
+    if (!ci->error && (ci->received != 0 || ci->results == 0))
+        ci->error = "Pixel data length mismatch";
+    if (ci->error) {
+        Log(Log_Warn, "Master: /api/result/bin refused: %s", ci->error);
+        return send_response(connection, MHD_HTTP_BAD_REQUEST,
+                             temp_sprintf("{\"error\":\"%s\"}", ci->error));
+    }
+    return send_result_answer(connection,
+                              ci->refused ? ci->refused_status : MHD_HTTP_OK,
+                              ci->refused);
+}
+
+// Take the figures of a registered machine of the same name, false when
+// there is none
+static bool update_machine(Machines *machines, const MachineInfo *info) {
+    for (size_t i = 0; i < machines->size; i++) {
+        MachineInfo *m = &machines->items[i];
+        if (strcmp(m->name, info->name) != 0) continue;
+        m->perf = info->perf;
+        m->thread_count = info->thread_count;
+        m->simd = info->simd;
+        return true;
+    }
+    return false;
+}
+
+static enum MHD_Result answer_request(void *cls,
+                                     struct MHD_Connection *connection,
+                                     const char *url, const char *method,
+                                     const char *version,
+                                     const char *upload_data,
+                                     unsigned long *upload_data_size,
+                                     void **con_cls) {
     UNUSED(version);
     MasterAPIContext *context = cls;
     ConnectionInfo *ci = *con_cls;
 
     if (strcmp(method, "GET") == 0) {
-        if (strcmp(url, "/api/scene") == 0) {
-            Log(Log_Info, "Master: Serving scene %u to worker",
-                context->scene->scene_crc);
-            cJSON *root = cJSON_CreateObject();
-            cJSON_AddNumberToObject(root, "scene_crc",
-                                    context->scene->scene_crc);
-            cJSON_AddStringToObject(root, "scene_json",
-                                    context->scene->scene_json);
-            char *json = cJSON_PrintUnformatted(root);
-            cJSON_Delete(root);
+        if (strcmp(url, "/api/jobs") == 0 && context->jobs) {
+            const char *id_c = MHD_lookup_connection_value(
+                connection, MHD_GET_ARGUMENT_KIND, "id");
+            cJSON *jobs = id_c ? job_queue_job_json(context->jobs, atoi(id_c))
+                               : job_queue_json(context->jobs);
+            if (!jobs) {
+                return send_response(connection, MHD_HTTP_NOT_FOUND,
+                                     "{\"error\":\"no such job\"}");
+            }
+            char *json = cJSON_PrintUnformatted(jobs);
+            cJSON_Delete(jobs);
 
             enum MHD_Result ret = send_response(connection, MHD_HTTP_OK, json);
             free(json);
             return ret;
         }
 
+        if (strcmp(url, "/api/scene") == 0)
+            return send_scene(connection, context);
+
+        if (strcmp(url, "/api/asset") == 0)
+            return send_asset(connection, context);
+
+        if (strcmp(url, "/api/channel") == 0)
+            return open_channel(connection, context);
+
         if (strcmp(url, "/api/work") == 0) {
             const char *worker_id = MHD_lookup_connection_value(
                 connection, MHD_GET_ARGUMENT_KIND, "worker_id");
@@ -79,111 +1420,54 @@ static enum MHD_Result answer_get_request(
                                      badrequest);
             }
 
-            unsigned int scene_crc = atoi(scene_crc_c);
+            unsigned int scene_crc = strtoul(scene_crc_c, NULL, 10);
             if (context->scene->scene_crc != scene_crc) {
                 Log(Log_Warn,
                     "Master: Worker '%s' sent wrong scene CRC: %u (expected "
                     "%u)",
                     worker_id, scene_crc, context->scene->scene_crc);
-                const char *notfound =
-                    "{\"error\":\"/api/work wrong scene crc found\"}";
+                // the current crc tells serve mode workers to fetch the scene
+                const char *notfound = temp_sprintf(
+                    "{\"error\":\"/api/work wrong scene crc found\","
+                    "\"scene_crc\":%u}",
+                    context->scene->scene_crc);
                 return send_response(connection, MHD_HTTP_BAD_REQUEST,
                                      notfound);
             }
 
-            // Prefer using the MasterState tile assignments when available so
-            // master threads and the HTTP handlers coordinate through the
-            // same data structure.
             struct MasterState *ms = context->master_state;
-            if (!ms) {
-                // Fallback to legacy behaviour
-                int curr_tile =
-                    atomic_fetch_add(&context->work->tile_finished, 1);
-                if (curr_tile >= context->work->tile_count) {
-                    Log(Log_Info,
-                        "Master: Worker '%s' requested work but no tiles left",
-                        worker_id);
-                    const char *done =
-                        "{\"status\":\"/api/work all work done, no tiles "
-                        "left\"}";
-                    return send_response(connection, MHD_HTTP_OK, done);
-                }
-                Tile tile = context->work->tiles[curr_tile];
-                Log(Log_Debug, "Master: Assigned tile %d (%d,%d %dx%d) to '%s'",
-                    curr_tile, tile.x, tile.y, tile.tw, tile.th, worker_id);
-
-                cJSON *root = cJSON_CreateObject();
-                cJSON_AddNumberToObject(root, "tile_id", curr_tile);
-                cJSON *tilej = cJSON_CreateObject();
-                cJSON_AddNumberToObject(tilej, "x", tile.x);
-                cJSON_AddNumberToObject(tilej, "y", tile.y);
-                cJSON_AddNumberToObject(tilej, "tw", tile.tw);
-                cJSON_AddNumberToObject(tilej, "th", tile.th);
-                cJSON_AddItemToObject(root, "tile", tilej);
-                char *json = cJSON_PrintUnformatted(root);
-                cJSON_Delete(root);
-
-                enum MHD_Result ret =
-                    send_response(connection, MHD_HTTP_OK, json);
-                free(json);
-                return ret;
-            }
-
-            // find first TILE_UNASSIGNED
-            int found = -1;
-            int expected = 0;
-            while (!atomic_compare_exchange_strong(&ms->tile_assign_lock,
-                                                   &expected, 1)) {
-                expected = 0;
-            }
-            for (int i = 0; i < ms->tile_count; i++) {
-                if (ms->tiles[i].status == TILE_UNASSIGNED) {
-                    found = i;
-                    int worker_idx = -2;
-                    for (size_t wi = 0; wi < ms->workers.size; wi++) {
-                        if (strcmp(ms->workers.items[wi].name, worker_id) ==
-                            0) {
-                            worker_idx = (int)wi;
-                            break;
-                        }
-                    }
-                    ms->tiles[i].status = TILE_IN_FLIGHT;
-                    ms->tiles[i].assigned_worker_idx = worker_idx;
-                    break;
-                }
+            long thread_count = 1;
+            const int worker_idx = find_worker(ms, worker_id, &thread_count);
+            // results are only taken from registered workers
+            if (worker_idx < 0) {
+                Log(Log_Warn, "Master: /api/work from unregistered worker '%s'",
+                    worker_id);
+                return send_response(connection, MHD_HTTP_NOT_FOUND,
+                                     "{\"error\":\"worker not registered\"}");
             }
-            atomic_store(&ms->tile_assign_lock, 0);
 
-            if (found == -1) {
-                Log(Log_Info,
+            int leased[LEASE_MAX_ITEMS];
+            const int count = master_lease_items(ms, worker_idx, thread_count,
+                                                 leased, LEASE_MAX_ITEMS);
+
+            if (count == 0) {
+                Log(Log_Debug,
                     "Master: Worker '%s' requested work but no tiles left",
                     worker_id);
+                // a serve mode worker waits for the next job instead
                 const char *done =
-                    "{\"status\":\"/api/work all work done, no tiles left\"}";
+                    swaps_jobs(context)
+                        ? SERVE_IDLE
+                        : "{\"status\":\"/api/work all work done, no tiles "
+                          "left\"}";
                 return send_response(connection, MHD_HTTP_OK, done);
             }
 
-            Tile tile = ms->tiles[found].tile;
-            int assigned_idx = ms->tiles[found].assigned_worker_idx;
-            if (assigned_idx >= 0) {
-                Log(Log_Info,
-                    "Master: Assigned tile %d (%d,%d %dx%d) to '%s' (idx %d)",
-                    found, tile.x, tile.y, tile.tw, tile.th, worker_id,
-                    assigned_idx);
-            } else {
-                Log(Log_Info,
-                    "Master: Assigned tile %d (%d,%d %dx%d) to '%s' (external)",
-                    found, tile.x, tile.y, tile.tw, tile.th, worker_id);
-            }
-
-            cJSON *root = cJSON_CreateObject();
-            cJSON_AddNumberToObject(root, "tile_id", found);
-            cJSON *tilej = cJSON_CreateObject();
-            cJSON_AddNumberToObject(tilej, "x", tile.x);
-            cJSON_AddNumberToObject(tilej, "y", tile.y);
-            cJSON_AddNumberToObject(tilej, "tw", tile.tw);
-            cJSON_AddNumberToObject(tilej, "th", tile.th);
-            cJSON_AddItemToObject(root, "tile", tilej);
+            Log(Log_Debug,
+                "Master: Leased %d items (first %d) to '%s' (idx %d)", count,
+                leased[0], worker_id, worker_idx);
+
+            cJSON *root = lease_json(ms, context->job_id, leased, count);
             char *json = cJSON_PrintUnformatted(root);
             cJSON_Delete(root);
 
@@ -217,9 +1501,16 @@ static enum MHD_Result answer_get_request(
                 return send_response(connection, MHD_HTTP_CONTENT_TOO_LARGE,
                                      "Payload too large\n");
             }
+            ci->binary = strcmp(url, "/api/result/bin") == 0;
             *con_cls = ci;
             return MHD_YES;
         }
+        if (*upload_data_size != 0 && ci->binary) {
+            receive_result_chunk(ci, context, result_worker(connection),
+                                 upload_data, *upload_data_size);
+            *upload_data_size = 0;
+            return MHD_YES;
+        }
         if (*upload_data_size != 0) {
             size_t chunk = *upload_data_size;
 
@@ -266,7 +1557,7 @@ static enum MHD_Result answer_get_request(
         }
 
         cJSON *root = NULL;
-        if (!ci->processed) {
+        if (!ci->processed && !ci->binary) {
             ci->processed = 1;
             char *json_data = NULL;
 
@@ -284,6 +1575,15 @@ static enum MHD_Result answer_get_request(
             free(json_data);
         }
 
+        if (strcmp(url, "/api/heartbeat") == 0) {
+            cJSON_Delete(root);
+            const char *worker_id = MHD_lookup_connection_value(
+                connection, MHD_GET_ARGUMENT_KIND, "worker_id");
+            MasterState *ms = context->master_state;
+            if (ms) master_worker_seen(ms, find_worker(ms, worker_id, NULL));
+            return send_response(connection, MHD_HTTP_OK, "{\"success\":true}");
+        }
+
         if (strcmp(url, "/api/register") == 0) {
             if (!root) {
                 Log(Log_Warn, "Master: /api/register received invalid JSON");
@@ -306,7 +1606,6 @@ static enum MHD_Result answer_get_request(
                                      "{\"error\":\"Invalid JSON parameters\"}");
             }
 
-            // TODO: check unique names
             info.name = strdup(name->valuestring);
             info.perf = perf->valuedouble;
             info.thread_count = thread_count->valueint;
@@ -318,18 +1617,89 @@ static enum MHD_Result answer_get_request(
             }
             info.simd = simd->valueint;
 
-            Log(Log_Info, "Master: Registering worker '%s' (Perf: %.2f)",
-                info.name, info.perf);
+            // the master's codec when the worker has it, else none
+            Codec codec = CODEC_NONE;
+            const cJSON *codecs =
+                cJSON_GetObjectItemCaseSensitive(root, "codecs");
+            const cJSON *offered;
+            cJSON_ArrayForEach(offered, codecs) {
+                if (cJSON_IsString(offered) &&
+                    codec_from_name(offered->valuestring) == context->codec)
+                    codec = context->codec;
+            }
 
-            vec_push(&context->workers, info);
-            if (context->master_state) {
-                vec_push(&context->master_state->workers, info);
+            // a name registered before is updated in place, as a relay
+            // registers again when its own workers change. Serve mode copies
+            // the workers into each job's MasterState.
+            pthread_mutex_lock(&context->job_lock);
+            MasterState *ms = context->master_state;
+            if (ms) pthread_mutex_lock(&ms->lease_lock);
+            const bool known = update_machine(&context->workers, &info);
+            if (ms) update_machine(&ms->workers, &info);
+            if (!known) {
+                vec_push(&context->workers, info);
+                if (ms) vec_push(&ms->workers, info);
+            }
+            if (ms) pthread_mutex_unlock(&ms->lease_lock);
+            pthread_mutex_unlock(&context->job_lock);
+            if (known) {
+                Log(Log_Info,
+                    "Master: Worker '%s' registered again (Perf: %.2f, %ld "
+                    "threads)",
+                    info.name, info.perf, info.thread_count);
+                free(info.name);
+            } else {
                 Log(Log_Info,
-                    "Master: Worker '%s' mapped to index %zu in MasterState",
-                    info.name, context->master_state->workers.size - 1);
+                    "Master: Registering worker '%s' (Perf: %.2f, codec %s)",
+                    info.name, info.perf, codec_name(codec));
+            }
+
+            cJSON_Delete(root);
+            return send_response(
+                connection, MHD_HTTP_OK,
+                temp_sprintf("{\"success\":true,\"codec\":\"%s\"}",
+                             codec_name(codec)));
+        }
+
+        if (strcmp(url, "/api/jobs") == 0 && context->jobs) {
+            const cJSON *scene =
+                cJSON_GetObjectItemCaseSensitive(root, "scene");
+            const cJSON *output =
+                cJSON_GetObjectItemCaseSensitive(root, "output");
+            const cJSON *priority =
+                cJSON_GetObjectItemCaseSensitive(root, "priority");
+            if (!cJSON_IsString(scene) || !cJSON_IsString(output) ||
+                (priority && !cJSON_IsNumber(priority))) {
+                cJSON_Delete(root);
+                return send_response(connection, MHD_HTTP_BAD_REQUEST,
+                                     "{\"error\":\"Invalid JSON parameters\"}");
             }
+            const int id =
+                job_queue_submit(context->jobs, scene->valuestring,
+                                 output->valuestring,
+                                 priority ? priority->valueint : 0);
+            cJSON_Delete(root);
+            if (id < 0) {
+                return send_response(connection, MHD_HTTP_BAD_REQUEST,
+                                     "{\"error\":\"Cannot read scene, or "
+                                     "a path leaves the server "
+                                     "directory\"}");
+            }
+            return send_response(connection, MHD_HTTP_OK,
+                                 temp_sprintf("{\"job_id\":%d}", id));
+        }
 
+        if (strcmp(url, "/api/jobs/cancel") == 0 && context->jobs) {
+            const cJSON *id = cJSON_GetObjectItemCaseSensitive(root, "job_id");
+            const bool cancelled =
+                cJSON_IsNumber(id) && job_queue_cancel(context->jobs,
+                                                       id->valueint);
             cJSON_Delete(root);
+            if (!cancelled) {
+                return send_response(
+                    connection, MHD_HTTP_CONFLICT,
+                    "{\"error\":\"No queued or running job with that id\"}");
+            }
             return send_response(connection, MHD_HTTP_OK, "{\"success\":true}");
         }
 
@@ -342,120 +1712,53 @@ static enum MHD_Result answer_get_request(
 
             cJSON *name = cJSON_GetObjectItemCaseSensitive(root, "name");
             cJSON *tile_id = cJSON_GetObjectItemCaseSensitive(root, "tile_id");
+            cJSON *samples = cJSON_GetObjectItemCaseSensitive(root, "samples");
             cJSON *pixels = cJSON_GetObjectItemCaseSensitive(root, "pixels");
 
-            if (!cJSON_IsNumber(tile_id) || !cJSON_IsString(pixels) ||
-                !cJSON_IsString(name)) {
+            if (!cJSON_IsNumber(tile_id) || !cJSON_IsNumber(samples) ||
+                !cJSON_IsString(pixels) || !cJSON_IsString(name)) {
                 cJSON_Delete(root);
                 return send_response(connection, MHD_HTTP_BAD_REQUEST,
                                      "{\"error\":\"Invalid JSON parameters\"}");
             }
 
-            // TODO: check if worker registered, and for that tile
-            const char *worker_name = name->valuestring;
-
-            int tid = tile_id->valueint;
-            // TODO: check if tile already done
-            if (tid < 0 || tid >= context->work->tile_count) {
-                cJSON_Delete(root);
-                Log(Log_Warn, "Master: Worker sent invalid tile_id %d", tid);
-                return send_response(connection, MHD_HTTP_BAD_REQUEST,
-                                     "{\"error\":\"Invalid tile_id\"}");
-            }
-
-            struct MasterState *ms = context->master_state;
-            Tile tile;
-            int worker_idx = -1;
-            if (ms) {
-                for (size_t wi = 0; wi < ms->workers.size; wi++) {
-                    if (strcmp(ms->workers.items[wi].name, worker_name) == 0) {
-                        worker_idx = (int)wi;
-                        break;
-                    }
-                }
-            }
-            if (ms) {
-                if (tid < 0 || tid >= ms->tile_count) {
-                    cJSON_Delete(root);
-                    Log(Log_Warn, "Master: Worker sent invalid tile_id %d",
-                        tid);
-                    return send_response(connection, MHD_HTTP_BAD_REQUEST,
-                                         "{\"error\":\"Invalid tile_id\"}");
-                }
-                tile = ms->tiles[tid].tile;
-            } else {
-                tile = context->work->tiles[tid];
-            }
-
+            // 8 hex chars per float bit pattern, rgb
             const char *hex_pixels = pixels->valuestring;
-            int expected_len =
-                tile.tw * tile.th * 8;  // 8 hex chars per pixel (ARGB)
-
-            if ((int)strlen(hex_pixels) != expected_len) {
+            const size_t value_count = strlen(hex_pixels) / 8;
+            float *sums = malloc((value_count + 1) * sizeof(float));
+            if (!sums) {
                 cJSON_Delete(root);
-                Log(Log_Warn,
-                    "Master: Pixel data length mismatch. Expected %d, got %zu",
-                    expected_len, strlen(hex_pixels));
-                return send_response(
-                    connection, MHD_HTTP_BAD_REQUEST,
-                    "{\"error\":\"Pixel data length mismatch\"}");
-            }
-
-            // Parse hex string and write to image buffer
-            for (int y = 0; y < tile.th; y++) {
-                for (int x = 0; x < tile.tw; x++) {
-                    char hex[9];
-                    // FIX: better method (use binary POST or parse directly)
-                    memcpy(hex, hex_pixels, 8);
-                    hex[8] = '\0';
-                    uint32_t pixel = (uint32_t)strtoul(hex, NULL, 16);
-
-                    int image_idx;
-                    if (ms) {
-                        image_idx =
-                            (tile.y + y) * ms->image_width + (tile.x + x);
-                        ms->image[image_idx] = pixel;
-                    } else {
-                        image_idx =
-                            (tile.y + y) * context->state->width + (tile.x + x);
-                        context->state->image[image_idx] = pixel;
-                    }
-
-                    hex_pixels += 8;
-                }
+                return send_response(connection,
+                                     MHD_HTTP_INTERNAL_SERVER_ERROR,
+                                     "{\"error\":\"Out of memory\"}");
             }
-
-            // Mark tile as completed in MasterState if present and log mapping
-            if (ms) {
-                int expected = 0;
-                while (!atomic_compare_exchange_strong(&ms->tile_assign_lock,
-                                                       &expected, 1)) {
-                    expected = 0;
-                }
-                int assigned = ms->tiles[tid].assigned_worker_idx;
-                ms->tiles[tid].status = TILE_COMPLETED;
-                atomic_store(&ms->tile_assign_lock, 0);
-
-                if (worker_idx >= 0) {
-                    Log(Log_Info,
-                        "Master: Received result for tile %d from '%s' (idx "
-                        "%d), assigned idx was %d",
-                        tid, worker_name, worker_idx, assigned);
-                } else {
-                    Log(Log_Info,
-                        "Master: Received result for tile %d from '%s' "
-                        "(external), assigned idx was %d",
-                        tid, worker_name, assigned);
-                }
-            } else {
-                Log(Log_Debug, "Master: Received result for tile %d from '%s'",
-                    tid, worker_name);
+            for (size_t i = 0; i < value_count; i++) {
+                const uint32_t bits = parse_hex_u32(&hex_pixels[i * 8]);
+                memcpy(&sums[i], &bits, sizeof(bits));
             }
 
+            const cJSON *job_id =
+                cJSON_GetObjectItemCaseSensitive(root, "job_id");
+            const ResultHeader h = {
+                .job_id = cJSON_IsNumber(job_id) ? job_id->valueint
+                                                 : context->job_id,
+                .tile_id = tile_id->valueint,
+                .samples = samples->valueint,
+            };
+            const char *refused = NULL;
+            const unsigned int status = accept_result(
+                context, name->valuestring, &h, sums,
+                strlen(hex_pixels) % 8 ? 0 : value_count, &refused);
+            const enum MHD_Result ret =
+                send_result_answer(connection, status, refused);
+            free(sums);
             cJSON_Delete(root);
-            return send_response(connection, MHD_HTTP_OK, "{\"success\":true}");
+            return ret;
         }
 
+        if (strcmp(url, "/api/result/bin") == 0)
+            return answer_binary_result(connection, ci);
+
         Log(Log_Debug, "Master: 404 Not Found (POST): %s", url);
         const char *notfound = "{\"error\":\"not found\"}";
         return send_response(connection, MHD_HTTP_NOT_FOUND, notfound);
@@ -466,21 +1769,84 @@ static enum MHD_Result answer_get_request(
     return send_response(connection, MHD_HTTP_METHOD_NOT_ALLOWED, mna);
 }
 
+// Serve and relay modes pin the running job for the request, or answer idle
+// when there is none. Registering and the job routes work without a job.
+static enum MHD_Result answer_get_request(
+    void *cls, struct MHD_Connection *connection, const char *url,
+    const char *method, const char *version, const char *upload_data,
+    unsigned long *upload_data_size, void **con_cls) {
+    MasterAPIContext *context = cls;
+    if (!swaps_jobs(context) || strcmp(url, "/api/register") == 0 ||
+        strcmp(url, "/api/channel") == 0 ||
+        strncmp(url, "/api/jobs", 9) == 0) {
+        return answer_request(cls, connection, url, method, version,
+                              upload_data, upload_data_size, con_cls);
+    }
+
+    pthread_mutex_lock(&context->job_lock);
+    const bool pinned = context->master_state != NULL;
+    if (pinned) context->job_users++;
+    pthread_mutex_unlock(&context->job_lock);
+    if (!pinned) return send_response(connection, MHD_HTTP_OK, SERVE_IDLE);
+
+    const enum MHD_Result ret =
+        answer_request(cls, connection, url, method, version, upload_data,
+                       upload_data_size, con_cls);
+    pthread_mutex_lock(&context->job_lock);
+    context->job_users--;
+    pthread_mutex_unlock(&context->job_lock);
+    return ret;
+}
+
+void master_stop_server(void) {
+    if (channel_park.waking) {
+        // no connection may stay suspended past MHD_stop_daemon
+        pthread_mutex_lock(&channel_park.lock);
+        channel_park.stopping = true;
+        pthread_mutex_unlock(&channel_park.lock);
+        pthread_join(channel_park.waker, NULL);
+        channels_resume(NULL);
+        vec_free(&channel_park.parked);
+        channel_park.waking = false;
+    }
+    if (master_daemon) MHD_stop_daemon(master_daemon);
+    master_daemon = NULL;
+}
+
 bool master_start_server(int port, MasterAPIContext *context) {
-    Log(Log_Info, "Master: Starting server on port %d", port);
+    const int threads =
+        context->http_threads > 0 ? context->http_threads : HTTP_THREADS;
+    Log(Log_Info, "Master: Starting server on port %d, %d HTTP threads", port,
+        threads);
 
+    // epoll where there is one: connections cost no thread of their own,
+    // handlers never block
+    unsigned int flags =
+        MHD_USE_AUTO_INTERNAL_THREAD | MHD_ALLOW_SUSPEND_RESUME;
 #ifdef DEBUG
+    flags |= MHD_USE_DEBUG;
+#endif
+    // a pool of one is the internal thread alone, MHD warns when asked for
+    // it
+    struct MHD_OptionItem pool[] = {
+        {threads > 1 ? MHD_OPTION_THREAD_POOL_SIZE : MHD_OPTION_END,
+         (intptr_t)threads, NULL},
+        {MHD_OPTION_END, 0, NULL}};
+    channel_park.stopping = false;
+    vec_init(&channel_park.parked);
     master_daemon = MHD_start_daemon(
-        MHD_USE_INTERNAL_POLLING_THREAD | MHD_USE_THREAD_PER_CONNECTION |
-            MHD_USE_DEBUG,
-        port, NULL, NULL, &answer_get_request, context,
+        flags, port, NULL, NULL, &answer_get_request, context,
+        MHD_OPTION_ARRAY, pool,
+        MHD_OPTION_CONNECTION_TIMEOUT, (unsigned int)HTTP_IDLE_TIMEOUT_S,
+        MHD_OPTION_LISTEN_BACKLOG_SIZE, (unsigned int)HTTP_BACKLOG,
         MHD_OPTION_NOTIFY_COMPLETED, free_conn_info, NULL, MHD_OPTION_END);
-#else
-    master_daemon = MHD_start_daemon(
-        MHD_USE_INTERNAL_POLLING_THREAD | MHD_USE_THREAD_PER_CONNECTION, port,
-        NULL, NULL, &answer_get_request, context, MHD_OPTION_NOTIFY_COMPLETED,
-        free_conn_info, NULL, MHD_OPTION_END);
-#endif
+    if (master_daemon &&
+        pthread_create(&channel_park.waker, NULL, channel_waker, context) !=
+            0) {
+        MHD_stop_daemon(master_daemon);
+        master_daemon = NULL;
+    }
+    channel_park.waking = master_daemon != NULL;
 
     if (master_daemon == NULL) {
         free(context);
@@ -2,6 +2,7 @@
 
 #include "common.h"
 #include "rinternal.h"
+#include "sampling.h"
 #include "vec.h"
 
 // always scatter, attenuate, though with prob (1-reflectance R) we can just
@@ -12,10 +13,8 @@ static bool lambertian_scatter(const Material *mat, const HitRecord *rec,
     UNUSED(ray_in);
     ASSERT(mat->type == MAT_LAMBERTIAN);
 
-    V3f scatter_dir = v3f_add(rec->normal, v3f_random_unit());
-    if (v3f_near_zero(scatter_dir)) {
-        scatter_dir = rec->normal;
-    }
+    // cosine weighted, same distribution as normal + random unit vector
+    V3f scatter_dir = v3f_random_cosine_direction(rec->normal);
     *ray_out = (Ray){rec->point, scatter_dir, v3f_inv(scatter_dir)};
     // FIXME: Ray.length_sq not explicitly initialized here
     if (mat->properties.lambertian.albedo.type ==
@@ -84,3 +83,22 @@ bool scatter(const Material *mat, const HitRecord *rec, const Ray *ray_in,
 
     return false;
 }
+
+// Surface colour independent of lighting, used as a denoiser guide. Glass
+// and lights pass their illumination through unchanged.
+Colour material_albedo(const Material *mat) {
+    const Texture *tex = NULL;
+    if (mat->type == MAT_LAMBERTIAN) tex = &mat->properties.lambertian.albedo;
+    if (mat->type == MAT_METAL) tex = &mat->properties.metal.albedo;
+    if (tex && tex->type == TEX_CONSTANT)  // TODO: add TEX_IMAGE
+        return tex->colour;
+    return (Colour){1, 1, 1};
+}
+
+Colour material_emission(const Material *mat) {
+    if (mat->type == MAT_EMISSIVE &&
+        mat->properties.emissive.emission.type ==
+            TEX_CONSTANT)  // TODO: handle TEX_IMAGE
+        return mat->properties.emissive.emission.colour;
+    return (Colour){0, 0, 0};
+}
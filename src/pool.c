@@ -0,0 +1,354 @@
+#include "pool.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+
+#include "topology.h"
+#include "utils.h"
+
+// Failed steal rounds before a waiting caller starts sleeping between tries
+#define POOL_WAIT_SPINS 64
+// Steal rounds before a pool thread goes to sleep
+#define POOL_IDLE_SPINS 32
+
+typedef struct {
+    TaskFn fn;
+    void *arg;
+    TaskGroup *group;
+    int node;  // only threads on this NUMA node may run it, -1 = any
+} Task;
+
+// Ring buffer of tasks, the owner works the back and thieves the front
+typedef struct {
+    pthread_mutex_t lock;
+    Task *tasks;
+    int head;  // oldest task
+    int size;
+    int capacity;
+} Deque;
+
+static struct {
+    long thread_count;
+    pthread_t *threads;
+    Deque *deques;  // one per pool thread, [thread_count] for outside threads
+
+    _Atomic int queued;  // tasks sitting in any deque
+    _Atomic int sleepers;
+    _Atomic bool shutdown;
+    pthread_mutex_t sleep_lock;
+    pthread_cond_t wake;
+
+    // Pinned pools: cpus of every pool thread, node of every deque's thread
+    // ([thread_count] is the caller's) and all cpus to unpin the caller
+    int node_count;
+    int *thread_cpu;
+    int *thread_node;
+    int *cpus;
+    int cpu_count;
+} pool;
+
+// This thread's deque in pool.deques, outside threads use the shared one
+static _Thread_local long tls_deque = -1;
+static _Thread_local int tls_node = 0;
+
+static inline long own_deque(void) {
+    return tls_deque >= 0 ? tls_deque : pool.thread_count;
+}
+
+static bool deque_push(Deque *d, Task task) {
+    pthread_mutex_lock(&d->lock);
+    if (d->size == d->capacity) {
+        const int capacity = d->capacity ? d->capacity * 2 : 64;
+        Task *tasks = malloc(capacity * sizeof(*tasks));
+        if (!tasks) {
+            pthread_mutex_unlock(&d->lock);
+            return false;
+        }
+        for (int i = 0; i < d->size; i++)
+            tasks[i] = d->tasks[(d->head + i) % d->capacity];
+        free(d->tasks);
+        d->tasks = tasks;
+        d->head = 0;
+        d->capacity = capacity;
+    }
+    d->tasks[(d->head + d->size) % d->capacity] = task;
+    d->size++;
+    pthread_mutex_unlock(&d->lock);
+    return true;
+}
+
+static bool deque_pop(Deque *d, bool front, Task *out) {
+    if (atomic_load_explicit(&pool.queued, memory_order_relaxed) == 0)
+        return false;
+    pthread_mutex_lock(&d->lock);
+    if (d->size == 0) {
+        pthread_mutex_unlock(&d->lock);
+        return false;
+    }
+    const int node = d->tasks[d->head].node;
+    if (front && node >= 0 && node != tls_node) {
+        pthread_mutex_unlock(&d->lock);
+        return false;
+    }
+    if (front) {
+        *out = d->tasks[d->head];
+        d->head = (d->head + 1) % d->capacity;
+    } else {
+        *out = d->tasks[(d->head + d->size - 1) % d->capacity];
+    }
+    d->size--;
+    pthread_mutex_unlock(&d->lock);
+    atomic_fetch_sub(&pool.queued, 1);
+    return true;
+}
+
+// Newest task of our own deque, else the oldest one of somebody else's
+static bool find_task(Task *out) {
+    const long deque_count = pool.thread_count + 1;
+    const long self = own_deque();
+    if (deque_pop(&pool.deques[self], false, out)) return true;
+    for (long i = 1; i < deque_count; i++) {
+        if (deque_pop(&pool.deques[(self + i) % deque_count], true, out))
+            return true;
+    }
+    return false;
+}
+
+static void run_task(const Task *task) {
+    task->fn(task->arg);
+    atomic_fetch_sub_explicit(&task->group->pending, 1, memory_order_release);
+}
+
+static void *pool_thread(void *arg) {
+    tls_deque = (long)(intptr_t)arg;
+    if (pool.thread_cpu) {
+        tls_node = pool.thread_node[tls_deque];
+        if (!topology_pin(&pool.thread_cpu[tls_deque], 1))
+            Log(Log_Warn, "pool_thread: cannot pin to cpu %d",
+                pool.thread_cpu[tls_deque]);
+    }
+    int idle = 0;
+    while (!atomic_load(&pool.shutdown)) {
+        Task task;
+        if (find_task(&task)) {
+            run_task(&task);
+            idle = 0;
+            continue;
+        }
+        if (++idle < POOL_IDLE_SPINS) {
+            sched_yield();
+            continue;
+        }
+
+        pthread_mutex_lock(&pool.sleep_lock);
+        atomic_fetch_add(&pool.sleepers, 1);
+        while (atomic_load(&pool.queued) == 0 && !atomic_load(&pool.shutdown))
+            pthread_cond_wait(&pool.wake, &pool.sleep_lock);
+        atomic_fetch_sub(&pool.sleepers, 1);
+        pthread_mutex_unlock(&pool.sleep_lock);
+        idle = 0;
+    }
+    return NULL;
+}
+
+// Thread i runs on cpus[i + 1] (wrapping around), the caller on cpus[0], so
+// nodes fill up one after the other
+static void pin_threads(long thread_count, const Topology *topo) {
+    pool.thread_cpu = malloc(thread_count * sizeof(*pool.thread_cpu));
+    pool.thread_node = malloc((thread_count + 1) * sizeof(*pool.thread_node));
+    pool.cpus = malloc(topo->cpu_count * sizeof(*pool.cpus));
+    if (!pool.thread_cpu || !pool.thread_node || !pool.cpus) {
+        Log(Log_Error, "pool_init: Memory allocation failed");
+        exit(1);
+    }
+    for (long i = 0; i < thread_count; i++) {
+        const int slot = (int)((i + 1) % topo->cpu_count);
+        pool.thread_cpu[i] = topo->cpus[slot];
+        pool.thread_node[i] = topo->cpu_node[slot];
+    }
+    memcpy(pool.cpus, topo->cpus, topo->cpu_count * sizeof(*pool.cpus));
+    pool.cpu_count = topo->cpu_count;
+    pool.node_count = topo->node_count;
+
+    pool.thread_node[thread_count] = topo->cpu_node[0];
+    tls_node = topo->cpu_node[0];
+    if (!topology_pin(&topo->cpus[0], 1))
+        Log(Log_Warn, "pool_init: cannot pin the caller to cpu %d",
+            topo->cpus[0]);
+}
+
+void pool_init(long thread_count, const Topology *topo) {
+    if (pool.threads || thread_count <= 0) {
+        Log(Log_Info, "pool_init: running tasks on the calling thread");
+        return;
+    }
+
+    pool.deques = calloc(thread_count + 1, sizeof(*pool.deques));
+    pool.threads = malloc(thread_count * sizeof(*pool.threads));
+    if (!pool.deques || !pool.threads) {
+        Log(Log_Error, "pool_init: Memory allocation failed");
+        exit(1);
+    }
+    for (long i = 0; i <= thread_count; i++)
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+    pthread_mutex_init(&pool.sleep_lock, NULL);
+    pthread_cond_init(&pool.wake, NULL);
+    atomic_store(&pool.shutdown, false);
+    pool.thread_count = thread_count;
+    pool.node_count = 1;
+    if (topo && topo->cpu_count > 0) pin_threads(thread_count, topo);
+
+    for (long i = 0; i < thread_count; i++) {
+        if (pthread_create(&pool.threads[i], NULL, pool_thread,
+                           (void *)(intptr_t)i) != 0) {
+            Log(Log_Error, "pool_init: pthread_create failed");
+            exit(1);
+        }
+    }
+    Log(Log_Info, "pool_init: started %ld threads%s", thread_count,
+        pool.thread_cpu ? temp_sprintf(", pinned over %d NUMA nodes",
+                                       pool.node_count)
+                        : "");
+}
+
+void pool_shutdown(void) {
+    if (!pool.threads) return;
+
+    pthread_mutex_lock(&pool.sleep_lock);
+    atomic_store(&pool.shutdown, true);
+    pthread_cond_broadcast(&pool.wake);
+    pthread_mutex_unlock(&pool.sleep_lock);
+    for (long i = 0; i < pool.thread_count; i++)
+        pthread_join(pool.threads[i], NULL);
+
+    for (long i = 0; i <= pool.thread_count; i++) {
+        pthread_mutex_destroy(&pool.deques[i].lock);
+        free(pool.deques[i].tasks);
+    }
+    free(pool.deques);
+    free(pool.threads);
+    pool.deques = NULL;
+    pool.threads = NULL;
+    pool.thread_count = 0;
+
+    if (pool.thread_cpu) {
+        topology_pin(pool.cpus, pool.cpu_count);
+        tls_node = 0;
+    }
+    free(pool.thread_cpu);
+    free(pool.thread_node);
+    free(pool.cpus);
+    pool.thread_cpu = NULL;
+    pool.thread_node = NULL;
+    pool.cpus = NULL;
+    pool.node_count = 1;
+}
+
+long pool_concurrency(void) { return pool.thread_count + 1; }
+
+int pool_node_count(void) { return pool.thread_cpu ? pool.node_count : 1; }
+
+int pool_thread_node(void) { return tls_node; }
+
+bool pool_wants_work(void) {
+    return pool.threads &&
+           atomic_load_explicit(&pool.queued, memory_order_relaxed) == 0;
+}
+
+static void spawn_into(long deque, Task task) {
+    atomic_fetch_add(&task.group->pending, 1);
+    if (deque >= 0) {
+        // counted before it is visible so queued never goes negative
+        atomic_fetch_add(&pool.queued, 1);
+        if (deque_push(&pool.deques[deque], task)) {
+            if (atomic_load(&pool.sleepers) > 0) {
+                pthread_mutex_lock(&pool.sleep_lock);
+                // any sleeper will do unless the task is tied to a node
+                if (task.node >= 0)
+                    pthread_cond_broadcast(&pool.wake);
+                else
+                    pthread_cond_signal(&pool.wake);
+                pthread_mutex_unlock(&pool.sleep_lock);
+            }
+            return;
+        }
+        atomic_fetch_sub(&pool.queued, 1);
+    }
+    run_task(&task);
+}
+
+void pool_spawn(TaskGroup *group, TaskFn fn, void *arg) {
+    const Task task = {.fn = fn, .arg = arg, .group = group, .node = -1};
+    spawn_into(pool.threads ? own_deque() : -1, task);
+}
+
+void pool_spawn_on_node(TaskGroup *group, int node, TaskFn fn, void *arg) {
+    const Task task = {.fn = fn, .arg = arg, .group = group, .node = node};
+    long deque = -1;  // inline when the node has no pool thread
+    if (pool.thread_cpu && node != tls_node) {
+        for (long i = 0; i < pool.thread_count; i++) {
+            if (pool.thread_node[i] == node) {
+                deque = i;
+                break;
+            }
+        }
+    }
+    spawn_into(deque, task);
+}
+
+void pool_wait(TaskGroup *group) {
+    int idle = 0;
+    while (atomic_load_explicit(&group->pending, memory_order_acquire) > 0) {
+        Task task;
+        if (find_task(&task)) {
+            run_task(&task);
+            idle = 0;
+        } else if (++idle < POOL_WAIT_SPINS) {
+            sched_yield();
+        } else {
+            // the rest is running elsewhere, don't burn the core meanwhile
+            const struct timespec nap = {.tv_nsec = 50 * 1000};
+            thrd_sleep(&nap, NULL);
+        }
+    }
+}
+
+typedef struct {
+    RangeFn fn;
+    void *ctx;
+    int begin, end;
+} ForChunk;
+
+static void run_chunk(void *arg) {
+    const ForChunk *chunk = arg;
+    chunk->fn(chunk->ctx, chunk->begin, chunk->end);
+}
+
+void pool_parallel_for(int count, int grain, RangeFn fn, void *ctx) {
+    if (count <= 0) return;
+    grain = MAX(grain, 1);
+    const int chunk_count = (count + grain - 1) / grain;
+    ForChunk *chunks =
+        pool.threads && chunk_count > 1 ? malloc(chunk_count * sizeof(*chunks))
+                                        : NULL;
+    if (!chunks) {
+        fn(ctx, 0, count);
+        return;
+    }
+
+    TaskGroup group = {0};
+    for (int i = 0; i < chunk_count; i++) {
+        chunks[i] = (ForChunk){.fn = fn,
+                               .ctx = ctx,
+                               .begin = i * grain,
+                               .end = MIN((i + 1) * grain, count)};
+        pool_spawn(&group, run_chunk, &chunks[i]);
+    }
+    pool_wait(&group);
+    free(chunks);
+}
@@ -6,28 +6,26 @@
 #include <stdatomic.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
 #include <unistd.h>
 
 #include "api.h"
 #include "common.h"
+#include "denoise.h"
+#include "imagerw.h"
+#include "light.h"
+#include "pool.h"
 #include "rinternal.h"
+#include "sampling.h"
 #include "scene.h"
 #include "utils.h"
 #include "vec.h"
 
-static inline float linear_to_gamma(float linear_component) {
-    if (linear_component > 0) return sqrtf(linear_component);
-    return 0;
-}
-
-// argb
-static uint32_t pack_colour(Colour colour) {
-    colour = v3f_clamp(colour, 0, 1);
-    return (((uint8_t)(255)) << 24) |
-           (((uint8_t)(linear_to_gamma(colour.x) * 255)) << 16) |
-           (((uint8_t)(linear_to_gamma(colour.y) * 255)) << 8) |
-           ((uint8_t)(linear_to_gamma(colour.z) * 255));
+static inline void store_colour(float *dst, Colour colour) {
+    dst[0] = colour.x;
+    dst[1] = colour.y;
+    dst[2] = colour.z;
 }
 
 void calculate_camera_fields(Camera *cam) {
@@ -42,10 +40,64 @@ void calculate_camera_fields(Camera *cam) {
 
 const Colour BACKGROUND = {0.1f, 0.1f, 0.1f};
 
+_Atomic bool render_stop_requested = false;
+
+// Power heuristic (beta = 2) weight of a sample from the strategy with pdf a
+static inline float mis_weight(float a, float b) {
+    return a * a / (a * a + b * b);
+}
+
+// Direct light at a diffuse hit: one light picked from the light tree, one
+// direction towards it, weighted against the cosine bounce that could have
+// found it too
+static Colour sample_direct(const Scene *scene, const HitRecord *rec,
+                            Colour albedo, long *ray_count) {
+    const Colour none = {0, 0, 0};
+    const LightTree *tree = &scene->lights;
+    int light_idx;
+    float pmf;
+    if (!light_tree_sample(tree, rec->point, rec->normal, rng_f32_tls(),
+                           &light_idx, &pmf))
+        return none;
+
+    const Light *light = &tree->lights.items[light_idx];
+    const float u1 = rng_f32_tls();
+    const float u2 = rng_f32_tls();
+    V3f wi;
+    float pdf;
+    if (!light_sample(light, rec->point, u1, u2, &wi, &pdf)) return none;
+    const float cos_s = v3f_dot(rec->normal, wi);
+    if (cos_s <= 0) return none;
+
+    // visible when the first thing along wi is the light itself
+    (*ray_count)++;
+    Ray shadow = {.origin = rec->point, .direction = wi};
+    shadow.length_sq = 1;
+    shadow.length = 1;
+    shadow.inv_dir = v3f_inv(wi);
+    HitRecord hit = {0};
+    if (!scene_hit(&shadow, scene, 0.001f, INFINITY, &hit) ||
+        hit.light_idx != light_idx)
+        return none;
+
+    const float pdf_light = pmf * pdf;
+    const float pdf_bsdf = cos_s / PI;
+    const float w = mis_weight(pdf_light, pdf_bsdf) * pdf_bsdf / pdf_light;
+    return v3f_mulf(v3f_comp_mul(albedo, light->emission), w);
+}
+
+// first_hit, when set, receives the camera ray's denoiser guides
 static Colour ray_colour(Ray *ray, const Scene *scene, int max_depth,
-                         long *ray_count) {
+                         long *ray_count, PixelAov *first_hit) {
     Colour throughput = {1.0f, 1.0f, 1.0f};
     Colour final_colour = {0.0f, 0.0f, 0.0f};
+    const bool sample_lights = scene->lights.node_count > 0;
+
+    // last diffuse bounce, for weighting emitters it hits against light
+    // sampling from the same point
+    bool after_diffuse = false;
+    V3f diffuse_point = {0}, diffuse_normal = {0};
+    float bsdf_pdf = 0;
 
     for (int depth = 0; depth < max_depth; depth++) {
         (*ray_count)++;
@@ -55,6 +107,11 @@ static Colour ray_colour(Ray *ray, const Scene *scene, int max_depth,
         // surface then intersection point may be inside the surface then the
         // ray will just bounce inside
         if (!scene_hit(ray, scene, 0.001f, INFINITY, &record)) {
+            if (depth == 0 && first_hit) {
+                first_hit->albedo = (Colour){1, 1, 1};
+                first_hit->normal = v3f_neg(v3f_normalize(ray->direction));
+                first_hit->depth = AOV_MISS_DEPTH;
+            }
             // Hit nothing: return background contribution
             final_colour =
                 v3f_add(final_colour, v3f_comp_mul(throughput, BACKGROUND));
@@ -62,18 +119,38 @@ static Colour ray_colour(Ray *ray, const Scene *scene, int max_depth,
         }
 
         Material *mat = &scene->materials.items[record.mat_index];
+        if (depth == 0 && first_hit) {
+            first_hit->albedo = material_albedo(mat);
+            first_hit->normal = v3f_normalize(record.normal);
+            first_hit->depth = record.t * ray->length;
+        }
 
         // Handle Emission
         if (mat->type == MAT_EMISSIVE) {
-            Colour emission = (mat->properties.emissive.emission.type ==
-                               TEX_CONSTANT)  // TODO: handle TEX_IMAGE
-                                  ? mat->properties.emissive.emission.colour
-                                  : (Colour){0, 0, 0};
             // NOTE: image textures not yet supported for emission
+            Colour emission = material_emission(mat);
+            if (after_diffuse && record.light_idx >= 0) {
+                const Light *light =
+                    &scene->lights.lights.items[record.light_idx];
+                const float pdf_light =
+                    light_tree_pmf(&scene->lights, diffuse_point,
+                                   diffuse_normal, record.light_idx) *
+                    light_pdf(light, diffuse_point, record.point);
+                emission = v3f_mulf(emission, mis_weight(bsdf_pdf, pdf_light));
+            }
             final_colour =
                 v3f_add(final_colour, v3f_comp_mul(throughput, emission));
         }
 
+        const bool diffuse = mat->type == MAT_LAMBERTIAN && sample_lights;
+        if (diffuse) {
+            final_colour = v3f_add(
+                final_colour,
+                v3f_comp_mul(throughput,
+                             sample_direct(scene, &record, material_albedo(mat),
+                                           ray_count)));
+        }
+
         // Handle Scattering
         Ray scattered = {0};
         Colour attenuation = {0};
@@ -81,6 +158,16 @@ static Colour ray_colour(Ray *ray, const Scene *scene, int max_depth,
             break;
         }
 
+        after_diffuse = diffuse;
+        if (diffuse) {
+            diffuse_point = record.point;
+            diffuse_normal = record.normal;
+            bsdf_pdf =
+                MAX(0.0f, v3f_dot(record.normal,
+                                  v3f_normalize(scattered.direction))) /
+                PI;
+        }
+
         throughput = v3f_comp_mul(throughput, attenuation);
         *ray = scattered;
         ray->length_sq = v3f_slength(ray->direction);
@@ -93,59 +180,144 @@ static Colour ray_colour(Ray *ray, const Scene *scene, int max_depth,
     return final_colour;
 }
 
-static void render_single_tile_impl(
-    const Scene *scene, const Tile *tile, const Camera *cam,
-    int samples_per_pixel, int max_depth, const V3f *pixel00_loc,
-    const V3f *pixel_delta_u, const V3f *pixel_delta_v,
-    const V3f *defocus_disk_u, const V3f *defocus_disk_v,
-    float colour_contribution, int image_width, uint32_t *output_buffer) {
-    (void)image_width;
-    long ray_count = 0;
-    rng_seed_tls((uint32_t)time(NULL) ^ (uint32_t)(uintptr_t)pthread_self());
+// Tile rows per pool task when a single tile is spread over the pool
+#define TILE_ROWS_GRAIN 4
+
+// Samples generated together for the batched camera warps
+#define CAMERA_BATCH 32
+
+typedef struct {
+    const Scene *scene;
+    const Camera *cam;
+    V3f pixel00_loc;
+    V3f pixel_delta_u, pixel_delta_v;
+    V3f defocus_disk_u, defocus_disk_v;
+    size_t image_width;
+    int max_depth;
+} PixelSampler;
+
+// Sum of samples [sample_begin, sample_end) for image pixel (x, y). The
+// camera dimensions (jitter, lens) of a chunk are drawn and warped up front,
+// then each sample continues its own stream through ray_colour. Denoiser
+// guides are summed into aov when it is not NULL.
+static Colour sample_pixel(const PixelSampler *ps, int x, int y,
+                           int sample_begin, int sample_end, long *ray_count,
+                           PixelAov *aov) {
+    const Camera *cam = ps->cam;
+    const bool defocus = cam->defocus_angle > 0;
+    const uint32_t pixel_idx = (uint32_t)(y * ps->image_width + x);
+
+    const V3f pixel_base = v3f_add(
+        ps->pixel00_loc, v3f_add(v3f_mulf(ps->pixel_delta_u, x),
+                                 v3f_mulf(ps->pixel_delta_v, y)));
+
+    RNG streams[CAMERA_BATCH];
+    float jx[CAMERA_BATCH], jy[CAMERA_BATCH];
+    float lu[CAMERA_BATCH], lv[CAMERA_BATCH];
+    float dx[CAMERA_BATCH], dy[CAMERA_BATCH];
+
+    Colour colour = {0, 0, 0};
+    for (int base = sample_begin; base < sample_end; base += CAMERA_BATCH) {
+        const int n = MIN(CAMERA_BATCH, sample_end - base);
+
+        for (int k = 0; k < n; k++) {
+            rng_seed_sample(&streams[k], pixel_idx, base + k, RENDER_SEED);
+            jx[k] = rng_f32(&streams[k]) - 0.5f;
+            jy[k] = rng_f32(&streams[k]) - 0.5f;
+            if (defocus) {
+                lu[k] = rng_f32(&streams[k]);
+                lv[k] = rng_f32(&streams[k]);
+            }
+        }
+        if (defocus) sample_concentric_disk_n(lu, lv, dx, dy, n);
 
-    V3f row_start =
-        v3f_add(*pixel00_loc, v3f_add(v3f_mulf(*pixel_delta_u, tile->x),
-                                      v3f_mulf(*pixel_delta_v, tile->y)));
+        for (int k = 0; k < n; k++) {
+            rng_state = streams[k];
 
-    for (int j = 0; j < tile->th; j++) {
-        for (int i = 0; i < tile->tw; i++) {
-            Colour colour = (V3f){0, 0, 0};
-
-            V3f pixel_base =
-                v3f_add(row_start, v3f_add(v3f_mulf(*pixel_delta_u, i),
-                                           v3f_mulf(*pixel_delta_v, j)));
-
-            for (int s = 0; s < samples_per_pixel; s++) {
-                V3f pixel_center = v3f_add(
-                    pixel_base,
-                    v3f_add(v3f_mulf(*pixel_delta_u, rng_f32_tls() - 0.5f),
-                            v3f_mulf(*pixel_delta_v, rng_f32_tls() - 0.5f)));
-
-                V3f ray_origin;
-                if (cam->defocus_angle <= 0) {
-                    ray_origin = cam->position;
-                } else {
-                    V3f p = v3f_random_in_unit_disk();
-                    ray_origin = v3f_add(
-                        cam->position, v3f_add(v3f_mulf(*defocus_disk_u, p.x),
-                                               v3f_mulf(*defocus_disk_v, p.y)));
-                }
-                Ray ray = {.origin = ray_origin,
-                           .direction = v3f_sub(pixel_center, cam->position)};
-                ray.length_sq = v3f_slength(ray.direction);
-                ray.length = sqrtf(ray.length_sq);
-                ray.inv_dir = v3f_inv(ray.direction);
-                colour = v3f_add(ray_colour(&ray, scene, max_depth, &ray_count),
-                                 colour);
+            V3f pixel_center = v3f_add(
+                pixel_base, v3f_add(v3f_mulf(ps->pixel_delta_u, jx[k]),
+                                    v3f_mulf(ps->pixel_delta_v, jy[k])));
+
+            V3f ray_origin = cam->position;
+            if (defocus) {
+                ray_origin = v3f_add(
+                    cam->position,
+                    v3f_add(v3f_mulf(ps->defocus_disk_u, dx[k]),
+                            v3f_mulf(ps->defocus_disk_v, dy[k])));
+            }
+            Ray ray = {.origin = ray_origin,
+                       .direction = v3f_sub(pixel_center, cam->position)};
+            ray.length_sq = v3f_slength(ray.direction);
+            ray.length = sqrtf(ray.length_sq);
+            ray.inv_dir = v3f_inv(ray.direction);
+            if (!aov) {
+                colour = v3f_add(
+                    ray_colour(&ray, ps->scene, ps->max_depth, ray_count, NULL),
+                    colour);
+                continue;
             }
 
+            PixelAov hit = {0};
+            const Colour c =
+                ray_colour(&ray, ps->scene, ps->max_depth, ray_count, &hit);
+            const float lum = v3f_luminance(c);
+            colour = v3f_add(c, colour);
+            aov->albedo = v3f_add(aov->albedo, hit.albedo);
+            aov->normal = v3f_add(aov->normal, hit.normal);
+            aov->depth += hit.depth;
+            aov->lum_sq += lum * lum;
+        }
+    }
+    return colour;
+}
+
+typedef struct {
+    PixelSampler ps;
+    Tile tile;
+    int sample_begin, sample_end;
+    float *output_buffer;
+} TileRows;
+
+static void render_tile_rows(void *ctx, int begin, int end) {
+    TileRows *tr = ctx;
+    const Tile *tile = &tr->tile;
+    long ray_count = 0;
+    for (int j = begin; j < end; j++) {
+        for (int i = 0; i < tile->tw; i++) {
+            Colour colour = sample_pixel(&tr->ps, tile->x + i, tile->y + j,
+                                         tr->sample_begin, tr->sample_end,
+                                         &ray_count, NULL);
+
             int buffer_idx = j * tile->tw + i;
-            output_buffer[buffer_idx] =
-                pack_colour(v3f_mulf(colour, colour_contribution));
+            store_colour(&tr->output_buffer[buffer_idx * 3], colour);
         }
     }
 }
 
+// Writes the rgb sums of samples [sample_begin, sample_end) of every tile
+// pixel to output_buffer, the rows are spread over the pool
+static void render_single_tile_impl(
+    const Scene *scene, const Tile *tile, const Camera *cam, int sample_begin,
+    int sample_end, int max_depth, const V3f *pixel00_loc,
+    const V3f *pixel_delta_u, const V3f *pixel_delta_v,
+    const V3f *defocus_disk_u, const V3f *defocus_disk_v, int image_width,
+    float *output_buffer) {
+    TileRows tr = {.ps = {.scene = scene,
+                          .cam = cam,
+                          .pixel00_loc = *pixel00_loc,
+                          .pixel_delta_u = *pixel_delta_u,
+                          .pixel_delta_v = *pixel_delta_v,
+                          .defocus_disk_u = *defocus_disk_u,
+                          .defocus_disk_v = *defocus_disk_v,
+                          .image_width = image_width,
+                          .max_depth = max_depth},
+                   .tile = *tile,
+                   .sample_begin = sample_begin,
+                   .sample_end = sample_end,
+                   .output_buffer = output_buffer};
+    pool_parallel_for(tile->th, TILE_ROWS_GRAIN, render_tile_rows, &tr);
+}
+
 // Compute camera-derived vectors used for tiling and tile rendering.
 void compute_render_camera_fields(const Camera *cam, size_t image_width,
                                   size_t image_height, V3f *pixel00_loc,
@@ -173,81 +345,56 @@ void compute_render_camera_fields(const Camera *cam, size_t image_width,
     *defocus_disk_v = v3f_mulf(tmp.up, defocus_radius);
 }
 
-// Thread func for master, rendering TILE_UNASSIGNED
-static void *render_tile_distributed(void *arg) {
+// Pool task for the master, rendering claimed items, then backup copies of
+// the items still out with workers, until none are left
+static void render_tile_distributed(void *arg) {
     struct MasterState *ms = (struct MasterState *)arg;
     const Scene *scene = ms->scene;
-    Camera cam = scene->camera;
 
     while (true) {
-        int found = -1;
-
-        int expected = 0;
-        while (!atomic_compare_exchange_strong(&ms->tile_assign_lock, &expected,
-                                               1)) {
-            expected = 0;
-            // spin briefly
-        }
-
-        for (int i = 0; i < ms->tile_count; i++) {
-            if (ms->tiles[i].status == TILE_UNASSIGNED) {
-                found = i;
-                ms->tiles[i].status = TILE_IN_FLIGHT;
-                ms->tiles[i].assigned_worker_idx = -1;  // master
-                break;
-            }
-        }
-
-        atomic_store(&ms->tile_assign_lock, 0);
-
+        int found = master_claim_item(ms, -1, master_node_rate(ms, -1));
+        if (found == -1) found = master_claim_backup(ms, -1);
         if (found == -1) break;
 
         TileAssignment *assign = &ms->tiles[found];
+        const MasterFrame *frame = &ms->frames[assign->frame];
 
-        uint32_t *tmp =
-            malloc(assign->tile.tw * assign->tile.th * sizeof(uint32_t));
+        float *tmp =
+            malloc(assign->tile.tw * assign->tile.th * 3 * sizeof(float));
         if (!tmp) {
             Log(Log_Error,
                 "render_tile_distributed: malloc failed for tile buffer");
-            assign->status = TILE_UNASSIGNED;
-            continue;
+            master_release_item(ms, found);
+            break;
         }
 
+        struct timeval start, end;
+        gettimeofday(&start, NULL);
         render_single_tile_impl(
-            scene, &assign->tile, &cam, ms->samples_per_pixel, ms->max_depth,
-            &ms->pixel00_loc, &ms->pixel_delta_u, &ms->pixel_delta_v,
-            &ms->defocus_disk_u, &ms->defocus_disk_v, ms->colour_contribution,
-            ms->image_width, tmp);
-
-        for (int y = 0; y < assign->tile.th; y++) {
-            int dst_idx =
-                (assign->tile.y + y) * ms->image_width + assign->tile.x;
-            memcpy(&ms->image[dst_idx], &tmp[y * assign->tile.tw],
-                   assign->tile.tw * sizeof(uint32_t));
-        }
+            scene, &assign->tile, &frame->camera, assign->sample_begin,
+            assign->sample_end, ms->max_depth, &frame->pixel00_loc,
+            &frame->pixel_delta_u, &frame->pixel_delta_v,
+            &frame->defocus_disk_u, &frame->defocus_disk_v, ms->image_width,
+            tmp);
+        gettimeofday(&end, NULL);
+        master_item_rendered(ms, found, timersub_ms(&end, &start));
+        master_merge_result(ms, found, tmp);
 
         free(tmp);
-
-        assign->status = TILE_COMPLETED;
     }
-
-    return NULL;
 }
 
-void render_scene_distributed(struct MasterState *master_state,
-                              long thread_count) {
+void render_scene_distributed(struct MasterState *master_state) {
     struct timeval start, end;
     gettimeofday(&start, NULL);
 
+    const long thread_count = pool_concurrency();
     Log(Log_Info, "render_scene_distributed: Starting with %ld threads",
         thread_count);
-    pthread_t *threads = malloc(thread_count * sizeof(pthread_t));
-    for (long i = 0; i < thread_count; i++) {
-        pthread_create(&threads[i], NULL, render_tile_distributed,
-                       master_state);
-    }
-    for (long i = 0; i < thread_count; i++) pthread_join(threads[i], NULL);
-    free(threads);
+    TaskGroup group = {0};
+    for (long i = 0; i < thread_count; i++)
+        pool_spawn(&group, render_tile_distributed, master_state);
+    pool_wait(&group);
 
     gettimeofday(&end, NULL);
     double ms = timersub_ms(&end, &start);
@@ -256,105 +403,354 @@ void render_scene_distributed(struct MasterState *master_state,
 
 // Public wrapper that forwards to the internal implementation.
 void render_single_tile(const Scene *scene, const Tile *tile, const Camera *cam,
-                        int samples_per_pixel, int max_depth,
+                        int sample_begin, int sample_end, int max_depth,
                         const V3f *pixel00_loc, const V3f *pixel_delta_u,
                         const V3f *pixel_delta_v, const V3f *defocus_disk_u,
-                        const V3f *defocus_disk_v, float colour_contribution,
-                        int image_width, uint32_t *output_buffer) {
-    render_single_tile_impl(scene, tile, cam, samples_per_pixel, max_depth,
-                            pixel00_loc, pixel_delta_u, pixel_delta_v,
-                            defocus_disk_u, defocus_disk_v, colour_contribution,
+                        const V3f *defocus_disk_v, int image_width,
+                        float *output_buffer) {
+    render_single_tile_impl(scene, tile, cam, sample_begin, sample_end,
+                            max_depth, pixel00_loc, pixel_delta_u,
+                            pixel_delta_v, defocus_disk_u, defocus_disk_v,
                             image_width, output_buffer);
 }
 
-// TODO: very similar to render_tile_distributed, combine?
-static void *render_tile(void *arg) {
-    Work *work = arg;
-    const Scene *scene = work->scene;
-    Camera cam = scene->camera;
+// Rows a tile part keeps to itself, smaller parts are not split any further
+#define TILE_SPLIT_MIN_ROWS 4
+
+typedef struct {
+    float start_ms, end_ms;  // since the start of render_scene
+    int parts;               // 0 when the tile was skipped
+} TileTiming;
+
+// Tiles left for one NUMA node, in claim order
+typedef struct {
+    const int *tiles;
+    int count;
+    _Atomic int next;
+} TileQueue;
+
+// One render_scene call
+typedef struct {
+    Work *work;
+    PixelSampler ps;
+    struct timeval start;
+    TileTiming *timing;  // per tile, NULL when it could not be allocated
+
+    // One queue per node of the pool, threads drain their own node's first
+    TileQueue *queues;
+    int queue_count;
+    _Atomic int claimed;  // tiles claimed from all queues
+} Frame;
+
+struct TileJob;
+
+typedef struct {
+    struct TileJob *job;
+    int row_begin, row_end;
+} TilePart;
+
+// A tile in flight, its parts render disjoint row ranges
+typedef struct TileJob {
+    Frame *frame;
+    Tile tile;
+    // Progressive passes sum the tile here first so a stop request never
+    // leaves a half added pass in accum
+    Colour *pass;
+    PixelAov *pass_aov;
+    _Atomic bool stopped;
+
+    TaskGroup group;  // split off parts
+    _Atomic int part_count;
+    TilePart parts[TILE_HEIGHT / TILE_SPLIT_MIN_ROWS];
+} TileJob;
+
+static void render_tile_part(void *arg);
+
+// Renders rows [begin, end) of the tile. Once every tile was claimed and the
+// pool runs out of queued tasks, the rows left are halved and the second half
+// is queued for an idle thread to steal, so an expensive tile doesn't end the
+// frame on one thread.
+static void render_tile_job_rows(TileJob *job, int begin, int end) {
+    const Work *work = job->frame->work;
+    const PixelSampler *ps = &job->frame->ps;
+    const Tile *tile = &job->tile;
 
     long ray_count = 0;
-    int curr_tile;
-    rng_seed_tls((uint32_t)time(NULL) ^ (uint32_t)(uintptr_t)pthread_self());
-
-    while (true) {
-        curr_tile = atomic_fetch_add(&work->tile_finished, 1);
-        if (curr_tile >= work->tile_count) break;
+    for (int j = begin; j < end; j++) {
+        if (end - j >= 2 * TILE_SPLIT_MIN_ROWS &&
+            atomic_load(&job->frame->claimed) >= work->tile_count &&
+            pool_wants_work()) {
+            const int mid = j + (end - j) / 2;
+            TilePart *part = &job->parts[atomic_fetch_add(&job->part_count, 1)];
+            *part = (TilePart){.job = job, .row_begin = mid, .row_end = end};
+            pool_spawn(&job->group, render_tile_part, part);
+            end = mid;
+        }
 
-        Tile tile = work->tiles[curr_tile];
-        V3f row_start = v3f_add(work->pixel00_loc,
-                                v3f_add(v3f_mulf(work->pixel_delta_u, tile.x),
-                                        v3f_mulf(work->pixel_delta_v, tile.y)));
+        if (!job->pass) {
+            for (int i = 0; i < tile->tw; i++) {
+                const int x = tile->x + i, y = tile->y + j;
+                Colour colour = sample_pixel(ps, x, y, 0,
+                                             work->samples_per_pixel,
+                                             &ray_count, NULL);
+                store_colour(&work->image[(y * work->width + x) * 3],
+                             v3f_mulf(colour, work->colour_contribution));
+            }
+            continue;
+        }
 
-        for (int j = tile.y; j < tile.y + tile.th; j++) {
-            for (int i = tile.x; i < tile.x + tile.tw; i++) {
-                Colour colour = (V3f){0, 0, 0};
-
-                V3f pixel_base = v3f_add(
-                    row_start,
-                    v3f_add(v3f_mulf(work->pixel_delta_u, (i - tile.x)),
-                            v3f_mulf(work->pixel_delta_v, (j - tile.y))));
-
-                for (int s = 0; s < work->samples_per_pixel; s++) {
-                    V3f pixel_center = v3f_add(
-                        pixel_base, v3f_add(v3f_mulf(work->pixel_delta_u,
-                                                     rng_f32_tls() - 0.5f),
-                                            v3f_mulf(work->pixel_delta_v,
-                                                     rng_f32_tls() - 0.5f)));
-
-                    V3f ray_origin;
-                    if (cam.defocus_angle <= 0) {
-                        ray_origin = cam.position;
-                    } else {
-                        V3f p = v3f_random_in_unit_disk();
-                        ray_origin = v3f_add(
-                            cam.position,
-                            v3f_add(v3f_mulf(work->defocus_disk_u, p.x),
-                                    v3f_mulf(work->defocus_disk_v, p.y)));
-                    }
-                    Ray ray = {
-                        .origin = ray_origin,
-                        .direction = v3f_sub(pixel_center, cam.position)};
-                    ray.length_sq = v3f_slength(ray.direction);
-                    ray.length = sqrtf(ray.length_sq);
-                    ray.inv_dir = v3f_inv(ray.direction);
-                    colour = v3f_add(
-                        ray_colour(&ray, scene, work->max_depth, &ray_count),
-                        colour);
-                }
-                work->image[j * work->width + i] =
-                    pack_colour(v3f_mulf(colour, work->colour_contribution));
+        if (atomic_load(&render_stop_requested)) {
+            atomic_store(&job->stopped, true);
+            break;
+        }
+        for (int i = 0; i < tile->tw; i++) {
+            PixelAov *aov = NULL;
+            if (job->pass_aov) {
+                aov = &job->pass_aov[j * tile->tw + i];
+                *aov = (PixelAov){0};
             }
+            job->pass[j * tile->tw + i] =
+                sample_pixel(ps, tile->x + i, tile->y + j, work->sample_begin,
+                             work->sample_end, &ray_count, aov);
         }
     }
-    atomic_fetch_add(&work->ray_count, ray_count);
+    atomic_fetch_add(&job->frame->work->ray_count, ray_count);
+}
 
-    pthread_exit(NULL);
+static void render_tile_part(void *arg) {
+    const TilePart *part = arg;
+    render_tile_job_rows(part->job, part->row_begin, part->row_end);
 }
 
-void init_work(Scene *scene, State *state, Work *work) {
-    const size_t width = state->width;
-    const size_t height = state->height;
+// Add a finished progressive pass of the tile into accum
+static void commit_tile_pass(Work *work, const TileJob *job, int tile_idx) {
+    const Tile tile = job->tile;
+    for (int j = 0; j < tile.th; j++) {
+        float *dst = &work->accum[((tile.y + j) * work->width + tile.x) * 3];
+        for (int i = 0; i < tile.tw; i++) {
+            const Colour c = job->pass[j * tile.tw + i];
+            dst[i * 3 + 0] += c.x;
+            dst[i * 3 + 1] += c.y;
+            dst[i * 3 + 2] += c.z;
+        }
+        if (!job->pass_aov) continue;
+        PixelAov *aov_dst = &work->aov[(tile.y + j) * work->width + tile.x];
+        for (int i = 0; i < tile.tw; i++) {
+            const PixelAov *a = &job->pass_aov[j * tile.tw + i];
+            aov_dst[i].albedo = v3f_add(aov_dst[i].albedo, a->albedo);
+            aov_dst[i].normal = v3f_add(aov_dst[i].normal, a->normal);
+            aov_dst[i].depth += a->depth;
+            aov_dst[i].lum_sq += a->lum_sq;
+        }
+    }
+    work->tile_samples[tile_idx] += work->sample_end - work->sample_begin;
+}
+
+static float frame_ms(const Frame *frame) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (float)timersub_ms(&now, &frame->start);
+}
+
+// TODO: very similar to render_tile_distributed, combine?
+static void render_tile(Frame *frame, int tile_idx) {
+    Work *work = frame->work;
+    TileJob job = {.frame = frame, .tile = work->tiles[tile_idx]};
+    const int pixel_count = job.tile.tw * job.tile.th;
+    if (work->accum) {
+        job.pass = malloc(pixel_count * sizeof(*job.pass));
+        if (work->aov)
+            job.pass_aov = malloc(pixel_count * sizeof(*job.pass_aov));
+        if (!job.pass || (work->aov && !job.pass_aov)) {
+            Log(Log_Error, "render_tile: malloc failed for pass buffer");
+            exit(1);
+        }
+    }
+
+    const float start_ms = frame_ms(frame);
+    render_tile_job_rows(&job, 0, job.tile.th);
+    pool_wait(&job.group);
+    if (frame->timing) {
+        frame->timing[tile_idx] =
+            (TileTiming){.start_ms = start_ms,
+                         .end_ms = frame_ms(frame),
+                         .parts = atomic_load(&job.part_count) + 1};
+    }
+
+    if (work->accum && !atomic_load(&job.stopped))
+        commit_tile_pass(work, &job, tile_idx);
+    free(job.pass);
+    free(job.pass_aov);
+}
+
+// Next tile from the calling thread's node queue, then from the others
+static int claim_tile(Frame *frame) {
+    const int home = pool_thread_node() % frame->queue_count;
+    for (int k = 0; k < frame->queue_count; k++) {
+        TileQueue *q = &frame->queues[(home + k) % frame->queue_count];
+        if (atomic_load(&q->next) >= q->count) continue;
+        const int i = atomic_fetch_add(&q->next, 1);
+        if (i < q->count) {
+            atomic_fetch_add(&frame->claimed, 1);
+            return q->tiles[i];
+        }
+    }
+    return -1;
+}
 
-    Camera cam = scene->camera;
+// Pool task, claims tiles in order until none are left
+static void render_tiles(void *arg) {
+    Frame *frame = arg;
+    Work *work = frame->work;
 
-    V3f vu = v3f_mulf(cam.right, cam.viewport_w);
-    V3f vv = v3f_mulf(cam.up, -cam.viewport_h);
+    while (true) {
+        if (work->accum && atomic_load(&render_stop_requested)) break;
+        const int t = claim_tile(frame);
+        if (t < 0) break;
+        render_tile(frame, t);
+    }
+}
 
-    V3f pixel_delta_u = v3f_divf(vu, (float)width);
-    V3f pixel_delta_v = v3f_divf(vv, (float)height);
+// Rows of tiles are split into one horizontal band per NUMA node, the
+// node's threads first touch its band and render its tiles
+static inline int tile_row_node(const Work *work, int y, int node_count) {
+    const int tile_rows = (int)((work->height + TILE_HEIGHT - 1) / TILE_HEIGHT);
+    return (y / TILE_HEIGHT) * node_count / tile_rows;
+}
+
+typedef struct {
+    Work *work;
+    size_t row_begin, row_end;
+} Band;
+
+static void touch_band(void *arg) {
+    const Band *band = arg;
+    const Work *work = band->work;
+    const size_t first = band->row_begin * work->width;
+    const size_t count = (band->row_end - band->row_begin) * work->width;
+    memset(&work->image[first * 3], 0, count * 3 * sizeof(float));
+    if (work->accum)
+        memset(&work->accum[first * 3], 0, count * 3 * sizeof(float));
+    if (work->aov) memset(&work->aov[first], 0, count * sizeof(PixelAov));
+}
+
+// Fresh pages land on the node of the thread writing them first, so zero
+// each band from its own node before anything else touches the buffers
+static void first_touch_bands(Work *work, int node_count) {
+    Band bands[node_count];
+    for (int n = 0; n < node_count; n++)
+        bands[n] = (Band){.work = work, .row_begin = work->height};
+    for (size_t y = 0; y < work->height; y++) {
+        Band *b = &bands[tile_row_node(work, (int)y, node_count)];
+        b->row_begin = MIN(b->row_begin, y);
+        b->row_end = y + 1;
+    }
+
+    TaskGroup group = {0};
+    for (int n = 0; n < node_count; n++) {
+        if (bands[n].row_end > bands[n].row_begin)
+            pool_spawn_on_node(&group, n, touch_band, &bands[n]);
+    }
+    pool_wait(&group);
+    work->first_touched = true;
+}
+
+// Split the claim order (tile_order or raster) into per node queues
+static bool build_queues(Frame *frame, int *tiles) {
+    const Work *work = frame->work;
+    const int node_count = frame->queue_count;
+    int *starts = calloc(node_count + 1, sizeof(*starts));
+    if (!starts) return false;
+    for (int t = 0; t < work->tile_count; t++)
+        starts[tile_row_node(work, work->tiles[t].y, node_count) + 1]++;
+    for (int n = 0; n < node_count; n++) starts[n + 1] += starts[n];
+
+    for (int n = 0; n < node_count; n++) {
+        frame->queues[n].tiles = &tiles[starts[n]];
+        frame->queues[n].count = 0;
+        atomic_init(&frame->queues[n].next, 0);
+    }
+    for (int k = 0; k < work->tile_count; k++) {
+        const int t = work->tile_order ? work->tile_order[k] : k;
+        const int n = tile_row_node(work, work->tiles[t].y, node_count);
+        tiles[starts[n] + frame->queues[n].count++] = t;
+    }
+    free(starts);
+    return true;
+}
+
+static int compare_float(const void *a, const void *b) {
+    const float fa = *(const float *)a, fb = *(const float *)b;
+    return (fa > fb) - (fa < fb);
+}
+
+// The tail is the time from the last tile starting (nothing left to hand
+// out) to the frame being done, when threads can only idle or split tiles
+static void log_tile_timing(const Frame *frame) {
+    const Work *work = frame->work;
+    if (!frame->timing) return;
+
+    float *durations = malloc(work->tile_count * sizeof(*durations));
+    if (!durations) return;
+    int rendered = 0, splits = 0;
+    float last_start = 0, done = 0;
+    for (int t = 0; t < work->tile_count; t++) {
+        const TileTiming *tt = &frame->timing[t];
+        if (tt->parts == 0) continue;
+        // single pass renders are worth a line per tile, passes are not
+        if (!work->accum) {
+            const Tile *tile = &work->tiles[t];
+            Log(Log_Debug,
+                "render_scene: tile %d (%d,%d %dx%d) %.1fms in %d parts, "
+                "predicted cost %.0f",
+                t, tile->x, tile->y, tile->tw, tile->th,
+                tt->end_ms - tt->start_ms, tt->parts,
+                work->tile_cost ? work->tile_cost[t] : 0.0f);
+        }
+        durations[rendered++] = tt->end_ms - tt->start_ms;
+        splits += tt->parts - 1;
+        last_start = MAX(last_start, tt->start_ms);
+        done = MAX(done, tt->end_ms);
+    }
+
+    if (rendered > 0) {
+        qsort(durations, rendered, sizeof(*durations), compare_float);
+        Log(Log_Info,
+            "render_scene: tiles min %.1f median %.1f max %.1fms, %d splits, "
+            "tail %.0fms (last tile started at %.0fms, done at %.0fms)",
+            durations[0], durations[rendered / 2], durations[rendered - 1],
+            splits, done - last_start, last_start, done);
+    }
+    free(durations);
+}
+
+// Render from cam (fields calculated), e.g. one frame of an animation
+void work_set_camera(Work *work, const Camera *cam) {
+    V3f vu = v3f_mulf(cam->right, cam->viewport_w);
+    V3f vv = v3f_mulf(cam->up, -cam->viewport_h);
+
+    V3f pixel_delta_u = v3f_divf(vu, (float)work->width);
+    V3f pixel_delta_v = v3f_divf(vv, (float)work->height);
 
     V3f viewport_top_left =
-        v3f_sub(v3f_add(cam.position, v3f_mulf(cam.forward, cam.focus_dist)),
+        v3f_sub(v3f_add(cam->position, v3f_mulf(cam->forward, cam->focus_dist)),
                 v3f_add(v3f_divf(vu, 2), v3f_divf(vv, 2)));
 
-    V3f pixel00_loc =
+    work->camera = *cam;
+    work->pixel_delta_u = pixel_delta_u;
+    work->pixel_delta_v = pixel_delta_v;
+    work->pixel00_loc =
         v3f_add(viewport_top_left,
                 v3f_mulf(v3f_add(pixel_delta_u, pixel_delta_v), 0.5));
 
-    float defocus_radius = cam.focus_dist * tanf(cam.defocus_angle / 2);
-    V3f defocus_disk_u = v3f_mulf(cam.right, defocus_radius);
-    V3f defocus_disk_v = v3f_mulf(cam.up, defocus_radius);
+    float defocus_radius = cam->focus_dist * tanf(cam->defocus_angle / 2);
+    work->defocus_disk_u = v3f_mulf(cam->right, defocus_radius);
+    work->defocus_disk_v = v3f_mulf(cam->up, defocus_radius);
+}
+
+void init_work(Scene *scene, State *state, Work *work) {
+    const size_t width = state->width;
+    const size_t height = state->height;
 
     const int tile_count =
         CEILF((float)width / TILE_WIDTH) * CEILF((float)height / TILE_HEIGHT);
@@ -389,38 +785,138 @@ void init_work(Scene *scene, State *state, Work *work) {
         .ray_count = 0,
 
         .width = width,
+        .height = height,
         .samples_per_pixel = state->samples_per_pixel,
         .max_depth = state->max_depth,
 
-        .pixel00_loc = pixel00_loc,
-        .pixel_delta_u = pixel_delta_u,
-        .pixel_delta_v = pixel_delta_v,
-        .defocus_disk_u = defocus_disk_u,
-        .defocus_disk_v = defocus_disk_v,
         .colour_contribution = colour_contribution,
+
+        .sample_begin = 0,
+        .sample_end = state->samples_per_pixel,
+        .accum = state->accum,
+        .tile_samples =
+            state->accum ? calloc(tile_count, sizeof(int)) : NULL,
+        .aov = state->accum && state->denoise.enabled
+                   ? calloc(width * height, sizeof(PixelAov))
+                   : NULL,
     };
+    work_set_camera(work, &scene->camera);
+}
+
+// The cost prepass traces PREPASS_SAMPLES spp on every PREPASS_STRIDE-th
+// pixel in x and y, with at most PREPASS_MAX_DEPTH bounces
+#define PREPASS_STRIDE 4
+#define PREPASS_SAMPLES 1
+#define PREPASS_MAX_DEPTH 3
+// Cost of a traced ray (shading, scattering) in BVH node visits
+#define PREPASS_RAY_COST 4
+
+static void prepass_tiles(void *arg, int begin, int end) {
+    Work *work = arg;
+    const PixelSampler ps = {.scene = work->scene,
+                             .cam = &work->camera,
+                             .pixel00_loc = work->pixel00_loc,
+                             .pixel_delta_u = work->pixel_delta_u,
+                             .pixel_delta_v = work->pixel_delta_v,
+                             .defocus_disk_u = work->defocus_disk_u,
+                             .defocus_disk_v = work->defocus_disk_v,
+                             .image_width = work->width,
+                             .max_depth = MIN(work->max_depth,
+                                              PREPASS_MAX_DEPTH)};
+
+    for (int t = begin; t < end; t++) {
+        const Tile tile = work->tiles[t];
+        long visits = 0;
+        long ray_count = 0;
+        bvh_visit_counter = &visits;
+        int samples = 0;
+        for (int j = tile.y; j < tile.y + tile.th; j += PREPASS_STRIDE) {
+            for (int i = tile.x; i < tile.x + tile.tw; i += PREPASS_STRIDE) {
+                sample_pixel(&ps, i, j, 0, PREPASS_SAMPLES, &ray_count, NULL);
+                samples += PREPASS_SAMPLES;
+            }
+        }
+        bvh_visit_counter = NULL;
+        const float cost = (float)(ray_count * PREPASS_RAY_COST + visits);
+        work->tile_cost[t] = cost / samples * tile.tw * tile.th;
+    }
 }
 
-void render_scene(Work *work, long thread_count) {
+typedef struct {
+    float cost;
+    int tile;
+} TileCost;
+
+static int compare_cost_desc(const void *a, const void *b) {
+    const float ca = ((const TileCost *)a)->cost;
+    const float cb = ((const TileCost *)b)->cost;
+    return (ca < cb) - (ca > cb);
+}
+
+void estimate_tile_costs(Work *work) {
     struct timeval start, end;
     gettimeofday(&start, NULL);
 
-    // NOTe: thread pinning not needed, as running on thread_count-1?
-    // NOTE: consider thread affinity for reproducible performance
-    Log(Log_Info, "Running over %d threads", thread_count);
-    pthread_t thread[thread_count];
-    for (int i = 0; i < thread_count; i++) {
-        pthread_create(&thread[i], NULL, render_tile, work);
-        // cpu_set_t set;
-        // CPU_ZERO(&set);
-        // CPU_SET(i, &set);
-        // pthread_setaffinity_np(thread[i], sizeof(set), &set);
+    const int n = work->tile_count;
+    work->tile_cost = malloc(n * sizeof(*work->tile_cost));
+    work->tile_order = malloc(n * sizeof(*work->tile_order));
+    TileCost *sorted = malloc(n * sizeof(*sorted));
+    if (!work->tile_cost || !work->tile_order || !sorted) {
+        Log(Log_Error, "estimate_tile_costs: Memory allocation failed");
+        exit(1);
+    }
+    pool_parallel_for(n, 1, prepass_tiles, work);
+
+    // longest processing time first
+    double total = 0;
+    for (int t = 0; t < n; t++) {
+        sorted[t] = (TileCost){.cost = work->tile_cost[t], .tile = t};
+        total += work->tile_cost[t];
     }
+    qsort(sorted, n, sizeof(*sorted), compare_cost_desc);
+    for (int k = 0; k < n; k++) work->tile_order[k] = sorted[k].tile;
+    free(sorted);
+    gettimeofday(&end, NULL);
+    Log(Log_Info,
+        "estimate_tile_costs: prepass took %.0fms, most expensive tile %d "
+        "costs %.1fx the mean",
+        timersub_ms(&end, &start), work->tile_order[0],
+        work->tile_cost[work->tile_order[0]] * n / total);
+}
+
+void render_scene(Work *work) {
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
 
-    for (int i = 0; i < thread_count; i++) {
-        pthread_join(thread[i], NULL);
+    Log(Log_Info, "Running over %ld threads", pool_concurrency());
+    Frame frame = {.work = work,
+                   .ps = {.scene = work->scene,
+                          .cam = &work->camera,
+                          .pixel00_loc = work->pixel00_loc,
+                          .pixel_delta_u = work->pixel_delta_u,
+                          .pixel_delta_v = work->pixel_delta_v,
+                          .defocus_disk_u = work->defocus_disk_u,
+                          .defocus_disk_v = work->defocus_disk_v,
+                          .image_width = work->width,
+                          .max_depth = work->max_depth},
+                   .start = start,
+                   .timing = calloc(work->tile_count, sizeof(TileTiming)),
+                   .queue_count = pool_node_count(),
+                   .claimed = 0};
+    if (frame.queue_count > 1 && !work->first_touched)
+        first_touch_bands(work, frame.queue_count);
+    frame.queues = malloc(frame.queue_count * sizeof(*frame.queues));
+    int *queued_tiles = malloc(work->tile_count * sizeof(*queued_tiles));
+    if (!frame.queues || !queued_tiles || !build_queues(&frame, queued_tiles)) {
+        Log(Log_Error, "render_scene: Memory allocation failed");
+        exit(1);
     }
 
+    TaskGroup group = {0};
+    for (long i = 0; i < pool_concurrency(); i++)
+        pool_spawn(&group, render_tiles, &frame);
+    pool_wait(&group);
+
     long ray_count = work->ray_count;
     gettimeofday(&end, NULL);
     double ms = timersub_ms(&end, &start);
@@ -428,4 +924,162 @@ void render_scene(Work *work, long thread_count) {
 
     Log(Log_Info, "Rendered %ld rays in %ldms or %fms/ray", ray_count,
         (long int)ms, time_per_ray);
+    log_tile_timing(&frame);
+    free(frame.timing);
+    free(frame.queues);
+    free(queued_tiles);
+}
+
+// Normalize accum by the samples each tile has so far into image
+void resolve_accum_into(const Work *work, const float *accum,
+                        const int *tile_samples, float *image) {
+    for (int t = 0; t < work->tile_count; t++) {
+        const Tile tile = work->tiles[t];
+        const int samples = tile_samples[t];
+        const float scale = samples > 0 ? 1.0f / samples : 0.0f;
+        for (int j = tile.y; j < tile.y + tile.th; j++) {
+            for (int i = tile.x; i < tile.x + tile.tw; i++) {
+                const size_t idx = j * work->width + i;
+                const float *c = &accum[idx * 3];
+                store_colour(&image[idx * 3],
+                             v3f_mulf((Colour){c[0], c[1], c[2]}, scale));
+            }
+        }
+    }
+}
+
+void resolve_accum(const Work *work) {
+    resolve_accum_into(work, work->accum, work->tile_samples, work->image);
+}
+
+// Final image from accum, through the denoiser when the scene enables it
+void resolve_image(const Work *work, const State *state) {
+    if (work->aov)
+        denoise_image(work, &state->denoise);
+    else
+        resolve_accum(work);
+}
+
+// Render the frame in passes of state->pass_samples spp, resolving and
+// writing snapshot_name every state->snapshot_interval seconds. Stops early,
+// with the best image so far, once render_stop_requested is set.
+void render_scene_progressive(Work *work, const State *state,
+                              const char *snapshot_name) {
+    struct timeval start, last_snapshot, now;
+    gettimeofday(&start, NULL);
+    last_snapshot = start;
+
+    const int spp = work->samples_per_pixel;
+    const int pass_samples = MAX(state->pass_samples, 1);
+    const int pass_count = (spp + pass_samples - 1) / pass_samples;
+    Log(Log_Info, "render_scene_progressive: %d passes of %d spp", pass_count,
+        pass_samples);
+
+    int pass = 0;
+    for (; pass < pass_count; pass++) {
+        if (atomic_load(&render_stop_requested)) break;
+
+        work->sample_begin = pass * pass_samples;
+        work->sample_end = MIN(work->sample_begin + pass_samples, spp);
+        atomic_store(&work->ray_count, 0);
+        render_scene(work);
+
+        gettimeofday(&now, NULL);
+        Log(Log_Info, "render_scene_progressive: pass %d/%d (%d spp) at %.0fms",
+            pass + 1, pass_count, work->sample_end,
+            timersub_ms(&now, &start));
+
+        const bool last = pass + 1 == pass_count;
+        if (!last && snapshot_name && state->snapshot_interval > 0 &&
+            timersub_ms(&now, &last_snapshot) >=
+                state->snapshot_interval * 1000.0) {
+            resolve_image(work, state);
+            export_image(snapshot_name, work->image, state->width,
+                         state->height, &state->tonemap);
+            last_snapshot = now;
+        }
+    }
+
+    if (pass < pass_count) {
+        Log(Log_Warn,
+            "render_scene_progressive: stopped after %d/%d passes, keeping "
+            "current image",
+            pass, pass_count);
+    }
+    resolve_image(work, state);
+}
+
+typedef struct {
+    char *file_name;
+    const float *image;
+    size_t width, height;
+    const Tonemap *tonemap;
+} FrameExport;
+
+static void export_frame(void *arg) {
+    FrameExport *e = arg;
+    export_image(e->file_name, e->image, e->width, e->height, e->tonemap);
+    free(e->file_name);
+}
+
+// Render every frame of the scene's animation to frame_file_name(output, f).
+// Frame f is exported on the pool while frame f + 1 renders, into the other
+// of two image buffers.
+void render_animation(Work *work, const State *state, const char *output) {
+    struct timeval start, now;
+    gettimeofday(&start, NULL);
+
+    const Cameras *frames = &work->scene->frames;
+    const size_t values = work->width * work->height * 3;
+    float *images[2] = {work->image,
+                        aligned_alloc(64, values * sizeof(float))};
+    if (!images[1]) {
+        Log(Log_Error, "render_animation: Memory allocation failed");
+        exit(1);
+    }
+    FrameExport exports[2];
+    TaskGroup exporting[2] = {0};
+
+    size_t f = 0;
+    for (; f < frames->size; f++) {
+        if (atomic_load(&render_stop_requested)) break;
+        const int b = f % 2;
+        pool_wait(&exporting[b]);  // frame f - 2 is written out
+
+        work->image = images[b];
+        work_set_camera(work, &frames->items[f]);
+        if (work->accum) {
+            memset(work->accum, 0, values * sizeof(float));
+            memset(work->tile_samples, 0,
+                   work->tile_count * sizeof(*work->tile_samples));
+            if (work->aov)
+                memset(work->aov, 0,
+                       work->width * work->height * sizeof(*work->aov));
+        }
+        atomic_store(&work->ray_count, 0);
+        render_scene(work);
+        if (work->accum) resolve_image(work, state);
+
+        exports[b] = (FrameExport){.file_name = frame_file_name(output, f),
+                                   .image = images[b],
+                                   .width = work->width,
+                                   .height = work->height,
+                                   .tonemap = &state->tonemap};
+        pool_spawn(&exporting[b], export_frame, &exports[b]);
+
+        gettimeofday(&now, NULL);
+        Log(Log_Info, "render_animation: frame %zu/%zu rendered at %.0fms",
+            f + 1, frames->size, timersub_ms(&now, &start));
+    }
+    pool_wait(&exporting[0]);
+    pool_wait(&exporting[1]);
+    if (f < frames->size)
+        Log(Log_Warn, "render_animation: stopped after %zu/%zu frames", f,
+            frames->size);
+
+    work->image = images[0];
+    free(images[1]);
+    gettimeofday(&now, NULL);
+    Log(Log_Info, "render_animation: %zu frames in %.0fms", f,
+        timersub_ms(&now, &start));
 }
@@ -40,6 +40,7 @@ static bool sphere_hit(const Hittable *hittable, const Ray *ray, float tmin,
     record->t = t;
     record->point = ray_at(ray, t);
     record->mat_index = sphere->mat_index;
+    record->light_idx = sphere->light_idx;
     record->uv = (V2f){-1, -1};
     V3f norm = v3f_divf(v3f_sub(record->point, sphere->center), sphere->radius);
     set_face_normal(ray, &norm, record);
@@ -60,6 +61,7 @@ static bool plane_hit(const Hittable *hittable, const Ray *ray, float tmin,
     record->t = t;
     record->point = ray_at(ray, t);
     record->mat_index = plane->mat_index;
+    record->light_idx = -1;
     record->uv = (V2f){-1, -1};
     set_face_normal(ray, &plane->normal, record);
 
@@ -89,6 +91,7 @@ static bool triangle_hit(const Hittable *hittable, const Ray *ray, float tmin,
     record->t = t;
     record->point = ray_at(ray, t);
     record->mat_index = tr->mat_index;
+    record->light_idx = tr->light_idx;
     record->uv = tr->v1.uv;  // using only 1 point for uv, barycentric stuff
     set_face_normal(ray, &tr->v1.normal,
                     record);  // using only 1 point as normal
@@ -116,57 +119,65 @@ static bool quad_hit(const Hittable *hittable, const Ray *ray, float tmin,
     record->t = t;
     record->point = P;
     record->mat_index = quad->mat_index;
+    record->light_idx = quad->light_idx;
     record->uv = (V2f){-1, -1};
     set_face_normal(ray, &quad->normal, record);
 
     return true;
 }
 
-static bool aabb_hit(const Hittable *h, const Ray *r, float tmin, float tmax,
-                     HitRecord *rec) {
-    const BVH_Node *node = h->data;
-    const AABB box = h->box;
+_Thread_local long *bvh_visit_counter = NULL;
+
+// Clips [tmin, tmax] to the ray's span inside box, false if it misses
+static inline bool aabb_slab(const AABB *box, const Ray *r, float *tmin,
+                             float *tmax) {
     const V3f *origin = &(r->origin);
     // x;
     float adinv = r->inv_dir.x;
 
-    float t0 = (box.xmin - origin->x) * adinv;
-    float t1 = (box.xmax - origin->x) * adinv;
+    float t0 = (box->xmin - origin->x) * adinv;
+    float t1 = (box->xmax - origin->x) * adinv;
     if (t0 < t1) {
-        if (t0 > tmin) tmin = t0;
-        if (t1 < tmax) tmax = t1;
+        if (t0 > *tmin) *tmin = t0;
+        if (t1 < *tmax) *tmax = t1;
     } else {
-        if (t1 > tmin) tmin = t1;
-        if (t0 < tmax) tmax = t0;
+        if (t1 > *tmin) *tmin = t1;
+        if (t0 < *tmax) *tmax = t0;
     }
-    if (tmax <= tmin) return false;
+    if (*tmax <= *tmin) return false;
 
     // y;
     adinv = r->inv_dir.y;
-    t0 = (box.ymin - origin->y) * adinv;
-    t1 = (box.ymax - origin->y) * adinv;
+    t0 = (box->ymin - origin->y) * adinv;
+    t1 = (box->ymax - origin->y) * adinv;
     if (t0 < t1) {
-        if (t0 > tmin) tmin = t0;
-        if (t1 < tmax) tmax = t1;
+        if (t0 > *tmin) *tmin = t0;
+        if (t1 < *tmax) *tmax = t1;
     } else {
-        if (t1 > tmin) tmin = t1;
-        if (t0 < tmax) tmax = t0;
+        if (t1 > *tmin) *tmin = t1;
+        if (t0 < *tmax) *tmax = t0;
     }
-    if (tmax <= tmin) return false;
+    if (*tmax <= *tmin) return false;
 
     // z;
     adinv = r->inv_dir.z;
-    t0 = (box.zmin - origin->z) * adinv;
-    t1 = (box.zmax - origin->z) * adinv;
+    t0 = (box->zmin - origin->z) * adinv;
+    t1 = (box->zmax - origin->z) * adinv;
     if (t0 < t1) {
-        if (t0 > tmin) tmin = t0;
-        if (t1 < tmax) tmax = t1;
+        if (t0 > *tmin) *tmin = t0;
+        if (t1 < *tmax) *tmax = t1;
     } else {
-        if (t1 > tmin) tmin = t1;
-        if (t0 < tmax) tmax = t0;
+        if (t1 > *tmin) *tmin = t1;
+        if (t0 < *tmax) *tmax = t0;
     }
-    if (tmax <= tmin) return false;
+    return *tmax > *tmin;
+}
+
+static bool aabb_hit(const Hittable *h, const Ray *r, float tmin, float tmax,
+                     HitRecord *rec) {
+    if (!aabb_slab(&h->box, r, &tmin, &tmax)) return false;
 
+    const BVH_Node *node = h->data;
     bool hit_left = node->left.hit(&node->left, r, tmin, tmax, rec);
     bool hit_right =
         node->right.hit(&node->right, r, tmin, hit_left ? rec->t : tmax, rec);
@@ -174,9 +185,28 @@ static bool aabb_hit(const Hittable *h, const Ray *r, float tmin, float tmax,
     return hit_left || hit_right;
 }
 
+// Same traversal as aabb_hit, adding each BVH node entered to *visits
+static bool counted_hit(const Hittable *h, const Ray *r, float tmin,
+                        float tmax, HitRecord *rec, long *visits) {
+    if (h->type != HITTABLE_BVH) return h->hit(h, r, tmin, tmax, rec);
+
+    (*visits)++;
+    if (!aabb_slab(&h->box, r, &tmin, &tmax)) return false;
+
+    const BVH_Node *node = h->data;
+    bool hit_left = counted_hit(&node->left, r, tmin, tmax, rec, visits);
+    bool hit_right = counted_hit(&node->right, r, tmin,
+                                 hit_left ? rec->t : tmax, rec, visits);
+
+    return hit_left || hit_right;
+}
+
 bool scene_hit(const Ray *r, const Scene *scene, float tmin, float tmax,
                HitRecord *record) {
     if (!scene->bvh_root.hit) return false;
+    if (bvh_visit_counter)
+        return counted_hit(&scene->bvh_root, r, tmin, tmax, record,
+                           bvh_visit_counter);
     return scene->bvh_root.hit(&scene->bvh_root, r, tmin, tmax, record);
 }
 
@@ -8,15 +8,24 @@
 
 #include "aabb.h"
 #include "common.h"
+#include "renderer.h"
 #include "rinternal.h"
 #include "utils.h"
 #include "vec.h"
 
+// Widest or tallest image a scene may ask for, keeping buffer sizes in
+// range
+#define MAX_IMAGE_SIDE 32768
+
 static void fatal(const char *msg) {
     Log(Log_Error, msg);
     exit(1);
 }
 
+static void log_error(const char *msg) {
+    Log(Log_Error, "load_scene: %s", msg);
+}
+
 static void log_warn(const char *msg) { Log(Log_Warn, "load_scene: %s", msg); }
 
 void print_summary(const Scene *scene, const State *state) {
@@ -26,7 +35,11 @@ void print_summary(const Scene *scene, const State *state) {
     Log(Log_Info, "load_scene: Loaded %d planes", scene->plane_count);
     Log(Log_Info, "load_scene: Loaded %d triangles", scene->triangle_count);
     Log(Log_Info, "load_scene: Loaded %d quads", scene->quad_count);
+    Log(Log_Info, "load_scene: Loaded %zu lights", scene->lights.lights.size);
     Log(Log_Info, "load_scene: Loaded %d materials", scene->materials.size);
+    if (scene->frames.size > 0)
+        Log(Log_Info, "load_scene: Loaded %zu animation frames",
+            scene->frames.size);
 }
 
 // TODO: check what all actually needs to be normalized
@@ -112,10 +125,31 @@ static inline void append_hittable(Scene *scene, Hittable h) {
     vec_push(&scene->objects, h);
 }
 
+// Registers the primitive with the light tree if its material emits, returns
+// its light index or -1
+static int add_light(Scene *scene, LightShape shape, const void *data,
+                     int mat_index, V3f normal, float area) {
+    const Material *mat = &scene->materials.items[mat_index];
+    if (mat->type != MAT_EMISSIVE) return -1;
+    const Colour emission = material_emission(mat);
+    if (v3f_luminance(emission) <= 0 || area <= 0) return -1;
+
+    const Light light = {.shape = shape,
+                         .data = data,
+                         .emission = emission,
+                         .normal = normal,
+                         .area = area};
+    vec_push(&scene->lights.lights, light);
+    return (int)scene->lights.lights.size - 1;
+}
+
 static void append_sphere(Scene *scene, Sphere sphere) {
     scene->sphere_count++;
     Sphere *sphere_data = ARENA_PUSH_STRUCT(&scene->arena, Sphere);
     *sphere_data = sphere;
+    sphere_data->light_idx =
+        add_light(scene, LIGHT_SPHERE, sphere_data, sphere.mat_index,
+                  (V3f){0, 0, 1}, 4 * PI * sphere.radius * sphere.radius);
 
     Hittable h = make_hittable_sphere(sphere_data);
     append_hittable(scene, h);
@@ -133,6 +167,10 @@ static void append_triangle(Scene *scene, Triangle triangle) {
     scene->triangle_count++;
     Triangle *triangle_data = ARENA_PUSH_STRUCT(&scene->arena, Triangle);
     *triangle_data = triangle;
+    const V3f n = v3f_cross(triangle.e1, triangle.e2);
+    triangle_data->light_idx =
+        add_light(scene, LIGHT_TRIANGLE, triangle_data, triangle.mat_index,
+                  v3f_normalize(n), v3f_length(n) / 2);
     Hittable h = make_hittable_triangle(triangle_data);
     append_hittable(scene, h);
 }
@@ -141,6 +179,9 @@ static void append_quad(Scene *scene, Quad quad) {
     scene->quad_count++;
     Quad *quad_data = ARENA_PUSH_STRUCT(&scene->arena, Quad);
     *quad_data = quad;
+    quad_data->light_idx =
+        add_light(scene, LIGHT_QUAD, quad_data, quad.mat_index, quad.normal,
+                  v3f_length(v3f_cross(quad.u, quad.v)));
     Hittable h = make_hittable_quad(quad_data);
     append_hittable(scene, h);
 }
@@ -388,7 +429,7 @@ static int parse_triangle(Scene *scene, const cJSON *tnode) {
 
     V3f e1 = v3f_sub(P2, P1);
     V3f e2 = v3f_sub(P3, P1);
-    V3f n = v3f_cross(e1, e2);
+    V3f n = v3f_normalize(v3f_cross(e1, e2));
 
     append_triangle(scene, make_triangle(P1, P2, P3, n, n, n, (V2f){0},
                                          (V2f){0}, (V2f){0}, mi));
@@ -397,26 +438,159 @@ static int parse_triangle(Scene *scene, const cJSON *tnode) {
 
 char *read_compress_scene(const char *scene_file) {
     char *file = read_entire_file(scene_file);
-    if (!file) fatal("load_scene: Cannot read file.");
+    if (!file) {
+        log_error(temp_sprintf("Cannot read %s", scene_file));
+        return NULL;
+    }
     cJSON_Minify(file);
     return file;
 }
 
-void load_scene(const char *scene_file_content, Scene *scene, State *state) {
+// Camera fields a keyframe sets, the others carry over from the keyframe
+// before it (the scene camera for the first)
+static Camera parse_keyframe(const cJSON *key, Camera cam, const char *ctx) {
+    const cJSON *v;
+    if ((v = cJSON_GetObjectItemCaseSensitive(key, "position")))
+        cam.position = parse_v3f(v, ctx, cam.position);
+    if ((v = cJSON_GetObjectItemCaseSensitive(key, "look_at")))
+        cam.look_at = parse_v3f(v, ctx, cam.look_at);
+    if ((v = cJSON_GetObjectItemCaseSensitive(key, "up")))
+        cam.up = v3f_normalize(parse_v3f(v, ctx, cam.up));
+    if ((v = cJSON_GetObjectItemCaseSensitive(key, "fov")))
+        cam.fov = DEG2RAD(parse_float(v, ctx, RAD2DEG(cam.fov)));
+    if ((v = cJSON_GetObjectItemCaseSensitive(key, "defocus_angle")))
+        cam.defocus_angle =
+            DEG2RAD(parse_float(v, ctx, RAD2DEG(cam.defocus_angle)));
+    if ((v = cJSON_GetObjectItemCaseSensitive(key, "focus_dist")))
+        cam.focus_dist = parse_float(v, ctx, cam.focus_dist);
+    return cam;
+}
+
+static inline float lerp(float a, float b, float t) { return a + (b - a) * t; }
+
+static inline V3f v3f_lerp(V3f a, V3f b, float t) {
+    return v3f_add(a, v3f_mulf(v3f_sub(b, a), t));
+}
+
+// Uniform Catmull-Rom through p1 (t = 0) and p2 (t = 1)
+static V3f catmull_rom(V3f p0, V3f p1, V3f p2, V3f p3, float t) {
+    const float t2 = t * t, t3 = t2 * t;
+    const V3f a = v3f_mulf(p1, 2);
+    const V3f b = v3f_mulf(v3f_sub(p2, p0), t);
+    const V3f c = v3f_mulf(
+        v3f_add(v3f_sub(v3f_mulf(p0, 2), v3f_mulf(p1, 5)),
+                v3f_sub(v3f_mulf(p2, 4), p3)),
+        t2);
+    const V3f d = v3f_mulf(
+        v3f_add(v3f_sub(v3f_mulf(p1, 3), p0), v3f_sub(p3, v3f_mulf(p2, 3))),
+        t3);
+    return v3f_mulf(v3f_add(v3f_add(a, b), v3f_add(c, d)), 0.5f);
+}
+
+// "animation": {"frames": N, "interpolation": "linear" | "catmull_rom",
+// "keyframes": [{"frame": f, camera fields..}, ..]} becomes N cameras, held
+// before the first keyframe and after the last
+static void parse_animation(const cJSON *anim, const Camera *base,
+                            Scene *scene) {
+    const int frame_count = parse_int(
+        cJSON_GetObjectItemCaseSensitive(anim, "frames"), "animation.frames",
+        0);
+    const cJSON *keys = cJSON_GetObjectItemCaseSensitive(anim, "keyframes");
+    const int key_count = cJSON_IsArray(keys) ? cJSON_GetArraySize(keys) : 0;
+    if (frame_count <= 0 || key_count == 0) {
+        log_warn("animation: needs frames > 0 and keyframes, ignoring it");
+        return;
+    }
+    const cJSON *interp =
+        cJSON_GetObjectItemCaseSensitive(anim, "interpolation");
+    const bool smooth = cJSON_IsString(interp) &&
+                        strcmp(interp->valuestring, "catmull_rom") == 0;
+    if (cJSON_IsString(interp) && !smooth &&
+        strcmp(interp->valuestring, "linear") != 0)
+        log_warn("animation.interpolation: unknown, using linear");
+
+    Camera *key_cams = malloc(key_count * sizeof(*key_cams));
+    int *key_frames = malloc(key_count * sizeof(*key_frames));
+    if (!key_cams || !key_frames) fatal("load_scene: keyframe alloc failed");
+    Camera prev = *base;
+    for (int k = 0; k < key_count; k++) {
+        const cJSON *key = cJSON_GetArrayItem(keys, k);
+        const char *ctx = temp_sprintf("animation.keyframes[%d]", k);
+        key_frames[k] =
+            parse_int(cJSON_GetObjectItemCaseSensitive(key, "frame"), ctx,
+                      k > 0 ? key_frames[k - 1] + 1 : 0);
+        if (k > 0 && key_frames[k] <= key_frames[k - 1]) {
+            log_warn(temp_sprintf("%s: frames must increase", ctx));
+            key_frames[k] = key_frames[k - 1] + 1;
+        }
+        key_cams[k] = prev = parse_keyframe(key, prev, ctx);
+    }
+
+    vec_init(&scene->frames);
+    for (int f = 0; f < frame_count; f++) {
+        int k = 0;
+        while (k + 1 < key_count && key_frames[k + 1] <= f) k++;
+        Camera cam = key_cams[k];
+        if (k + 1 < key_count && f > key_frames[k]) {
+            const Camera *a = &key_cams[k], *b = &key_cams[k + 1];
+            const float t = (float)(f - key_frames[k]) /
+                            (float)(key_frames[k + 1] - key_frames[k]);
+            if (smooth) {
+                const Camera *before = &key_cams[k > 0 ? k - 1 : k];
+                const Camera *after =
+                    &key_cams[k + 2 < key_count ? k + 2 : k + 1];
+                cam.position = catmull_rom(before->position, a->position,
+                                           b->position, after->position, t);
+                cam.look_at = catmull_rom(before->look_at, a->look_at,
+                                          b->look_at, after->look_at, t);
+            } else {
+                cam.position = v3f_lerp(a->position, b->position, t);
+                cam.look_at = v3f_lerp(a->look_at, b->look_at, t);
+            }
+            cam.up = v3f_normalize(v3f_lerp(a->up, b->up, t));
+            cam.fov = lerp(a->fov, b->fov, t);
+            cam.defocus_angle = lerp(a->defocus_angle, b->defocus_angle, t);
+            cam.focus_dist = lerp(a->focus_dist, b->focus_dist, t);
+        }
+        calculate_camera_fields(&cam);
+        vec_push(&scene->frames, cam);
+    }
+    free(key_cams);
+    free(key_frames);
+}
+
+// zlib's CRC-32, a nibble at a time
+unsigned int scene_crc32(const char *scene_json) {
+    static const uint32_t table[16] = {
+        0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4,
+        0x4db26158, 0x5005713c, 0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+        0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c};
+    uint32_t crc = ~0u;
+    for (const unsigned char *p = (const unsigned char *)scene_json; *p; p++) {
+        crc ^= *p;
+        crc = (crc >> 4) ^ table[crc & 15];
+        crc = (crc >> 4) ^ table[crc & 15];
+    }
+    return ~crc;
+}
+
+bool load_scene(const char *scene_file_content, Scene *scene, State *state) {
     struct timeval start, end;
     gettimeofday(&start, NULL);
 
     scene->objects = (Hittables){0};
+    scene->lights = (LightTree){0};
 
     cJSON *json = cJSON_Parse(scene_file_content);
 
     if (!json) {
         const char *indicator =
             "                                                          ^";
-        fatal(temp_sprintf(
-            "load_scene: JSON parse error near: %.30s\n%s",
+        log_error(temp_sprintf(
+            "JSON parse error near: %.30s\n%s",
             cJSON_GetErrorPtr() ? cJSON_GetErrorPtr() - 15 : "unknown",
             indicator));
+        return false;
     }
 
     Camera camera = {.position = {0, 0, -5},
@@ -434,8 +608,10 @@ void load_scene(const char *scene_file_content, Scene *scene, State *state) {
         int height =
             parse_int(cJSON_GetObjectItemCaseSensitive(config, "height"),
                       "config.height", -1);
-        if (width <= 0 || height <= 0) {
-            fatal("config: invalid width/height");
+        if (width <= 0 || height <= 0 || width > MAX_IMAGE_SIDE ||
+            height > MAX_IMAGE_SIDE) {
+            log_error("config: invalid width/height");
+            goto PARSE_FAILED;
         }
         state->width = (size_t)width;
         state->height = (size_t)height;
@@ -446,8 +622,81 @@ void load_scene(const char *scene_file_content, Scene *scene, State *state) {
         state->max_depth =
             parse_int(cJSON_GetObjectItemCaseSensitive(config, "max_depth"),
                       "config.max_depth", state->max_depth);
+
+        state->pass_samples = 0;
+        state->snapshot_interval = 0;
+        const cJSON *prog =
+            cJSON_GetObjectItemCaseSensitive(config, "progressive");
+        if (cJSON_IsObject(prog)) {
+            state->pass_samples = parse_int(
+                cJSON_GetObjectItemCaseSensitive(prog, "pass_samples"),
+                "config.progressive.pass_samples", 1);
+            state->snapshot_interval = parse_float(
+                cJSON_GetObjectItemCaseSensitive(prog, "snapshot_interval"),
+                "config.progressive.snapshot_interval", 0);
+            if (state->pass_samples <= 0) {
+                log_warn(
+                    "config.progressive.pass_samples: must be >0, using 1");
+                state->pass_samples = 1;
+            }
+        }
+
+        state->denoise = (DenoiseConfig){.enabled = false,
+                                         .iterations = 5,
+                                         .sigma_luminance = 4.0f,
+                                         .sigma_normal = 128.0f,
+                                         .sigma_depth = 0.05f};
+        const cJSON *dn = cJSON_GetObjectItemCaseSensitive(config, "denoise");
+        if (cJSON_IsObject(dn)) {
+            DenoiseConfig *d = &state->denoise;
+            d->enabled = true;
+            d->iterations = parse_int(
+                cJSON_GetObjectItemCaseSensitive(dn, "iterations"),
+                "config.denoise.iterations", d->iterations);
+            d->sigma_luminance = parse_float(
+                cJSON_GetObjectItemCaseSensitive(dn, "sigma_luminance"),
+                "config.denoise.sigma_luminance", d->sigma_luminance);
+            d->sigma_normal = parse_float(
+                cJSON_GetObjectItemCaseSensitive(dn, "sigma_normal"),
+                "config.denoise.sigma_normal", d->sigma_normal);
+            d->sigma_depth = parse_float(
+                cJSON_GetObjectItemCaseSensitive(dn, "sigma_depth"),
+                "config.denoise.sigma_depth", d->sigma_depth);
+            if (d->iterations < 1 || d->iterations > 10) {
+                log_warn("config.denoise.iterations: must be 1..10, using 5");
+                d->iterations = 5;
+            }
+        }
+
+        state->tonemap = (Tonemap){.op = TONEMAP_CLAMP, .exposure = 0};
+        const cJSON *tm = cJSON_GetObjectItemCaseSensitive(config, "tonemap");
+        if (cJSON_IsObject(tm)) {
+            const cJSON *op = cJSON_GetObjectItemCaseSensitive(tm, "operator");
+            if (cJSON_IsString(op)) {
+                if (strcmp(op->valuestring, "clamp") == 0)
+                    state->tonemap.op = TONEMAP_CLAMP;
+                else if (strcmp(op->valuestring, "reinhard") == 0)
+                    state->tonemap.op = TONEMAP_REINHARD;
+                else if (strcmp(op->valuestring, "aces") == 0)
+                    state->tonemap.op = TONEMAP_ACES;
+                else
+                    log_warn("config.tonemap.operator: unknown, using clamp");
+            }
+            state->tonemap.exposure = parse_float(
+                cJSON_GetObjectItemCaseSensitive(tm, "exposure"),
+                "config.tonemap.exposure", 0);
+        }
+
+        state->cost_prepass = false;
+        const cJSON *cp =
+            cJSON_GetObjectItemCaseSensitive(config, "cost_prepass");
+        if (cJSON_IsBool(cp))
+            state->cost_prepass = cJSON_IsTrue(cp);
+        else if (cp)
+            log_warn("config.cost_prepass: must be true or false");
     } else {
-        fatal("config: not found.");
+        log_error("config: not found.");
+        goto PARSE_FAILED;
     }
 
     const cJSON *cam = cJSON_GetObjectItemCaseSensitive(json, "camera");
@@ -485,6 +734,10 @@ void load_scene(const char *scene_file_content, Scene *scene, State *state) {
     } else
         log_warn("camera: not found, using defaults.");
 
+    scene->frames = (Cameras){0};
+    const cJSON *anim = cJSON_GetObjectItemCaseSensitive(json, "animation");
+    if (cJSON_IsObject(anim)) parse_animation(anim, &camera, scene);
+
     const cJSON *materials =
         cJSON_GetObjectItemCaseSensitive(json, "materials");
     if (cJSON_IsArray(materials)) {
@@ -541,9 +794,9 @@ void load_scene(const char *scene_file_content, Scene *scene, State *state) {
                     break;
 
                 default:
-                    Log(Log_Error, "load_scene: material: unknown type %s",
-                        type->valuestring);
-                    exit(1);
+                    log_error(temp_sprintf("material: unknown type %s",
+                                           type->valuestring));
+                    goto PARSE_FAILED;
             }
 
             vec_push(&scene->materials, dst);
@@ -670,16 +923,37 @@ END_PARSE:
 
     scene->bvh_root = construct_bvh(&scene->arena, scene->objects.items, 0,
                                     scene->objects.size);
+    light_tree_build(&scene->lights);
 
     state->image =
-        aligned_alloc(64, state->width * state->height * sizeof(uint32_t));
-    if (!state->image) fatal("load_scene: image alloc failed: %s");
+        aligned_alloc(64, state->width * state->height * 3 * sizeof(float));
+    if (!state->image) {
+        log_error("image alloc failed");
+        return false;
+    }
+
+    state->accum = NULL;
+    if (state->pass_samples > 0 || state->denoise.enabled) {
+        state->accum =
+            calloc(state->width * state->height * 3, sizeof(*state->accum));
+        if (!state->accum) {
+            log_error("accum alloc failed");
+            free(state->image);
+            state->image = NULL;
+            return false;
+        }
+    }
 
     scene->camera = camera;
     gettimeofday(&end, NULL);
     float ms = (float)timersub_ms(&end, &start);
 
     Log(Log_Info, "load_scene: Loaded scene in %fms", ms);
+    return true;
+
+PARSE_FAILED:
+    cJSON_Delete(json);
+    return false;
 }
 
 void free_scene(Scene *scene) {
@@ -689,4 +963,6 @@ void free_scene(Scene *scene) {
 
     vec_free(&scene->objects);
     vec_free(&scene->materials);
+    vec_free(&scene->frames);
+    light_tree_free(&scene->lights);
 }
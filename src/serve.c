@@ -0,0 +1,430 @@
+#include "serve.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "api.h"
+#include "imagerw.h"
+#include "renderer.h"
+#include "scene.h"
+#include "utils.h"
+
+typedef enum {
+    JOB_QUEUED,
+    JOB_RUNNING,
+    JOB_DONE,
+    JOB_FAILED,
+    JOB_CANCELLED,
+} JobStatus;
+
+static const char *const job_status_names[] = {"queued", "running", "done",
+                                               "failed", "cancelled"};
+
+typedef struct {
+    int id;
+    int priority;  // higher runs first, ties in submission order
+    char *scene_file;
+    char *output_file;
+    JobStatus status;
+    bool cancel_requested;
+    MasterState *ms;  // while running, for progress and cancelling
+    double queued_ms, started_ms, finished_ms;  // since the server started
+} Job;
+
+// A loaded scene, kept between jobs
+typedef struct {
+    unsigned int crc;  // of the minified scene JSON
+    Scene *scene;
+    State state;  // as loaded, without image and accum
+    float *tile_cost;  // cost prepass, NULL until a job ran one
+    int *tile_order;
+    long last_used;
+} Resident;
+
+Vector(Job, Jobs);
+Vector(Resident, Residents);
+
+struct JobQueue {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    Jobs jobs;  // jobs.items[id - 1]
+    struct timeval start;
+
+    // only touched by the serve thread
+    Residents residents;
+    int resident_limit;
+    long clock;  // jobs started, orders residents by last use
+};
+
+static double queue_ms(const struct JobQueue *q) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return timersub_ms(&now, &q->start);
+}
+
+int job_queue_submit(struct JobQueue *q, const char *scene_file,
+                     const char *output_file, int priority) {
+    // clients name files relative to the server's directory, and only there
+    if (!asset_local_path(scene_file) || !asset_local_path(output_file)) {
+        Log(Log_Warn, "serve: Refusing job, %s -> %s leaves the directory",
+            scene_file, output_file);
+        return -1;
+    }
+    FILE *f = fopen(scene_file, "r");
+    if (!f) {
+        Log(Log_Warn, "serve: Refusing job, cannot open scene %s", scene_file);
+        return -1;
+    }
+    fclose(f);
+
+    pthread_mutex_lock(&q->lock);
+    const Job job = {.id = (int)q->jobs.size + 1,
+                     .priority = priority,
+                     .scene_file = strdup(scene_file),
+                     .output_file = strdup(output_file),
+                     .status = JOB_QUEUED,
+                     .queued_ms = queue_ms(q)};
+    vec_push(&q->jobs, job);
+    pthread_cond_signal(&q->changed);
+    pthread_mutex_unlock(&q->lock);
+
+    Log(Log_Info, "serve: Queued job %d (%s -> %s, priority %d)", job.id,
+        scene_file, output_file, priority);
+    return job.id;
+}
+
+bool job_queue_cancel(struct JobQueue *q, int id) {
+    pthread_mutex_lock(&q->lock);
+    Job *job = id >= 1 && id <= (int)q->jobs.size ? &q->jobs.items[id - 1]
+                                                   : NULL;
+    const bool live =
+        job && (job->status == JOB_QUEUED || job->status == JOB_RUNNING);
+    if (live) {
+        job->cancel_requested = true;
+        if (job->status == JOB_QUEUED) {
+            job->status = JOB_CANCELLED;
+            job->finished_ms = queue_ms(q);
+        }
+        if (job->ms) atomic_store(&job->ms->cancelled, true);
+    }
+    pthread_mutex_unlock(&q->lock);
+    if (live) Log(Log_Info, "serve: Cancelled job %d", id);
+    return live;
+}
+
+// Caller holds q->lock
+static cJSON *job_json(const Job *job) {
+    cJSON *j = cJSON_CreateObject();
+    cJSON_AddNumberToObject(j, "job_id", job->id);
+    cJSON_AddNumberToObject(j, "priority", job->priority);
+    cJSON_AddStringToObject(j, "scene", job->scene_file);
+    cJSON_AddStringToObject(j, "output", job->output_file);
+    cJSON_AddStringToObject(j, "status", job_status_names[job->status]);
+    if (job->ms) {
+        cJSON_AddNumberToObject(j, "items_completed",
+                                atomic_load(&job->ms->items_completed));
+        cJSON_AddNumberToObject(j, "item_count", job->ms->tile_count);
+    }
+    cJSON_AddNumberToObject(j, "queued_ms", job->queued_ms);
+    if (job->status != JOB_QUEUED && job->started_ms > 0)
+        cJSON_AddNumberToObject(j, "started_ms", job->started_ms);
+    if (job->finished_ms > 0)
+        cJSON_AddNumberToObject(j, "finished_ms", job->finished_ms);
+    return j;
+}
+
+cJSON *job_queue_json(struct JobQueue *q) {
+    cJSON *root = cJSON_CreateObject();
+    cJSON *jobs = cJSON_AddArrayToObject(root, "jobs");
+    pthread_mutex_lock(&q->lock);
+    for (size_t i = 0; i < q->jobs.size; i++)
+        cJSON_AddItemToArray(jobs, job_json(&q->jobs.items[i]));
+    pthread_mutex_unlock(&q->lock);
+    return root;
+}
+
+cJSON *job_queue_job_json(struct JobQueue *q, int id) {
+    pthread_mutex_lock(&q->lock);
+    cJSON *j = id >= 1 && id <= (int)q->jobs.size
+                   ? job_json(&q->jobs.items[id - 1])
+                   : NULL;
+    pthread_mutex_unlock(&q->lock);
+    return j;
+}
+
+// Index of the queued job to run next, -1 for none. Caller holds q->lock.
+static int next_job(const struct JobQueue *q) {
+    int best = -1;
+    for (size_t i = 0; i < q->jobs.size; i++) {
+        const Job *job = &q->jobs.items[i];
+        if (job->status != JOB_QUEUED) continue;
+        if (best < 0 || job->priority > q->jobs.items[best].priority)
+            best = (int)i;
+    }
+    return best;
+}
+
+static void resident_free(Resident *r) {
+    free(r->scene->scene_json);
+    scene_bundle_free(r->scene->bundle);
+    free_scene(r->scene);
+    free(r->scene);
+    free(r->tile_cost);
+    free(r->tile_order);
+}
+
+// The loaded scene of scene_file, loading it (and evicting the least
+// recently used one) unless a scene with the same JSON is resident already
+static Resident *resident_get(struct JobQueue *q, const char *scene_file) {
+    char *json = read_entire_file(scene_file);
+    if (!json) return NULL;
+    cJSON_Minify(json);
+    const unsigned int crc = scene_crc32(json);
+
+    for (size_t i = 0; i < q->residents.size; i++) {
+        Resident *r = &q->residents.items[i];
+        if (r->crc != crc) continue;
+        free(json);
+        r->last_used = q->clock;
+        Log(Log_Info, "serve: Scene %s (%u) is resident", scene_file, crc);
+        return r;
+    }
+
+    if ((int)q->residents.size >= q->resident_limit) {
+        size_t lru = 0;
+        for (size_t i = 1; i < q->residents.size; i++) {
+            if (q->residents.items[i].last_used <
+                q->residents.items[lru].last_used)
+                lru = i;
+        }
+        Log(Log_Info, "serve: Evicting scene %u",
+            q->residents.items[lru].crc);
+        resident_free(&q->residents.items[lru]);
+        q->residents.items[lru] =
+            q->residents.items[--q->residents.size];
+    }
+
+    Resident r = {.crc = crc, .last_used = q->clock};
+    r.scene = calloc(1, sizeof(*r.scene));
+    if (!r.scene) {
+        Log(Log_Error, "serve: Memory allocation failed");
+        free(json);
+        return NULL;
+    }
+    r.scene->arena = arena_create(1024 * 1024 * 256);  // 256MB
+    if (!load_scene(json, r.scene, &r.state)) {
+        Log(Log_Warn, "serve: Scene %s cannot be rendered", scene_file);
+        free_scene(r.scene);
+        free(r.scene);
+        free(json);
+        return NULL;
+    }
+    r.scene->scene_crc = crc;
+    r.scene->scene_json = json;
+    r.scene->bundle = scene_bundle_create(json, crc);
+    calculate_camera_fields(&r.scene->camera);
+    print_summary(r.scene, &r.state);
+    // every job renders into buffers of its own
+    free(r.state.image);
+    free(r.state.accum);
+    r.state.image = NULL;
+    r.state.accum = NULL;
+
+    vec_push(&q->residents, r);
+    return &q->residents.items[q->residents.size - 1];
+}
+
+static void finish_job(struct JobQueue *q, int idx, JobStatus status) {
+    pthread_mutex_lock(&q->lock);
+    Job *job = &q->jobs.items[idx];
+    job->status = status;
+    job->ms = NULL;
+    job->finished_ms = queue_ms(q);
+    Log(Log_Info, "serve: Job %d %s after %.0fms", job->id,
+        job_status_names[status], job->finished_ms - job->started_ms);
+    pthread_mutex_unlock(&q->lock);
+}
+
+// Tile costs are a property of the scene, the prepass runs once per resident.
+// False when out of memory.
+static bool job_tile_costs(Resident *r, Work *work) {
+    const size_t size = work->tile_count * sizeof(float);
+    if (r->tile_cost) {
+        work->tile_cost = malloc(size);
+        work->tile_order = malloc(work->tile_count * sizeof(int));
+        if (!work->tile_cost || !work->tile_order) {
+            Log(Log_Error, "serve: Memory allocation failed");
+            return false;
+        }
+        memcpy(work->tile_cost, r->tile_cost, size);
+        memcpy(work->tile_order, r->tile_order, work->tile_count * sizeof(int));
+        return true;
+    }
+    estimate_tile_costs(work);
+    float *cost = malloc(size);
+    int *order = malloc(work->tile_count * sizeof(int));
+    if (!cost || !order) {
+        // the job still has its costs, the next one runs the prepass again
+        free(cost);
+        free(order);
+        return true;
+    }
+    memcpy(cost, work->tile_cost, size);
+    memcpy(order, work->tile_order, work->tile_count * sizeof(int));
+    r->tile_cost = cost;
+    r->tile_order = order;
+    return true;
+}
+
+static void free_job_buffers(Work *work, State *state) {
+    free(work->tiles);
+    free(work->tile_samples);
+    free(work->tile_cost);
+    free(work->tile_order);
+    free(work->aov);
+    free(state->image);
+    free(state->accum);
+}
+
+static void run_job(struct JobQueue *q, MasterAPIContext *context,
+                    const MachineInfo *self, int idx) {
+    pthread_mutex_lock(&q->lock);
+    const Job job = q->jobs.items[idx];  // the strings don't change
+    pthread_mutex_unlock(&q->lock);
+    Log(Log_Info, "serve: Starting job %d (%s)", job.id, job.scene_file);
+
+    q->clock++;
+    Resident *r = resident_get(q, job.scene_file);
+    if (!r) {
+        finish_job(q, idx, JOB_FAILED);
+        return;
+    }
+
+    State state = r->state;
+    if (state.pass_samples > 0) {
+        Log(Log_Warn, "serve: progressive mode is standalone only, rendering "
+                      "in one pass");
+    }
+    // results carry colour sums only, not the denoiser's guides
+    if (state.denoise.enabled) {
+        Log(Log_Warn, "serve: distributed renders are not denoised, skipping "
+                      "denoise");
+        state.denoise.enabled = false;
+    }
+    const size_t values = state.width * state.height * 3;
+    state.image = aligned_alloc(64, values * sizeof(float));
+    state.accum = calloc(values, sizeof(float));
+    if (!state.image || !state.accum) {
+        Log(Log_Error, "serve: Memory allocation failed");
+        free(state.image);
+        free(state.accum);
+        finish_job(q, idx, JOB_FAILED);
+        return;
+    }
+    Work work;
+    init_work(r->scene, &state, &work);
+    if (state.cost_prepass && !job_tile_costs(r, &work)) {
+        free_job_buffers(&work, &state);
+        finish_job(q, idx, JOB_FAILED);
+        return;
+    }
+
+    MasterState *ms = master_state_create(r->scene, &state, &work, self);
+    ms->frame_output = job.output_file;  // animation frames, as they complete
+    master_init_work_items(ms, &work);
+    pthread_mutex_lock(&q->lock);
+    q->jobs.items[idx].ms = ms;
+    if (q->jobs.items[idx].cancel_requested)
+        atomic_store(&ms->cancelled, true);
+    pthread_mutex_unlock(&q->lock);
+
+    master_set_job(context, job.id, r->scene, &state, &work, ms);
+    master_render(ms);
+    master_set_job(context, 0, NULL, NULL, NULL, NULL);
+
+    // cancel_requested can't change once the job is finished
+    pthread_mutex_lock(&q->lock);
+    q->jobs.items[idx].ms = NULL;
+    const bool cancelled = atomic_load(&ms->cancelled);
+    pthread_mutex_unlock(&q->lock);
+    // a bad output path fails the job, the server keeps running
+    bool written = !atomic_load(&ms->export_failed);
+    if (!cancelled && r->scene->frames.size == 0) {
+        resolve_accum(&work);
+        written = export_image(job.output_file, state.image, state.width,
+                               state.height, &state.tonemap);
+    }
+    finish_job(q, idx,
+               cancelled ? JOB_CANCELLED : written ? JOB_DONE : JOB_FAILED);
+
+    master_state_free(ms);
+    free_job_buffers(&work, &state);
+}
+
+bool serve_run(int port, const MachineInfo *self, int resident_scenes,
+               Codec codec, int http_threads) {
+    struct JobQueue q = {.resident_limit = MAX(resident_scenes, 1)};
+    pthread_mutex_init(&q.lock, NULL);
+    pthread_cond_init(&q.changed, NULL);
+    vec_init(&q.jobs);
+    vec_init(&q.residents);
+    gettimeofday(&q.start, NULL);
+
+    MasterAPIContext *context = calloc(1, sizeof(*context));
+    if (!context) {
+        Log(Log_Error, "serve: Memory allocation failed");
+        return false;
+    }
+    vec_init(&context->workers);
+    pthread_mutex_init(&context->job_lock, NULL);
+    pthread_cond_init(&context->channel_wake, NULL);
+    context->jobs = &q;
+    context->codec = codec;
+    context->http_threads = http_threads;
+    if (!master_start_server(port, context)) return false;
+    Log(Log_Info, "serve: Listening on port %d, up to %d resident scenes", port,
+        q.resident_limit);
+
+    while (true) {
+        pthread_mutex_lock(&q.lock);
+        int next = -1;
+        while (!atomic_load(&render_stop_requested) &&
+               (next = next_job(&q)) < 0) {
+            struct timespec until;
+            timespec_get(&until, TIME_UTC);
+            until.tv_sec += 1;  // to notice render_stop_requested
+            pthread_cond_timedwait(&q.changed, &q.lock, &until);
+        }
+        const bool stop = atomic_load(&render_stop_requested);
+        if (!stop) {
+            q.jobs.items[next].status = JOB_RUNNING;
+            q.jobs.items[next].started_ms = queue_ms(&q);
+        }
+        pthread_mutex_unlock(&q.lock);
+        if (stop) break;
+        run_job(&q, context, self, next);
+    }
+
+    Log(Log_Info, "serve: Shutting down");
+    codec_stats_log(&context->scene_stats, "serve: scene downloads");
+    codec_stats_log(&context->result_stats, "serve: result uploads");
+    master_stop_server();
+    for (size_t i = 0; i < q.residents.size; i++)
+        resident_free(&q.residents.items[i]);
+    vec_free(&q.residents);
+    for (size_t i = 0; i < q.jobs.size; i++) {
+        free(q.jobs.items[i].scene_file);
+        free(q.jobs.items[i].output_file);
+    }
+    vec_free(&q.jobs);
+    vec_free(&context->workers);
+    pthread_mutex_destroy(&context->job_lock);
+    pthread_cond_destroy(&context->channel_wake);
+    free(context);
+    pthread_cond_destroy(&q.changed);
+    pthread_mutex_destroy(&q.lock);
+    return true;
+}
@@ -0,0 +1,107 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  // cpu_set_t and sched_setaffinity
+#endif
+#include "topology.h"
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+
+_Static_assert(TOPOLOGY_MAX_CPUS <= CPU_SETSIZE, "cpu_set_t too small");
+
+// Highest node directory probed in sysfs
+#define TOPOLOGY_MAX_NODES 256
+
+// cpulist format, e.g. "0-3,8-11"
+static bool parse_cpulist(const char *path, cpu_set_t *out) {
+    FILE *f = fopen(path, "r");
+    if (!f) return false;
+    char buf[4096];
+    const size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+
+    CPU_ZERO(out);
+    char *p = buf;
+    while (*p) {
+        char *end;
+        const long first = strtol(p, &end, 10);
+        if (end == p) break;
+        long last = first;
+        p = end;
+        if (*p == '-') {
+            p++;
+            last = strtol(p, &end, 10);
+            p = end;
+        }
+        for (long c = first; c <= last && c < TOPOLOGY_MAX_CPUS; c++)
+            if (c >= 0) CPU_SET(c, out);
+        if (*p == ',') p++;
+    }
+    return true;
+}
+
+bool topology_detect(Topology *topo) {
+    *topo = (Topology){0};
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        Log(Log_Warn, "topology_detect: cannot read the cpu affinity mask");
+        return false;
+    }
+
+    topo->cpus = malloc(TOPOLOGY_MAX_CPUS * sizeof(*topo->cpus));
+    topo->cpu_node = malloc(TOPOLOGY_MAX_CPUS * sizeof(*topo->cpu_node));
+    if (!topo->cpus || !topo->cpu_node) {
+        Log(Log_Error, "topology_detect: Memory allocation failed");
+        exit(1);
+    }
+
+    cpu_set_t seen;
+    CPU_ZERO(&seen);
+    for (int node = 0; node < TOPOLOGY_MAX_NODES; node++) {
+        cpu_set_t cpus;
+        const char *path = temp_sprintf(
+            "/sys/devices/system/node/node%d/cpulist", node);
+        if (!parse_cpulist(path, &cpus)) continue;
+
+        const int before = topo->cpu_count;
+        for (int c = 0; c < TOPOLOGY_MAX_CPUS; c++) {
+            if (!CPU_ISSET(c, &cpus) || !CPU_ISSET(c, &allowed)) continue;
+            topo->cpus[topo->cpu_count] = c;
+            topo->cpu_node[topo->cpu_count++] = topo->node_count;
+            CPU_SET(c, &seen);
+        }
+        // nodes without usable cpus (memory only, or masked) are skipped
+        if (topo->cpu_count > before) topo->node_count++;
+    }
+
+    // no sysfs nodes (or cpus missing from them): one more node with the rest
+    const int before = topo->cpu_count;
+    for (int c = 0; c < TOPOLOGY_MAX_CPUS; c++) {
+        if (!CPU_ISSET(c, &allowed) || CPU_ISSET(c, &seen)) continue;
+        topo->cpus[topo->cpu_count] = c;
+        topo->cpu_node[topo->cpu_count++] = topo->node_count;
+    }
+    if (topo->cpu_count > before) topo->node_count++;
+
+    Log(Log_Info, "topology_detect: %d cpus on %d NUMA nodes", topo->cpu_count,
+        topo->node_count);
+    return topo->cpu_count > 0;
+}
+
+void topology_free(Topology *topo) {
+    free(topo->cpus);
+    free(topo->cpu_node);
+    *topo = (Topology){0};
+}
+
+bool topology_pin(const int *cpus, int count) {
+    cpu_set_t mask;
+    CPU_ZERO(&mask);
+    for (int i = 0; i < count; i++) CPU_SET(cpus[i], &mask);
+    return sched_setaffinity(0, sizeof(mask), &mask) == 0;
+}
@@ -1,9 +1,18 @@
+// topology.c needs it before the first system header
+#define _GNU_SOURCE
+#include "assets.c"
+#include "codec.c"
+#include "denoise.c"
 #include "imagerw.c"
+#include "light.c"
 #include "main.c"
 #undef UTILS_IMPLEMENTATION
 #include "master.c"
 #include "material.c"
+#include "pool.c"
 #include "renderer.c"
 #include "rinternal.c"
 #include "scene_loader.c"
+#include "serve.c"
+#include "topology.c"
 #include "worker.c"
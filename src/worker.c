@@ -1,12 +1,25 @@
 #include <cJSON.h>
+#include <ctype.h>
 #include <curl/curl.h>
+#include <limits.h>
+#include <threads.h>
 #include <time.h>
 
 #include "api.h"
 #include "renderer.h"
 #include "scene.h"
+#include "serve.h"
 #include "utils.h"
 
+// Wait between polls of a serve mode master without a job
+#define IDLE_POLL_MS 200
+// How often the worker checks whether its lease is all taken
+#define LEASE_POLL_MS 2
+// Answer to If-None-Match when the cached copy is current
+#define HTTP_NOT_MODIFIED 304
+// A channel without a byte (pings included) for this long is lost
+#define CHANNEL_TIMEOUT_S 5
+
 struct CurlBuffer {
     char *data;
     size_t size;
@@ -24,7 +37,8 @@ static size_t curl_write_cb(void *ptr, size_t size, size_t nmemb, void *ud) {
     return realsz;
 }
 
-static char *http_get(CURL *curl, const char *url) {
+// The response body (NUL terminated) and its size
+static char *http_get_data(CURL *curl, const char *url, size_t *size) {
     struct CurlBuffer buf = {0};
     curl_easy_setopt(curl, CURLOPT_URL, url);
     curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
@@ -36,15 +50,66 @@ static char *http_get(CURL *curl, const char *url) {
         free(buf.data);
         return NULL;
     }
+    if (!buf.data) buf.data = calloc(1, 1);  // empty, e.g. 304
+    if (size) *size = buf.size;
     return buf.data;
 }
 
-static char *http_post(CURL *curl, const char *url, const char *body,
-                       struct curl_slist *headers) {
+static char *http_get(CURL *curl, const char *url) {
+    return http_get_data(curl, url, NULL);
+}
+
+// Value of an ETag header without its quotes
+static size_t etag_header_cb(char *line, size_t size, size_t nitems,
+                             void *ud) {
+    const size_t n = size * nitems;
+    static const char name[] = "etag:";
+    bool match = n > sizeof(name);
+    for (size_t i = 0; match && i < sizeof(name) - 1; i++)
+        match = tolower((unsigned char)line[i]) == name[i];
+    if (match) {
+        const char *v = line + sizeof(name) - 1;
+        const char *end = line + n;
+        while (v < end && (*v == ' ' || *v == '"')) v++;
+        size_t len = 0;
+        while (v + len < end && !strchr("\"\r\n", v[len])) len++;
+        snprintf(ud, ASSET_HASH_LEN + 1, "%.*s", (int)len, v);
+    }
+    return n;
+}
+
+// GET with If-None-Match (unless tags is empty), the status and the ETag of
+// the answer
+static char *http_get_tagged(CURL *curl, const char *url, const char *tags,
+                             size_t *size, long *status,
+                             char etag[ASSET_HASH_LEN + 1]) {
+    struct curl_slist *headers = NULL;
+    if (tags[0]) {
+        char header[ASSET_CACHE_TAGS * (ASSET_HASH_LEN + 4) + 32];
+        snprintf(header, sizeof(header), "If-None-Match: %s", tags);
+        headers = curl_slist_append(headers, header);
+    }
+    etag[0] = '\0';
+    *status = 0;
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, etag_header_cb);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, etag);
+    char *body = http_get_data(curl, url, size);
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, status);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, NULL);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, NULL);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, NULL);
+    curl_slist_free_all(headers);
+    return body;
+}
+
+static char *http_post_data(CURL *curl, const char *url, const void *body,
+                            size_t size, struct curl_slist *headers) {
     struct CurlBuffer buf = {0};
     curl_easy_setopt(curl, CURLOPT_URL, url);
     curl_easy_setopt(curl, CURLOPT_POST, 1L);
     curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body);
+    curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)size);
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_cb);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buf);
     curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
@@ -57,169 +122,1066 @@ static char *http_post(CURL *curl, const char *url, const char *body,
     return buf.data;
 }
 
-bool worker_connect(const char *master_ip, int port, MachineInfo stats) {
-    Log(Log_Info,
-        temp_sprintf("Worker: Connecting to Master at %s:%d", master_ip, port));
+static char *http_post(CURL *curl, const char *url, const char *body,
+                       struct curl_slist *headers) {
+    return http_post_data(curl, url, body, strlen(body), headers);
+}
 
-    curl_global_init(CURL_GLOBAL_ALL);
-    CURL *curl = curl_easy_init();
-    if (!curl) return false;
+// POST /api/register body, offering the codecs this build has
+static char *hello_json(const MachineInfo *info) {
+    cJSON *reg = cJSON_CreateObject();
+    cJSON_AddStringToObject(reg, "name", info->name);
+    cJSON_AddNumberToObject(reg, "perf", info->perf);
+    cJSON_AddNumberToObject(reg, "thread_count", info->thread_count);
+    cJSON_AddNumberToObject(reg, "simd", info->simd);
+    cJSON *codecs = cJSON_AddArrayToObject(reg, "codecs");
+    for (int c = CODEC_COUNT - 1; c >= 0; c--)
+        cJSON_AddItemToArray(codecs, cJSON_CreateString(codec_name(c)));
+    char *body = cJSON_PrintUnformatted(reg);
+    cJSON_Delete(reg);
+    return body;
+}
 
-    char base[512];
-    if (strstr(master_ip, "http://") == master_ip ||
-        strstr(master_ip, "https://") == master_ip) {
-        snprintf(base, sizeof(base), "%s", master_ip);
-    } else {
-        snprintf(base, sizeof(base), "http://%s:%d", master_ip, port);
+static void drop_scene(Scene *scene, State *state) {
+    free(scene->scene_json);
+    scene_bundle_free(scene->bundle);
+    free_scene(scene);
+    free(scene);
+    free(state->image);
+    free(state->accum);
+    free(state);
+}
+
+static void idle_wait(void) {
+    const struct timespec nap = {.tv_nsec = IDLE_POLL_MS * 1000000L};
+    thrd_sleep(&nap, NULL);
+}
+
+// Loads the scene json into a new Scene and State, NULL when it cannot be
+// rendered
+static Scene *load_fetched_scene(const char *json, unsigned int scene_crc,
+                                 State **state_out) {
+    Scene *scene = malloc(sizeof(Scene));
+    memset(scene, 0, sizeof(Scene));
+    scene->arena = arena_create(1024 * 1024 * 128);
+    State *state = malloc(sizeof(State));
+
+    if (!load_scene(json, scene, state)) {
+        free_scene(scene);
+        free(scene);
+        free(state);
+        return NULL;
+    }
+    scene->scene_json = strdup(json);
+    scene->scene_crc = scene_crc;
+    Log(Log_Info, "Worker: Loaded scene %u", scene->scene_crc);
+    *state_out = state;
+    return scene;
+}
+
+// Decodes a SceneHeader answer of /api/scene into its payload (NUL
+// terminated), NULL when malformed. stats is NULL for cached answers.
+static char *decode_scene(const uint8_t *resp, size_t size, SceneHeader *h,
+                          CodecStats *stats) {
+    if (size < sizeof(*h)) return NULL;
+    memcpy(h, resp, sizeof(*h));
+    if (h->magic != SCENE_MAGIC || h->json_bytes > h->raw_bytes) return NULL;
+    char *payload = malloc((size_t)h->raw_bytes + 1);
+    if (!payload) return NULL;
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    const bool ok = codec_decode(h->codec, resp + sizeof(*h), size - sizeof(*h),
+                                 1, payload, h->raw_bytes);
+    gettimeofday(&end, NULL);
+    if (!ok) {
+        Log(Log_Error, "Worker: Malformed %s scene from /api/scene",
+            codec_name(h->codec));
+        free(payload);
+        return NULL;
+    }
+    payload[h->raw_bytes] = '\0';
+    if (stats) {
+        codec_stats_add(stats, h->raw_bytes, size - sizeof(*h),
+                        timersub_ms(&end, &start));
+    }
+    return payload;
+}
+
+// GET /api/asset into the cache, checking the content against its hash
+static bool fetch_asset(CURL *curl, const char *base, Codec codec,
+                        const char *cache_dir, const char *hash,
+                        CodecStats *stats) {
+    char url[512];
+    snprintf(url, sizeof(url), "%s/api/asset?hash=%s&codec=%s", base, hash,
+             codec_name(codec));
+    size_t size = 0;
+    char *resp = http_get_data(curl, url, &size);
+    AssetHeader h = {0};
+    if (resp && size >= sizeof(h)) memcpy(&h, resp, sizeof(h));
+    uint8_t *data = h.magic == ASSET_MAGIC && h.raw_bytes <= ASSET_MAX_BYTES
+                        ? malloc((size_t)h.raw_bytes + 1)
+                        : NULL;
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    bool ok = data && codec_decode(h.codec, (uint8_t *)resp + sizeof(h),
+                                   size - sizeof(h), 1, data, h.raw_bytes);
+    gettimeofday(&end, NULL);
+    char got[ASSET_HASH_LEN + 1] = "";
+    if (ok) asset_hash(data, h.raw_bytes, got);
+    ok = ok && strcmp(got, hash) == 0 &&
+         asset_cache_put(cache_dir, hash, data, h.raw_bytes);
+    if (ok) {
+        codec_stats_add(stats, h.raw_bytes, size - sizeof(h),
+                        timersub_ms(&end, &start));
+    }
+    free(data);
+    free(resp);
+    return ok;
+}
+
+// The scene JSON of a payload with every model file of the manifest
+// pointing into the cache, fetching missing assets first. Files left out of
+// the manifest keep their path. NULL when an asset cannot be fetched.
+static char *resolve_assets(CURL *curl, const char *base, Codec codec,
+                            const char *cache_dir, const char *tag,
+                            const char *payload, size_t json_bytes,
+                            CodecStats *stats) {
+    cJSON *manifest = cJSON_Parse(payload + json_bytes);
+    cJSON *root = cJSON_ParseWithLength(payload, json_bytes);
+    bool ok = root != NULL;
+    int fetched = 0, assets = 0;
+    const cJSON *asset;
+    cJSON_ArrayForEach(asset, manifest) {
+        if (!ok || !cJSON_IsString(asset)) continue;
+        if (!asset_hash_valid(asset->valuestring)) {
+            Log(Log_Error, "Worker: Malformed hash for asset %s",
+                asset->string);
+            ok = false;
+            continue;
+        }
+        assets++;
+        if (asset_cache_has(cache_dir, asset->valuestring)) continue;
+        ok = fetch_asset(curl, base, codec, cache_dir, asset->valuestring,
+                         stats);
+        fetched++;
+        if (!ok) {
+            Log(Log_Error, "Worker: Cannot fetch asset %s (%s)",
+                asset->string, asset->valuestring);
+        }
+    }
+
+    // every file gets linked, so an OBJ finds the MTL next to it
+    cJSON_ArrayForEach(asset, manifest) {
+        if (!ok || !cJSON_IsString(asset)) continue;
+        char *linked =
+            asset_cache_link(cache_dir, tag, asset->string, asset->valuestring);
+        ok = linked != NULL;
+        free(linked);
+    }
+    const cJSON *objects = cJSON_GetObjectItemCaseSensitive(root, "objects");
+    const cJSON *models = cJSON_GetObjectItemCaseSensitive(objects, "models");
+    cJSON *model;
+    cJSON_ArrayForEach(model, models) {
+        const cJSON *file = cJSON_GetObjectItemCaseSensitive(model, "file");
+        const cJSON *hash =
+            cJSON_IsString(file)
+                ? cJSON_GetObjectItemCaseSensitive(manifest, file->valuestring)
+                : NULL;
+        if (!ok || !cJSON_IsString(hash)) continue;
+        char *linked = asset_cache_link(cache_dir, tag, file->valuestring,
+                                        hash->valuestring);
+        ok = linked != NULL;
+        if (ok) {
+            cJSON_ReplaceItemInObjectCaseSensitive(model, "file",
+                                                   cJSON_CreateString(linked));
+        }
+        free(linked);
+    }
+    char *json = ok ? cJSON_PrintUnformatted(root) : NULL;
+    cJSON_Delete(root);
+    cJSON_Delete(manifest);
+    if (json) {
+        Log(Log_Info, "Worker: Scene assets: %d, %d fetched, %d cached",
+            assets, fetched, assets - fetched);
     }
+    return json;
+}
+
+// Kept decoded, the codec may differ next time
+static void cache_scene(const char *cache_dir, const char *tag,
+                        const SceneHeader *h, const char *payload) {
+    const SceneHeader raw = {.magic = SCENE_MAGIC,
+                             .scene_crc = h->scene_crc,
+                             .codec = CODEC_NONE,
+                             .raw_bytes = h->raw_bytes,
+                             .json_bytes = h->json_bytes};
+    uint8_t *cached = malloc(sizeof(raw) + h->raw_bytes);
+    if (!cached) return;
+    memcpy(cached, &raw, sizeof(raw));
+    memcpy(cached + sizeof(raw), payload, h->raw_bytes);
+    asset_cache_put_scene(cache_dir, tag, cached, sizeof(raw) + h->raw_bytes);
+    free(cached);
+}
 
-    // 1) GET /api/scene
+// The scene answer with its payload hash, checked first in the cache
+// through If-None-Match
+static uint8_t *get_scene(CURL *curl, const char *url, const char *cache_dir,
+                          size_t *size, char tag[ASSET_HASH_LEN + 1],
+                          bool *cached) {
+    *cached = false;
+    char tags[ASSET_CACHE_TAGS * (ASSET_HASH_LEN + 4) + 1] = "";
+    if (cache_dir) asset_cache_tags(cache_dir, tags, sizeof(tags));
+    long status = 0;
+    char *resp = http_get_tagged(curl, url, tags, size, &status, tag);
+    if (resp && status == HTTP_NOT_MODIFIED) {
+        free(resp);
+        uint8_t *scene = asset_cache_scene(cache_dir, tag, size);
+        if (scene) {
+            Log(Log_Info, "Worker: Scene %s unchanged, loaded from cache", tag);
+            *cached = true;
+            return scene;
+        }
+        resp = http_get_tagged(curl, url, "", size, &status, tag);
+    }
+    if (!asset_hash_valid(tag)) tag[0] = '\0';  // then it is not cached
+    return (uint8_t *)resp;
+}
+
+// GET /api/scene and load it, NULL on errors or (setting *idle) when a
+// serve mode master has no job. The scene comes through codec, JSON from
+// masters without codecs. With a cache_dir, scenes and the files of their
+// models are kept there, and a scene already cached transfers nothing.
+static Scene *fetch_scene(CURL *curl, const char *base, Codec codec,
+                          const char *cache_dir, State **state_out,
+                          bool *idle, CodecStats *stats) {
+    *idle = false;
     char scene_url[512];
-    snprintf(scene_url, sizeof(scene_url), "%s/api/scene", base);
-    char *scene_resp = http_get(curl, scene_url);
+    snprintf(scene_url, sizeof(scene_url), "%s/api/scene?codec=%s", base,
+             codec_name(codec));
+    size_t size = 0;
+    char tag[ASSET_HASH_LEN + 1] = "";
+    bool cached = false;
+    uint8_t *scene_resp =
+        get_scene(curl, scene_url, cache_dir, &size, tag, &cached);
     if (!scene_resp) {
         Log(Log_Error, "Worker: Failed to GET /api/scene");
-        curl_easy_cleanup(curl);
-        curl_global_cleanup();
-        return false;
+        return NULL;
+    }
+    uint32_t magic = 0;
+    if (size >= sizeof(SceneHeader)) memcpy(&magic, scene_resp, sizeof(magic));
+    if (magic == SCENE_MAGIC) {
+        SceneHeader h;
+        char *payload =
+            decode_scene(scene_resp, size, &h, cached ? NULL : stats);
+        free(scene_resp);
+        if (!payload) return NULL;
+        char *json = payload;
+        if (cache_dir && tag[0]) {
+            if (!cached) cache_scene(cache_dir, tag, &h, payload);
+            json = resolve_assets(curl, base, codec, cache_dir, tag, payload,
+                                  h.json_bytes, stats);
+            if (!json) {
+                free(payload);
+                return NULL;
+            }
+        } else {
+            // without a cache, model files are opened from the local disk
+            payload[h.json_bytes] = '\0';
+        }
+        Scene *scene = load_fetched_scene(json, h.scene_crc, state_out);
+        if (json != payload) free(json);
+        free(payload);
+        return scene;
     }
 
-    cJSON *root = cJSON_Parse(scene_resp);
+    cJSON *root = cJSON_Parse((char *)scene_resp);
+    free(scene_resp);
     if (!root) {
         Log(Log_Error, "Worker: Invalid JSON from /api/scene");
-        free(scene_resp);
-        curl_easy_cleanup(curl);
-        curl_global_cleanup();
-        return false;
+        return NULL;
     }
+    const cJSON *status = cJSON_GetObjectItemCaseSensitive(root, "status");
     cJSON *scene_json = cJSON_GetObjectItemCaseSensitive(root, "scene_json");
     cJSON *scene_crc_j = cJSON_GetObjectItemCaseSensitive(root, "scene_crc");
+    if (cJSON_IsString(status) && strcmp(status->valuestring, "idle") == 0) {
+        *idle = true;
+        cJSON_Delete(root);
+        return NULL;
+    }
     if (!cJSON_IsString(scene_json)) {
         Log(Log_Error, "Worker: /api/scene missing scene_json");
         cJSON_Delete(root);
-        free(scene_resp);
-        curl_easy_cleanup(curl);
-        curl_global_cleanup();
+        return NULL;
+    }
+
+    // valueint saturates at INT_MAX, crcs use all 32 bits
+    const unsigned int scene_crc =
+        cJSON_IsNumber(scene_crc_j) ? (unsigned int)scene_crc_j->valuedouble
+                                    : 0;
+    Scene *scene =
+        load_fetched_scene(scene_json->valuestring, scene_crc, state_out);
+    cJSON_Delete(root);
+    codec_stats_add(stats, size, size, 0.0);
+    return scene;
+}
+
+static double worker_ms(const WorkerState *ws) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return timersub_ms(&now, &ws->start);
+}
+
+static void add_us(_Atomic uint64_t *total, double ms) {
+    atomic_fetch_add(total, (uint64_t)(ms * 1000.0));
+}
+
+// Sleep while at least limit items wait for a render thread
+static void wait_items(WorkerState *ws, int limit) {
+    const struct timespec poll = {.tv_nsec = LEASE_POLL_MS * 1000000L};
+    while (atomic_load(&ws->items_waiting) >= limit) thrd_sleep(&poll, NULL);
+}
+
+// A leased item queued on the pool
+typedef struct {
+    WorkerState *ws;
+    WorkerWork work;
+} WorkerItem;
+
+static bool parse_item(const cJSON *itemj, int job_id, const State *state,
+                       WorkerWork *work) {
+    const cJSON *tilej = cJSON_GetObjectItemCaseSensitive(itemj, "tile");
+    const cJSON *tile_id_j = cJSON_GetObjectItemCaseSensitive(itemj, "tile_id");
+    if (!tilej || !cJSON_IsNumber(tile_id_j)) return false;
+
+    work->job_id = job_id;
+    work->tile_id = tile_id_j->valueint;
+    work->tile = (Tile){0};
+    work->tile.x = cJSON_GetObjectItemCaseSensitive(tilej, "x")->valueint;
+    work->tile.y = cJSON_GetObjectItemCaseSensitive(tilej, "y")->valueint;
+    work->tile.tw = cJSON_GetObjectItemCaseSensitive(tilej, "tw")->valueint;
+    work->tile.th = cJSON_GetObjectItemCaseSensitive(tilej, "th")->valueint;
+    const cJSON *begin_j =
+        cJSON_GetObjectItemCaseSensitive(itemj, "sample_begin");
+    const cJSON *end_j = cJSON_GetObjectItemCaseSensitive(itemj, "sample_end");
+    work->sample_begin = cJSON_IsNumber(begin_j) ? begin_j->valueint : 0;
+    work->sample_end =
+        cJSON_IsNumber(end_j) ? end_j->valueint : state->samples_per_pixel;
+    const cJSON *frame_j = cJSON_GetObjectItemCaseSensitive(itemj, "frame");
+    work->frame = cJSON_IsNumber(frame_j) ? frame_j->valueint : 0;
+    return true;
+}
+
+// Hand the sums of an item (in body, after room for its header) to the
+// upload thread, encoded when the codec pays off
+static void queue_result(WorkerState *ws, const WorkerWork *work,
+                         char *body) {
+    const Codec codec = ws->codec;
+    const size_t value_count = (size_t)work->tile.tw * work->tile.th * 3;
+    const size_t pixel_bytes = value_count * sizeof(float);
+    size_t body_size = sizeof(ResultHeader) + pixel_bytes;
+    const float *buf = (const float *)(body + sizeof(ResultHeader));
+    char *encoded =
+        malloc(sizeof(ResultHeader) + codec_bound(codec, pixel_bytes));
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+    const size_t payload_bytes =
+        encoded ? codec_encode(codec, buf, pixel_bytes, RESULT_STRIDE,
+                               (uint8_t *)encoded + sizeof(ResultHeader))
+                : 0;
+    gettimeofday(&end, NULL);
+    codec_stats_add(&ws->upload_stats, pixel_bytes,
+                    payload_bytes ? payload_bytes : pixel_bytes,
+                    timersub_ms(&end, &start));
+
+    // the rgb float sums, the master merges and normalizes
+    const ResultHeader header = {
+        .magic = RESULT_MAGIC,
+        .job_id = work->job_id,
+        .tile_id = work->tile_id,
+        .samples = work->sample_end - work->sample_begin,
+        .tw = (uint16_t)work->tile.tw,
+        .th = (uint16_t)work->tile.th,
+        .format = RESULT_FORMAT_F32,
+        .codec = (uint16_t)(payload_bytes ? codec : CODEC_NONE),
+        .payload_bytes =
+            (uint32_t)(payload_bytes ? payload_bytes : pixel_bytes),
+        .checksum = result_checksum(buf, value_count),
+    };
+    if (payload_bytes) {
+        free(body);
+        body = encoded;
+        body_size = sizeof(ResultHeader) + payload_bytes;
+    } else {
+        free(encoded);
+    }
+    memcpy(body, &header, sizeof(header));
+
+    pthread_mutex_lock(&ws->upload_lock);
+    if (ws->uploads_in_flight >= ws->max_uploads) {
+        const double stalled = worker_ms(ws);
+        while (ws->uploads_in_flight >= ws->max_uploads)
+            pthread_cond_wait(&ws->upload_space, &ws->upload_lock);
+        add_us(&ws->stalled_us, worker_ms(ws) - stalled);
+    }
+    ws->uploads_in_flight++;
+    vec_push(&ws->uploads, ((WorkerUpload){body, body_size}));
+    pthread_cond_signal(&ws->upload_ready);
+    pthread_mutex_unlock(&ws->upload_lock);
+}
+
+// Pool task: render one item and queue its sums for upload
+static void render_item(void *arg) {
+    WorkerItem *item = arg;
+    WorkerState *ws = item->ws;
+    const WorkerWork *work = &item->work;
+    const Scene *scene = ws->scene;
+    const State *state = ws->state;
+    if (atomic_fetch_sub(&ws->items_waiting, 1) == 1)
+        atomic_store(&ws->emptied_ms, worker_ms(ws));
+    if (work->job_id == atomic_load(&ws->cancelled_job)) {
+        free(item);
+        return;
+    }
+
+    // the tile renders straight into the result body, after its header,
+    // and is encoded into a second body when the codec pays off
+    const size_t pixel_bytes =
+        (size_t)work->tile.tw * work->tile.th * 3 * sizeof(float);
+    char *body = malloc(sizeof(ResultHeader) + pixel_bytes);
+    if (!body) {
+        Log(Log_Error, "Worker: Dropping item %d, out of memory",
+            work->tile_id);
+        free(item);
+        return;
+    }
+    float *buf = (float *)(body + sizeof(ResultHeader));
+
+    // compute camera-derived vectors and render the tile
+    Camera cam = scene->camera;
+    if (work->frame >= 0 && (size_t)work->frame < scene->frames.size)
+        cam = scene->frames.items[work->frame];
+    V3f pixel00_loc, pixel_delta_u, pixel_delta_v, defocus_disk_u,
+        defocus_disk_v;
+    compute_render_camera_fields(&cam, state->width, state->height,
+                                 &pixel00_loc, &pixel_delta_u, &pixel_delta_v,
+                                 &defocus_disk_u, &defocus_disk_v);
+
+    render_single_tile(scene, &work->tile, &cam, work->sample_begin,
+                       work->sample_end, state->max_depth, &pixel00_loc,
+                       &pixel_delta_u, &pixel_delta_v, &defocus_disk_u,
+                       &defocus_disk_v, state->width, buf);
+    queue_result(ws, work, body);
+    free(item);
+}
+
+// One body of count uploads back to back, NULL when out of memory
+static char *join_uploads(const WorkerUpload *uploads, size_t count,
+                          WorkerUpload *joined) {
+    size_t size = 0;
+    for (size_t i = 0; i < count; i++) size += uploads[i].size;
+    char *data = malloc(size);
+    if (!data) return NULL;
+    size_t at = 0;
+    for (size_t i = 0; i < count; i++) {
+        memcpy(data + at, uploads[i].data, uploads[i].size);
+        at += uploads[i].size;
+    }
+    *joined = (WorkerUpload){data, size};
+    return data;
+}
+
+// A relay's local job stands for its part of a job of the master: the items
+// the master leased the relay, rendered by its own threads and the workers
+// registered with it (see relay_connect)
+typedef struct Relay {
+    WorkerState *ws;            // towards the master
+    MasterAPIContext *context;  // towards the local workers
+    MachineInfo self;           // thread_count being the render pool's
+    char register_url[512];
+    long registered_threads;  // with the master
+
+    // The running local job, ms is NULL between jobs. Local job ids count
+    // up, so local workers tell the master's jobs apart.
+    MasterState *ms;
+    Work work;
+    int job_id;  // the master's
+    int local_jobs;
+    pthread_t render;
+} Relay;
+
+// The relay as one machine: its threads and those of its workers, the
+// perf of which averages to the sum of their speeds
+static MachineInfo relay_capacity(Relay *relay) {
+    MachineInfo info = relay->self;
+    double speed = machine_speed(&relay->self);
+    pthread_mutex_lock(&relay->context->job_lock);
+    for (size_t i = 0; i < relay->context->workers.size; i++) {
+        const MachineInfo *w = &relay->context->workers.items[i];
+        info.thread_count += w->thread_count;
+        speed += machine_speed(w);
+    }
+    pthread_mutex_unlock(&relay->context->job_lock);
+    info.perf = (float)(speed / (double)MAX(info.thread_count, 1L));
+    return info;
+}
+
+// Register again with the master when workers came or went, the master
+// updates the relay's entry in place
+static void relay_sync(Relay *relay, CURL *curl) {
+    const MachineInfo info = relay_capacity(relay);
+    if (info.thread_count == relay->registered_threads) return;
+    char *body = hello_json(&info);
+    struct curl_slist *headers =
+        curl_slist_append(NULL, "Content-Type: application/json");
+    char *resp = body ? http_post(curl, relay->register_url, body, headers)
+                      : NULL;
+    if (resp) {
+        relay->registered_threads = info.thread_count;
+        Log(Log_Info, "Relay: Registered with the master as %ld threads",
+            info.thread_count);
+    }
+    free(resp);
+    free(body);
+    curl_slist_free_all(headers);
+}
+
+// Results of the local job go up as the relay's own
+static void relay_forward(MasterState *ms, int item, const float *sums) {
+    Relay *relay = ms->forward_arg;
+    const TileAssignment *a = &ms->tiles[item];
+    const WorkerWork work = {.job_id = relay->job_id,
+                             .tile_id = item,
+                             .frame = a->frame,
+                             .tile = a->tile,
+                             .sample_begin = a->sample_begin,
+                             .sample_end = a->sample_end};
+    const size_t pixel_bytes =
+        (size_t)a->tile.tw * a->tile.th * 3 * sizeof(float);
+    char *body = malloc(sizeof(ResultHeader) + pixel_bytes);
+    if (!body) {
+        // its lease with the master runs out, it is handed out again
+        Log(Log_Error, "Relay: Dropping item %d, out of memory", item);
+        return;
+    }
+    memcpy(body + sizeof(ResultHeader), sums, pixel_bytes);
+    queue_result(relay->ws, &work, body);
+}
+
+static void *relay_render(void *arg) {
+    master_render(arg);
+    return NULL;
+}
+
+// A local job for job_id of the master, laid out like the master's so the
+// item ids match, false when it cannot start
+static bool relay_start_job(Relay *relay, int job_id) {
+    WorkerState *ws = relay->ws;
+    init_work(ws->scene, ws->state, &relay->work);
+    MasterState *ms = master_state_create(ws->scene, ws->state, &relay->work,
+                                          &relay->self);
+    master_init_work_items(ms, &relay->work);
+    master_set_relay(ms, relay_forward, relay);
+    relay->job_id = job_id;
+    relay->local_jobs++;
+    master_set_job(relay->context, relay->local_jobs, ws->scene, ws->state,
+                   &relay->work, ms);
+    if (pthread_create(&relay->render, NULL, relay_render, ms) != 0) {
+        Log(Log_Error, "Relay: Cannot start the render thread");
+        master_set_job(relay->context, 0, NULL, NULL, NULL, NULL);
+        master_state_free(ms);
+        free(relay->work.tiles);
+        free(relay->work.tile_samples);
         return false;
     }
+    relay->ms = ms;
+    Log(Log_Info, "Relay: Job %d of the master runs as local job %d", job_id,
+        relay->local_jobs);
+    return true;
+}
 
-    // Load scene into local Scene and State
-    Scene *scene = malloc(sizeof(Scene));
-    memset(scene, 0, sizeof(Scene));
-    scene->arena = arena_create(1024 * 1024 * 128);
-    State *state = malloc(sizeof(State));
+// End the local job, once the master cancelled or finished its job. Items
+// still with local workers are dropped, the master hands them out again.
+static void relay_end_job(Relay *relay) {
+    MasterState *ms = relay->ms;
+    if (!ms) return;
+    atomic_store(&ms->cancelled, true);
+    pthread_join(relay->render, NULL);
+    master_set_job(relay->context, 0, NULL, NULL, NULL, NULL);
+    Log(Log_Info, "Relay: Local job %d over, %d items sent up",
+        relay->local_jobs, atomic_load(&ms->items_completed));
+    master_state_free(ms);
+    free(relay->work.tiles);
+    free(relay->work.tile_samples);
+    relay->ms = NULL;
+}
 
-    load_scene(scene_json->valuestring, scene, state);
-    scene->scene_json = strdup(scene_json->valuestring);
-    if (cJSON_IsNumber(scene_crc_j)) {
-        scene->scene_crc = (unsigned int)scene_crc_j->valueint;
+// Add the items of a lease to the local job of job_id, starting it first
+static void relay_lease(Relay *relay, const cJSON *items, int job_id) {
+    if (relay->ms && relay->job_id != job_id) relay_end_job(relay);
+    if (!relay->ms && !relay_start_job(relay, job_id)) return;
+    int added = 0;
+    const cJSON *itemj;
+    cJSON_ArrayForEach(itemj, items) {
+        WorkerWork work;
+        if (parse_item(itemj, job_id, relay->ws->state, &work) &&
+            master_relay_item(relay->ms, &work))
+            added++;
     }
+    Log(Log_Debug, "Relay: %d items leased by the master", added);
+    // the local channels push them right away
+    pthread_mutex_lock(&relay->context->job_lock);
+    pthread_cond_broadcast(&relay->context->channel_wake);
+    pthread_mutex_unlock(&relay->context->job_lock);
+}
+
+// Upload thread: posts finished results with its own curl handle until the
+// worker closes and nothing is left, a batch of those queued at once per
+// request, and a heartbeat when the master has not heard from the worker in
+// HEARTBEAT_MS. A relay registers again from here when its capacity
+// changed.
+static void *upload_results(void *arg) {
+    WorkerState *ws = arg;
+    CURL *curl = curl_easy_init();
+    struct curl_slist *headers = curl_slist_append(
+        NULL, "Content-Type: application/octet-stream");
+    while (true) {
+        pthread_mutex_lock(&ws->upload_lock);
+        double quiet = 0.0;
+        while (ws->uploads.size == 0 && !ws->closing &&
+               (quiet = worker_ms(ws) - atomic_load(&ws->contact_ms)) <
+                   HEARTBEAT_MS) {
+            const struct timespec until =
+                deadline_ms((long)(HEARTBEAT_MS - quiet) + 1);
+            pthread_cond_timedwait(&ws->upload_ready, &ws->upload_lock,
+                                   &until);
+        }
+        WorkerUploads batch = ws->uploads;
+        vec_init(&ws->uploads);
+        const bool closing = ws->closing;
+        pthread_mutex_unlock(&ws->upload_lock);
+        if (ws->relay && curl) relay_sync(ws->relay, curl);
+        if (batch.size == 0 && closing) break;
+        if (batch.size == 0) {
+            if (curl) free(http_post(curl, ws->heartbeat_url, "", headers));
+            atomic_store(&ws->contact_ms, worker_ms(ws));
+            continue;
+        }
+
+        for (size_t i = 0; i < batch.size;) {
+            // results queued together go up in one body
+            size_t count = MIN(batch.size - i, (size_t)RESULT_BATCH_MAX);
+            WorkerUpload body = batch.items[i];
+            char *joined = NULL;
+            if (count > 1) joined = join_uploads(&batch.items[i], count, &body);
+            if (!joined) count = 1;
 
+            const double posting = worker_ms(ws);
+            char *resp = curl ? http_post_data(curl, ws->result_url, body.data,
+                                               body.size, headers)
+                              : NULL;
+            add_us(&ws->upload_us, worker_ms(ws) - posting);
+            atomic_store(&ws->contact_ms, worker_ms(ws));
+            if (!resp)
+                Log(Log_Warn, "Worker: Failed to upload %zu results", count);
+            free(resp);
+            free(joined);
+            for (size_t k = i; k < i + count; k++) free(batch.items[k].data);
+            i += count;
+
+            pthread_mutex_lock(&ws->upload_lock);
+            ws->uploads_in_flight -= (int)count;
+            pthread_cond_broadcast(&ws->upload_space);
+            pthread_mutex_unlock(&ws->upload_lock);
+        }
+        vec_free(&batch);
+    }
+    curl_slist_free_all(headers);
+    if (curl) curl_easy_cleanup(curl);
+    return NULL;
+}
+
+// Queue the items of a lease on the render pool
+static void spawn_items(WorkerState *ws, const cJSON *items, int job_id) {
+    const cJSON *itemj;
+    cJSON_ArrayForEach(itemj, items) {
+        WorkerItem *item = malloc(sizeof(*item));
+        if (!item) break;
+        item->ws = ws;
+        if (!parse_item(itemj, job_id, ws->state, &item->work)) {
+            Log(Log_Warn, "Worker: Skipping a malformed item");
+            free(item);
+            continue;
+        }
+        atomic_fetch_add(&ws->items_waiting, 1);
+        pool_spawn(&ws->renders, render_item, item);
+    }
+}
+
+// Why a channel ended
+typedef enum {
+    CHANNEL_UNSUPPORTED,  // not offered, poll /api/work instead
+    CHANNEL_SCENE,        // the master moved on to another scene
+    CHANNEL_DONE,
+    CHANNEL_LOST,
+} ChannelEnd;
+
+typedef struct {
+    WorkerState *ws;
+    CURL *curl;
+    struct CurlBuffer buf;  // the line being received
+    ChannelEnd end;
+} ChannelReader;
+
+// Act on one line of the channel, false once it ends
+static bool channel_line(ChannelReader *r, const char *line) {
+    WorkerState *ws = r->ws;
+    cJSON *root = cJSON_Parse(line);
+    const cJSON *type = cJSON_GetObjectItemCaseSensitive(root, "type");
+    const cJSON *job_id_j = cJSON_GetObjectItemCaseSensitive(root, "job_id");
+    const int job_id = cJSON_IsNumber(job_id_j) ? job_id_j->valueint : 0;
+    bool go = true;
+    if (!cJSON_IsString(type)) {
+        Log(Log_Warn, "Worker: Skipping a malformed channel line");
+    } else if (strcmp(type->valuestring, "lease") == 0) {
+        const cJSON *items = cJSON_GetObjectItemCaseSensitive(root, "items");
+        if (ws->scene && cJSON_IsArray(items)) {
+            if (ws->relay)
+                relay_lease(ws->relay, items, job_id);
+            else
+                spawn_items(ws, items, job_id);
+            ws->pushed_leases++;
+        }
+    } else if (strcmp(type->valuestring, "cancel") == 0) {
+        Log(Log_Info, "Worker: Job %d is over, dropping its items", job_id);
+        atomic_store(&ws->cancelled_job, job_id);
+        if (ws->relay && ws->relay->job_id == job_id)
+            relay_end_job(ws->relay);
+    } else if (strcmp(type->valuestring, "scene") == 0) {
+        r->end = CHANNEL_SCENE;
+        go = false;
+    } else if (strcmp(type->valuestring, "done") == 0) {
+        r->end = CHANNEL_DONE;
+        go = false;
+    }
     cJSON_Delete(root);
-    free(scene_resp);
+    return go;
+}
 
-    // 2) Register (best-effort)
+static size_t channel_write_cb(void *ptr, size_t size, size_t nmemb,
+                               void *ud) {
+    ChannelReader *r = ud;
+    long code = 0;
+    curl_easy_getinfo(r->curl, CURLINFO_RESPONSE_CODE, &code);
+    if (code != 200) {
+        r->end = CHANNEL_UNSUPPORTED;
+        return 0;
+    }
+    if (curl_write_cb(ptr, size, nmemb, &r->buf) == 0) return 0;
+    char *nl;
+    while ((nl = memchr(r->buf.data, '\n', r->buf.size))) {
+        *nl = '\0';
+        const bool go = channel_line(r, r->buf.data);
+        r->buf.size -= (size_t)(nl + 1 - r->buf.data);
+        memmove(r->buf.data, nl + 1, r->buf.size + 1);
+        if (!go) return 0;
+    }
+    return size * nmemb;
+}
+
+// Render what the master pushes on GET /api/channel until the channel ends.
+// scene_crc is 0 without a scene, the master then announces its own.
+static ChannelEnd run_channel(WorkerState *ws, CURL *curl, const char *base,
+                              const char *worker_id, unsigned int scene_crc) {
+    char url[512];
+    snprintf(url, sizeof(url), "%s/api/channel?worker_id=%s&scene_crc=%u",
+             base, worker_id, scene_crc);
+    ChannelReader r = {.ws = ws, .curl = curl, .end = CHANNEL_LOST};
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_HTTPGET, 1L);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, channel_write_cb);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &r);
+    // the master pings, silence means it is gone
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, (long)CHANNEL_TIMEOUT_S);
+    const CURLcode res = curl_easy_perform(curl);
+    long code = 0;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 0L);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, 0L);
+    free(r.buf.data);
+    atomic_store(&ws->contact_ms, worker_ms(ws));
+
+    if (res == CURLE_OK && code != 200) return CHANNEL_UNSUPPORTED;
+    if (res == CURLE_OK && r.end == CHANNEL_LOST) {
+        // the master closed it, as it does when every item is rendered
+        return CHANNEL_DONE;
+    }
+    return r.end;
+}
+
+// GET /api/scene like fetch_scene, a relay serving it on to its workers
+static Scene *next_scene(WorkerState *ws, CURL *curl, const char *base,
+                         const char *cache_dir, bool *idle) {
+    Scene *scene = fetch_scene(curl, base, ws->codec, cache_dir, &ws->state,
+                               idle, &ws->scene_stats);
+    if (scene && ws->relay) {
+        scene->bundle =
+            scene_bundle_create(scene->scene_json, scene->scene_crc);
+    }
+    return scene;
+}
+
+// The worker and the upstream side of a relay
+static bool run_worker(const char *master_ip, int port, MachineInfo stats,
+                       const char *cache_dir, Relay *relay) {
+    Log(Log_Info,
+        temp_sprintf("Worker: Connecting to Master at %s:%d", master_ip, port));
+    const char *cache = cache_dir && asset_cache_init(cache_dir) ? cache_dir
+                                                                 : NULL;
+    if (!cache) {
+        Log(Log_Warn,
+            "Worker: No asset cache, model files are opened from the local "
+            "disk");
+    }
+
+    curl_global_init(CURL_GLOBAL_ALL);
+    CURL *curl = curl_easy_init();
+    if (!curl) return false;
+
+    char base[512];
+    if (strstr(master_ip, "http://") == master_ip ||
+        strstr(master_ip, "https://") == master_ip) {
+        snprintf(base, sizeof(base), "%s", master_ip);
+    } else {
+        snprintf(base, sizeof(base), "http://%s:%d", master_ip, port);
+    }
+
+    // a lease in reserve for every render thread, two results each queued
+    // for upload at most. A relay's results are bounded by its lease and
+    // come from server threads, which must not wait.
+    WorkerState ws = {.codec = CODEC_NONE,
+                      .prefetch_items = (int)pool_concurrency(),
+                      .max_uploads = relay ? INT_MAX
+                                           : 2 * (int)pool_concurrency(),
+                      .cancelled_job = -1,
+                      .relay = relay};
+    gettimeofday(&ws.start, NULL);
+    vec_init(&ws.uploads);
+    pthread_mutex_init(&ws.upload_lock, NULL);
+    pthread_cond_init(&ws.upload_ready, NULL);
+    pthread_cond_init(&ws.upload_space, NULL);
+    snprintf(ws.result_url, sizeof(ws.result_url),
+             "%s/api/result/bin?worker_id=%s", base, stats.name);
+    snprintf(ws.heartbeat_url, sizeof(ws.heartbeat_url),
+             "%s/api/heartbeat?worker_id=%s", base, stats.name);
+
+    // 1) Register, a relay as the machines it stands for. The master leases
+    // to and takes results from registered workers only.
     char reg_url[512];
     snprintf(reg_url, sizeof(reg_url), "%s/api/register", base);
-    cJSON *reg = cJSON_CreateObject();
-    cJSON_AddStringToObject(reg, "name", stats.name);
-    cJSON_AddNumberToObject(reg, "perf", stats.perf);
-    cJSON_AddNumberToObject(reg, "thread_count", stats.thread_count);
-    cJSON_AddNumberToObject(reg, "simd", stats.simd);
-    char *reg_body = cJSON_PrintUnformatted(reg);
-    cJSON_Delete(reg);
+    const MachineInfo hello = relay ? relay_capacity(relay) : stats;
+    char *reg_body = hello_json(&hello);
+    if (relay) {
+        relay->ws = &ws;
+        snprintf(relay->register_url, sizeof(relay->register_url), "%s",
+                 reg_url);
+    }
     struct curl_slist *headers = NULL;
     headers = curl_slist_append(headers, "Content-Type: application/json");
     // NOTE: no timeouts or retries configured on CURL requests
     char *reg_resp = http_post(curl, reg_url, reg_body, headers);
     if (reg_resp) {
-        Log(Log_Info, "Worker: Registered with master");
+        cJSON *regj = cJSON_Parse(reg_resp);
+        const cJSON *chosen = cJSON_GetObjectItemCaseSensitive(regj, "codec");
+        if (cJSON_IsString(chosen) &&
+            codec_from_name(chosen->valuestring) < CODEC_COUNT)
+            ws.codec = codec_from_name(chosen->valuestring);
+        cJSON_Delete(regj);
+        Log(Log_Info, "Worker: Registered with master, codec %s",
+            codec_name(ws.codec));
+        if (relay) relay->registered_threads = hello.thread_count;
         free(reg_resp);
     } else {
         Log(Log_Warn, "Worker: Registration failed (continuing)");
     }
     free(reg_body);
 
-    // 3) Work loop
-    while (true) {
+    // 2) GET /api/scene, a serve mode master may not have a job yet
+    bool idle = false;
+    ws.scene = next_scene(&ws, curl, base, cache, &idle);
+    bool ok = ws.scene || idle;
+
+    // 3) Work loop, following the master's scene from job to job. Leased
+    // items render on the pool while this thread takes the leases the
+    // master pushes on the channel (or, from masters without one, fetches
+    // the next lease ahead of time) and the upload thread posts the results.
+    pthread_t uploader;
+    const bool uploading =
+        ok && pthread_create(&uploader, NULL, upload_results, &ws) == 0;
+    if (ok && !uploading) {
+        Log(Log_Error, "Worker: Cannot start the upload thread");
+        if (ws.scene) drop_scene(ws.scene, ws.state);
+        ws.scene = NULL;
+        ok = false;
+    }
+    bool channel = true;
+    while (ok) {
+        if (!ws.scene) {
+            ws.scene = next_scene(&ws, curl, base, cache, &idle);
+            if (!ws.scene && !idle) break;
+        }
+
+        if (channel) {
+            // without a scene, wait for the master to announce one
+            const unsigned int crc = ws.scene ? ws.scene->scene_crc : 0;
+            const ChannelEnd end =
+                run_channel(&ws, curl, base, stats.name, crc);
+            if (end == CHANNEL_UNSUPPORTED && relay) {
+                Log(Log_Error, "Relay: The master has no channel to relay");
+                ok = false;
+                break;
+            }
+            if (end == CHANNEL_UNSUPPORTED) {
+                Log(Log_Info, "Worker: No channel, polling for work");
+                channel = false;
+                continue;
+            }
+            if (relay) relay_end_job(relay);
+            if (end != CHANNEL_SCENE) break;
+            wait_items(&ws, 1);
+            pool_wait(&ws.renders);
+            if (ws.scene) drop_scene(ws.scene, ws.state);
+            ws.scene = NULL;
+            continue;
+        }
+
+        if (!ws.scene) {
+            idle_wait();
+            continue;
+        }
+
+        // ask for more while the render threads still have items queued
+        wait_items(&ws, ws.prefetch_items);
+
         char work_url[512];
         // TODO: pass a unique worker_id instead of the literal "worker"
         snprintf(work_url, sizeof(work_url),
                  "%s/api/work?worker_id=%s&scene_crc=%u", base, stats.name,
-                 scene->scene_crc);
+                 ws.scene->scene_crc);
+        const double requested = worker_ms(&ws);
         char *work_resp = http_get(curl, work_url);
+        const double answered = worker_ms(&ws);
+        atomic_store(&ws.contact_ms, answered);
+        ws.lease_requests++;
+        add_us(&ws.lease_us, answered - requested);
+        if (atomic_load(&ws.items_waiting) == 0) {
+            add_us(&ws.starved_us,
+                   answered - MAX(requested, atomic_load(&ws.emptied_ms)));
+        }
         if (!work_resp) break;
 
         cJSON *workj = cJSON_Parse(work_resp);
         free(work_resp);
         if (!workj) break;
 
-        if (cJSON_GetObjectItemCaseSensitive(workj, "status")) {
-            // no tiles left or error
+        const cJSON *status = cJSON_GetObjectItemCaseSensitive(workj, "status");
+        if (status) {
+            // no tiles left, or a serve mode master between jobs
+            const bool wait = cJSON_IsString(status) &&
+                              strcmp(status->valuestring, "idle") == 0;
             cJSON_Delete(workj);
-            break;
+            if (!wait) break;
+            idle_wait();
+            continue;
         }
 
-        cJSON *tilej = cJSON_GetObjectItemCaseSensitive(workj, "tile");
-        cJSON *tile_id_j = cJSON_GetObjectItemCaseSensitive(workj, "tile_id");
-        if (!tilej || !tile_id_j) {
+        const cJSON *items = cJSON_GetObjectItemCaseSensitive(workj, "items");
+        if (!cJSON_IsArray(items)) {
+            // the master moved on to another scene
+            const bool moved =
+                cJSON_GetObjectItemCaseSensitive(workj, "scene_crc") != NULL;
             cJSON_Delete(workj);
-            break;
+            if (!moved) break;
+            wait_items(&ws, 1);
+            pool_wait(&ws.renders);
+            drop_scene(ws.scene, ws.state);
+            ws.scene = NULL;
+            continue;
         }
+        const cJSON *job_id_j =
+            cJSON_GetObjectItemCaseSensitive(workj, "job_id");
+        const int job_id = cJSON_IsNumber(job_id_j) ? job_id_j->valueint : 0;
 
-        Tile tile = {0};
-        tile.x = cJSON_GetObjectItemCaseSensitive(tilej, "x")->valueint;
-        tile.y = cJSON_GetObjectItemCaseSensitive(tilej, "y")->valueint;
-        tile.tw = cJSON_GetObjectItemCaseSensitive(tilej, "tw")->valueint;
-        tile.th = cJSON_GetObjectItemCaseSensitive(tilej, "th")->valueint;
-        int tid = tile_id_j->valueint;
+        spawn_items(&ws, items, job_id);
         cJSON_Delete(workj);
+    }
 
-        uint32_t *buf = malloc(tile.tw * tile.th * sizeof(uint32_t));
-        if (!buf) break;
-
-        // compute camera-derived vectors and render the tile
-        Camera cam = scene->camera;
-        V3f pixel00_loc, pixel_delta_u, pixel_delta_v, defocus_disk_u,
-            defocus_disk_v;
-        compute_render_camera_fields(
-            &cam, state->width, state->height, &pixel00_loc, &pixel_delta_u,
-            &pixel_delta_v, &defocus_disk_u, &defocus_disk_v);
-
-        render_single_tile(scene, &tile, &cam, state->samples_per_pixel,
-                           state->max_depth, &pixel00_loc, &pixel_delta_u,
-                           &pixel_delta_v, &defocus_disk_u, &defocus_disk_v,
-                           1.0f / state->samples_per_pixel, state->width, buf);
-
-        // build hex payload (inefficient - consider binary POST)
-        int pixel_count = tile.tw * tile.th;
-        int hex_len = pixel_count * 8;
-        char *hex = malloc(hex_len + 1);
-        char *hp = hex;
-        for (int i = 0; i < pixel_count; i++) {
-            sprintf(hp, "%08x", buf[i]);
-            hp += 8;
-        }
-        hex[hex_len] = '\0';
-
-        cJSON *res = cJSON_CreateObject();
-        cJSON_AddStringToObject(res, "name", "worker");
-        cJSON_AddNumberToObject(res, "tile_id", tid);
-        cJSON_AddStringToObject(res, "pixels", hex);
-        char *res_body = cJSON_PrintUnformatted(res);
-        cJSON_Delete(res);
-        free(hex);
-        free(buf);
-
-        char res_url[512];
-        snprintf(res_url, sizeof(res_url), "%s/api/result", base);
-        char *res_resp = http_post(curl, res_url, res_body, headers);
-        free(res_body);
-        free(res_resp);
+    // the last items render, then the upload thread posts what is left
+    if (relay) relay_end_job(relay);
+    wait_items(&ws, 1);
+    pool_wait(&ws.renders);
+    if (uploading) {
+        pthread_mutex_lock(&ws.upload_lock);
+        ws.closing = true;
+        pthread_cond_signal(&ws.upload_ready);
+        pthread_mutex_unlock(&ws.upload_lock);
+        pthread_join(uploader, NULL);
     }
 
+    Log(Log_Info,
+        "Worker: %d leases pushed, %d lease requests took %.0f ms (%.0f ms "
+        "with no item queued), uploads %.0f ms, renders stalled on uploads "
+        "%.0f ms",
+        ws.pushed_leases, ws.lease_requests,
+        (double)atomic_load(&ws.lease_us) / 1000.0,
+        (double)atomic_load(&ws.starved_us) / 1000.0,
+        (double)atomic_load(&ws.upload_us) / 1000.0,
+        (double)atomic_load(&ws.stalled_us) / 1000.0);
+    codec_stats_log(&ws.scene_stats, "Worker: scene downloads");
+    codec_stats_log(&ws.upload_stats, "Worker: result uploads");
+    if (ws.scene) drop_scene(ws.scene, ws.state);
+    vec_free(&ws.uploads);
+    pthread_cond_destroy(&ws.upload_ready);
+    pthread_cond_destroy(&ws.upload_space);
+    pthread_mutex_destroy(&ws.upload_lock);
     curl_slist_free_all(headers);
     curl_easy_cleanup(curl);
     curl_global_cleanup();
-    return true;
+    return ok;
+}
+
+bool worker_connect(const char *master_ip, int port, MachineInfo stats,
+                    const char *cache_dir) {
+    return run_worker(master_ip, port, stats, cache_dir, NULL);
+}
+
+bool relay_connect(const char *master_url, int port, MachineInfo stats,
+                   const char *cache_dir, Codec codec, int http_threads) {
+    MasterAPIContext *context = calloc(1, sizeof(*context));
+    if (!context) {
+        Log(Log_Error, "Relay: Memory allocation failed");
+        return false;
+    }
+    vec_init(&context->workers);
+    pthread_mutex_init(&context->job_lock, NULL);
+    pthread_cond_init(&context->channel_wake, NULL);
+    context->relay = true;
+    context->codec = codec;
+    context->http_threads = http_threads;
+    if (!master_start_server(port, context)) return false;
+    Log(Log_Info, "Relay: Serving workers on port %d", port);
+
+    // its render thread joins the pool, like the caller thread of a master
+    Relay relay = {.context = context, .self = stats};
+    relay.self.thread_count = pool_concurrency();
+    const bool ok = run_worker(master_url, 0, stats, cache_dir, &relay);
+
+    codec_stats_log(&context->scene_stats, "Relay: scene downloads");
+    codec_stats_log(&context->result_stats, "Relay: result uploads");
+    master_stop_server();
+    vec_free(&context->workers);
+    pthread_mutex_destroy(&context->job_lock);
+    pthread_cond_destroy(&context->channel_wake);
+    free(context);
+    return ok;
 }
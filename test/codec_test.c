@@ -0,0 +1,191 @@
+// Round trips of the payload codecs over random, run, constant and float
+// plane data, and malformed streams: truncated, corrupted, or describing more
+// bytes than the output holds. Decoding may never write past raw_size.
+//
+// Usage: ./build/test/codec_test
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define UTILS_IMPLEMENTATION
+#include "utils.h"
+#undef UTILS_IMPLEMENTATION
+#include "codec.h"
+
+// Bytes past raw_size that decoding must leave alone
+#define GUARD 64
+#define GUARD_BYTE 0xA5
+
+static int failures = 0;
+
+#define CHECK(cond, ...)                           \
+    do {                                           \
+        if (!(cond)) {                             \
+            failures++;                            \
+            fprintf(stderr, "FAIL: " __VA_ARGS__); \
+            fprintf(stderr, "\n");                 \
+        }                                          \
+    } while (0)
+
+static uint32_t noise_state = 0x9E3779B9u;
+
+static uint32_t next_rand(void) {
+    uint32_t x = noise_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return noise_state = x;
+}
+
+// Decodes into a guarded buffer, false when the guard was overwritten
+static bool guarded_decode(Codec codec, const uint8_t *src, size_t size,
+                           size_t stride, uint8_t *dst, size_t raw_size,
+                           bool *decoded) {
+    memset(&dst[raw_size], GUARD_BYTE, GUARD);
+    *decoded = codec_decode(codec, src, size, stride, dst, raw_size);
+    for (size_t i = 0; i < GUARD; i++)
+        if (dst[raw_size + i] != GUARD_BYTE) return false;
+    return true;
+}
+
+static void check_codec(Codec codec, const char *what, const uint8_t *raw,
+                        size_t raw_size, size_t stride) {
+    const char *name = codec_name(codec);
+    uint8_t *enc = malloc(codec_bound(codec, raw_size));
+    uint8_t *dec = malloc(raw_size + GUARD);
+    uint8_t *bad = malloc(codec_bound(codec, raw_size) + 1);
+    if (!enc || !dec || !bad) {
+        fprintf(stderr, "codec_test: Memory allocation failed\n");
+        exit(1);
+    }
+
+    const size_t size = codec_encode(codec, raw, raw_size, stride, enc);
+    bool decoded;
+    if (size == 0) {
+        // incompressible, sent as is: nothing to decode
+        printf("%-4s %-9s stride %2zu: %7zu bytes, sent raw\n", name, what,
+               stride, raw_size);
+        goto done;
+    }
+    CHECK(guarded_decode(codec, enc, size, stride, dec, raw_size, &decoded),
+          "%s %s stride %zu: round trip wrote past raw_size", name, what,
+          stride);
+    CHECK(decoded && memcmp(dec, raw, raw_size) == 0,
+          "%s %s stride %zu: round trip differs", name, what, stride);
+    printf("%-4s %-9s stride %2zu: %7zu -> %7zu bytes\n", name, what, stride,
+           raw_size, size);
+
+    // a dropped tail can only go unnoticed when it held no output bytes
+    for (size_t cut = 0; cut < size; cut += 1 + cut / 16) {
+        CHECK(guarded_decode(codec, enc, cut, stride, dec, raw_size, &decoded),
+              "%s %s stride %zu: truncation to %zu wrote past raw_size", name,
+              what, stride, cut);
+        CHECK(!decoded || memcmp(dec, raw, raw_size) == 0,
+              "%s %s stride %zu: truncation to %zu decoded wrong bytes", name,
+              what, stride, cut);
+    }
+
+    // bytes after the last sequence are malformed
+    memcpy(bad, enc, size);
+    bad[size] = 0;
+    CHECK(guarded_decode(codec, bad, size + 1, stride, dec, raw_size,
+                         &decoded) &&
+              !decoded,
+          "%s %s stride %zu: trailing byte accepted", name, what, stride);
+
+    // flipped bits may decode (a literal changed), but stay in bounds
+    for (int t = 0; t < 256; t++) {
+        memcpy(bad, enc, size);
+        bad[next_rand() % size] ^= (uint8_t)(1u << (next_rand() % 8));
+        CHECK(guarded_decode(codec, bad, size, stride, dec, raw_size,
+                             &decoded),
+              "%s %s stride %zu: corrupted stream wrote past raw_size", name,
+              what, stride);
+    }
+
+done:
+    free(enc);
+    free(dec);
+    free(bad);
+}
+
+// Streams that are malformed by construction, for raw_size bytes of output
+static void check_malformed(void) {
+    uint8_t dst[16 + GUARD];
+    bool decoded;
+    struct {
+        Codec codec;
+        const char *what;
+        uint8_t stream[8];
+        size_t size;
+    } cases[] = {
+        {CODEC_RLE, "literals past raw_size", {127, 1, 2}, 3},
+        {CODEC_RLE, "run past raw_size", {255, 7}, 2},
+        {CODEC_RLE, "run without its byte", {130}, 1},
+        {CODEC_RLE, "empty stream", {0}, 0},
+        {CODEC_LZ, "literals past raw_size", {0xF0, 200}, 2},
+        {CODEC_LZ, "offset before the output", {0x10, 1, 2, 0, 0x00}, 4},
+        {CODEC_LZ, "zero offset", {0x10, 1, 0, 0}, 4},
+        {CODEC_LZ, "match past raw_size", {0x1F, 1, 1, 0, 40}, 5},
+        {CODEC_LZ, "unterminated length", {0xF0, 255, 255}, 3},
+        {CODEC_LZ, "half an offset", {0x10, 1, 1}, 3},
+    };
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        CHECK(guarded_decode(cases[i].codec, cases[i].stream, cases[i].size,
+                             1, dst, 16, &decoded) &&
+                  !decoded,
+              "%s: %s accepted or out of bounds",
+              codec_name(cases[i].codec), cases[i].what);
+    }
+}
+
+int main(void) {
+    const size_t count = 64 * 64 * 3;
+    const size_t raw_size = count * sizeof(float);
+    uint8_t *random = malloc(raw_size);
+    uint8_t *runs = malloc(raw_size);
+    uint8_t *constant = malloc(raw_size);
+    float *plane = malloc(raw_size);
+    if (!random || !runs || !constant || !plane) {
+        fprintf(stderr, "codec_test: Memory allocation failed\n");
+        return 1;
+    }
+    for (size_t i = 0; i < raw_size; i++) random[i] = (uint8_t)next_rand();
+    // random bytes repeated 1 to 8 times, literals and runs mixed
+    for (size_t i = 0; i < raw_size;) {
+        const uint8_t b = (uint8_t)next_rand();
+        for (uint32_t n = 1 + next_rand() % 8; n > 0 && i < raw_size; n--)
+            runs[i++] = b;
+    }
+    memset(constant, 0x3F, raw_size);
+    // a smooth rgb gradient with some noise, like a tile of sample sums
+    for (size_t i = 0; i < count; i++) {
+        const float pixel = (float)(i / 3) / (float)(count / 3);
+        plane[i] = 16.0f * (0.3f + 0.2f * pixel + 0.1f * (float)(i % 3)) +
+                   (float)(next_rand() % 1000) * 1e-4f;
+    }
+
+    const size_t strides[] = {1, 12};
+    for (int c = CODEC_RLE; c < CODEC_COUNT; c++) {
+        for (size_t s = 0; s < 2; s++) {
+            check_codec((Codec)c, "random", random, raw_size, strides[s]);
+            check_codec((Codec)c, "runs", runs, raw_size, strides[s]);
+            check_codec((Codec)c, "constant", constant, raw_size, strides[s]);
+            check_codec((Codec)c, "plane", (const uint8_t *)plane, raw_size,
+                        strides[s]);
+        }
+    }
+    check_malformed();
+
+    free(random);
+    free(runs);
+    free(constant);
+    free(plane);
+    if (failures) {
+        fprintf(stderr, "codec_test: %d checks failed\n", failures);
+        return 1;
+    }
+    printf("codec_test: ok\n");
+    return 0;
+}
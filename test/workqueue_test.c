@@ -0,0 +1,167 @@
+// Multi thread stress of the lock-free WorkQueue: threads claim items from
+// both ends and hand some back, as failed or expired leases do. Every item
+// must end up done exactly once, claimed once more per hand back.
+//
+// Usage: ./build/test/workqueue_test [THREADS] [ROUNDS]
+
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define UTILS_IMPLEMENTATION
+#include "utils.h"
+#undef UTILS_IMPLEMENTATION
+#include "workqueue.h"
+
+#define ITEMS 4096
+// Hand backs per item at most, so the rounds end
+#define MAX_REQUEUES 3
+
+typedef struct {
+    WorkQueue *queue;
+    _Atomic int *claims;
+    _Atomic int *requeues;
+    _Atomic int *done;
+    _Atomic int *holder;  // claiming thread + 1, 0 when free
+    _Atomic int *overlaps;
+    pthread_barrier_t *start;
+    int id;
+    uint32_t seed;
+} StressArg;
+
+static uint32_t next_rand(uint32_t *state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+static void *stress_thread(void *arg) {
+    StressArg *a = arg;
+    // odd threads take the back, like slow machines on a sorted list
+    const bool back = a->id & 1;
+    pthread_barrier_wait(a->start);
+    int item;
+    while ((item = work_queue_pop(a->queue, back)) >= 0) {
+        atomic_fetch_add(&a->claims[item], 1);
+        int expected = 0;
+        if (!atomic_compare_exchange_strong(&a->holder[item], &expected,
+                                            a->id + 1))
+            atomic_fetch_add(a->overlaps, 1);
+
+        if (atomic_load(&a->requeues[item]) < MAX_REQUEUES &&
+            next_rand(&a->seed) % 4 == 0) {
+            atomic_fetch_add(&a->requeues[item], 1);
+            atomic_store(&a->holder[item], 0);
+            work_queue_push(a->queue, item);
+            continue;
+        }
+        atomic_fetch_add(&a->done[item], 1);
+        atomic_store(&a->holder[item], 0);
+    }
+    return NULL;
+}
+
+// One round over a fresh queue, false when an item went missing or twice
+static bool stress_round(int threads, int round, bool cleared) {
+    WorkQueue queue;
+    _Atomic int *counters = calloc(4 * ITEMS, sizeof(*counters));
+    pthread_t *tids = malloc(threads * sizeof(*tids));
+    StressArg *args = malloc(threads * sizeof(*args));
+    if (!counters || !tids || !args || !work_queue_init(&queue, ITEMS)) {
+        fprintf(stderr, "workqueue_test: Memory allocation failed\n");
+        exit(1);
+    }
+    _Atomic int overlaps = 0;
+    // all threads race for the first claims
+    pthread_barrier_t start;
+    pthread_barrier_init(&start, NULL, (unsigned)threads);
+    _Atomic int *claims = counters;
+    _Atomic int *requeues = counters + ITEMS;
+    _Atomic int *done = counters + 2 * ITEMS;
+    _Atomic int *holder = counters + 3 * ITEMS;
+
+    if (cleared) {
+        // every item claimed up front and handed back, the stack holds all
+        for (int i = 0; i < ITEMS; i++)
+            atomic_fetch_add(&claims[work_queue_pop(&queue, false)], 1);
+        work_queue_clear(&queue);
+        for (int i = 0; i < ITEMS; i++) work_queue_push(&queue, i);
+    }
+
+    for (int t = 0; t < threads; t++) {
+        args[t] = (StressArg){
+            .queue = &queue,
+            .claims = claims,
+            .requeues = requeues,
+            .done = done,
+            .holder = holder,
+            .overlaps = &overlaps,
+            .start = &start,
+            .id = t,
+            .seed = 0x9E3779B9u ^ (uint32_t)(round * 7919 + t * 104729),
+        };
+        if (pthread_create(&tids[t], NULL, stress_thread, &args[t]) != 0) {
+            fprintf(stderr, "workqueue_test: Cannot start thread %d\n", t);
+            exit(1);
+        }
+    }
+    for (int t = 0; t < threads; t++) pthread_join(tids[t], NULL);
+    pthread_barrier_destroy(&start);
+
+    bool ok = true;
+    for (int i = 0; i < ITEMS && ok; i++) {
+        const int expected_claims =
+            1 + atomic_load(&requeues[i]) + (cleared ? 1 : 0);
+        if (atomic_load(&done[i]) != 1 ||
+            atomic_load(&claims[i]) != expected_claims) {
+            fprintf(stderr,
+                    "FAIL: round %d item %d done %d times, claimed %d times "
+                    "for %d hand backs\n",
+                    round, i, atomic_load(&done[i]), atomic_load(&claims[i]),
+                    atomic_load(&requeues[i]));
+            ok = false;
+        }
+    }
+    if (atomic_load(&overlaps) > 0) {
+        fprintf(stderr, "FAIL: round %d claimed held items %d times\n", round,
+                atomic_load(&overlaps));
+        ok = false;
+    }
+    if (!work_queue_empty(&queue) || work_queue_size(&queue) != 0) {
+        fprintf(stderr, "FAIL: round %d left %d items queued\n", round,
+                work_queue_size(&queue));
+        ok = false;
+    }
+
+    work_queue_free(&queue);
+    free(counters);
+    free(tids);
+    free(args);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    const int threads = argc > 1 ? atoi(argv[1]) : 8;
+    const int rounds = argc > 2 ? atoi(argv[2]) : 200;
+    if (threads < 1 || rounds < 1) {
+        fprintf(stderr, "Usage: %s [THREADS] [ROUNDS]\n", argv[0]);
+        return 1;
+    }
+
+    int failed = 0;
+    for (int r = 0; r < rounds; r++) {
+        // every fourth round runs on hand backs only
+        if (!stress_round(threads, r, r % 4 == 3)) failed++;
+    }
+    if (failed) {
+        fprintf(stderr, "workqueue_test: %d of %d rounds failed\n", failed,
+                rounds);
+        return 1;
+    }
+    printf("workqueue_test: ok, %d rounds of %d items on %d threads\n",
+           rounds, ITEMS, threads);
+    return 0;
+}